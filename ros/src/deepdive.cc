@@ -3,17 +3,36 @@
 #include <tf2_ros/transform_broadcaster.h>
 #include <tf2_ros/static_transform_broadcaster.h>
 
+// Messages
+#include <deepdive_ros/Progress.h>
+
+// ROS bag
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+#include <rosbag/message_instance.h>
+
 // STL
+#include <algorithm>
+#include <atomic>
 #include <fstream>
+#include <limits>
+#include <mutex>
+#include <numeric>
 #include <sstream>
+#include <thread>
+#include <utility>
 
 // This include
 #include "deepdive.hh"
 
 // TRANSFORM ENGINE
 
+// Solutions are sent from background solves as well as from callbacks, and
+// the static broadcaster keeps a list of everything it has latched
 void SendStaticTransform(geometry_msgs::TransformStamped const& tfs) {
+  static std::mutex mutex;
   static tf2_ros::StaticTransformBroadcaster bc;
+  std::lock_guard<std::mutex> lock(mutex);
   bc.sendTransform(tfs);
 }
 
@@ -99,7 +118,7 @@ void SendTransforms(
 }
 
 // Convert a ceres to an Eigen transform
-Eigen::Affine3d CeresToEigen(double ceres[6], bool invert) {
+Eigen::Affine3d CeresToEigen(double const ceres[6], bool invert) {
   Eigen::Affine3d A;
   A.translation()[0] = ceres[0];
   A.translation()[1] = ceres[1];
@@ -250,6 +269,73 @@ bool WriteConfig(std::string const& calfile,    // Calibration file
   return true;
 }
 
+// LIGHTHOUSE CORRECTION
+
+constexpr size_t CorrectionTable::SIZE;
+constexpr double CorrectionTable::LIMIT;
+
+bool CorrectionTable::Build(double const* params) {
+  if (Built() && std::equal(params, params + NUM_MOTORS*NUM_PARAMS, params_))
+    return false;
+  std::copy(params, params + NUM_MOTORS*NUM_PARAMS, params_);
+  // Sample the correction at every grid point
+  double step = 2.0 * LIMIT / (SIZE - 1);
+  table_.resize(2 * SIZE * SIZE);
+  for (size_t i = 0; i < SIZE; i++) {
+    for (size_t j = 0; j < SIZE; j++) {
+      double angle[2] = { -LIMIT + i * step, -LIMIT + j * step };
+      double ideal[2] = { angle[0], angle[1] };
+      Correct(params_, ideal, true);
+      table_[2 * (i * SIZE + j) + 0] = ideal[0] - angle[0];
+      table_[2 * (i * SIZE + j) + 1] = ideal[1] - angle[1];
+    }
+  }
+  // Interpolation error is largest away from the grid points, so compare the
+  // table with the iterative correction at points spread inside every cell
+  static const double fractions[3] = { 0.25, 0.5, 0.75 };
+  error_ = 0.0;
+  for (size_t i = 0; i + 1 < SIZE; i++) {
+    for (size_t j = 0; j + 1 < SIZE; j++) {
+      for (size_t k = 0; k < 9; k++) {
+        double angle[2] = { -LIMIT + (i + fractions[k / 3]) * step,
+                            -LIMIT + (j + fractions[k % 3]) * step };
+        double table[2] = { angle[0], angle[1] };
+        Apply(table);
+        Correct(params_, angle, true);
+        error_ = std::max(error_, std::fabs(table[0] - angle[0]));
+        error_ = std::max(error_, std::fabs(table[1] - angle[1]));
+      }
+    }
+  }
+  return true;
+}
+
+void CorrectionTable::Apply(double const* in, double * out, size_t n) const {
+  static constexpr double SCALE = (SIZE - 1) / (2.0 * LIMIT);
+  // Interpolate every pair without branching, clamping the cell so that the
+  // lookup is always valid and masking the pairs that fall outside the grid
+  for (size_t p = 0; p < 2 * n; p += 2) {
+    double u = (in[p + 0] + LIMIT) * SCALE;
+    double v = (in[p + 1] + LIMIT) * SCALE;
+    double inside = (u >= 0.0 && u < SIZE - 1 && v >= 0.0 && v < SIZE - 1);
+    size_t i = std::min(static_cast<size_t>(std::max(u, 0.0)), SIZE - 2);
+    size_t j = std::min(static_cast<size_t>(std::max(v, 0.0)), SIZE - 2);
+    double fu = u - i, fv = v - j;
+    double const* c = &table_[2 * (i * SIZE + j)];
+    for (size_t k = 0; k < 2; k++)
+      out[p + k] = in[p + k] + inside * (
+          (1.0 - fu) * ((1.0 - fv) * c[k] + fv * c[2 + k])
+        + fu * ((1.0 - fv) * c[2 * SIZE + k] + fv * c[2 * SIZE + 2 + k]));
+  }
+  // The few pairs outside of the grid were copied, so correct them in place
+  for (size_t p = 0; p < 2 * n; p += 2) {
+    double u = (in[p + 0] + LIMIT) * SCALE;
+    double v = (in[p + 1] + LIMIT) * SCALE;
+    if (!(u >= 0.0 && u < SIZE - 1 && v >= 0.0 && v < SIZE - 1))
+      Correct(params_, &out[p], true);
+  }
+}
+
 // REUSABLE CALLS
 
 void LighthouseCallback(deepdive_ros::Lighthouses::ConstPtr const& msg,
@@ -271,6 +357,9 @@ void LighthouseCallback(deepdive_ros::Lighthouses::ConstPtr const& msg,
       lighthouse->second.params[i*NUM_PARAMS + PARAM_CURVE]
         = it->motors[i].curve;
     }
+    if (lighthouse->second.correction.Build(lighthouse->second.params))
+      ROS_INFO_STREAM("Correction table for " << it->serial << " is within "
+        << lighthouse->second.correction.Error() << " rad of the iterative");
     if (!lighthouse->second.ready) {
       lighthouse->second.ready = true;
       cb(lighthouse);
@@ -379,10 +468,566 @@ void TrackerCallback(deepdive_ros::Trackers::ConstPtr const& msg,
   }
 }
 
+// Older bags store light without the driver ids, or also without the
+// timecode, so they can only be read by deserializing the remaining fields by
+// hand. Their ids are left at zero, since only the tracker uses them.
+bool ReadLight(rosbag::MessageInstance const& m, deepdive_ros::Light & light) {
+  deepdive_ros::Light::ConstPtr msg = m.instantiate<deepdive_ros::Light>();
+  if (msg) {
+    light = *msg;
+    return true;
+  }
+  if (m.getDataType() != ros::message_traits::datatype<deepdive_ros::Light>())
+    return false;
+  std::vector<uint8_t> buffer(m.size());
+  ros::serialization::OStream os(buffer.data(), buffer.size());
+  m.write(os);
+  light.tracker_id = 0;
+  light.lighthouse_id = 0;
+  try {
+    ros::serialization::IStream is(buffer.data(), buffer.size());
+    ros::serialization::deserialize(is, light.header);
+    ros::serialization::deserialize(is, light.timecode);
+    ros::serialization::deserialize(is, light.lighthouse);
+    ros::serialization::deserialize(is, light.axis);
+    ros::serialization::deserialize(is, light.pulses);
+    if (is.getLength() == 0)
+      return true;
+  } catch (ros::serialization::StreamOverrunException const& e) {}
+  ros::serialization::IStream is(buffer.data(), buffer.size());
+  ros::serialization::deserialize(is, light.header);
+  ros::serialization::deserialize(is, light.lighthouse);
+  ros::serialization::deserialize(is, light.axis);
+  ros::serialization::deserialize(is, light.pulses);
+  light.timecode = 0;
+  return true;
+}
+
+// Older bags store trackers without the driver id
+bool ReadTrackers(rosbag::MessageInstance const& m,
+  deepdive_ros::Trackers::ConstPtr & msg) {
+  msg = m.instantiate<deepdive_ros::Trackers>();
+  if (msg)
+    return true;
+  if (m.getDataType()
+    != ros::message_traits::datatype<deepdive_ros::Trackers>())
+    return false;
+  std::vector<uint8_t> buffer(m.size());
+  ros::serialization::OStream os(buffer.data(), buffer.size());
+  m.write(os);
+  ros::serialization::IStream is(buffer.data(), buffer.size());
+  deepdive_ros::Trackers::Ptr trackers(new deepdive_ros::Trackers);
+  ros::serialization::deserialize(is, trackers->header);
+  uint32_t n;
+  ros::serialization::deserialize(is, n);
+  trackers->trackers.resize(n);
+  std::vector<deepdive_ros::Tracker>::iterator it;
+  for (it = trackers->trackers.begin(); it != trackers->trackers.end(); it++) {
+    ros::serialization::deserialize(is, it->serial);
+    ros::serialization::deserialize(is, it->sensors);
+    ros::serialization::deserialize(is, it->acc_bias);
+    ros::serialization::deserialize(is, it->acc_scale);
+    ros::serialization::deserialize(is, it->gyr_bias);
+    ros::serialization::deserialize(is, it->gyr_scale);
+    ros::serialization::deserialize(is, it->imu_transform);
+    ros::serialization::deserialize(is, it->head_transform);
+    ros::serialization::deserialize(is, it->lastcount);
+    ros::serialization::deserialize(is, it->overflows);
+    it->id = 0;
+  }
+  msg = trackers;
+  return true;
+}
+
+// Older bags store lighthouses without the driver id
+bool ReadLighthouses(rosbag::MessageInstance const& m,
+  deepdive_ros::Lighthouses::ConstPtr & msg) {
+  msg = m.instantiate<deepdive_ros::Lighthouses>();
+  if (msg)
+    return true;
+  if (m.getDataType()
+    != ros::message_traits::datatype<deepdive_ros::Lighthouses>())
+    return false;
+  std::vector<uint8_t> buffer(m.size());
+  ros::serialization::OStream os(buffer.data(), buffer.size());
+  m.write(os);
+  ros::serialization::IStream is(buffer.data(), buffer.size());
+  deepdive_ros::Lighthouses::Ptr lighthouses(new deepdive_ros::Lighthouses);
+  ros::serialization::deserialize(is, lighthouses->header);
+  uint32_t n;
+  ros::serialization::deserialize(is, n);
+  lighthouses->lighthouses.resize(n);
+  std::vector<deepdive_ros::Lighthouse>::iterator it;
+  for (it = lighthouses->lighthouses.begin();
+    it != lighthouses->lighthouses.end(); it++) {
+    ros::serialization::deserialize(is, it->serial);
+    ros::serialization::deserialize(is, it->motors);
+    ros::serialization::deserialize(is, it->acceleration);
+    it->id = 0;
+  }
+  msg = lighthouses;
+  return true;
+}
+
+// BAG PROCESSING
+
+bool ReadBag(std::string const& file, BagHandlers const& handlers) {
+  rosbag::Bag bag;
+  try {
+    bag.open(file, rosbag::bagmode::Read);
+  } catch (rosbag::BagException const& e) {
+    ROS_ERROR_STREAM("Could not open bag " << file << ": " << e.what());
+    return false;
+  }
+  std::vector<std::string> topics;
+  if (handlers.trackers) topics.push_back("/trackers");
+  if (handlers.lighthouses) topics.push_back("/lighthouses");
+  if (handlers.light) topics.push_back("/light");
+  if (handlers.imu) topics.push_back("/imu");
+  if (handlers.tf) topics.push_back("/tf");
+  if (handlers.light || handlers.imu) topics.push_back("/packed");
+  rosbag::View view(bag, rosbag::TopicQuery(topics));
+  ROS_INFO_STREAM("Reading " << view.size() << " messages from " << file);
+  size_t count = 0;
+  rosbag::View::iterator it;
+  for (it = view.begin(); it != view.end() && !ros::isShuttingDown(); it++) {
+    std::string const& topic = it->getTopic();
+    if (topic == "/light") {
+      deepdive_ros::Light light;
+      if (ReadLight(*it, light))
+        handlers.light(it->getTime(), light);
+    } else if (topic == "/packed") {
+      deepdive_ros::Packed::ConstPtr msg =
+        it->instantiate<deepdive_ros::Packed>();
+      if (msg)
+        Unpack(*msg, handlers);
+    } else if (topic == "/imu") {
+      sensor_msgs::Imu::ConstPtr msg = it->instantiate<sensor_msgs::Imu>();
+      if (msg)
+        handlers.imu(it->getTime(), *msg);
+    } else if (topic == "/tf") {
+      tf2_msgs::TFMessage::ConstPtr msg = it->instantiate<tf2_msgs::TFMessage>();
+      if (msg)
+        handlers.tf(it->getTime(), *msg);
+    } else if (topic == "/trackers") {
+      deepdive_ros::Trackers::ConstPtr msg;
+      if (ReadTrackers(*it, msg))
+        handlers.trackers(msg);
+    } else if (topic == "/lighthouses") {
+      deepdive_ros::Lighthouses::ConstPtr msg;
+      if (ReadLighthouses(*it, msg))
+        handlers.lighthouses(msg);
+    }
+    if (++count % 100000 == 0)
+      ROS_INFO_STREAM("Read " << count << " of " << view.size() << " messages");
+  }
+  bag.close();
+  return true;
+}
+
+// PACKED DATA
+
+// Host time of a timecode from a tracker in a packed message
+static ros::Time PackedTime(deepdive_ros::Packed const& msg, uint8_t tracker,
+  uint32_t timecode) {
+  int32_t ticks = static_cast<int32_t>(timecode - msg.timecodes[tracker]);
+  return msg.stamps[tracker]
+    + ros::Duration(ticks / deepdive_ros::Packed::TICKS_PER_SEC);
+}
+
+bool Unpack(deepdive_ros::Packed const& msg, BagHandlers const& handlers,
+  std::vector<bool> const* keep) {
+  typedef deepdive_ros::Packed P;
+  size_t nt = msg.trackers.size();
+  size_t ns = msg.sweep_timecode.size();
+  size_t ni = msg.imu_timecode.size();
+  if (msg.timecodes.size() != nt || msg.stamps.size() != nt
+    || msg.tracker_ids.size() != nt
+    || msg.lighthouse_ids.size() != msg.lighthouses.size()
+    || msg.sweep_tracker.size() != ns || msg.sweep_lighthouse.size() != ns
+    || msg.sweep_axis.size() != ns || msg.sweep_pulses.size() != ns
+    || msg.imu_tracker.size() != ni || msg.imu_acc.size() != 3 * ni
+    || msg.imu_gyr.size() != 3 * ni || (keep && keep->size() != nt))
+    return false;
+  size_t np = std::accumulate(msg.sweep_pulses.begin(),
+    msg.sweep_pulses.end(), size_t(0));
+  if (msg.pulse_sensor.size() != np || msg.pulse_angle.size() != np
+    || msg.pulse_length.size() != np)
+    return false;
+  for (size_t i = 0; i < ns; i++)
+    if (msg.sweep_tracker[i] >= nt
+      || msg.sweep_lighthouse[i] >= msg.lighthouses.size())
+      return false;
+  for (size_t i = 0; i < ni; i++)
+    if (msg.imu_tracker[i] >= nt)
+      return false;
+  // Sweeps
+  if (handlers.light) {
+    deepdive_ros::Light light;
+    size_t p = 0;
+    for (size_t i = 0; i < ns; i++) {
+      uint8_t t = msg.sweep_tracker[i];
+      if (keep && !(*keep)[t]) {
+        p += msg.sweep_pulses[i];
+        continue;
+      }
+      light.header.frame_id = msg.trackers[t];
+      light.header.stamp = PackedTime(msg, t, msg.sweep_timecode[i]);
+      light.timecode = msg.sweep_timecode[i];
+      light.lighthouse = msg.lighthouses[msg.sweep_lighthouse[i]];
+      light.tracker_id = msg.tracker_ids[t];
+      light.lighthouse_id = msg.lighthouse_ids[msg.sweep_lighthouse[i]];
+      light.axis = msg.sweep_axis[i];
+      light.pulses.resize(msg.sweep_pulses[i]);
+      for (size_t j = 0; j < light.pulses.size(); j++, p++) {
+        light.pulses[j].sensor = msg.pulse_sensor[p];
+        light.pulses[j].angle = (M_PI / P::SWEEP_DURATION)
+          * (static_cast<double>(msg.pulse_angle[p]) - P::SWEEP_CENTER);
+        light.pulses[j].duration =
+          static_cast<double>(msg.pulse_length[p]) / P::TICKS_PER_SEC;
+      }
+      handlers.light(light.header.stamp, light);
+    }
+  }
+  // IMU samples
+  if (handlers.imu) {
+    sensor_msgs::Imu imu;
+    for (size_t i = 0; i < ni; i++) {
+      uint8_t t = msg.imu_tracker[i];
+      if (keep && !(*keep)[t])
+        continue;
+      int16_t const* acc = &msg.imu_acc[3 * i];
+      int16_t const* gyr = &msg.imu_gyr[3 * i];
+      imu.header.frame_id = msg.trackers[t];
+      imu.header.stamp = PackedTime(msg, t, msg.imu_timecode[i]);
+      imu.linear_acceleration.x = acc[0] * P::GRAVITY / P::ACC_SCALE;
+      imu.linear_acceleration.y = acc[1] * P::GRAVITY / P::ACC_SCALE;
+      imu.linear_acceleration.z = acc[2] * P::GRAVITY / P::ACC_SCALE;
+      imu.angular_velocity.x = gyr[0] / P::GYRO_SCALE * (M_PI / 180.);
+      imu.angular_velocity.y = gyr[1] / P::GYRO_SCALE * (M_PI / 180.);
+      imu.angular_velocity.z = gyr[2] / P::GYRO_SCALE * (M_PI / 180.);
+      handlers.imu(imu.header.stamp, imu);
+    }
+  }
+  return true;
+}
+
+// MEASUREMENT STORE
+
+// Samples are reserved this many at a time
+static constexpr size_t STORE_CHUNK = 1 << 16;
+
+// The sensor masks in a bin need a bit per sensor
+static_assert(NUM_SENSORS <= 32, "Light bins assume at most 32 sensors");
+
+// Get the id of a serial, giving it a new one if it hasn't been seen
+static uint16_t Intern(std::vector<std::string> & names,
+  std::string const& name) {
+  std::vector<std::string>::iterator it =
+    std::find(names.begin(), names.end(), name);
+  if (it != names.end())
+    return it - names.begin();
+  names.push_back(name);
+  return names.size() - 1;
+}
+
+MeasurementStore::MeasurementStore() : res_(0.0), count_(0) {
+  time_.reserve(STORE_CHUNK);
+  tracker_.reserve(STORE_CHUNK);
+  lighthouse_.reserve(STORE_CHUNK);
+  sensor_.reserve(STORE_CHUNK);
+  axis_.reserve(STORE_CHUNK);
+  angle_.reserve(STORE_CHUNK);
+}
+
+void MeasurementStore::Add(ros::Time const& t,
+  deepdive_ros::Light const& light) {
+  if (light.axis >= NUM_MOTORS)
+    return;
+  uint16_t tid = Intern(trackers_, light.header.frame_id);
+  uint16_t lid = Intern(lighthouses_, light.lighthouse);
+  // Grow all columns together by a whole chunk
+  size_t n = angle_.size() + light.pulses.size();
+  if (n > angle_.capacity()) {
+    size_t c = angle_.capacity() + std::max(STORE_CHUNK, angle_.capacity());
+    time_.reserve(c);
+    tracker_.reserve(c);
+    lighthouse_.reserve(c);
+    sensor_.reserve(c);
+    axis_.reserve(c);
+    angle_.reserve(c);
+  }
+  std::vector<deepdive_ros::Pulse>::const_iterator pt;
+  for (pt = light.pulses.begin(); pt != light.pulses.end(); pt++) {
+    if (pt->sensor >= NUM_SENSORS)
+      continue;
+    time_.push_back(t.toNSec());
+    tracker_.push_back(tid);
+    lighthouse_.push_back(lid);
+    sensor_.push_back(pt->sensor);
+    axis_.push_back(light.axis);
+    angle_.push_back(pt->angle);
+  }
+  if (count_ == 0 || t < first_)
+    first_ = t;
+  if (count_ == 0 || t > last_)
+    last_ = t;
+  count_++;
+}
+
+void MeasurementStore::Clear() {
+  time_.clear();
+  tracker_.clear();
+  lighthouse_.clear();
+  sensor_.clear();
+  axis_.clear();
+  angle_.clear();
+  closed_.clear();
+  count_ = 0;
+}
+
+// Time bin of a sample
+static int64_t BinIndex(int64_t nsec, double res) {
+  return static_cast<int64_t>(round(nsec * 1e-9 / res));
+}
+
+void MeasurementStore::Reduce(double res, int64_t before,
+  LightBins & bins) const {
+  size_t first = bins.size();
+  // Sortable key for every sample
+  struct Key {
+    uint32_t pair;      // Tracker and lighthouse
+    int64_t bin;        // Time bin
+    uint8_t sensor;     // Sensor
+    uint8_t axis;       // Axis
+    uint32_t index;     // Index of the sample
+    bool operator<(Key const& k) const {
+      if (pair != k.pair) return pair < k.pair;
+      if (bin != k.bin) return bin < k.bin;
+      if (sensor != k.sensor) return sensor < k.sensor;
+      return axis < k.axis;
+    }
+  };
+  std::vector<Key> keys;
+  keys.reserve(angle_.size());
+  for (size_t i = 0; i < angle_.size(); i++) {
+    Key k;
+    k.pair = (static_cast<uint32_t>(tracker_[i]) << 16) | lighthouse_[i];
+    k.bin = BinIndex(time_[i], res);
+    k.sensor = sensor_[i];
+    k.axis = axis_[i];
+    k.index = i;
+    if (k.bin < before)
+      keys.push_back(k);
+  }
+  std::sort(keys.begin(), keys.end());
+  // Reduce each run of equal keys to its mean
+  size_t i = 0;
+  while (i < keys.size()) {
+    Key const& k = keys[i];
+    if (bins.size() == first || bins.back().tracker != tracker_[k.index]
+      || bins.back().lighthouse != lighthouse_[k.index]
+      || keys[i - 1].bin != k.bin) {
+      bins.emplace_back();
+      LightBin & b = bins.back();
+      b.time = ros::Time(k.bin * res);
+      b.tracker = tracker_[k.index];
+      b.lighthouse = lighthouse_[k.index];
+      for (size_t a = 0; a < NUM_MOTORS; a++)
+        b.seen[a] = 0;
+    }
+    double sum = 0.0;
+    size_t j = i;
+    for (; j < keys.size() && !(k < keys[j]); j++)
+      sum += angle_[keys[j].index];
+    LightBin & b = bins.back();
+    b.seen[k.axis] |= (1u << k.sensor);
+    b.angles[k.sensor][k.axis] = sum / (j - i);
+    i = j;
+  }
+}
+
+void MeasurementStore::Compact(double res) {
+  if (angle_.empty())
+    return;
+  // Bins before the newest one can't receive any more samples
+  int64_t before = BinIndex(last_.toNSec(), res);
+  Reduce(res, before, closed_);
+  res_ = res;
+  size_t n = 0;
+  for (size_t i = 0; i < angle_.size(); i++) {
+    if (BinIndex(time_[i], res) < before)
+      continue;
+    time_[n] = time_[i];
+    tracker_[n] = tracker_[i];
+    lighthouse_[n] = lighthouse_[i];
+    sensor_[n] = sensor_[i];
+    axis_[n] = axis_[i];
+    angle_[n] = angle_[i];
+    n++;
+  }
+  time_.resize(n);
+  tracker_.resize(n);
+  lighthouse_.resize(n);
+  sensor_.resize(n);
+  axis_.resize(n);
+  angle_.resize(n);
+}
+
+void MeasurementStore::Bundle(double res, LightBins & bins) const {
+  if (!closed_.empty() && res != res_)
+    ROS_WARN("Bundling at a different resolution to the compacted light");
+  bins = closed_;
+  Reduce(res, std::numeric_limits<int64_t>::max(), bins);
+  if (closed_.empty())
+    return;
+  std::stable_sort(bins.begin(), bins.end(),
+    [](LightBin const& a, LightBin const& b) {
+      if (a.tracker != b.tracker) return a.tracker < b.tracker;
+      if (a.lighthouse != b.lighthouse) return a.lighthouse < b.lighthouse;
+      return a.time < b.time;
+    });
+}
+
+void MeasurementStore::Find(LightBins const& bins, std::string const& tracker,
+  std::string const& lighthouse, LightBins::const_iterator & begin,
+  LightBins::const_iterator & end) const {
+  begin = end = bins.end();
+  std::vector<std::string>::const_iterator tt =
+    std::find(trackers_.begin(), trackers_.end(), tracker);
+  std::vector<std::string>::const_iterator lt =
+    std::find(lighthouses_.begin(), lighthouses_.end(), lighthouse);
+  if (tt == trackers_.end() || lt == lighthouses_.end())
+    return;
+  uint32_t pair = (static_cast<uint32_t>(tt - trackers_.begin()) << 16)
+    | static_cast<uint32_t>(lt - lighthouses_.begin());
+  begin = std::lower_bound(bins.begin(), bins.end(), pair,
+    [](LightBin const& b, uint32_t p) {
+      return ((static_cast<uint32_t>(b.tracker) << 16) | b.lighthouse) < p;
+    });
+  end = std::upper_bound(begin, bins.end(), pair,
+    [](uint32_t p, LightBin const& b) {
+      return p < ((static_cast<uint32_t>(b.tracker) << 16) | b.lighthouse);
+    });
+}
+
 // STATISTICS
 
 bool Mean(std::vector<double> const& v, double & d) {
   if (v.empty()) return false;
   d = std::accumulate(v.begin(), v.end(), 0.0) / v.size(); 
   return true;
-}
\ No newline at end of file
+}
+
+// PARALLEL PROCESSING
+
+void ParallelFor(size_t n, std::function<void(size_t)> const& f,
+  int threads) {
+  size_t num = (threads > 0 ? threads : std::thread::hardware_concurrency());
+  num = std::max<size_t>(1, std::min(num, n));
+  std::atomic<size_t> next(0);
+  std::function<void()> work = [&next, &f, n]() {
+    for (size_t i = next++; i < n; i = next++)
+      f(i);
+  };
+  // The calling thread does its share of the work
+  std::vector<std::thread> pool;
+  for (size_t t = 1; t < num; t++)
+    pool.push_back(std::thread(work));
+  work();
+  for (size_t t = 0; t < pool.size(); t++)
+    pool[t].join();
+}
+
+Worker::Worker() : busy_(false), stop_(false) {}
+
+Worker::~Worker() {
+  Stop();
+}
+
+bool Worker::Start(std::function<void()> const& job) {
+  if (busy_)
+    return false;
+  // The last job has returned, so its thread only needs to be reaped
+  if (thread_.joinable())
+    thread_.join();
+  busy_ = true;
+  stop_ = false;
+  thread_ = std::thread([this, job]() {
+    job();
+    busy_ = false;
+  });
+  return true;
+}
+
+void Worker::Stop() {
+  stop_ = true;
+  if (thread_.joinable())
+    thread_.join();
+}
+
+// BACKGROUND SOLVING
+
+SegmentSolver::SegmentSolver(MeasurementStore & measurements,
+  CorrectionMap & corrections, LighthouseMap & lighthouses,
+  TrackerMap & trackers, double wTv[6], SolveFunction const& solve,
+  CommitFunction const& commit)
+  : measurements_(measurements), corrections_(corrections),
+    lighthouses_(lighthouses), trackers_(trackers), wTv_(wTv),
+    solve_(solve), commit_(commit) {
+  segment_.id = 0;
+}
+
+void SegmentSolver::Advertise(ros::NodeHandle & nh) {
+  pub_progress_ = nh.advertise<deepdive_ros::Progress>("/progress", 100);
+}
+
+void SegmentSolver::Progress(std::string const& stage, uint32_t iteration,
+  double cost, bool done, bool success) {
+  deepdive_ros::Progress msg;
+  msg.header.stamp = ros::Time::now();
+  msg.segment = segment_.id;
+  msg.stage = stage;
+  msg.iteration = iteration;
+  msg.cost = cost;
+  msg.done = done;
+  msg.success = success;
+  pub_progress_.publish(msg);
+}
+
+bool SegmentSolver::Trigger(std::string & message) {
+  // Don't drop the segment, but let it grow until the solver is free
+  if (worker_.Busy()) {
+    message = "Still solving segment " + std::to_string(segment_.id)
+      + ". Recording continues.";
+    return false;
+  }
+  // The worker is idle, so only the callbacks touch what is being swapped
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    segment_.id++;
+    std::swap(measurements_, segment_.measurements);
+    std::swap(corrections_, segment_.corrections);
+    segment_.lighthouses = lighthouses_;
+    segment_.trackers = trackers_;
+    for (size_t i = 0; i < 6; i++)
+      segment_.wTv[i] = wTv_[i];
+  }
+  worker_.Start(std::bind(&SegmentSolver::Run, this));
+  message = "Solving segment " + std::to_string(segment_.id)
+    + ". Recording continues.";
+  return true;
+}
+
+void SegmentSolver::Run() {
+  bool success = solve_(segment_);
+  if (success) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    commit_(segment_);
+  }
+  ROS_INFO_STREAM("Segment " << segment_.id
+    << (success ? " solved." : " not solved."));
+  Progress("done", 0, 0.0, true, success);
+  segment_.measurements.Clear();
+  segment_.corrections.clear();
+}
@@ -1,21 +1,41 @@
 #ifndef SRC_DEEPDIVE_HH
 #define SRC_DEEPDIVE_HH
 
+// ROS
+#include <ros/ros.h>
+
 // Messages
 #include <geometry_msgs/TransformStamped.h>
 #include <deepdive_ros/Lighthouses.h>
 #include <deepdive_ros/Trackers.h>
 #include <deepdive_ros/Light.h>
+#include <deepdive_ros/Packed.h>
+#include <sensor_msgs/Imu.h>
+#include <tf2_msgs/TFMessage.h>
 
 // Eigen
 #include <Eigen/Core>
 #include <Eigen/Geometry>
 
 // STL
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <random>
 #include <string>
+#include <thread>
 #include <vector>
 #include <map>
 
+// Deepdive internal
+#include "deepdive_clock.hh"
+
+// Bags are only read by some nodes
+namespace rosbag {
+  class MessageInstance;
+}
+
 // Universal constants
 static constexpr size_t NUM_SENSORS = 32;
 
@@ -46,10 +66,45 @@ enum Motors {
   NUM_MOTORS
 };
 
+// Replaces the iterative inversion of the lighthouse model with a lookup. The
+// difference between the corrected and measured angles is smooth over the
+// field of view, so it is sampled on a grid when the parameters arrive and
+// interpolated bilinearly. Angles outside the grid use the iterative form.
+class CorrectionTable {
+ public:
+  static constexpr size_t SIZE = 65;            // Grid points per axis
+  static constexpr double LIMIT = 1.0472;       // Half field of view (60deg)
+
+  CorrectionTable() : error_(0.0) {}
+
+  // Sample the correction for these parameters. Returns false if the table
+  // was already built for exactly the same parameters.
+  bool Build(double const* params);
+
+  // Has the table been built?
+  bool Built() const { return !table_.empty(); }
+
+  // Worst difference from the iterative correction measured inside the cells
+  double Error() const { return error_; }
+
+  // Correct one azimuth/elevation pair in place
+  inline void Apply(double * angle) const;
+
+  // Correct n interleaved azimuth/elevation pairs, such as a whole sweep, into
+  // an output array that must not overlap the input.
+  void Apply(double const* in, double * out, size_t n) const;
+
+ private:
+  double params_[NUM_MOTORS*NUM_PARAMS];        // Parameters sampled
+  std::vector<double> table_;                   // Corrections at grid points
+  double error_;                                // Interpolation error bound
+};
+
 // Lighthouse data structure
 struct Lighthouse {
   double vTl[6];
   double params[NUM_MOTORS*NUM_PARAMS];
+  CorrectionTable correction;
   bool ready;
 };
 typedef std::map<std::string, Lighthouse> LighthouseMap;
@@ -65,12 +120,77 @@ struct Tracker {
 };
 typedef std::map<std::string, Tracker> TrackerMap;
 
-// Pulse measurements
-struct Measurement {
-  double wTb[6];
-  deepdive_ros::Light light;
+// Mean angles seen by one tracker from one lighthouse over a bin of time
+struct LightBin {
+  ros::Time time;                           // Center of the bin
+  uint16_t tracker;                         // Tracker id in the store
+  uint16_t lighthouse;                      // Lighthouse id in the store
+  uint32_t seen[NUM_MOTORS];                // Sensors seen on each axis
+  double angles[NUM_SENSORS][NUM_MOTORS];   // Mean angle of each sensor
+  // Whether a sensor was seen on both axes
+  bool Seen(uint8_t sensor) const {
+    return ((seen[0] & seen[1]) >> sensor) & 1;
+  }
+};
+typedef std::vector<LightBin> LightBins;
+
+// Uncompacted samples to allow when streaming light in time order
+static constexpr size_t COMPACT_SAMPLES = 1 << 20;
+
+// Pulse measurements, stored as flat columns of samples rather than one node
+// per light message. The columns are reserved in large chunks up front and
+// keep their capacity when cleared, so they are reused between recordings.
+class MeasurementStore {
+ public:
+  MeasurementStore();
+
+  // Add the pulses of a light message received at the given time
+  void Add(ros::Time const& t, deepdive_ros::Light const& light);
+
+  // Forget all samples and keep the memory
+  void Clear();
+
+  // Number of light messages and their time span
+  size_t Size() const { return count_; }
+  bool Empty() const { return count_ == 0; }
+  ros::Time const& First() const { return first_; }
+  ros::Time const& Last() const { return last_; }
+
+  // Sort and reduce the samples to their mean in bins of width res, giving
+  // bins ordered by tracker, lighthouse and then time
+  void Bundle(double res, LightBins & bins) const;
+
+  // Reduce the bins that closed before the newest sample and drop their
+  // samples. This is exact when light is added in time order, which lets
+  // long recordings be streamed in with bounded memory.
+  void Compact(double res);
+
+  // Number of samples that have not been compacted
+  size_t Samples() const { return angle_.size(); }
+
+  // Get the range of bins for a given tracker and lighthouse serial
+  void Find(LightBins const& bins, std::string const& tracker,
+    std::string const& lighthouse, LightBins::const_iterator & begin,
+    LightBins::const_iterator & end) const;
+
+ private:
+  // Append the bins of all samples in a bin before the given one
+  void Reduce(double res, int64_t before, LightBins & bins) const;
+
+  std::vector<int64_t> time_;           // Receive time (ns)
+  std::vector<uint16_t> tracker_;       // Tracker id
+  std::vector<uint16_t> lighthouse_;    // Lighthouse id
+  std::vector<uint8_t> sensor_;         // Sensor index
+  std::vector<uint8_t> axis_;           // Motor axis
+  std::vector<double> angle_;           // Angle (rads)
+  std::vector<std::string> trackers_;       // Tracker id -> serial
+  std::vector<std::string> lighthouses_;    // Lighthouse id -> serial
+  LightBins closed_;                        // Compacted bins
+  double res_;                              // Resolution of compacted bins
+  size_t count_;
+  ros::Time first_;
+  ros::Time last_;
 };
-typedef std::map<ros::Time, Measurement> MeasurementMap;
 
 // Correction data structure
 typedef std::map<ros::Time, geometry_msgs::TransformStamped> CorrectionMap;
@@ -89,7 +209,7 @@ void SendTransforms(
   LighthouseMap const& lighthouses, TrackerMap const& trackers);
 
 // Convert a ceres to an Eigen transform
-Eigen::Affine3d CeresToEigen(double ceres[6], bool invert = false);
+Eigen::Affine3d CeresToEigen(double const ceres[6], bool invert = false);
 
 // CONFIG MANAGEMENT
 
@@ -117,6 +237,44 @@ void LighthouseCallback(deepdive_ros::Lighthouses::ConstPtr const& msg,
 void TrackerCallback(deepdive_ros::Trackers::ConstPtr const& msg,
   TrackerMap & trackers, std::function<void(TrackerMap::iterator)> cb);
 
+// Read light from a bag, including bags recorded before Light had a timecode
+// or driver ids
+bool ReadLight(rosbag::MessageInstance const& m, deepdive_ros::Light & light);
+
+// Read trackers and lighthouses from a bag, including bags recorded before
+// they had driver ids
+bool ReadTrackers(rosbag::MessageInstance const& m,
+  deepdive_ros::Trackers::ConstPtr & msg);
+bool ReadLighthouses(rosbag::MessageInstance const& m,
+  deepdive_ros::Lighthouses::ConstPtr & msg);
+
+// BAG PROCESSING
+
+// Handlers for the messages in a bag, which are given the time at which each
+// message was recorded. Handlers that are not set are skipped.
+struct BagHandlers {
+  std::function<void(deepdive_ros::Trackers::ConstPtr const&)> trackers;
+  std::function<void(deepdive_ros::Lighthouses::ConstPtr const&)> lighthouses;
+  std::function<void(ros::Time const&, deepdive_ros::Light const&)> light;
+  std::function<void(ros::Time const&, sensor_msgs::Imu const&)> imu;
+  std::function<void(ros::Time const&, tf2_msgs::TFMessage const&)> tf;
+};
+
+// Stream a bag through the handlers in recorded order, as fast as it can be
+// read. Packed messages are unpacked. Returns false if the bag could not be
+// opened.
+bool ReadBag(std::string const& file, BagHandlers const& handlers);
+
+// PACKED DATA
+
+// Unpack a batch of raw light and IMU into the light and IMU handlers, which
+// are given the host time of each sweep and sample. The same two messages are
+// reused for every call. If keep is given, only the trackers it marks (by
+// index into the serial list) are unpacked. Returns false if the columns are
+// inconsistent.
+bool Unpack(deepdive_ros::Packed const& msg, BagHandlers const& handlers,
+  std::vector<bool> const* keep = nullptr);
+
 // RUNTIME STATISTICS
 
 class Statistic {
@@ -159,6 +317,120 @@ class Statistic {
 // Get the average of a vector of doubles
 bool Mean(std::vector<double> const& v, double & d);
 
+// PARALLEL PROCESSING
+
+// Call f(i) for every i in [0, n) from a pool of threads, which each claim the
+// next unprocessed index until none remain. Zero threads means one per core.
+void ParallelFor(size_t n, std::function<void(size_t)> const& f,
+  int threads = 0);
+
+// Runs one job at a time on a background thread, so that a long solve does
+// not hold up the callbacks that keep recording the next segment
+class Worker {
+ public:
+  Worker();
+  ~Worker();
+
+  // Run a job in the background, unless the last one is still running
+  bool Start(std::function<void()> const& job);
+
+  // Whether a job is running
+  bool Busy() const { return busy_; }
+
+  // Ask the running job to give up, and wait for it to return
+  void Stop();
+
+  // Whether the running job has been asked to give up
+  bool Stopping() const { return stop_; }
+
+ private:
+  std::thread thread_;
+  std::atomic<bool> busy_;
+  std::atomic<bool> stop_;
+};
+
+// BACKGROUND SOLVING
+
+// Light recorded between two triggers, and the calibration it started from,
+// which is solved in the background while the next segment is recorded
+struct Segment {
+  uint32_t id;                          // Number of the segment
+  MeasurementStore measurements;        // Light
+  CorrectionMap corrections;            // Corrections
+  LighthouseMap lighthouses;            // Lighthouse calibration
+  TrackerMap trackers;                  // Tracker calibration
+  double wTv[6];                        // World -> vive registration
+};
+
+// Called when the calibration of a lighthouse or tracker is first received.
+// Every node that follows the calibration defines these.
+void NewLighthouseCallback(LighthouseMap::iterator lighthouse);
+void NewTrackerCallback(TrackerMap::iterator tracker);
+
+// Hands the segments that a node records to a worker, one at a time, and
+// publishes how far each solve has got on "/progress". The node says how to
+// solve a segment and how to write the solution back to its calibration. The
+// mutex guards the calibration and the buffers being recorded into.
+class SegmentSolver {
+ public:
+  typedef std::function<bool(Segment &)> SolveFunction;
+  typedef std::function<void(Segment const&)> CommitFunction;
+
+  // A node keeps its own buffers and calibration, which must outlive this
+  SegmentSolver(MeasurementStore & measurements, CorrectionMap & corrections,
+    LighthouseMap & lighthouses, TrackerMap & trackers, double wTv[6],
+    SolveFunction const& solve, CommitFunction const& commit);
+
+  // Start publishing progress
+  void Advertise(ros::NodeHandle & nh);
+
+  // Report how far the solve of the current segment has got
+  void Progress(std::string const& stage, uint32_t iteration = 0,
+    double cost = 0.0, bool done = false, bool success = false);
+
+  // End the segment being recorded and solve it in the background, leaving
+  // the buffers it was recorded into empty. If the last segment is still
+  // being solved, this one keeps growing. Returns whether a solve started.
+  bool Trigger(std::string & message);
+
+  // Tracker and lighthouse updates, which may race a solution being written.
+  // These are inline, so only the nodes that use them need the New*Callback.
+  void TrackersCallback(deepdive_ros::Trackers::ConstPtr const& msg) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    TrackerCallback(msg, trackers_, NewTrackerCallback);
+  }
+  void LighthousesCallback(deepdive_ros::Lighthouses::ConstPtr const& msg) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    LighthouseCallback(msg, lighthouses_, NewLighthouseCallback);
+  }
+
+  // Callbacks that record into the buffers or read the calibration lock this
+  std::mutex & Mutex() { return mutex_; }
+
+  // Whether a segment is being solved, or has been asked to give up
+  bool Busy() const { return worker_.Busy(); }
+  bool Stopping() const { return worker_.Stopping(); }
+
+  // Ask the solve to give up, and wait for it to return
+  void Stop() { worker_.Stop(); }
+
+ private:
+  // Solve the segment on the worker, and leave its buffers empty for reuse
+  void Run();
+
+  MeasurementStore & measurements_;
+  CorrectionMap & corrections_;
+  LighthouseMap & lighthouses_;
+  TrackerMap & trackers_;
+  double* wTv_;
+  SolveFunction solve_;
+  CommitFunction commit_;
+  std::mutex mutex_;
+  ros::Publisher pub_progress_;
+  Segment segment_;
+  Worker worker_;
+};
+
 // TRACKING ROUTINES
 
 // This algorithm solves the Procrustes problem in that it finds an affine transform
@@ -210,10 +482,10 @@ static bool Kabsch(
     in.col(col)  -= in_ctr;
     out.col(col) -= out_ctr;
   }
-  // SVD
-  Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> Cov = in * out.transpose();
-  Eigen::JacobiSVD < Eigen::Matrix < T, Eigen::Dynamic, Eigen::Dynamic > > svd(Cov,
-    Eigen::ComputeThinU | Eigen::ComputeThinV);
+  // SVD of the covariance, which is always 3x3 so needs no heap
+  Eigen::Matrix<T, 3, 3> Cov = in * out.transpose();
+  Eigen::JacobiSVD<Eigen::Matrix<T, 3, 3>> svd(Cov,
+    Eigen::ComputeFullU | Eigen::ComputeFullV);
   // Find the rotation
   T d = (svd.matrixV() * svd.matrixU().transpose()).determinant();
   if (d > T(0.0))
@@ -230,6 +502,71 @@ static bool Kabsch(
   return true;
 }
 
+// Robust version of the above, in which minimal sets of correspondences are
+// fitted at random. The fit that agrees with the most correspondences to
+// within the threshold is refitted to just those inliers.
+template <typename T>
+static bool KabschRansac(
+  Eigen::Matrix<T, 3, Eigen::Dynamic> const& in,
+  Eigen::Matrix<T, 3, Eigen::Dynamic> const& out,
+  Eigen::Transform<T, 3, Eigen::Affine> &A, T threshold,
+  size_t iterations = 100, size_t * inliers = nullptr) {
+  static constexpr int MINIMAL = 4;
+  // Default output, as for the plain fit
+  A.linear() = Eigen::Matrix<T, 3, 3>::Identity(3, 3);
+  A.translation() = Eigen::Matrix<T, 3, 1>::Zero();
+  if (inliers)
+    *inliers = in.cols();
+  if (in.cols() != out.cols() || in.cols() <= MINIMAL)
+    return Kabsch<T>(in, out, A, false);
+  // Seeded so that the same data always gives the same solution
+  std::mt19937 rng(0);
+  std::uniform_int_distribution<int> pick(0, in.cols() - 1);
+  std::vector<int> best;
+  for (size_t i = 0; i < iterations; i++) {
+    // Choose a minimal set of distinct correspondences
+    int idx[MINIMAL];
+    for (int j = 0; j < MINIMAL; j++) {
+      bool unique;
+      do {
+        idx[j] = pick(rng);
+        unique = true;
+        for (int k = 0; k < j; k++)
+          unique = unique && (idx[k] != idx[j]);
+      } while (!unique);
+    }
+    Eigen::Matrix<T, 3, Eigen::Dynamic> si(3, MINIMAL), so(3, MINIMAL);
+    for (int j = 0; j < MINIMAL; j++) {
+      si.col(j) = in.col(idx[j]);
+      so.col(j) = out.col(idx[j]);
+    }
+    Eigen::Transform<T, 3, Eigen::Affine> H;
+    if (!Kabsch<T>(si, so, H, false))
+      continue;
+    // Count the correspondences that agree with it
+    std::vector<int> agree;
+    for (int j = 0; j < in.cols(); j++)
+      if ((H * in.col(j) - out.col(j)).norm() < threshold)
+        agree.push_back(j);
+    if (agree.size() > best.size())
+      best.swap(agree);
+  }
+  if (best.size() < MINIMAL) {
+    if (inliers)
+      *inliers = 0;
+    return false;
+  }
+  // Refit to the consensus set
+  Eigen::Matrix<T, 3, Eigen::Dynamic> bi(3, best.size()), bo(3, best.size());
+  for (size_t j = 0; j < best.size(); j++) {
+    bi.col(j) = in.col(best[j]);
+    bo.col(j) = out.col(best[j]);
+  }
+  if (inliers)
+    *inliers = best.size();
+  return Kabsch<T>(bi, bo, A, false);
+}
+
 // Lighthouse correction
 // see: https://github.com/cnlohr/libsurvive/wiki/BSD-Calibration-Values
 
@@ -267,6 +604,33 @@ static void Correct(T const* params, T * angle, bool correct) {
   }
 }
 
+// Given the lighthouse angle, predict the point in space from the table
+static void Correct(Lighthouse const& lighthouse, double * angle,
+  bool correct) {
+  if (!correct)
+    return;
+  if (lighthouse.correction.Built())
+    lighthouse.correction.Apply(angle);
+  else
+    Correct(lighthouse.params, angle, correct);
+}
+
+// Interpolate between the four grid points around a pair
+inline void CorrectionTable::Apply(double * angle) const {
+  static constexpr double SCALE = (SIZE - 1) / (2.0 * LIMIT);
+  double u = (angle[0] + LIMIT) * SCALE;
+  double v = (angle[1] + LIMIT) * SCALE;
+  if (!(u >= 0.0 && u < SIZE - 1 && v >= 0.0 && v < SIZE - 1))
+    return Correct(params_, angle, true);
+  size_t i = static_cast<size_t>(u);
+  size_t j = static_cast<size_t>(v);
+  double fu = u - i, fv = v - j;
+  double const* c = &table_[2 * (i * SIZE + j)];
+  for (size_t k = 0; k < 2; k++)
+    angle[k] += (1.0 - fu) * ((1.0 - fv) * c[k] + fv * c[2 + k])
+              + fu * ((1.0 - fv) * c[2 * SIZE + k] + fv * c[2 * SIZE + 2 + k]);
+}
+
 
 #endif
 
@@ -0,0 +1,372 @@
+/*
+  This benchmark watches a capture being replayed through the bridge and the
+  tracker (see launch/bench.launch) and reports, once the data stops, how long
+  light took to pass through each stage of the pipeline, how much CPU the
+  pipeline used per tracker, and how far the poses were from a reference.
+
+  Parameters (private):
+    topic       Pose topic of the body to evaluate ("/loc/truth/pose")
+    reference   CSV of t,x,y,z[,qw,qx,qy,qz] to compare poses against ("")
+    output      CSV to write the poses to, in the same format ("")
+    processes   Names of processes whose CPU time is measured
+    idle        Seconds without data after which the results are reported
+*/
+
+// ROS includes
+#include <ros/ros.h>
+
+// Messages
+#include <geometry_msgs/PoseWithCovarianceStamped.h>
+#include <deepdive_ros/Timing.h>
+#include <deepdive_ros/Trackers.h>
+
+// C includes
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <unistd.h>
+
+// C++ includes
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <string>
+#include <vector>
+
+// Deepdive internal
+#include "deepdive.hh"
+
+// Largest gap in the reference that a pose may be interpolated across
+static constexpr double MAX_GAP = 0.1;
+
+// A pose at some time
+struct Sample {
+  double t;
+  Eigen::Vector3d p;
+  Eigen::Quaterniond q;
+  bool oriented;
+};
+
+// Stages of the pipeline, as indexes into the fields of a timing record
+enum Stage { USB, LIGHT, RECEIVED, FUSED, PUBLISHED, NUM_STAGES };
+static const char * STAGES[NUM_STAGES] = {
+  "usb", "light", "received", "fused", "published"
+};
+
+// Timing of each sweep, keyed by tracker and timecode, pieced together from
+// the records of the bridge and the tracker
+static std::map<uint64_t, std::vector<uint64_t>> timing_;
+
+// Poses received, and the trajectory they are compared against
+static std::vector<Sample> poses_;
+static std::vector<Sample> reference_;
+
+// Number of trackers seen by the bridge
+static size_t trackers_ = 0;
+
+// Processes whose CPU time is measured, and their ticks at the first data and
+// when last seen, since the bridge exits at the end of a replay
+static std::vector<std::string> processes_;
+static std::map<int, uint64_t> cpu_first_;
+static std::map<int, uint64_t> cpu_last_;
+
+// Wall time of the first and the last data received
+static ros::WallTime first_, last_;
+static double idle_ = 2.0;
+static std::string output_;
+
+// CPU
+
+// CPU ticks used so far by every process with one of the names we measure
+static std::map<int, uint64_t> Ticks() {
+  std::map<int, uint64_t> ticks;
+  DIR * dir = opendir("/proc");
+  if (!dir)
+    return ticks;
+  struct dirent * ent;
+  while ((ent = readdir(dir))) {
+    int pid = atoi(ent->d_name);
+    if (pid <= 0)
+      continue;
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE * f = fopen(path, "r");
+    if (!f)
+      continue;
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+    // The name is in parentheses, and may itself contain spaces or brackets
+    char * open = strchr(buf, '(');
+    char * close = strrchr(buf, ')');
+    if (!open || !close || close < open)
+      continue;
+    std::string comm(open + 1, close);
+    if (std::find(processes_.begin(), processes_.end(), comm)
+      == processes_.end())
+      continue;
+    // User and system time are the 12th and 13th fields after the name
+    unsigned long long utime, stime;
+    if (sscanf(close + 2,
+      "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+      &utime, &stime) == 2)
+      ticks[pid] = utime + stime;
+  }
+  closedir(dir);
+  return ticks;
+}
+
+// Keep the newest ticks of every measured process that is still running
+static void SampleCpu() {
+  std::map<int, uint64_t> now = Ticks();
+  std::map<int, uint64_t>::const_iterator it;
+  for (it = now.begin(); it != now.end(); it++)
+    cpu_last_[it->first] = it->second;
+}
+
+// CPU seconds used by the measured processes since the first data
+static double CpuSeconds() {
+  SampleCpu();
+  uint64_t ticks = 0;
+  std::map<int, uint64_t>::const_iterator it;
+  for (it = cpu_last_.begin(); it != cpu_last_.end(); it++) {
+    std::map<int, uint64_t>::const_iterator jt = cpu_first_.find(it->first);
+    ticks += it->second - (jt == cpu_first_.end() ? 0 : jt->second);
+  }
+  return static_cast<double>(ticks) / sysconf(_SC_CLK_TCK);
+}
+
+// TRAJECTORIES
+
+// Read a trajectory from a CSV file, skipping lines that aren't poses
+static bool ReadCsv(std::string const& file, std::vector<Sample> & samples) {
+  FILE * f = fopen(file.c_str(), "r");
+  if (!f)
+    return false;
+  char line[512];
+  while (fgets(line, sizeof(line), f)) {
+    Sample s;
+    double v[8];
+    int n = sscanf(line, "%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf",
+      &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]);
+    if (n != 4 && n != 8)
+      continue;
+    s.t = v[0];
+    s.p = Eigen::Vector3d(v[1], v[2], v[3]);
+    s.oriented = (n == 8);
+    s.q = Eigen::Quaterniond::Identity();
+    if (s.oriented)
+      s.q = Eigen::Quaterniond(v[4], v[5], v[6], v[7]).normalized();
+    samples.push_back(s);
+  }
+  fclose(f);
+  std::sort(samples.begin(), samples.end(),
+    [](Sample const& a, Sample const& b) { return a.t < b.t; });
+  return true;
+}
+
+// Write a trajectory to a CSV file
+static bool WriteCsv(std::string const& file,
+  std::vector<Sample> const& samples) {
+  FILE * f = fopen(file.c_str(), "w");
+  if (!f)
+    return false;
+  fprintf(f, "t,x,y,z,qw,qx,qy,qz\n");
+  for (size_t i = 0; i < samples.size(); i++) {
+    Sample const& s = samples[i];
+    fprintf(f, "%.9f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f\n", s.t,
+      s.p[0], s.p[1], s.p[2], s.q.w(), s.q.x(), s.q.y(), s.q.z());
+  }
+  fclose(f);
+  return true;
+}
+
+// Interpolate the reference at some time, if it covers it
+static bool Interpolate(std::vector<Sample> const& ref, double t, Sample & s) {
+  std::vector<Sample>::const_iterator it = std::lower_bound(ref.begin(),
+    ref.end(), t, [](Sample const& a, double t) { return a.t < t; });
+  if (it == ref.end() || (it == ref.begin() && it->t > t))
+    return false;
+  if (it->t == t) {
+    s = *it;
+    return true;
+  }
+  Sample const& a = *(it - 1);
+  Sample const& b = *it;
+  if (b.t - a.t > MAX_GAP)
+    return false;
+  double f = (t - a.t) / (b.t - a.t);
+  s.t = t;
+  s.p = a.p + f * (b.p - a.p);
+  s.q = a.q.slerp(f, b.q);
+  s.oriented = a.oriented && b.oriented;
+  return true;
+}
+
+// STATISTICS
+
+// Print the percentiles of a set of values
+static void Print(const char * name, std::vector<double> & v,
+  const char * unit) {
+  if (v.empty()) {
+    printf("%-24s %10s\n", name, "no data");
+    return;
+  }
+  std::sort(v.begin(), v.end());
+  double sum = 0;
+  for (size_t i = 0; i < v.size(); i++)
+    sum += v[i] * v[i];
+  printf("%-24s %8zu samples %10.3f p50 %10.3f p90 %10.3f p99 %10.3f max"
+    " %10.3f rms %s\n", name, v.size(), v[v.size() / 2],
+    v[(v.size() * 9) / 10], v[(v.size() * 99) / 100], v.back(),
+    sqrt(sum / v.size()), unit);
+}
+
+// Latency of every sweep between two stages, in microseconds
+static std::vector<double> Latency(Stage from, Stage to) {
+  std::vector<double> v;
+  std::map<uint64_t, std::vector<uint64_t>>::const_iterator it;
+  for (it = timing_.begin(); it != timing_.end(); it++)
+    if (it->second[from] && it->second[to]
+      && it->second[to] >= it->second[from])
+      v.push_back(1e-3 * (it->second[to] - it->second[from]));
+  return v;
+}
+
+// Print the results of the run
+static void Report() {
+  double cpu = CpuSeconds();
+  double wall = (last_ - first_).toSec();
+  double capture = (poses_.size() > 1 ? poses_.back().t - poses_.front().t : 0);
+  printf("%zu trackers, %zu sweeps timed, %zu poses\n",
+    trackers_, timing_.size(), poses_.size());
+  printf("%.3f s of capture in %.3f s (%.2fx real time)\n",
+    capture, wall, (wall > 0 ? capture / wall : 0));
+
+  // Latency of each stage, and end to end
+  for (size_t i = USB; i < PUBLISHED; i++) {
+    std::string name = std::string(STAGES[i]) + " -> " + STAGES[i + 1];
+    std::vector<double> v = Latency(Stage(i), Stage(i + 1));
+    Print(name.c_str(), v, "us");
+  }
+  std::vector<double> total = Latency(USB, PUBLISHED);
+  Print("usb -> published", total, "us");
+
+  // CPU used per tracker, and how many trackers one core could keep up with
+  printf("%.3f s of cpu in %zu processes\n", cpu, cpu_last_.size());
+  if (trackers_ > 0 && cpu > 0 && capture > 0) {
+    printf("%10.3f %% of a core per tracker\n",
+      100.0 * cpu / (capture * trackers_));
+    printf("%10.1f trackers per core\n", capture * trackers_ / cpu);
+  }
+
+  // Error against the reference trajectory
+  if (!reference_.empty()) {
+    std::vector<double> position, orientation;
+    for (size_t i = 0; i < poses_.size(); i++) {
+      Sample ref;
+      if (!Interpolate(reference_, poses_[i].t, ref))
+        continue;
+      position.push_back(1e3 * (poses_[i].p - ref.p).norm());
+      if (ref.oriented)
+        orientation.push_back(
+          ref.q.angularDistance(poses_[i].q) * 180.0 / M_PI);
+    }
+    Print("position error", position, "mm");
+    if (!orientation.empty())
+      Print("orientation error", orientation, "deg");
+  }
+
+  // Keep the poses, so that this run can be the reference for the next
+  if (!output_.empty() && !WriteCsv(output_, poses_))
+    ROS_ERROR_STREAM("Could not write " << output_);
+}
+
+// CALLBACKS
+
+// Note that data has arrived, starting the clocks on the first of it
+static void Activity() {
+  last_ = ros::WallTime::now();
+  if (first_.isZero()) {
+    first_ = last_;
+    cpu_first_ = Ticks();
+    cpu_last_ = cpu_first_;
+  }
+}
+
+// Merge the stages timed by the bridge or the tracker into the sweep's record
+void TimingCallback(deepdive_ros::Timing::ConstPtr const& msg) {
+  Activity();
+  uint64_t key = (static_cast<uint64_t>(msg->tracker_id) << 32) | msg->timecode;
+  std::vector<uint64_t> & record = timing_[key];
+  record.resize(NUM_STAGES, 0);
+  uint64_t stages[NUM_STAGES] = {
+    msg->usb, msg->light, msg->received, msg->fused, msg->published
+  };
+  for (size_t i = 0; i < NUM_STAGES; i++)
+    if (stages[i])
+      record[i] = stages[i];
+}
+
+void PoseCallback(
+  geometry_msgs::PoseWithCovarianceStamped::ConstPtr const& msg) {
+  Activity();
+  Sample s;
+  s.t = msg->header.stamp.toSec();
+  s.p = Eigen::Vector3d(msg->pose.pose.position.x,
+    msg->pose.pose.position.y, msg->pose.pose.position.z);
+  s.q = Eigen::Quaterniond(msg->pose.pose.orientation.w,
+    msg->pose.pose.orientation.x, msg->pose.pose.orientation.y,
+    msg->pose.pose.orientation.z);
+  s.oriented = true;
+  poses_.push_back(s);
+}
+
+void TrackersCallback(deepdive_ros::Trackers::ConstPtr const& msg) {
+  trackers_ = std::max(trackers_, msg->trackers.size());
+}
+
+// Sample the CPU time used, and report once the data has stopped for long
+// enough
+void IdleCallback(ros::WallTimerEvent const& event) {
+  if (first_.isZero())
+    return;
+  SampleCpu();
+  if ((ros::WallTime::now() - last_).toSec() < idle_)
+    return;
+  Report();
+  ros::shutdown();
+}
+
+int main(int argc, char **argv) {
+  ros::init(argc, argv, "deepdive_bench");
+  ros::NodeHandle nh, pnh("~");
+
+  // What to measure
+  std::string topic, reference;
+  pnh.param<std::string>("topic", topic, "/loc/truth/pose");
+  pnh.param<std::string>("reference", reference, "");
+  pnh.param<std::string>("output", output_, "");
+  pnh.param<double>("idle", idle_, 2.0);
+  std::vector<std::string> processes = {"deepdive_bridge", "deepdive_track"};
+  pnh.param<std::vector<std::string>>("processes", processes_, processes);
+  if (!reference.empty() && !ReadCsv(reference, reference_)) {
+    ROS_FATAL_STREAM("Could not read reference " << reference);
+    return 1;
+  }
+
+  // Collect the data
+  ros::Subscriber sub_timing = nh.subscribe("/timing", 10000, TimingCallback);
+  ros::Subscriber sub_pose = nh.subscribe(topic, 10000, PoseCallback);
+  ros::Subscriber sub_trackers = nh.subscribe("/trackers", 10,
+    TrackersCallback);
+  ros::WallTimer timer = nh.createWallTimer(ros::WallDuration(0.1),
+    IdleCallback);
+
+  // Block until the results have been reported
+  ros::spin();
+
+  // Success!
+  return 0;
+}
@@ -11,27 +11,46 @@ extern "C" {
 // ROS includes
 #include <ros/ros.h>
 
+// Nodelet includes
+#ifdef DEEPDIVE_NODELET
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#endif
+
 // Standard messages
 #include <sensor_msgs/Imu.h>
 #include <geometry_msgs/Vector3.h>
 #include <geometry_msgs/Quaternion.h>
 #include <geometry_msgs/Point.h>
+#include <rosgraph_msgs/Clock.h>
 
 // Non-standard messages
 #include <deepdive_ros/Button.h>
 #include <deepdive_ros/Light.h>
+#include <deepdive_ros/Packed.h>
 #include <deepdive_ros/Pulse.h>
 #include <deepdive_ros/Motor.h>
 #include <deepdive_ros/Sensor.h>
 #include <deepdive_ros/Lighthouses.h>
 #include <deepdive_ros/Trackers.h>
+#include <deepdive_ros/Timing.h>
 
 // C++ includes
+#include <cerrno>
 #include <cstdint>
+#include <cstring>
 #include <cmath>
 #include <map>
 #include <string>
+#include <vector>
 #include <limits>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+// Deepdive internal
+#include "deepdive_clock.hh"
 
 // Various constants used by the Vive system
 static constexpr double GRAVITY         = 9.80665;
@@ -41,11 +60,61 @@ static constexpr double SWEEP_DURATION  = 400000.0;
 static constexpr double SWEEP_CENTER    = 200000.0;
 static constexpr double TICKS_PER_SEC   = 48e6;
 
+// CLOCK SYNCHRONIZATION
+
+// Maps the 32-bit 48MHz tick counter of a tracker to host time. The counter
+// is unwrapped to 64 bits, and the offset to host time is the minimum of the
+// observed (host - device) differences, since USB and scheduling delays can
+// only ever add to it. The offset may rise by at most MAX_DRIFT seconds per
+// second to follow crystal drift, and is reset after a large discontinuity.
+class ClockEstimator {
+ public:
+  static constexpr double MAX_DRIFT = 1e-4;
+  static constexpr double MAX_JUMP = 1.0;
+
+  // Constructor and initialization
+  ClockEstimator() : initialized_(false), last_(0), ticks_(0), offset_(0) {}
+
+  // Feed a device timecode received at a host time, and get its host time
+  ros::Time Map(uint32_t timecode, ros::Time const& host) {
+    if (!initialized_) {
+      last_ = timecode;
+      ticks_ = timecode;
+    }
+    ticks_ += static_cast<int32_t>(timecode - last_);
+    last_ = timecode;
+    double device = static_cast<double>(ticks_) / TICKS_PER_SEC;
+    double obs = host.toSec() - device;
+    if (!initialized_ || fabs(obs - offset_) > MAX_JUMP) {
+      offset_ = obs;
+      host_ = host;
+      initialized_ = true;
+    } else if (obs < offset_) {
+      offset_ = obs;
+    } else {
+      offset_ += std::min(obs - offset_, MAX_DRIFT * (host - host_).toSec());
+    }
+    host_ = host;
+    return ros::Time(offset_ + device);
+  }
+
+ private:
+  bool initialized_;    // Whether we have seen a timecode
+  uint32_t last_;       // Last raw timecode
+  int64_t ticks_;       // Unwrapped timecode
+  double offset_;       // Host time minus device time
+  ros::Time host_;      // Host time of the last timecode
+};
+
 // DATA STRUCTURES
 
-// Data structures for storing lighthouses and trackers
-static std::map<std::string, deepdive_ros::Lighthouse> lighthouses_;
-static std::map<std::string, deepdive_ros::Tracker> trackers_;
+// Clock estimator for each tracker, indexed by its id
+static std::vector<ClockEstimator> clocks_;
+
+// Data structures for storing lighthouses and trackers, keyed by their ids so
+// that a lighthouse taking over a slot replaces the previous one
+static std::map<uint8_t, deepdive_ros::Lighthouse> lighthouses_;
+static std::map<uint16_t, deepdive_ros::Tracker> trackers_;
 
 // Create data publishers
 static ros::Publisher pub_lighthouses_;
@@ -53,6 +122,35 @@ static ros::Publisher pub_trackers_;
 static ros::Publisher pub_button_;
 static ros::Publisher pub_light_;
 static ros::Publisher pub_imu_;
+static ros::Publisher pub_packed_;
+static ros::Publisher pub_timing_;
+static ros::Publisher pub_clock_;
+
+// Optionally batch light and IMU into packed messages over an interval
+static bool packed_ = false;
+static double interval_ = 0.01;
+static deepdive_ros::Packed::Ptr batch_;
+
+// Driver, and whether it is replaying a capture rather than reading USB
+static struct Driver *driver_ = nullptr;
+static bool replay_ = false;
+
+// Unless USB is handled on its own thread, the driver is polled alongside ROS,
+// waking up at least this often to flush batches and service callbacks
+static constexpr int WAKE_MS = 10;
+static constexpr int BACKOFF_MS = 100;
+static bool threaded_ = false;
+static std::atomic<bool> pollfds_changed_(true);
+
+// Cleared to stop polling the driver
+static std::atomic<bool> running_(true);
+
+// Optionally time every light through the pipeline, and drive the ROS clock
+// from a replay, throttled to this period in seconds
+static constexpr double CLOCK_PERIOD = 0.001;
+static bool timing_ = false;
+static bool clock_ = false;
+static ros::Time clock_last_;
 
 // Quaternion :: ROS <-> DOUBLE
 
@@ -104,6 +202,87 @@ void Convert(const T from[3], geometry_msgs::Point & to) {
   to.z = from[2];
 }
 
+// Clock estimator of a tracker
+static ClockEstimator & Clock(struct Tracker const* tracker) {
+  if (tracker->id >= clocks_.size())
+    clocks_.resize(tracker->id + 1);
+  return clocks_[tracker->id];
+}
+
+// Host time at which the data being handled arrived. In a replay this is the
+// time at which it was captured, so that stamps follow the capture no matter
+// how fast it is replayed.
+static ros::Time Host() {
+  uint64_t ns;
+  if (replay_ && deepdive_replay_time(driver_, &ns) == 0)
+    return ros::Time().fromNSec(ns);
+  return ros::Time::now();
+}
+
+// Publish the capture time of the data last handled in a replay as the ROS
+// clock, for nodes that use simulated time, so that their timers keep pace
+// with the replay without running ahead of what has been published
+static void Tick() {
+  uint64_t ns;
+  if (!clock_ || !replay_ || deepdive_replay_time(driver_, &ns))
+    return;
+  ros::Time now = ros::Time().fromNSec(ns);
+  if (!clock_last_.isZero() && now < clock_last_ + ros::Duration(CLOCK_PERIOD))
+    return;
+  rosgraph_msgs::Clock msg;
+  msg.clock = now;
+  pub_clock_.publish(msg);
+  clock_last_ = now;
+}
+
+// PACKING
+
+// Index of an id in a packed list, adding it and its serial if needed
+template <typename T>
+static uint8_t Index(std::vector<T> & ids, std::vector<std::string> & serials,
+  T id, const char * serial) {
+  typename std::vector<T>::iterator it = std::find(ids.begin(), ids.end(), id);
+  if (it != ids.end())
+    return it - ids.begin();
+  ids.push_back(id);
+  serials.push_back(serial);
+  return ids.size() - 1;
+}
+
+// Index of a tracker in the batch, recording where its clock maps to host time
+static uint8_t TrackerIndex(struct Tracker const* tracker, uint32_t timecode,
+  ros::Time const& stamp) {
+  size_t n = batch_->tracker_ids.size();
+  uint8_t idx = Index<uint16_t>(batch_->tracker_ids, batch_->trackers,
+    tracker->id, tracker->serial);
+  if (idx == n) {
+    batch_->timecodes.push_back(timecode);
+    batch_->stamps.push_back(stamp);
+  }
+  return idx;
+}
+
+// Publish the batch if its interval has passed, or if forced to
+static void Flush(bool force) {
+  if (!batch_ || batch_->trackers.empty())
+    return;
+  ros::Time now = ros::Time::now();
+  if (!force && (now - batch_->header.stamp).toSec() < interval_)
+    return;
+  batch_->header.stamp = now;
+  pub_packed_.publish(batch_);
+  batch_.reset();
+}
+
+// Start a new batch if there isn't one being filled
+static void Batch() {
+  if (batch_)
+    return;
+  batch_.reset(new deepdive_ros::Packed);
+  batch_->header.stamp = ros::Time::now();
+  batch_->header.frame_id = "world";
+}
+
 // CALLBACKS
 
 // Callback to display light info
@@ -111,53 +290,95 @@ void LightCallback(struct Tracker * tracker,
   struct Lighthouse * lighthouse, uint8_t axis, uint32_t synctime,
   uint16_t num_sensors, uint16_t *sensors, uint32_t *sweeptimes,
   uint32_t *angles, uint16_t *lengths) {
-  deepdive_ros::Light msg;
-  msg.header.frame_id = tracker->serial;
-  msg.header.stamp = ros::Time::now();
-  msg.lighthouse = lighthouse->serial;
+  deepdive_ros::Light::Ptr msg(new deepdive_ros::Light);
+  msg->header.frame_id = tracker->serial;
+  msg->header.stamp = Clock(tracker).Map(synctime, Host());
+  msg->timecode = synctime;
+  msg->lighthouse = lighthouse->serial;
+  msg->tracker_id = tracker->id;
+  msg->lighthouse_id = lighthouse->id;
   // Make sure we convert to RHS
   switch (axis) {
   case MOTOR_AXIS0:
-    msg.axis = deepdive_ros::Motor::AXIS_0;
+    msg->axis = deepdive_ros::Motor::AXIS_0;
     break;
   case MOTOR_AXIS1:
-    msg.axis = deepdive_ros::Motor::AXIS_1;
+    msg->axis = deepdive_ros::Motor::AXIS_1;
     break;
   default:
     ROS_WARN("Received light with invalid axis");
     return;
   }
+  // Record when the packet carrying this light completed, and when it got here
+  if (timing_ && tracker->completed) {
+    deepdive_ros::Timing timing;
+    timing.tracker_id = tracker->id;
+    timing.timecode = synctime;
+    timing.usb = tracker->completed;
+    timing.light = Monotonic();
+    pub_timing_.publish(timing);
+  }
+  // Add the raw sweep to the batch, keeping the ticks as they are
+  if (packed_) {
+    Batch();
+    batch_->sweep_timecode.push_back(synctime);
+    batch_->sweep_tracker.push_back(
+      TrackerIndex(tracker, synctime, msg->header.stamp));
+    batch_->sweep_lighthouse.push_back(Index<uint8_t>(batch_->lighthouse_ids,
+      batch_->lighthouses, lighthouse->id, lighthouse->serial));
+    batch_->sweep_axis.push_back(msg->axis);
+    batch_->sweep_pulses.push_back(num_sensors);
+    batch_->pulse_sensor.insert(batch_->pulse_sensor.end(),
+      sensors, sensors + num_sensors);
+    batch_->pulse_angle.insert(batch_->pulse_angle.end(),
+      angles, angles + num_sensors);
+    batch_->pulse_length.insert(batch_->pulse_length.end(),
+      lengths, lengths + num_sensors);
+    Flush(false);
+    return;
+  }
   // Add the pulses
-  msg.pulses.resize(num_sensors);
+  msg->pulses.resize(num_sensors);
   for (uint16_t i = 0; i < num_sensors; i++) {
-    msg.pulses[i].sensor = sensors[i];
-    msg.pulses[i].angle = (M_PI / SWEEP_DURATION)
+    msg->pulses[i].sensor = sensors[i];
+    msg->pulses[i].angle = (M_PI / SWEEP_DURATION)
       * (static_cast<double>(angles[i]) - SWEEP_CENTER);
-    msg.pulses[i].duration =
+    msg->pulses[i].duration =
       static_cast<double>(lengths[i]) / TICKS_PER_SEC;
   }
-  // Publish the data
+  // Publish the data, which intra-process subscribers share without a copy
   pub_light_.publish(msg);
 }
 
 // Called back when new IMU data is available
 void ImuCallback(struct Tracker * tracker, uint32_t timecode,
   int16_t acc[3], int16_t gyr[3], int16_t mag[3]) {
+  // Add the raw sample to the batch
+  if (packed_) {
+    Batch();
+    batch_->imu_timecode.push_back(timecode);
+    batch_->imu_tracker.push_back(TrackerIndex(tracker, timecode,
+      Clock(tracker).Map(timecode, Host())));
+    batch_->imu_acc.insert(batch_->imu_acc.end(), acc, acc + 3);
+    batch_->imu_gyr.insert(batch_->imu_gyr.end(), gyr, gyr + 3);
+    Flush(false);
+    return;
+  }
   // Package up the IMU data
-  sensor_msgs::Imu msg;
-  msg.header.frame_id = tracker->serial;
-  msg.header.stamp = ros::Time::now();
-  msg.linear_acceleration.x =
+  sensor_msgs::Imu::Ptr msg(new sensor_msgs::Imu);
+  msg->header.frame_id = tracker->serial;
+  msg->header.stamp = Clock(tracker).Map(timecode, Host());
+  msg->linear_acceleration.x =
     static_cast<double>(acc[0]) * GRAVITY / ACC_SCALE;
-  msg.linear_acceleration.y =
+  msg->linear_acceleration.y =
     static_cast<double>(acc[1]) * GRAVITY / ACC_SCALE;
-  msg.linear_acceleration.z =
+  msg->linear_acceleration.z =
     static_cast<double>(acc[2]) * GRAVITY / ACC_SCALE;
-  msg.angular_velocity.x =
+  msg->angular_velocity.x =
     static_cast<double>(gyr[0]) * (1./GYRO_SCALE) * (M_PI/180.);
-  msg.angular_velocity.y =
+  msg->angular_velocity.y =
     static_cast<double>(gyr[1]) * (1./GYRO_SCALE) * (M_PI/180.);
-  msg.angular_velocity.z =
+  msg->angular_velocity.z =
     static_cast<double>(gyr[2]) * (1./GYRO_SCALE) * (M_PI/180.);
   // Publish the data
   pub_imu_.publish(msg);
@@ -177,21 +398,41 @@ void ButtonCallback(struct Tracker * tracker,
   pub_button_.publish(msg);
 }
 
+// Send all trackers at once
+void PublishTrackers() {
+  deepdive_ros::Trackers msg;
+  msg.header.stamp = ros::Time::now();
+  msg.header.frame_id = "world";
+  std::map<uint16_t, deepdive_ros::Tracker>::iterator it;
+  for (it = trackers_.begin(); it != trackers_.end(); it++)
+    msg.trackers.push_back(it->second);
+  pub_trackers_.publish(msg);
+}
+
 // Configuration call from the vive_tool
 void TrackerCallback(struct Tracker * t) {
   if (!t) return;
-  deepdive_ros::Tracker & tracker = trackers_[t->serial];
+  deepdive_ros::Tracker & tracker = trackers_[t->id];
+  tracker.id = t->id;
   tracker.serial = t->serial;
   tracker.sensors.resize(t->cal.num_channels);
   for (size_t i = 0; i < t->cal.num_channels; i++) {
     Convert(t->cal.positions[i], tracker.sensors[i].position);
     Convert(t->cal.normals[i], tracker.sensors[i].normal);
   }
-  // Set the IMU sensor calibration data
-  Convert(t->cal.acc_bias, tracker.acc_bias);
-  Convert(t->cal.acc_scale, tracker.acc_scale);
-  Convert(t->cal.gyr_bias, tracker.gyr_bias);
-  Convert(t->cal.gyr_scale, tracker.gyr_scale);
+  // Set the IMU sensor calibration data, unless the driver already applies it
+  if (driver_ && driver_->options.imu_calibrate) {
+    float zero[3] = {0, 0, 0}, one[3] = {1, 1, 1};
+    Convert(zero, tracker.acc_bias);
+    Convert(one, tracker.acc_scale);
+    Convert(zero, tracker.gyr_bias);
+    Convert(one, tracker.gyr_scale);
+  } else {
+    Convert(t->cal.acc_bias, tracker.acc_bias);
+    Convert(t->cal.acc_scale, tracker.acc_scale);
+    Convert(t->cal.gyr_bias, tracker.gyr_bias);
+    Convert(t->cal.gyr_scale, tracker.gyr_scale);
+  }
   // Set the default IMU transform
   Convert(&t->cal.imu_transform[0], tracker.imu_transform.rotation);
   Convert(&t->cal.imu_transform[4], tracker.imu_transform.translation);
@@ -199,19 +440,24 @@ void TrackerCallback(struct Tracker * t) {
   Convert(&t->cal.head_transform[0], tracker.head_transform.rotation);
   Convert(&t->cal.head_transform[4], tracker.head_transform.translation);
   // Send all trackers at once
-  deepdive_ros::Trackers msg;
-  msg.header.stamp = ros::Time::now();
-  msg.header.frame_id = "world";
-  std::map<std::string, deepdive_ros::Tracker>::iterator it;
-  for (it = trackers_.begin(); it != trackers_.end(); it++)
-    msg.trackers.push_back(it->second);
-  pub_trackers_.publish(msg);
+  PublishTrackers();
+}
+
+// Called when a tracker is unplugged
+void RemovalCallback(struct Tracker * t) {
+  if (!t) return;
+  ROS_INFO_STREAM("Tracker " << t->serial << " was unplugged");
+  trackers_.erase(t->id);
+  if (t->id < clocks_.size())
+    clocks_[t->id] = ClockEstimator();
+  PublishTrackers();
 }
 
 // Configuration call from the vive_tool
 void LighthouseCallback(struct Lighthouse *l) {
   if (!l) return;
-  deepdive_ros::Lighthouse & lighthouse = lighthouses_[l->serial];
+  deepdive_ros::Lighthouse & lighthouse = lighthouses_[l->id];
+  lighthouse.id = l->id;
   lighthouse.serial = l->serial;
   lighthouse.motors.resize(2);
   for (size_t i = 0; i < MAX_NUM_MOTORS; i++) {
@@ -228,18 +474,19 @@ void LighthouseCallback(struct Lighthouse *l) {
   deepdive_ros::Lighthouses msg;
   msg.header.stamp = ros::Time::now();
   msg.header.frame_id = "world";
-  std::map<std::string, deepdive_ros::Lighthouse>::iterator it;
+  std::map<uint8_t, deepdive_ros::Lighthouse>::iterator it;
   for (it = lighthouses_.begin(); it != lighthouses_.end(); it++)
     msg.lighthouses.push_back(it->second);
   pub_lighthouses_.publish(msg);
 }
 
-// Main entry point of application
-int main(int argc, char **argv) {
-  // Initialize ROS
-  ros::init(argc, argv, "deepdive_bridge");
-  ros::NodeHandle nh;
+// Called when the driver adds or removes a descriptor, possibly from a worker
+void PollfdCallback(int fd, short events) {
+  pollfds_changed_ = true;
+}
 
+// Advertise the topics and start the driver. Returns false on failure.
+bool Setup(ros::NodeHandle & nh, ros::NodeHandle & pnh) {
   // Latched publishers
   pub_lighthouses_ =
     nh.advertise<deepdive_ros::Lighthouses>("lighthouses", 10, true);
@@ -250,32 +497,169 @@ int main(int argc, char **argv) {
   pub_light_ = nh.advertise<deepdive_ros::Light>("light", 10);
   pub_button_ = nh.advertise<deepdive_ros::Button>("button", 10);
   pub_imu_ = nh.advertise<sensor_msgs::Imu>("imu", 10);
+  pub_packed_ = nh.advertise<deepdive_ros::Packed>("packed", 10);
+  pub_timing_ = nh.advertise<deepdive_ros::Timing>("timing", 1000);
+  pub_clock_ = nh.advertise<rosgraph_msgs::Clock>("/clock", 10);
+
+  // Batch light and IMU into packed messages, instead of one per event
+  pnh.param<bool>("packed", packed_, false);
+  pnh.param<double>("interval", interval_, 0.01);
+
+  // Number of USB transfers to keep in flight per endpoint
+  struct Options options;
+  deepdive_default_options(&options);
+  int transfers = DEFAULT_TRANSFERS;
+  pnh.param<int>("transfers", transfers, DEFAULT_TRANSFERS);
+  options.num_transfers = std::max(1, std::min(transfers, MAX_TRANSFERS));
+
+  // Where to cache tracker calibration ("" disables the cache)
+  std::string cache_dir = options.cache_dir;
+  pnh.param<std::string>("cache_dir", cache_dir, cache_dir);
+  snprintf(options.cache_dir, MAX_PATH_LENGTH, "%s", cache_dir.c_str());
+
+  // Optionally capture raw packets, or replay a capture instead of USB
+  std::string capture, replay;
+  pnh.param<std::string>("capture", capture, "");
+  pnh.param<std::string>("replay", replay, "");
+  snprintf(options.capture, MAX_PATH_LENGTH, "%s", capture.c_str());
+  snprintf(options.replay, MAX_PATH_LENGTH, "%s", replay.c_str());
+  double speed = 1.0;
+  pnh.param<double>("speed", speed, 1.0);
+  options.speed = speed;
+  replay_ = !replay.empty();
+
+  // Optionally calibrate the IMU, and average it down to a lower rate
+  bool imu_calibrate = false;
+  pnh.param<bool>("imu_calibrate", imu_calibrate, false);
+  options.imu_calibrate = imu_calibrate;
+  double imu_rate = 0.0;
+  pnh.param<double>("imu_rate", imu_rate, 0.0);
+  options.imu_rate = imu_rate;
+
+  // Optionally time every light through the pipeline, rather than a sample,
+  // and publish the capture time of a replay on /clock
+  pnh.param<bool>("timing", timing_, false);
+  options.timing = timing_;
+  pnh.param<bool>("clock", clock_, false);
 
   // Try to initialize vive
-  struct Driver *driver = deepdive_init();
-  if (!driver) {
+  driver_ = deepdive_init_options(&options);
+  if (!driver_) {
     ROS_ERROR("Deepdive initialization failed");
-    return 1;
+    return false;
   }
 
   // Install the callbacks
-  deepdive_install_light_fn(driver, LightCallback);
-  deepdive_install_imu_fn(driver, ImuCallback);
-  deepdive_install_button_fn(driver, ButtonCallback);
-  deepdive_install_lighthouse_fn(driver, LighthouseCallback);
-  deepdive_install_tracker_fn(driver, TrackerCallback);
-
-  // Set active to true on initialization
-  while (ros::ok()) {
-    // Poll the ros driver for activity
-    deepdive_poll(driver);
-    // Flush the ROS messaging queue
-    ros::spinOnce();
+  deepdive_install_light_fn(driver_, LightCallback);
+  deepdive_install_imu_fn(driver_, ImuCallback);
+  deepdive_install_button_fn(driver_, ButtonCallback);
+  deepdive_install_lighthouse_fn(driver_, LighthouseCallback);
+  deepdive_install_tracker_fn(driver_, TrackerCallback);
+  deepdive_install_removal_fn(driver_, RemovalCallback);
+  deepdive_install_pollfd_fn(driver_, PollfdCallback);
+
+  // Optionally handle USB on its own thread, so publishing can't stall it
+  pnh.param<bool>("threaded", threaded_, false);
+  if (threaded_ && deepdive_start(driver_)) {
+    ROS_ERROR("Could not start the USB thread");
+    deepdive_close(driver_);
+    driver_ = nullptr;
+    return false;
   }
 
+  // Success!
+  return true;
+}
+
+// Wait for USB activity, or until the driver next needs to handle a timeout,
+// and handle whatever is ready. Returns 1 at the end of a replay.
+int Wait(std::vector<struct pollfd> & fds) {
+  if (threaded_)
+    return deepdive_poll(driver_);
+  if (pollfds_changed_.exchange(false)) {
+    int n = deepdive_get_pollfds(driver_, nullptr, 0);
+    fds.resize(n > 0 ? n : 0);
+    deepdive_get_pollfds(driver_, fds.data(), fds.size());
+  }
+  int ms = WAKE_MS;
+  struct timeval tv;
+  if (deepdive_next_timeout(driver_, &tv) == 1)
+    ms = std::min<int64_t>(ms, tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000);
+  // Back off rather than spin if the descriptors keep failing
+  if (poll(fds.data(), fds.size(), ms) < 0 && errno != EINTR) {
+    ROS_ERROR_THROTTLE(1.0, "Could not poll the driver: %s", strerror(errno));
+    std::this_thread::sleep_for(std::chrono::milliseconds(BACKOFF_MS));
+    return -1;
+  }
+  return deepdive_handle_ready(driver_);
+}
+
+// Poll the driver until shutdown, or the end of a replay
+void Run(bool spin) {
+  std::vector<struct pollfd> fds;
+  while (running_ && ros::ok()) {
+    // Poll the ros driver for activity, stopping at the end of a replay
+    if (Wait(fds) > 0 && replay_)
+      break;
+    // Keep the clock of other nodes up with the replay
+    Tick();
+    // Don't hold on to a batch when the data stops
+    Flush(false);
+    // Flush the ROS messaging queue
+    if (spin)
+      ros::spinOnce();
+  }
   // Close the vive context
-  deepdive_close(driver);
+  deepdive_close(driver_);
+  driver_ = nullptr;
+  Flush(true);
+}
+
+#ifdef DEEPDIVE_NODELET
+
+namespace deepdive_ros {
+
+// The bridge as a nodelet, so that nodelets in the same manager receive its
+// light and IMU messages as shared pointers, without serialization. The
+// manager owns the callback queues, so the driver is polled on its own thread.
+class BridgeNodelet : public nodelet::Nodelet {
+ public:
+  ~BridgeNodelet() {
+    running_ = false;
+    if (thread_.joinable())
+      thread_.join();
+  }
+
+ private:
+  void onInit() override {
+    if (Setup(getNodeHandle(), getPrivateNodeHandle()))
+      thread_ = std::thread(Run, false);
+  }
+
+  std::thread thread_;
+};
+
+}  // namespace deepdive_ros
+
+PLUGINLIB_EXPORT_CLASS(deepdive_ros::BridgeNodelet, nodelet::Nodelet)
+
+#else
+
+// Main entry point of application
+int main(int argc, char **argv) {
+  // Initialize ROS
+  ros::init(argc, argv, "deepdive_bridge");
+  ros::NodeHandle nh, pnh("~");
+
+  // Start the driver
+  if (!Setup(nh, pnh))
+    return 1;
+
+  // Poll until shutdown
+  Run(true);
 
   // Success!
   return 0;
-}
\ No newline at end of file
+}
+
+#endif
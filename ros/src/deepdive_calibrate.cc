@@ -14,6 +14,7 @@
 
 // Non-standard datra messages
 #include <deepdive_ros/Light.h>
+#include <deepdive_ros/Packed.h>
 #include <deepdive_ros/Lighthouses.h>
 #include <deepdive_ros/Trackers.h>
 
@@ -22,11 +23,13 @@
 #include <Eigen/Geometry>
 
 // C++ libraries
+#include <array>
 #include <map>
 #include <vector>
 #include <string>
 #include <fstream>
 #include <sstream>
+#include <mutex>
 
 // Shared local code
 #include "deepdive.hh"
@@ -36,7 +39,7 @@
 // List of lighthouses
 TrackerMap trackers_;
 LighthouseMap lighthouses_;
-MeasurementMap measurements_;
+MeasurementStore measurements_;
 CorrectionMap corrections_;
 
 // Global strings
@@ -50,10 +53,17 @@ std::string frame_truth_ = "truth";     // Vive solution
 int thresh_count_ = 4;
 double thresh_angle_ = 60.0;
 double thresh_duration_ = 1.0;
+double thresh_inlier_ = 0.05;           // Kabsch inlier distance (meters)
+
+// Threads used to estimate poses in parallel (0 = one per core)
+int threads_ = 0;
 
 // Are we running in "offline" mode
 bool offline_ = false;
 
+// Bag to read directly, instead of subscribing to a played-back one
+std::string bag_;
+
 // Should we publish rviz markers
 bool visualize_ = true;
 
@@ -80,46 +90,40 @@ std::map<std::string, std::map<std::string, ros::Publisher>> pub_path_;
 // Timer for managing offline
 ros::Timer timer_;
 
-// Jointly solve
-bool Solve() {
+// Background solving, which writes the solution back with Commit
+bool Solve(Segment & seg);
+void Commit(Segment const& seg);
+SegmentSolver solver_(measurements_, corrections_, lighthouses_, trackers_,
+  wTv_, Solve, Commit);
+
+// Jointly solve for the calibration seen over a recorded segment
+bool Solve(Segment & seg) {
   // Check that we have enough measurements
-  if (measurements_.empty()) {
+  if (seg.measurements.Empty()) {
     ROS_WARN("Insufficient measurements received, so cannot solve problem.");
     return false;
   } else {
-    double t = (measurements_.rbegin()->first
-      - measurements_.begin()->first).toSec();
-    ROS_INFO_STREAM("Processing " << measurements_.size()
+    double t = (seg.measurements.Last() - seg.measurements.First()).toSec();
+    ROS_INFO_STREAM("Processing " << seg.measurements.Size()
       << " measurements running for " << t << " seconds from "
-      << measurements_.begin()->first << " to "
-      << measurements_.rbegin()->first);
+      << seg.measurements.First() << " to "
+      << seg.measurements.Last());
   }
 
   // Check corrections
-  if (corrections_.empty()) {
+  if (seg.corrections.empty()) {
     ROS_INFO("No corrections in dataset. Assuming first body pose at origin.");
   } else {
-    double t = (corrections_.rbegin()->first - corrections_.begin()->first).toSec();
-    ROS_INFO_STREAM("Processing " << corrections_.size()
+    double t = (seg.corrections.rbegin()->first - seg.corrections.begin()->first).toSec();
+    ROS_INFO_STREAM("Processing " << seg.corrections.size()
       << " corrections running for " << t << " seconds from "
-      << corrections_.begin()->first << " to "
-      << corrections_.rbegin()->first);
+      << seg.corrections.begin()->first << " to "
+      << seg.corrections.rbegin()->first);
   }
 
   // Data storage for the upcoming steps
 
-  typedef std::map<ros::Time,             // Time
-            std::map<uint8_t,             // Sensor
-              std::map<uint8_t,           // Axis
-                std::vector<double>       // Sample
-              >
-            >
-          > Bundle;
-  std::map<std::string,                   // Tracker
-    std::map<std::string,                 // Lighthouse
-      Bundle
-    >
-  > bundle;
+  LightBins bundle;                       // Light
 
   std::map<ros::Time, double[6]> cor;     // Corrections
 
@@ -129,19 +133,11 @@ bool Solve() {
   // us to take the average of the measurements to improve accuracy
   {
     ROS_INFO("Bundling measurements into larger discrete time units.");
-    MeasurementMap::iterator mt;
-    for (mt = measurements_.begin(); mt != measurements_.end(); mt++) {
-      std::string const& tserial = mt->second.light.header.frame_id;
-      std::string const& lserial = mt->second.light.lighthouse;
-      size_t const& a = mt->second.light.axis;
-      ros::Time t = ros::Time(round(mt->first.toSec() / res_) * res_);
-      std::vector<deepdive_ros::Pulse>::iterator pt;
-      for (pt = mt->second.light.pulses.begin(); pt != mt->second.light.pulses.end(); pt++)
-        bundle[tserial][lserial][t][pt->sensor][a].push_back(pt->angle);
-    }
+    solver_.Progress("bundling");
+    seg.measurements.Bundle(res_, bundle);
     ROS_INFO("Bundling corrections into larger discrete time units.");
     CorrectionMap::iterator ct;
-    for (ct = corrections_.begin(); ct != corrections_.end(); ct++) {
+    for (ct = seg.corrections.begin(); ct != seg.corrections.end(); ct++) {
       ros::Time t = ros::Time(round(ct->first.toSec() / res_) * res_);
       Eigen::Quaterniond q(
         ct->second.transform.rotation.w,
@@ -157,8 +153,8 @@ bool Solve() {
       cor[t][5] = aa.angle() * aa.axis()[2];
       height += ct->second.transform.translation.z;
     }
-    if (!corrections_.empty())
-      height /= corrections_.size();
+    if (!seg.corrections.empty())
+      height /= seg.corrections.size();
     ROS_INFO_STREAM("Average height is " << height << " meters");
   }
 
@@ -180,21 +176,25 @@ bool Solve() {
   // ondences (photosensors). We want to calibrate this stereo pair.
   {
     ROS_INFO("Using P3P to estimate pose sequence in every lighthouse frame.");
+    solver_.Progress("estimating");
     double fov = 2.0944;                          // 120deg FOV
     double w = 1.0;                               // 1m synthetic image plane
     double z = w / (2.0 * std::tan(fov / 2.0));   // Principle distance
     uint32_t count = 0;                           // Track num transforms
     // Iterate over lighthouses
     LighthouseMap::iterator lt;
-    for (lt = lighthouses_.begin(); lt != lighthouses_.end(); lt++) {
+    for (lt = seg.lighthouses.begin(); lt != seg.lighthouses.end(); lt++) {
       // Iterate over trackers
       TrackerMap::iterator tt;
-      for (tt = trackers_.begin(); tt != trackers_.end(); tt++) {
+      for (tt = seg.trackers.begin(); tt != seg.trackers.end(); tt++) {
         ROS_INFO_STREAM("- Slave " << lt->first << " and tracker " << tt->first);
-        // Iterate over time epochs
-        Bundle::iterator bt;
-        for (bt = bundle[tt->first][lt->first].begin();
-          bt != bundle[tt->first][lt->first].end(); bt++) {
+        // Estimate the pose in every time epoch independently and in parallel
+        LightBins::const_iterator bt, be;
+        seg.measurements.Find(bundle, tt->first, lt->first, bt, be);
+        std::vector<std::array<double, 6>> est(be - bt);
+        std::vector<char> ok(be - bt, 0);
+        ParallelFor(be - bt, [&](size_t i) {
+          LightBin const& bin = *(bt + i);
           // One for each time instance
           std::vector<cv::Point3f> obj;
           std::vector<cv::Point2f> img;
@@ -203,16 +203,17 @@ bool Solve() {
             // Mean angles for the <lighthouse, axis>
             double angles[2];
             // Check that we have azimuth/elevation for both lighthouses
-            if (!Mean(bundle[tt->first][lt->first][bt->first][s][0], angles[0]) ||
-                !Mean(bundle[tt->first][lt->first][bt->first][s][1], angles[1]))
+            if (!bin.Seen(s))
               continue;
+            angles[0] = bin.angles[s][0];
+            angles[1] = bin.angles[s][1];
             // Correct the angles using the lighthouse parameters
-            Correct(lt->second.params, angles, correct_);
+            Correct(lt->second, angles, correct_);
             // Push on the correct world sensor position
             obj.push_back(cv::Point3f(
-              trackers_[tt->first].sensors[s * 6 + 0],
-              trackers_[tt->first].sensors[s * 6 + 1],
-              trackers_[tt->first].sensors[s * 6 + 2]));
+              tt->second.sensors[s * 6 + 0],
+              tt->second.sensors[s * 6 + 1],
+              tt->second.sensors[s * 6 + 2]));
             // Push on the coordinate in the slave image plane
             img.push_back(cv::Point2f(z * tan(angles[0]), z * tan(angles[1])));
           }
@@ -234,31 +235,43 @@ bool Solve() {
                 for (size_t c = 0; c < 3; c++)
                   rot(r, c) = C.at<double>(r, c);
               Eigen::AngleAxisd aa(rot);
-              poses[tt->first][bt->first][lt->first][0] = T.at<double>(0, 0);
-              poses[tt->first][bt->first][lt->first][1] = T.at<double>(1, 0);
-              poses[tt->first][bt->first][lt->first][2] = T.at<double>(2, 0);
-              poses[tt->first][bt->first][lt->first][3] = aa.angle() * aa.axis()[0];
-              poses[tt->first][bt->first][lt->first][4] = aa.angle() * aa.axis()[1];
-              poses[tt->first][bt->first][lt->first][5] = aa.angle() * aa.axis()[2];
-              count++;
+              est[i][0] = T.at<double>(0, 0);
+              est[i][1] = T.at<double>(1, 0);
+              est[i][2] = T.at<double>(2, 0);
+              est[i][3] = aa.angle() * aa.axis()[0];
+              est[i][4] = aa.angle() * aa.axis()[1];
+              est[i][5] = aa.angle() * aa.axis()[2];
+              ok[i] = 1;
             }
           }
+        }, threads_);
+        // Collect the solutions in time order
+        for (size_t i = 0; i < est.size(); i++) {
+          if (!ok[i])
+            continue;
+          for (size_t j = 0; j < 6; j++)
+            poses[tt->first][(bt + i)->time][lt->first][j] = est[i][j];
+          count++;
         }
       }
     }
     ROS_INFO_STREAM("Using " << count << " PNP solutions");
   }
+  // Give up between steps if we are asked to stop
+  if (solver_.Stopping())
+    return false;
   // We now have a separate pose sequence for each tracker in each lighthouse
   // frame. We now need to find the transform from the slave to master light-
   // house in a way that projects one pose sequence into the other.
   {
     ROS_INFO("Estimating master -> slave lighthouse transforms.");
+    solver_.Progress("lighthouses");
     // Add residual blocks to the problem
-    LighthouseMap::iterator lm = lighthouses_.begin();  // First is master
+    LighthouseMap::iterator lm = seg.lighthouses.begin();  // First is master
     LighthouseMap::iterator lt;                         //
-    for (lt = lighthouses_.begin(); lt != lighthouses_.end(); lt++) {
+    for (lt = seg.lighthouses.begin(); lt != seg.lighthouses.end(); lt++) {
       // Master lighthouse
-      if (lt == lighthouses_.begin()) {
+      if (lt == seg.lighthouses.begin()) {
         for (size_t i = 0; i < 6; i++)
           lt->second.vTl[0] = 0;
         continue;
@@ -266,9 +279,9 @@ bool Solve() {
       // Correspondences
       std::vector<std::pair<Eigen::Vector3d, Eigen::Vector3d>> corresp;
       // Slave lighthouse
-      if (lt != lighthouses_.begin()) {
+      if (lt != seg.lighthouses.begin()) {
         TrackerMap::iterator tt;
-        for (tt = trackers_.begin(); tt != trackers_.end(); tt++) {
+        for (tt = seg.trackers.begin(); tt != seg.trackers.end(); tt++) {
           std::map<ros::Time, std::map<std::string, double[6]>>::iterator pt;
           for (pt = poses[tt->first].begin(); pt != poses[tt->first].end(); pt++) {
             // We must have a pose for both the master AND the slave
@@ -300,8 +313,10 @@ bool Solve() {
       // Perform a KABSCH transform on the two matrices
       ROS_INFO_STREAM("- Using " << corresp.size() << " correspondences");
       Eigen::Affine3d A;
-      if (Kabsch<double>(pti, ptj, A, false))
-        ROS_INFO_STREAM("- Solution " << A.translation().norm());
+      size_t inliers = 0;
+      if (KabschRansac<double>(pti, ptj, A, thresh_inlier_, 100, &inliers))
+        ROS_INFO_STREAM("- Solution " << A.translation().norm()
+          << " from " << inliers << " inliers");
       else
         ROS_INFO("- Solution not found");
       // Write the solution
@@ -321,8 +336,9 @@ bool Solve() {
   // is fixed, so we can take the average from the corrections 
   {
     ROS_INFO("Using corrections to register vive to world frame.");
+    solver_.Progress("registration");
     // The vive frame is the same as the maste rlighthouse
-    std::string lm = lighthouses_.begin()->first;
+    std::string lm = seg.lighthouses.begin()->first;
     // This will store the correspondences
     std::vector<std::pair<Eigen::Vector3d, Eigen::Vector3d>> corresp;
     // Iterate over all corrections
@@ -331,7 +347,7 @@ bool Solve() {
       double x = 0.0, y = 0.0, z = 0.0;
       size_t n = 0;
       TrackerMap::iterator tt;
-      for (tt = trackers_.begin(); tt != trackers_.end(); tt++) {
+      for (tt = seg.trackers.begin(); tt != seg.trackers.end(); tt++) {
         if (poses.find(tt->first) != poses.end() &&
           poses[tt->first].find(ct->first) != poses[tt->first].end() &&
           poses[tt->first][ct->first].find(lm) != poses[tt->first][ct->first].end()) {
@@ -342,7 +358,7 @@ bool Solve() {
         }
       }
       // Only if we have data from all trackers
-      if (n == trackers_.size()) {
+      if (n == seg.trackers.size()) {
         corresp.push_back(
           std::pair<Eigen::Vector3d, Eigen::Vector3d>(
             Eigen::Vector3d(x / n, y / n, z / n),
@@ -365,28 +381,30 @@ bool Solve() {
     // Perform a KABSCH transform on the two matrices
     ROS_INFO_STREAM("- Using " << corresp.size() << " correspondences");
     Eigen::Affine3d A;
-    if (Kabsch<double>(pti, ptj, A, false))
-      ROS_INFO_STREAM("- Solution " << A.translation().norm());
+    size_t inliers = 0;
+    if (KabschRansac<double>(pti, ptj, A, thresh_inlier_, 100, &inliers))
+      ROS_INFO_STREAM("- Solution " << A.translation().norm()
+        << " from " << inliers << " inliers");
     else
       ROS_INFO("- No correspondences so vive -> world frame is identity");
     // Write the solution
-    wTv_[0] = A.translation()[0];
-    wTv_[1] = A.translation()[1];
-    wTv_[2] = A.translation()[2];
+    seg.wTv[0] = A.translation()[0];
+    seg.wTv[1] = A.translation()[1];
+    seg.wTv[2] = A.translation()[2];
     Eigen::AngleAxisd aa(A.linear());
-    wTv_[3] = aa.angle() * aa.axis()[0];
-    wTv_[4] = aa.angle() * aa.axis()[1];
-    wTv_[5] = aa.angle() * aa.axis()[2];
+    seg.wTv[3] = aa.angle() * aa.axis()[0];
+    seg.wTv[4] = aa.angle() * aa.axis()[1];
+    seg.wTv[5] = aa.angle() * aa.axis()[2];
   }
 
   // We now have a great estimate of the slave -> master lighthous transforms,
   // sensor trajectories, and global registration
   {
     SendTransforms(frame_world_, frame_vive_, frame_body_,
-      wTv_, lighthouses_, trackers_);
+      seg.wTv, seg.lighthouses, seg.trackers);
     // Write the solution to a config file
     if (WriteConfig(calfile_, frame_world_, frame_vive_, frame_body_,
-      wTv_, lighthouses_, trackers_))
+      seg.wTv, seg.lighthouses, seg.trackers))
       ROS_INFO_STREAM("Calibration written to " << calfile_);
     else
       ROS_INFO_STREAM("Could not write calibration to" << calfile_);
@@ -394,9 +412,9 @@ bool Solve() {
     if (visualize_) {
       // Estimates
       LighthouseMap::iterator lt;
-      for (lt = lighthouses_.begin(); lt != lighthouses_.end(); lt++) {
+      for (lt = seg.lighthouses.begin(); lt != seg.lighthouses.end(); lt++) {
         TrackerMap::iterator tt;
-        for (tt = trackers_.begin(); tt != trackers_.end(); tt++) {
+        for (tt = seg.trackers.begin(); tt != seg.trackers.end(); tt++) {
           // Create a path
           nav_msgs::Path msg;
           msg.header.stamp = ros::Time::now();
@@ -465,21 +483,37 @@ bool Solve() {
   return true;
 }
 
+// BACKGROUND SOLVING
+
+// Write the solved lighthouse poses and registration back to the calibration,
+// which the solver has locked
+void Commit(Segment const& seg) {
+  LighthouseMap::const_iterator lt;
+  for (lt = seg.lighthouses.begin(); lt != seg.lighthouses.end(); lt++) {
+    LighthouseMap::iterator it = lighthouses_.find(lt->first);
+    if (it == lighthouses_.end())
+      continue;
+    for (size_t i = 0; i < 6; i++)
+      it->second.vTl[i] = lt->second.vTl[i];
+  }
+  for (size_t i = 0; i < 6; i++)
+    wTv_[i] = seg.wTv[i];
+}
+
 // MESSAGE CALLBACKS
 
-void LightCallback(deepdive_ros::Light::ConstPtr const& msg) {
-  // Reset the timer use din offline mode to determine the end of experiment
-  timer_.stop();
-  timer_.start();
+// Add light that was received at a given time
+void AddLight(ros::Time const& t, deepdive_ros::Light const& msg) {
+  std::lock_guard<std::mutex> lock(solver_.Mutex());
   // Check that we are recording and that the tracker/lighthouse is ready
   if (!recording_ ||
-    trackers_.find(msg->header.frame_id) == trackers_.end() ||
-    lighthouses_.find(msg->lighthouse) == lighthouses_.end() ||
-    !trackers_[msg->header.frame_id].ready ||
-    !lighthouses_[msg->lighthouse].ready) return;
+    trackers_.find(msg.header.frame_id) == trackers_.end() ||
+    lighthouses_.find(msg.lighthouse) == lighthouses_.end() ||
+    !trackers_[msg.header.frame_id].ready ||
+    !lighthouses_[msg.lighthouse].ready) return;
   // Copy over the data
   size_t deleted = 0;
-  deepdive_ros::Light data = *msg;
+  deepdive_ros::Light data = msg;
   std::vector<deepdive_ros::Pulse>::iterator it = data.pulses.end();
   while (it-- > data.pulses.begin()) {
     // std::cout << it->duration << std::endl;
@@ -492,51 +526,97 @@ void LightCallback(deepdive_ros::Light::ConstPtr const& msg) {
   if (data.pulses.size() < thresh_count_)
     return; 
   // Add the data
-  measurements_[ros::Time::now()].light = data;
+  measurements_.Add(t, data);
+}
+
+void LightCallback(deepdive_ros::Light::ConstPtr const& msg) {
+  // Reset the timer use din offline mode to determine the end of experiment
+  timer_.stop();
+  timer_.start();
+  AddLight(ros::Time::now(), *msg);
 }
 
+// Called when a batch of packed light arrives
+void PackedCallback(deepdive_ros::Packed::ConstPtr const& msg) {
+  // Reset the timer used in offline mode to determine the end of experiment
+  timer_.stop();
+  timer_.start();
+  BagHandlers handlers;
+  handlers.light = AddLight;
+  if (!Unpack(*msg, handlers))
+    ROS_WARN("Ignoring an inconsistent packed message");
+}
+
+// The first trigger starts recording. Every later one ends the segment and
+// solves it in the background, while the next segment is recorded into the
+// buffers that the last solve left empty. Progress goes to "/progress".
 bool TriggerCallback(std_srvs::Trigger::Request  &req,
                      std_srvs::Trigger::Response &res)
 {
   if (!recording_) {
+    recording_ = true;
     res.success = true;
     res.message = "Recording started.";
+    return true;
   }
-  if (recording_) {
-    // Solve the problem
-    res.success = Solve();
-    if (res.success)
-      res.message = "Recording stopped. Solution found.";
-    else
-      res.message = "Recording stopped. Solution not found.";
-    // Clear all the data and corrections
-    measurements_.clear();
-  }
-  // Toggle recording state
-  recording_ = !recording_;
-  // Success
+  res.success = solver_.Trigger(res.message);
   return true;
 }
 
-// When corrections arrive
-void CorrectionCallback(tf2_msgs::TFMessage::ConstPtr const& msg) {
+// Add corrections that were received at a given time
+void AddCorrections(ros::Time const& t, tf2_msgs::TFMessage const& msg) {
   // Check that we are recording and that the tracker/lighthouse is ready
   if (!recording_)
     return;
+  std::lock_guard<std::mutex> lock(solver_.Mutex());
   std::vector<geometry_msgs::TransformStamped>::const_iterator it;
-  for (it = msg->transforms.begin(); it != msg->transforms.end(); it++) {
+  for (it = msg.transforms.begin(); it != msg.transforms.end(); it++) {
     if (it->header.frame_id == frame_world_ &&
         it->child_frame_id == frame_body_) {
-      corrections_[ros::Time::now()] = *it;
+      corrections_[t] = *it;
     }
   }
 }
 
+void CorrectionCallback(tf2_msgs::TFMessage::ConstPtr const& msg) {
+  AddCorrections(ros::Time::now(), *msg);
+}
+
 // Fake a trigger when the timer expires
 void TimerCallback(ros::TimerEvent const& event) {
   std_srvs::Trigger::Request req;
   std_srvs::Trigger::Response res;
   TriggerCallback(req, res);
+  // Try again once the last segment has been solved
+  if (!res.success && solver_.Busy()) {
+    timer_.stop();
+    timer_.start();
+  }
+}
+
+// Stream a bag straight into the bins, and then solve
+void ReplayBag() {
+  BagHandlers handlers;
+  handlers.trackers = [](deepdive_ros::Trackers::ConstPtr const& msg) {
+    solver_.TrackersCallback(msg);
+  };
+  handlers.lighthouses = [](deepdive_ros::Lighthouses::ConstPtr const& msg) {
+    solver_.LighthousesCallback(msg);
+  };
+  handlers.light = [](ros::Time const& t,
+    deepdive_ros::Light const& msg) {
+    AddLight(t, msg);
+    // The bag is read in time order, so closed bins can be reduced early
+    if (measurements_.Samples() > COMPACT_SAMPLES)
+      measurements_.Compact(res_);
+  };
+  // Only the last correction in each bin is used, so only keep that one
+  handlers.tf = [](ros::Time const& t, tf2_msgs::TFMessage const& msg) {
+    AddCorrections(ros::Time(round(t.toSec() / res_) * res_), msg);
+  };
+  if (!ReadBag(bag_, handlers))
+    return;
+  TimerCallback(ros::TimerEvent());
 }
 
 // Called when a new lighthouse appears
@@ -613,6 +693,14 @@ int main(int argc, char **argv) {
     recording_ = true;
   }
 
+  // A bag can also be read directly, which is as fast as the disk allows
+  if (!nh.getParam("bag", bag_))
+    bag_ = "";
+  if (!bag_.empty()) {
+    ROS_INFO_STREAM("Reading light and corrections from " << bag_);
+    recording_ = true;
+  }
+
   // Reset the registration information
   for (size_t i = 0; i < 6; i++)
     wTv_[i] = 0;
@@ -638,6 +726,12 @@ int main(int argc, char **argv) {
     ROS_FATAL("Failed to get thresholds/angle parameter.");
   if (!nh.getParam("thresholds/duration", thresh_duration_))
     ROS_FATAL("Failed to get thresholds/duration parameter.");
+  if (!nh.getParam("thresholds/inlier", thresh_inlier_))
+    thresh_inlier_ = 0.05;
+
+  // Number of threads used to estimate poses in parallel
+  if (!nh.getParam("threads", threads_))
+    threads_ = 0;
 
   // Tracking resolution
   if (!nh.getParam("resolution", res_))
@@ -724,27 +818,37 @@ int main(int argc, char **argv) {
     wTv_, lighthouses_, trackers_);
 
   // Subscribe to tracker and lighthouse updates
-  ros::Subscriber sub_tracker  = 
-    nh.subscribe<deepdive_ros::Trackers>("/trackers", 1000, std::bind(
-      TrackerCallback, std::placeholders::_1, std::ref(trackers_),
-        NewTrackerCallback));
-  ros::Subscriber sub_lighthouse = 
-    nh.subscribe<deepdive_ros::Lighthouses>("/lighthouses", 1000, std::bind(
-      LighthouseCallback, std::placeholders::_1, std::ref(lighthouses_),
-        NewLighthouseCallback));
+  ros::Subscriber sub_tracker  =
+    nh.subscribe("/trackers", 1000, &SegmentSolver::TrackersCallback,
+      &solver_);
+  ros::Subscriber sub_lighthouse =
+    nh.subscribe("/lighthouses", 1000, &SegmentSolver::LighthousesCallback,
+      &solver_);
   ros::Subscriber sub_light =
     nh.subscribe("/light", 1000, LightCallback);
+  ros::Subscriber sub_packed =
+    nh.subscribe("/packed", 100, PackedCallback);
   ros::Subscriber sub_corrections =
     nh.subscribe("/tf", 1000, CorrectionCallback);
   ros::ServiceServer service =
     nh.advertiseService("/trigger", TriggerCallback);
 
+  // Report the progress of background solves
+  solver_.Advertise(nh);
+
   // Setup a timer to automatically trigger solution on end of experiment
   timer_ = nh.createTimer(ros::Duration(1.0), TimerCallback, true, false);
 
+  // Read the bag now, if one was given
+  if (!bag_.empty())
+    ReplayBag();
+
   // Block until safe shutdown
   ros::spin();
 
+  // Stop any solve that is still running
+  solver_.Stop();
+
   // Success!
   return 0;
 }
\ No newline at end of file
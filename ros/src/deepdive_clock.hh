@@ -0,0 +1,17 @@
+#ifndef SRC_DEEPDIVE_CLOCK_HH
+#define SRC_DEEPDIVE_CLOCK_HH
+
+// STL
+#include <chrono>
+#include <cstdint>
+
+// Host monotonic time in nanoseconds, which is the clock the driver times USB
+// transfers with, so that the stages of the pipeline can be compared. This is
+// kept apart from deepdive.hh so that the bridge, which sees the driver's own
+// Tracker and Lighthouse, can share it.
+inline uint64_t Monotonic() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#endif
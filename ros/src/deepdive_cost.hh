@@ -0,0 +1,445 @@
+#ifndef SRC_DEEPDIVE_COST_HH
+#define SRC_DEEPDIVE_COST_HH
+
+// Ceres
+#include <ceres/ceres.h>
+#include <ceres/rotation.h>
+
+// Eigen
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+
+// STL
+#include <cmath>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Deepdive internal
+#include "deepdive.hh"
+
+// TRANSFORM HELPERS
+
+// Helper function to apply a transform b = Ra + t
+template <typename T> inline
+void TransformInPlace(const T transform[6], T x[3]) {
+  T tmp[3];
+  ceres::AngleAxisRotatePoint(&transform[3], x, tmp);
+  x[0] = tmp[0] + transform[0];
+  x[1] = tmp[1] + transform[1];
+  x[2] = tmp[2] + transform[2];
+}
+
+// Helper function to invert a transform a = R'(b - t)
+template <typename T> inline
+void InverseTransformInPlace(const T transform[6], T x[3]) {
+  T aa[3], tmp[3];
+  tmp[0] = x[0] - transform[0];
+  tmp[1] = x[1] - transform[1];
+  tmp[2] = x[2] - transform[2];
+  aa[0] = -transform[3];
+  aa[1] = -transform[4];
+  aa[2] = -transform[5];
+  ceres::AngleAxisRotatePoint(aa, tmp, x);
+}
+
+// AUTOMATIC DIFFERENTIATION
+
+// Group of light measurements -- essential for accuracy
+typedef std::map<std::pair<uint16_t, uint8_t>, double> Group;
+
+// Residual error between predicted angles to a lighthouse
+struct GroupCost {
+  GroupCost(Group const& group, bool correct)
+    : group_(group), correct_(correct) {}
+  // Called by ceres-solver to calculate error
+  template <typename T>
+  bool operator()(const T* const wTv,         // Vive -> World
+                  const T* const vTl,         // Lighthouse -> vive
+                  const T* const wTb_pos_xy,  // Body -> world (pos xy)
+                  const T* const wTb_pos_z,   // Body -> world (pos z)
+                  const T* const wTb_rot_xy,  // Body -> world (rot xy)
+                  const T* const wTb_rot_z,   // Body -> world (rot z)
+                  const T* const bTh,         // Head -> body
+                  const T* const tTh,         // Head -> tracking (light)
+                  const T* const sensors,     // Lighthouse calibration
+                  const T* const params,      // Tracker extrinsics
+                  T* residual) const {
+    // The position of the sensor
+    T x[3], angle[2], wTb[6];
+    // Reconstruct a transform from the components
+    wTb[0] = wTb_pos_xy[0];
+    wTb[1] = wTb_pos_xy[1];
+    wTb[2] = wTb_pos_z[0];
+    wTb[3] = wTb_rot_xy[0];
+    wTb[4] = wTb_rot_xy[1];
+    wTb[5] = wTb_rot_z[0];
+    // Used to index the residual
+    size_t cnt = 0;
+    // Iterate over all measurements
+    Group::const_iterator gt;
+    for (gt = group_.begin(); gt != group_.end(); gt++) {
+      // Get the sensor and axis for this group
+      uint16_t const& s = gt->first.first;
+      uint8_t const& a = gt->first.second;
+      // Get the sensor position in the tracking frame
+      x[0] = sensors[6*s+0];
+      x[1] = sensors[6*s+1];
+      x[2] = sensors[6*s+2];
+      // Project the sensor position into the lighthouse frame
+      InverseTransformInPlace(tTh, x);    // light -> head
+      TransformInPlace(bTh, x);           // head -> body
+      TransformInPlace(wTb, x);           // body -> world
+      InverseTransformInPlace(wTv, x);    // world -> vive
+      InverseTransformInPlace(vTl, x);    // vive -> lighthouse
+      // Predict the angles
+      Predict(params, x, angle, correct_);
+      // The residual angle error for the specific axis
+      residual[cnt++] = angle[a] - T(gt->second);
+    }
+    return true;
+  }
+ // Internal variables
+ private:
+  Group group_;
+  bool correct_;
+};
+
+// Residual error between sequential poses
+struct MotionCost {
+  explicit MotionCost(double smoothing) : smoothing_(smoothing) {}
+  // Called by ceres-solver to calculate error
+  template <typename T>
+  bool operator()(const T* const prev_pos_xy,  // PREV Body -> world (pos xy)
+                  const T* const prev_pos_z,   // PREV Body -> world (pos z)
+                  const T* const prev_rot_xy,  // PREV Body -> world (rot xy)
+                  const T* const prev_rot_z,   // PREV Body -> world (rot z)
+                  const T* const next_pos_xy,  // NEXT Body -> world (pos xy)
+                  const T* const next_pos_z,   // NEXT Body -> world (pos z)
+                  const T* const next_rot_xy,  // NEXT Body -> world (rot xy)
+                  const T* const next_rot_z,   // NEXT Body -> world (rot z)
+                  T* residual) const {
+    residual[0] =  prev_pos_xy[0] - next_pos_xy[0];
+    residual[1] =  prev_pos_xy[1] - next_pos_xy[1];
+    residual[2] =  prev_pos_z[0] - next_pos_z[0];
+    residual[3] =  prev_rot_xy[0] - next_rot_xy[0];
+    residual[4] =  prev_rot_xy[1] - next_rot_xy[1];
+    residual[5] =  prev_rot_z[0] - next_rot_z[0];
+    for (size_t i = 0; i < 6; i++)
+      residual[i] *= T(smoothing_);
+    return true;
+  }
+ // Internal variables
+ private:
+  double smoothing_;
+};
+
+// ANALYTIC DIFFERENTIATION
+
+// Gradient of one predicted angle with respect to the point in the lighthouse
+// frame and the lighthouse parameters (see Predict in deepdive.hh)
+inline void PredictJacobian(double const* params, double const* xyz,
+  uint8_t axis, bool correct, double d_xyz[3], double d_params[NUM_MOTORS*NUM_PARAMS]) {
+  for (size_t i = 0; i < NUM_MOTORS*NUM_PARAMS; i++)
+    d_params[i] = 0.0;
+  // The swept coordinate, the other coordinate and the depth
+  uint8_t const p = axis, q = 1 - axis;
+  double const* P = &params[axis*NUM_PARAMS];
+  double u = xyz[p], du_dq = 0.0;
+  if (correct) {
+    u -= (P[PARAM_TILT] + P[PARAM_CURVE] * xyz[q]) * xyz[q];
+    du_dq = -(P[PARAM_TILT] + 2.0 * P[PARAM_CURVE] * xyz[q]);
+  }
+  double den = u * u + xyz[2] * xyz[2];
+  double da_du = xyz[2] / den;
+  double da_dz = -u / den;
+  double df_da = 1.0;
+  if (correct) {
+    double a = atan2(u, xyz[2]) + P[PARAM_GIB_PHASE];
+    df_da -= P[PARAM_GIB_MAG] * cos(a);
+    d_params[axis*NUM_PARAMS + PARAM_PHASE] = -1.0;
+    d_params[axis*NUM_PARAMS + PARAM_TILT] = -df_da * da_du * xyz[q];
+    d_params[axis*NUM_PARAMS + PARAM_CURVE] =
+      -df_da * da_du * xyz[q] * xyz[q];
+    d_params[axis*NUM_PARAMS + PARAM_GIB_PHASE] = -P[PARAM_GIB_MAG] * cos(a);
+    d_params[axis*NUM_PARAMS + PARAM_GIB_MAG] = -sin(a);
+  }
+  d_xyz[p] = df_da * da_du;
+  d_xyz[q] = df_da * da_du * du_dq;
+  d_xyz[2] = df_da * da_dz;
+}
+
+// Rotation matrix and right jacobian of an angle axis vector w, so that
+// d(R(w) x)/dw = -R(w) [x]_x Jr(w)
+inline void AngleAxisJacobian(double const* w,
+  Eigen::Matrix3d & R, Eigen::Matrix3d & J) {
+  Eigen::Map<const Eigen::Vector3d> v(w);
+  Eigen::Matrix3d W;
+  W <<     0, -v[2],  v[1],
+        v[2],     0, -v[0],
+       -v[1],  v[0],     0;
+  double t = v.norm();
+  if (t < 1e-8) {
+    R = Eigen::Matrix3d::Identity() + W;
+    J = Eigen::Matrix3d::Identity() - 0.5 * W;
+    return;
+  }
+  R = Eigen::AngleAxisd(t, v / t).toRotationMatrix();
+  J = Eigen::Matrix3d::Identity() - (1.0 - cos(t)) / (t * t) * W
+    + (t - sin(t)) / (t * t * t) * W * W;
+}
+
+// Skew-symmetric cross product matrix
+inline Eigen::Matrix3d Skew(Eigen::Vector3d const& x) {
+  Eigen::Matrix3d X;
+  X <<     0, -x[2],  x[1],
+        x[2],     0, -x[0],
+       -x[1],  x[0],     0;
+  return X;
+}
+
+// Write a row jacobian into a ceres jacobian block
+inline void Assign(double* jacobian, Eigen::RowVector3d const& row) {
+  jacobian[0] = row[0];
+  jacobian[1] = row[1];
+  jacobian[2] = row[2];
+}
+
+// Residual error for one sensor and axis, with hand-derived jacobians. Only
+// the sensor position is a parameter (a 3-vector into Tracker::sensors), so
+// no residual depends on the whole sensor array. Ceres passes no jacobian for
+// constant blocks, so blocks that aren't being refined cost nothing.
+class SensorCost : public ceres::SizedCostFunction<1,
+  6,                          // Vive -> World
+  6,                          // Lighthouse -> vive
+  2, 1, 2, 1,                 // Body -> world (pos xy, pos z, rot xy, rot z)
+  6,                          // Head -> body
+  6,                          // Head -> tracking (light)
+  3,                          // Sensor position
+  NUM_MOTORS*NUM_PARAMS> {    // Lighthouse parameters
+ public:
+  SensorCost(uint8_t axis, double angle, bool correct)
+    : axis_(axis), angle_(angle), correct_(correct) {}
+
+  // Called by ceres-solver to calculate error and jacobians
+  bool Evaluate(double const* const* parameters, double* residuals,
+    double** jacobians) const {
+    double const* wTv = parameters[0];
+    double const* vTl = parameters[1];
+    double const* bTh = parameters[6];
+    double const* tTh = parameters[7];
+    double const wTb[6] = {
+      parameters[2][0], parameters[2][1], parameters[3][0],
+      parameters[4][0], parameters[4][1], parameters[5][0]
+    };
+    // Forward pass through the chain of transforms
+    Eigen::Matrix3d R_wv, J_wv, R_vl, J_vl, R_wb, J_wb, R_bh, J_bh, R_th, J_th;
+    double n_wv[3] = {-wTv[3], -wTv[4], -wTv[5]};
+    double n_vl[3] = {-vTl[3], -vTl[4], -vTl[5]};
+    double n_th[3] = {-tTh[3], -tTh[4], -tTh[5]};
+    AngleAxisJacobian(n_wv, R_wv, J_wv);          // R_wv is inverted
+    AngleAxisJacobian(n_vl, R_vl, J_vl);          // R_vl is inverted
+    AngleAxisJacobian(&wTb[3], R_wb, J_wb);
+    AngleAxisJacobian(&bTh[3], R_bh, J_bh);
+    AngleAxisJacobian(n_th, R_th, J_th);          // R_th is inverted
+    Eigen::Vector3d s(parameters[8][0], parameters[8][1], parameters[8][2]);
+    Eigen::Vector3d ds = s - Eigen::Map<const Eigen::Vector3d>(tTh);
+    Eigen::Vector3d h = R_th * ds;                              // head
+    Eigen::Vector3d b = R_bh * h + Eigen::Map<const Eigen::Vector3d>(bTh);
+    Eigen::Vector3d w = R_wb * b + Eigen::Map<const Eigen::Vector3d>(wTb);
+    Eigen::Vector3d dw = w - Eigen::Map<const Eigen::Vector3d>(wTv);
+    Eigen::Vector3d v = R_wv * dw;                              // vive
+    Eigen::Vector3d dv = v - Eigen::Map<const Eigen::Vector3d>(vTl);
+    Eigen::Vector3d l = R_vl * dv;                              // lighthouse
+    double angle[2];
+    Predict(parameters[9], l.data(), angle, correct_);
+    residuals[0] = angle[axis_] - angle_;
+    if (!jacobians)
+      return true;
+    // Backward pass, from the angle to each of the parameter blocks
+    Eigen::RowVector3d g;
+    double d_params[NUM_MOTORS*NUM_PARAMS];
+    PredictJacobian(parameters[9], l.data(), axis_, correct_, g.data(),
+      d_params);
+    if (jacobians[9])
+      for (size_t i = 0; i < NUM_MOTORS*NUM_PARAMS; i++)
+        jacobians[9][i] = d_params[i];
+    Eigen::RowVector3d g_v = g * R_vl;
+    if (jacobians[1]) {
+      Assign(jacobians[1], -g_v);
+      Assign(jacobians[1] + 3, g_v * Skew(dv) * J_vl);
+    }
+    Eigen::RowVector3d g_w = g_v * R_wv;
+    if (jacobians[0]) {
+      Assign(jacobians[0], -g_w);
+      Assign(jacobians[0] + 3, g_v * R_wv * Skew(dw) * J_wv);
+    }
+    if (jacobians[2]) {
+      jacobians[2][0] = g_w[0];
+      jacobians[2][1] = g_w[1];
+    }
+    if (jacobians[3])
+      jacobians[3][0] = g_w[2];
+    if (jacobians[4] || jacobians[5]) {
+      Eigen::RowVector3d g_r = -g_w * R_wb * Skew(b) * J_wb;
+      if (jacobians[4]) {
+        jacobians[4][0] = g_r[0];
+        jacobians[4][1] = g_r[1];
+      }
+      if (jacobians[5])
+        jacobians[5][0] = g_r[2];
+    }
+    Eigen::RowVector3d g_b = g_w * R_wb;
+    if (jacobians[6]) {
+      Assign(jacobians[6], g_b);
+      Assign(jacobians[6] + 3, -g_b * R_bh * Skew(h) * J_bh);
+    }
+    Eigen::RowVector3d g_h = g_b * R_bh;
+    if (jacobians[7]) {
+      Assign(jacobians[7], -g_h * R_th);
+      Assign(jacobians[7] + 3, g_h * R_th * Skew(ds) * J_th);
+    }
+    if (jacobians[8])
+      Assign(jacobians[8], g_h * R_th);
+    return true;
+  }
+
+ // Internal variables
+ private:
+  uint8_t axis_;
+  double angle_;
+  bool correct_;
+};
+
+// The analytic counterpart of GroupCost, with one residual per measurement in
+// a group, each evaluated by a SensorCost. Keeping the group in one block
+// means that a loss applies to the group as a whole, as it does for the
+// autodiff cost. Each sensor seen is its own 3-vector block, in sensor order,
+// between the head -> tracking block and the lighthouse parameters.
+class SensorGroupCost : public ceres::CostFunction {
+ public:
+  SensorGroupCost(Group const& group, bool correct) {
+    Group::const_iterator gt;
+    for (gt = group.begin(); gt != group.end(); gt++) {
+      if (sensors_.empty() || sensors_.back() != gt->first.first)
+        sensors_.push_back(gt->first.first);
+      rows_.emplace_back(sensors_.size() - 1, std::unique_ptr<SensorCost>(
+        new SensorCost(gt->first.second, gt->second, correct)));
+    }
+    set_num_residuals(rows_.size());
+    for (size_t b = 0; b < 8; b++)
+      mutable_parameter_block_sizes()->push_back(Size(b));
+    for (size_t j = 0; j < sensors_.size(); j++)
+      mutable_parameter_block_sizes()->push_back(Size(8));
+    mutable_parameter_block_sizes()->push_back(Size(9));
+  }
+
+  // Sensors with a position block, in the order that they are expected
+  std::vector<uint16_t> const& Sensors() const {
+    return sensors_;
+  }
+
+  // Called by ceres-solver to calculate error and jacobians
+  bool Evaluate(double const* const* parameters, double* residuals,
+    double** jacobians) const {
+    size_t k = sensors_.size();
+    double const* sparameters[10];
+    std::copy(parameters, parameters + 8, sparameters);
+    sparameters[9] = parameters[8 + k];
+    double sjac[10][NUM_MOTORS*NUM_PARAMS];
+    double* sjacobians[10];
+    for (size_t r = 0; r < rows_.size(); r++) {
+      size_t j = rows_[r].first;
+      sparameters[8] = parameters[8 + j];
+      // Only ask the sensor for the jacobians that ceres asked for
+      for (size_t b = 0; jacobians && b < 10; b++)
+        sjacobians[b] = (jacobians[Block(b, j)] ? sjac[b] : nullptr);
+      if (!rows_[r].second->Evaluate(sparameters, &residuals[r],
+        jacobians ? sjacobians : nullptr))
+        return false;
+      if (!jacobians)
+        continue;
+      // Scatter the row into the group, where other sensors have no effect
+      for (size_t b = 0; b < 10; b++) {
+        if (b == 8) {
+          for (size_t i = 0; i < k; i++)
+            if (jacobians[8 + i])
+              for (int c = 0; c < Size(8); c++)
+                jacobians[8 + i][r * Size(8) + c] = (i == j ? sjac[8][c] : 0);
+          continue;
+        }
+        if (jacobians[Block(b, j)])
+          std::copy(sjac[b], sjac[b] + Size(b),
+            jacobians[Block(b, j)] + r * Size(b));
+      }
+    }
+    return true;
+  }
+
+ // Internal variables
+ private:
+  // Group block of a SensorCost block, given the sensor's position block
+  size_t Block(size_t b, size_t j) const {
+    return (b < 8 ? b : (b == 8 ? 8 + j : 8 + sensors_.size()));
+  }
+  // Size of a SensorCost block
+  static int Size(size_t b) {
+    static const int sizes[10] = {
+      6, 6, 2, 1, 2, 1, 6, 6, 3, NUM_MOTORS*NUM_PARAMS
+    };
+    return sizes[b];
+  }
+  std::vector<uint16_t> sensors_;
+  std::vector<std::pair<size_t, std::unique_ptr<SensorCost>>> rows_;
+};
+
+// PROBLEM CONSTRUCTION
+
+// Add the residuals for one group of light seen by a tracker, as one block
+// with either autodiff or analytic jacobians, so that the loss is the same.
+// Blocks are given in the same order as the GroupCost arguments.
+inline void AddLightCost(ceres::Problem & problem, Group const& group,
+  bool analytic, bool correct, double* wTv, double* vTl, double* wTb,
+  double* bTh, double* tTh, double* sensors, double* params,
+  std::vector<ceres::ResidualBlockId> * ids = nullptr) {
+  ceres::ResidualBlockId id;
+  if (!analytic) {
+    ceres::CostFunction* cost = new ceres::AutoDiffCostFunction<GroupCost,
+      ceres::DYNAMIC, 6, 6, 2, 1, 2, 1, 6, 6, NUM_SENSORS * 6,
+        NUM_PARAMS * 2>(new GroupCost(group, correct), group.size());
+    id = problem.AddResidualBlock(cost, new ceres::HuberLoss(1.0),
+      wTv, vTl, &wTb[0], &wTb[2], &wTb[3], &wTb[5], bTh, tTh, sensors, params);
+    if (ids)
+      ids->push_back(id);
+    return;
+  }
+  SensorGroupCost* cost = new SensorGroupCost(group, correct);
+  std::vector<double*> blocks = { wTv, vTl, &wTb[0], &wTb[2], &wTb[3],
+    &wTb[5], bTh, tTh };
+  for (size_t i = 0; i < cost->Sensors().size(); i++)
+    blocks.push_back(&sensors[6 * cost->Sensors()[i]]);
+  blocks.push_back(params);
+  id = problem.AddResidualBlock(cost, new ceres::HuberLoss(1.0), blocks);
+  if (ids)
+    ids->push_back(id);
+}
+
+// Get the sensor blocks of a tracker that are used by the problem, which is
+// either the whole array or the positions of individual sensors
+inline std::vector<std::pair<double*, int>> SensorBlocks(
+  ceres::Problem & problem, double* sensors) {
+  std::vector<std::pair<double*, int>> blocks;
+  if (problem.HasParameterBlock(sensors)
+    && problem.ParameterBlockSize(sensors) == NUM_SENSORS * 6) {
+    blocks.emplace_back(sensors, NUM_SENSORS * 6);
+    return blocks;
+  }
+  for (size_t s = 0; s < NUM_SENSORS; s++)
+    if (problem.HasParameterBlock(&sensors[6 * s]))
+      blocks.emplace_back(&sensors[6 * s], 3);
+  return blocks;
+}
+
+#endif
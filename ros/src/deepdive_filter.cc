@@ -0,0 +1,427 @@
+// This include
+#include "deepdive_filter.hh"
+
+// The bundle models below are written out once per sensor
+static_assert(NUM_SENSORS == 32, "Bundle models assume 32 sensors");
+
+// Predict the angle of a given sensor on the tracker in the context
+static real_t PredictAngle(State const& state, Context const& context,
+  uint16_t sensor) {
+  LighthouseModel const& lighthouse =
+    context.model->lighthouses[context.lighthouse];
+  TrackerModel const& tracker = context.model->trackers[context.tracker];
+  UKF::Vector<3> x = lighthouse.lTw                           // world -> lh
+    * (state.get_field<Attitude>() * tracker.bPs[sensor]
+      + state.get_field<Position>());                         // body -> world
+  double xyz[3], ang[2];
+  xyz[0] = x[0];
+  xyz[1] = x[1];
+  xyz[2] = x[2];
+  Predict(lighthouse.params, xyz, ang, context.model->correct);
+  return ang[context.axis];
+}
+
+// Difference between an accelerometer error and the one that preintegrated
+// samples were corrected with, as an equivalent change in bias
+static Eigen::Vector3d AccelerometerShift(Error const& error,
+  Preintegration const& imu) {
+  return error.get_field<AccelerometerBias>() - imu.ab
+    + (error.get_field<AccelerometerScale>() - imu.as).cwiseProduct(
+      imu.acc / imu.count);
+}
+
+// Difference between a gyroscope error and the one that preintegrated samples
+// were corrected with, as an equivalent change in bias
+static Eigen::Vector3d GyroscopeShift(Error const& error,
+  Preintegration const& imu) {
+  return error.get_field<GyroscopeBias>() - imu.gb
+    + (error.get_field<GyroscopeScale>() - imu.gs).cwiseProduct(
+      imu.gyr / imu.count);
+}
+
+// Angle model for sensor S in a bundle, for both tracking and error filters
+#define BUNDLE_MODEL(S)                                                     \
+  template <> template <> real_t                                            \
+  Observation::expected_measurement<State, Bundle + S, Error, Context>(     \
+    State const& state, Error const& error, Context const& context) {       \
+    return PredictAngle(state, context, S);                                 \
+  }                                                                         \
+  template <> template <> real_t                                            \
+  Observation::expected_measurement<Error, Bundle + S, State, Context>(     \
+    Error const& errors, State const& state, Context const& context) {      \
+    return PredictAngle(state, context, S);                                 \
+  }
+
+namespace UKF {
+
+  // MEASURMENT
+
+  template <>
+  Observation::CovarianceVector Observation::measurement_covariance(
+    (Observation::CovarianceVector() <<
+      1.0e-4, 1.0e-4, 1.0e-4,   // Accel
+      1.0e-6, 1.0e-6, 1.0e-6,   // Gyro
+      1.0e-4, 1.0e-4, 1.0e-4,   // Mean accel (per sample)
+      1.0e-6, 1.0e-6, 1.0e-6,   // Mean gyro (per sample)
+      1.0e-8,                   // Angle
+      Eigen::Matrix<real_t, NUM_SENSORS, 1>::Constant(1.0e-8)   // Bundle
+    ).finished());
+
+  // TRACKING FILTER
+
+  // Standard 6DoF kinematics with constant Acceleration assumption
+  template <> template <> State
+  State::derivative<>() const {
+    UKF::Quaternion omega_q;
+    omega_q.vec() = get_field<Omega>() * 0.5;
+    omega_q.w() = 0;
+    State output;
+    output.set_field<Position>(get_field<Velocity>());
+    output.set_field<Velocity>(get_field<Attitude>() * get_field<Acceleration>());
+    output.set_field<Acceleration>(UKF::Vector<3>(0, 0, 0));
+    output.set_field<Attitude>(omega_q * get_field<Attitude>());
+    output.set_field<Omega>(get_field<Alpha>());
+    output.set_field<Alpha>(UKF::Vector<3>(0, 0, 0));
+    return output;
+  }
+
+  // See http://www.mdpi.com/1424-8220/11/7/6771/htm
+  template <> template <> UKF::Vector<3>
+  Observation::expected_measurement<State, Accelerometer, Error, Context>(
+    State const& state, Error const& error, Context const& context) {
+    TrackerModel const& tracker = context.model->trackers[context.tracker];
+    Eigen::Vector3d w = state.get_field<Omega>();
+    return error.get_field<AccelerometerScale>().cwiseInverse().cwiseProduct(
+        tracker.iRb * (state.get_field<Acceleration>()
+          + w.cross(w.cross(tracker.iPb))
+          + state.get_field<Attitude>().conjugate() * context.model->gravity)
+      - error.get_field<AccelerometerBias>());
+  }
+
+  // See http://www.mdpi.com/1424-8220/11/7/6771/htm
+  template <> template <> UKF::Vector<3>
+  Observation::expected_measurement<State, Gyroscope, Error, Context>(
+    State const& state, Error const& error, Context const& context) {
+    TrackerModel const& tracker = context.model->trackers[context.tracker];
+    return error.get_field<GyroscopeScale>().cwiseInverse().cwiseProduct(
+        tracker.iRb * state.get_field<Omega>()
+      - error.get_field<GyroscopeBias>());
+  }
+
+  // The mean accelerometer is the specific force averaged over the samples,
+  // in the imu frame at the end of them. The state is at the end, so the
+  // acceleration is rotated back and the angular velocity is taken at the
+  // middle. Having been integrated with an older error estimate, the mean is
+  // shifted by the change in error to first order.
+  template <> template <> UKF::Vector<3>
+  Observation::expected_measurement<State, MeanAccelerometer, Error, Context>(
+    State const& state, Error const& error, Context const& context) {
+    TrackerModel const& tracker = context.model->trackers[context.tracker];
+    Preintegration const& imu = *context.imu;
+    Eigen::Vector3d a = state.get_field<Acceleration>();
+    Eigen::Vector3d w = state.get_field<Omega>();
+    Eigen::Vector3d m = w - 0.5 * imu.duration * state.get_field<Alpha>();
+    return imu.weight * (tracker.iRb * (a - 0.5 * imu.duration * w.cross(a)
+          + m.cross(m.cross(tracker.iPb))
+          + state.get_field<Attitude>().conjugate() * context.model->gravity)
+      - imu.dforce_dab * AccelerometerShift(error, imu)
+      - imu.dforce_dgb * GyroscopeShift(error, imu));
+  }
+
+  // The mean gyroscope is the rotation over the samples divided by their
+  // duration, predicted from the angular velocity at the middle of them.
+  template <> template <> UKF::Vector<3>
+  Observation::expected_measurement<State, MeanGyroscope, Error, Context>(
+    State const& state, Error const& error, Context const& context) {
+    TrackerModel const& tracker = context.model->trackers[context.tracker];
+    Preintegration const& imu = *context.imu;
+    Eigen::Vector3d m = state.get_field<Omega>()
+      - 0.5 * imu.duration * state.get_field<Alpha>();
+    return imu.weight * (tracker.iRb * m
+      - imu.domega_dgb * GyroscopeShift(error, imu));
+  }
+
+  // Lighthouse angle prediction
+  template <> template <> real_t
+  Observation::expected_measurement<State, Angle, Error, Context>(
+    State const& state, Error const& error, Context const& context) {
+    return PredictAngle(state, context, context.sensor);
+  }
+
+  // ERROR FILTER
+
+  template <> template <> Error
+  Error::derivative<>() const {
+    return Error::Zero();
+  }
+
+  template <> template <> UKF::Vector<3>
+  Observation::expected_measurement<Error, Accelerometer, State, Context>(
+    Error const& errors, State const& state, Context const& context) {
+    return expected_measurement<State, Accelerometer, Error, Context>(
+      state, errors, context);
+  }
+
+  template <> template <> UKF::Vector<3>
+  Observation::expected_measurement<Error, Gyroscope, State, Context>(
+    Error const& errors, State const& state, Context const& context) {
+    return expected_measurement<State, Gyroscope, Error, Context>(
+      state, errors, context);
+  }
+
+  template <> template <> UKF::Vector<3>
+  Observation::expected_measurement<Error, MeanAccelerometer, State, Context>(
+    Error const& errors, State const& state, Context const& context) {
+    return expected_measurement<State, MeanAccelerometer, Error, Context>(
+      state, errors, context);
+  }
+
+  template <> template <> UKF::Vector<3>
+  Observation::expected_measurement<Error, MeanGyroscope, State, Context>(
+    Error const& errors, State const& state, Context const& context) {
+    return expected_measurement<State, MeanGyroscope, Error, Context>(
+      state, errors, context);
+  }
+
+  template <> template <> real_t
+  Observation::expected_measurement<Error, Angle, State, Context>(
+    Error const& errors, State const& state, Context const& context) {
+    return expected_measurement<State, Angle, Error, Context>(
+      state, errors, context);
+  }
+
+  // BUNDLE
+
+  BUNDLE_MODEL(0)  BUNDLE_MODEL(1)  BUNDLE_MODEL(2)  BUNDLE_MODEL(3)
+  BUNDLE_MODEL(4)  BUNDLE_MODEL(5)  BUNDLE_MODEL(6)  BUNDLE_MODEL(7)
+  BUNDLE_MODEL(8)  BUNDLE_MODEL(9)  BUNDLE_MODEL(10) BUNDLE_MODEL(11)
+  BUNDLE_MODEL(12) BUNDLE_MODEL(13) BUNDLE_MODEL(14) BUNDLE_MODEL(15)
+  BUNDLE_MODEL(16) BUNDLE_MODEL(17) BUNDLE_MODEL(18) BUNDLE_MODEL(19)
+  BUNDLE_MODEL(20) BUNDLE_MODEL(21) BUNDLE_MODEL(22) BUNDLE_MODEL(23)
+  BUNDLE_MODEL(24) BUNDLE_MODEL(25) BUNDLE_MODEL(26) BUNDLE_MODEL(27)
+  BUNDLE_MODEL(28) BUNDLE_MODEL(29) BUNDLE_MODEL(30) BUNDLE_MODEL(31)
+}
+
+// Set the angle of sensor I in a bundle
+template <size_t I>
+static void SetBundleField(Observation & obs, real_t angle) {
+  obs.set_field<Bundle + I>(angle);
+}
+
+// Dispatch a runtime sensor id to the field with its compile-time key
+template <size_t... I>
+static void SetBundleField(Observation & obs, uint16_t sensor, real_t angle,
+  std::index_sequence<I...>) {
+  typedef void (*Setter)(Observation &, real_t);
+  static const Setter setters[] = { &SetBundleField<I>... };
+  setters[sensor](obs, angle);
+}
+
+// Convert an angle axis to an eigen transform
+static Eigen::Affine3d AngleAxisToTransform(double data[6]) {
+  Eigen::Affine3d tf = Eigen::Affine3d::Identity();
+  tf.translation() = Eigen::Vector3d(data[0], data[1], data[2]);
+  Eigen::Vector3d v(data[3], data[4], data[5]);
+  if (v.norm() > 0) {
+    Eigen::AngleAxisd aa = Eigen::AngleAxisd::Identity();
+    aa.angle() = v.norm();
+    aa.axis() = v.normalized();
+    tf.linear() = aa.toRotationMatrix();
+  }
+  return tf;
+}
+
+// Cross product matrix of a vector
+static Eigen::Matrix3d Skew(Eigen::Vector3d const& v) {
+  Eigen::Matrix3d m;
+  m <<     0, -v[2],  v[1],
+        v[2],     0, -v[0],
+       -v[1],  v[0],     0;
+  return m;
+}
+
+// Rotation matrix of a rotation vector
+static Eigen::Matrix3d Exp(Eigen::Vector3d const& v) {
+  if (v.norm() < 1e-12)
+    return Eigen::Matrix3d::Identity() + Skew(v);
+  return Eigen::AngleAxisd(v.norm(), v.normalized()).toRotationMatrix();
+}
+
+// Rotation vector of a rotation matrix
+static Eigen::Vector3d Log(Eigen::Matrix3d const& m) {
+  Eigen::AngleAxisd aa(m);
+  return aa.angle() * aa.axis();
+}
+
+// Right jacobian of the rotation of a rotation vector
+static Eigen::Matrix3d RightJacobian(Eigen::Vector3d const& v) {
+  double t = v.norm();
+  Eigen::Matrix3d s = Skew(v);
+  if (t < 1e-6)
+    return Eigen::Matrix3d::Identity() - 0.5 * s;
+  return Eigen::Matrix3d::Identity() - (1.0 - cos(t)) / (t * t) * s
+    + (t - sin(t)) / (t * t * t) * s * s;
+}
+
+// Inverse of the right jacobian of the rotation of a rotation vector
+static Eigen::Matrix3d RightJacobianInverse(Eigen::Vector3d const& v) {
+  double t = v.norm();
+  Eigen::Matrix3d s = Skew(v);
+  if (t < 1e-6)
+    return Eigen::Matrix3d::Identity() + 0.5 * s;
+  return Eigen::Matrix3d::Identity() + 0.5 * s
+    + (1.0 / (t * t) - (1.0 + cos(t)) / (2.0 * t * sin(t))) * s * s;
+}
+
+void CompileModel(TrackingModel & model, double registration[6],
+  LighthouseMap & lighthouses, TrackerMap & trackers) {
+  Eigen::Affine3d wTv = AngleAxisToTransform(registration);
+  LighthouseMap::iterator lt;
+  for (lt = lighthouses.begin(); lt != lighthouses.end(); lt++)
+    model.lighthouse_ids.emplace(lt->first, model.lighthouse_ids.size());
+  model.lighthouses.resize(model.lighthouse_ids.size());
+  for (lt = lighthouses.begin(); lt != lighthouses.end(); lt++) {
+    LighthouseModel & lm = model.lighthouses[model.lighthouse_ids[lt->first]];
+    lm.lTw = wTv.inverse() * AngleAxisToTransform(lt->second.vTl).inverse();
+    for (size_t i = 0; i < NUM_MOTORS*NUM_PARAMS; i++)
+      lm.params[i] = lt->second.params[i];
+    lm.ready = lt->second.ready;
+  }
+  TrackerMap::iterator tt;
+  for (tt = trackers.begin(); tt != trackers.end(); tt++)
+    model.tracker_ids.emplace(tt->first, model.tracker_ids.size());
+  model.trackers.resize(model.tracker_ids.size());
+  for (tt = trackers.begin(); tt != trackers.end(); tt++) {
+    TrackerModel & tm = model.trackers[model.tracker_ids[tt->first]];
+    Eigen::Affine3d bTh = AngleAxisToTransform(tt->second.bTh);
+    Eigen::Affine3d tTh = AngleAxisToTransform(tt->second.tTh);
+    Eigen::Affine3d tTi = AngleAxisToTransform(tt->second.tTi);
+    Eigen::Affine3d iTb = tTi.inverse() * tTh * bTh.inverse();
+    tm.iRb = iTb.linear();
+    tm.iPb = iTb.translation();
+    Eigen::Affine3d bTt = bTh * tTh.inverse();
+    for (size_t i = 0; i < NUM_SENSORS; i++)
+      tm.bPs[i] = bTt * Eigen::Vector3d(tt->second.sensors[6*i+0],
+        tt->second.sensors[6*i+1], tt->second.sensors[6*i+2]);
+    tm.ready = tt->second.ready;
+  }
+}
+
+void LightUpdate(ErrorFilter & error, TrackingFilter & filter,
+  Context context, std::vector<deepdive_ros::Pulse> const& pulses,
+  double dt, bool batch) {
+  // Stack the whole sweep into one observation
+  if (batch) {
+    Observation obs;
+    for (size_t i = 0; i < pulses.size(); i++)
+      SetBundleField(obs, pulses[i].sensor, pulses[i].angle,
+        std::make_index_sequence<NUM_SENSORS>());
+    error.a_priori_step(dt);
+    error.innovation_step(obs, filter.state, context);
+    error.a_posteriori_step();
+    filter.a_priori_step(dt);
+    filter.innovation_step(obs, error.state, context);
+    filter.a_posteriori_step();
+    return;
+  }
+  // Correct the error filter
+  error.a_priori_step(dt);
+  for (size_t i = 0; i < pulses.size(); i++) {
+    context.sensor = pulses[i].sensor;
+    Observation obs;
+    obs.set_field<Angle>(pulses[i].angle);
+    error.innovation_step(obs, filter.state, context);
+  }
+  error.a_posteriori_step();
+  // Correct the tracking filter
+  filter.a_priori_step(dt);
+  for (size_t i = 0; i < pulses.size(); i++) {
+    context.sensor = pulses[i].sensor;
+    Observation obs;
+    obs.set_field<Angle>(pulses[i].angle);
+    filter.innovation_step(obs, error.state, context);
+  }
+  filter.a_posteriori_step();
+}
+
+void ImuUpdate(ErrorFilter & error, TrackingFilter & filter,
+  Context const& context, Observation const& obs, double dt) {
+  // Step the parameter filter
+  error.a_priori_step(dt);
+  error.innovation_step(obs, filter.state, context);
+  error.a_posteriori_step();
+  // Propagate the filter
+  filter.a_priori_step(dt);
+  filter.innovation_step(obs, error.state, context);
+  filter.a_posteriori_step();
+}
+
+void Preintegrate(Preintegration & imu, ErrorFilter const& error,
+  Eigen::Vector3d const& acc, Eigen::Vector3d const& gyr, double dt) {
+  // Start over with the current error estimate
+  if (imu.count == 0) {
+    imu.ab = error.state.get_field<AccelerometerBias>();
+    imu.as = error.state.get_field<AccelerometerScale>();
+    imu.gb = error.state.get_field<GyroscopeBias>();
+    imu.gs = error.state.get_field<GyroscopeScale>();
+    imu.duration = 0;
+    imu.acc = Eigen::Vector3d::Zero();
+    imu.gyr = Eigen::Vector3d::Zero();
+    imu.dR = Eigen::Matrix3d::Identity();
+    imu.dv = Eigen::Vector3d::Zero();
+    imu.dR_dgb = Eigen::Matrix3d::Zero();
+    imu.dv_dab = Eigen::Matrix3d::Zero();
+    imu.dv_dgb = Eigen::Matrix3d::Zero();
+  }
+  // Correct the sample, which inverts the measurement model
+  Eigen::Vector3d f = imu.as.cwiseProduct(acc) + imu.ab;
+  Eigen::Vector3d w = imu.gs.cwiseProduct(gyr) + imu.gb;
+  // The velocity change depends on the rotation so far, so comes first
+  imu.dv_dgb -= imu.dR * Skew(f) * imu.dR_dgb * dt;
+  imu.dv_dab += imu.dR * dt;
+  imu.dv += imu.dR * f * dt;
+  Eigen::Matrix3d dR = Exp(w * dt);
+  imu.dR_dgb = dR.transpose() * imu.dR_dgb + RightJacobian(w * dt) * dt;
+  imu.dR = imu.dR * dR;
+  imu.acc += acc;
+  imu.gyr += gyr;
+  imu.duration += dt;
+  imu.count++;
+}
+
+void ReducePreintegration(Preintegration & imu) {
+  Eigen::Vector3d phi = Log(imu.dR);
+  imu.omega = phi / imu.duration;
+  imu.domega_dgb = RightJacobianInverse(phi) * imu.dR_dgb / imu.duration;
+  imu.force = imu.dR.transpose() * imu.dv / imu.duration;
+  imu.dforce_dab = imu.dR.transpose() * imu.dv_dab / imu.duration;
+  imu.dforce_dgb = imu.dR.transpose() * imu.dv_dgb / imu.duration
+    + Skew(imu.force) * imu.dR_dgb;
+}
+
+bool PreintegratedUpdate(ErrorFilter & error, TrackingFilter & filter,
+  Context context, Preintegration & imu, double dt,
+  bool accelerometer, bool gyroscope) {
+  if (imu.count == 0 || imu.duration <= 0)
+    return false;
+  ReducePreintegration(imu);
+  // The noise of a mean falls with the number of samples, which is the same
+  // as scaling both the measurement and its prediction up by the root of it
+  imu.weight = sqrt(static_cast<double>(imu.count));
+  Observation obs;
+  if (accelerometer)
+    obs.set_field<MeanAccelerometer>(imu.weight * imu.force);
+  if (gyroscope)
+    obs.set_field<MeanGyroscope>(imu.weight * imu.omega);
+  context.imu = &imu;
+  // Step the parameter filter over the time its samples span
+  error.a_priori_step(imu.duration);
+  error.innovation_step(obs, filter.state, context);
+  error.a_posteriori_step();
+  // Propagate the filter
+  filter.a_priori_step(dt);
+  filter.innovation_step(obs, error.state, context);
+  filter.a_posteriori_step();
+  imu.count = 0;
+  return true;
+}
@@ -0,0 +1,217 @@
+#ifndef SRC_DEEPDIVE_FILTER_HH
+#define SRC_DEEPDIVE_FILTER_HH
+
+// Messages
+#include <deepdive_ros/Pulse.h>
+
+// Eigen includes
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+
+// UKF includes
+#include <UKF/Types.h>
+#include <UKF/Integrator.h>
+#include <UKF/StateVector.h>
+#include <UKF/MeasurementVector.h>
+#include <UKF/Core.h>
+
+// STL
+#include <utility>
+#include <vector>
+#include <map>
+
+// Deepdive internal
+#include "deepdive.hh"
+
+// FILTER KEYS
+
+// State indexes
+enum Keys : uint8_t {
+  // STATE
+  Position,             // Position (world frame, m)
+  Attitude,             // Attitude quaternion (rotates vec from body to world)
+  Velocity,             // Velocity (body frame, m/s)
+  Omega,                // Angular velocity (body frame, rads/s)
+  Acceleration,         // Acceleration (body frame, m/s^2)
+  Alpha,                // Angular acceleration (body frame, rads/s^2)
+  // ERRORS
+  GyroscopeBias,        // Gyroscope bias offset (body frame, rad/s)
+  GyroscopeScale,       // Gyroscope scale factor (body frame, multiplier)
+  AccelerometerBias,    // Accelerometer bias offset (body frame, m/s^2)
+  AccelerometerScale,   // Accelerometer scale factor (body frame, mutliplier)
+  // MEASUREMENTS
+  Accelerometer,        // Acceleration (body frame, m/s^2)
+  Gyroscope,            // Gyroscope (body frame, rads/s)
+  MeanAccelerometer,    // Preintegrated acceleration (body frame, m/s^2)
+  MeanGyroscope,        // Preintegrated gyroscope (body frame, rads/s)
+  Angle,                // Angle of the sensor in the context (rads)
+  Bundle                // Bundle + i is the angle of sensor i (rads)
+};
+
+// OBSERVATION
+
+// A bundle sets one angle field per sensor that was hit by the sweep, so the
+// whole bundle is fused with a single sigma point propagation.
+template <typename Sequence> struct ObservationFields;
+template <size_t... I> struct ObservationFields<std::index_sequence<I...>> {
+  using type = UKF::DynamicMeasurementVector<
+    UKF::Field<Accelerometer, UKF::Vector<3>>,
+    UKF::Field<Gyroscope, UKF::Vector<3>>,
+    UKF::Field<MeanAccelerometer, UKF::Vector<3>>,
+    UKF::Field<MeanGyroscope, UKF::Vector<3>>,
+    UKF::Field<Angle, real_t>,
+    UKF::Field<Bundle + I, real_t>...
+  >;
+};
+
+// Observation vector
+using Observation =
+  ObservationFields<std::make_index_sequence<NUM_SENSORS>>::type;
+
+// TRACKING FILTER
+
+// State vector
+using State = UKF::StateVector<
+  UKF::Field<Position, UKF::Vector<3>>,
+  UKF::Field<Attitude, UKF::Quaternion>,
+  UKF::Field<Velocity, UKF::Vector<3>>,
+  UKF::Field<Omega, UKF::Vector<3>>,
+  UKF::Field<Acceleration, UKF::Vector<3>>,
+  UKF::Field<Alpha, UKF::Vector<3>>
+>;
+
+// For tracking
+using TrackingFilter = UKF::Core<
+  State, Observation, UKF::IntegratorRK4
+>;
+
+// ERROR FILTER
+
+// Parameters
+using Error = UKF::StateVector<
+  UKF::Field<AccelerometerBias, UKF::Vector<3>>,
+  UKF::Field<AccelerometerScale, UKF::Vector<3>>,
+  UKF::Field<GyroscopeBias, UKF::Vector<3>>,
+  UKF::Field<GyroscopeScale, UKF::Vector<3>>
+>;
+
+// For parameter estimation
+using ErrorFilter = UKF::Core<
+  Error, Observation, UKF::IntegratorEuler
+>;
+
+// For IMU parameter estimation
+typedef std::map<std::string, ErrorFilter> ErrorMap;
+
+// Process models are used by the node directly, while the measurement
+// models are only ever instantiated inside the update routines below.
+namespace UKF {
+  template <> template <> State State::derivative<>() const;
+  template <> template <> Error Error::derivative<>() const;
+}
+
+// COMPILED TRACKING MODEL
+
+// Lighthouses and trackers are given dense ids, and everything the measurement
+// models need is composed up front whenever calibration changes. So a sigma
+// point evaluation only indexes into arrays and does fixed-size multiplies.
+
+// A lighthouse with the world -> vive chain folded in
+struct LighthouseModel {
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  Eigen::Affine3d lTw;                    // world -> lighthouse
+  double params[NUM_MOTORS*NUM_PARAMS];   // Lighthouse parameters
+  bool ready;                             // Whether it has been seen
+};
+typedef std::vector<LighthouseModel,
+  Eigen::aligned_allocator<LighthouseModel>> LighthouseModels;
+
+// A tracker with its extrinsics folded in
+struct TrackerModel {
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  Eigen::Matrix3d iRb;                    // body -> imu rotation
+  Eigen::Vector3d iPb;                    // body -> imu translation
+  Eigen::Vector3d bPs[NUM_SENSORS];       // Sensor positions in body frame
+  bool ready;                             // Whether it has been seen
+};
+typedef std::vector<TrackerModel,
+  Eigen::aligned_allocator<TrackerModel>> TrackerModels;
+
+// Everything the measurement models need
+struct TrackingModel {
+  std::map<std::string, uint16_t> lighthouse_ids;   // Serial -> lighthouse id
+  std::map<std::string, uint16_t> tracker_ids;      // Serial -> tracker id
+  LighthouseModels lighthouses;                     // Indexed by lighthouse id
+  TrackerModels trackers;                           // Indexed by tracker id
+  Eigen::Vector3d gravity;                          // Gravity in world frame
+  bool correct;                                     // Apply light corrections
+};
+
+// IMU PREINTEGRATION
+
+// IMU samples taken between two steps of the filters, which are integrated
+// with the error estimate at the time of the first sample. The increments are
+// kept with their jacobians with respect to the biases, so that the mean rates
+// they are fused as can be predicted for any bias without integrating again.
+struct Preintegration {
+  size_t count = 0;                  // Number of samples integrated
+  double duration = 0;               // Time spanned by the samples (s)
+  Eigen::Vector3d ab, as, gb, gs;    // Error estimate used for integration
+  Eigen::Vector3d acc, gyr;          // Sums of the raw samples
+  Eigen::Matrix3d dR;                // Rotation over the samples (imu frame)
+  Eigen::Vector3d dv;                // Velocity change (first imu frame)
+  Eigen::Matrix3d dR_dgb;            // Rotation jacobian wrt gyro bias
+  Eigen::Matrix3d dv_dab;            // Velocity jacobian wrt accel bias
+  Eigen::Matrix3d dv_dgb;            // Velocity jacobian wrt gyro bias
+  Eigen::Vector3d omega;             // Mean angular velocity (imu frame)
+  Eigen::Vector3d force;             // Mean specific force (last imu frame)
+  Eigen::Matrix3d domega_dgb;        // Mean angular velocity wrt gyro bias
+  Eigen::Matrix3d dforce_dab;        // Mean specific force wrt accel bias
+  Eigen::Matrix3d dforce_dgb;        // Mean specific force wrt gyro bias
+  double weight;                     // Square root of the sample count
+};
+
+// Context data
+struct Context {
+  TrackingModel const* model;        // Compiled tracking model
+  uint16_t lighthouse;               // Active lighthouse id
+  uint16_t tracker;                  // Active tracker id
+  uint16_t sensor;                   // Active sensor id (Angle only)
+  uint8_t axis;                      // Active axis
+  Preintegration const* imu;         // Preintegrated IMU (Mean* only)
+};
+
+// Give any new lighthouses and trackers an id and recompose the model
+void CompileModel(TrackingModel & model, double registration[6],
+  LighthouseMap & lighthouses, TrackerMap & trackers);
+
+// FILTER UPDATES
+
+// Fuse the pulses of one sweep, either as one stacked observation (batch) or
+// as one scalar observation per pulse. Pulses must have valid sensor ids.
+void LightUpdate(ErrorFilter & error, TrackingFilter & filter,
+  Context context, std::vector<deepdive_ros::Pulse> const& pulses,
+  double dt, bool batch);
+
+// Fuse an accelerometer and/or gyroscope observation
+void ImuUpdate(ErrorFilter & error, TrackingFilter & filter,
+  Context const& context, Observation const& obs, double dt);
+
+// Add an IMU sample to the preintegration of a tracker. The first sample after
+// a fusion starts over with the current estimate of the error filter.
+void Preintegrate(Preintegration & imu, ErrorFilter const& error,
+  Eigen::Vector3d const& acc, Eigen::Vector3d const& gyr, double dt);
+
+// Reduce the preintegrated increments to mean rates and their bias jacobians
+void ReducePreintegration(Preintegration & imu);
+
+// Fuse the mean accelerometer and/or gyroscope over all preintegrated samples
+// in a single step of the filters, and empty the preintegration. The error
+// filter steps over the samples, and the tracking filter steps by dt. Samples
+// that span no time are kept for the next update. Returns whether the filters
+// were stepped.
+bool PreintegratedUpdate(ErrorFilter & error, TrackingFilter & filter,
+  Context context, Preintegration & imu, double dt,
+  bool accelerometer, bool gyroscope);
+
+#endif
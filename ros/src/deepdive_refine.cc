@@ -3,6 +3,12 @@
 #include <tf2_ros/transform_broadcaster.h>
 #include <tf2_ros/static_transform_broadcaster.h>
 
+// Nodelet includes
+#ifdef DEEPDIVE_NODELET
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#endif
+
 // Third-party includes
 #include <geometry_msgs/TransformStamped.h>
 #include <visualization_msgs/MarkerArray.h>
@@ -11,6 +17,7 @@
 
 // Non-standard datra messages
 #include <deepdive_ros/Light.h>
+#include <deepdive_ros/Packed.h>
 #include <deepdive_ros/Lighthouses.h>
 #include <deepdive_ros/Trackers.h>
 
@@ -26,21 +33,26 @@
 #include <Eigen/Geometry>
 
 // C++ libraries
+#include <array>
 #include <map>
 #include <vector>
 #include <string>
 #include <fstream>
 #include <sstream>
+#include <memory>
+#include <mutex>
+#include <algorithm>
 
 // Shared local code
 #include "deepdive.hh"
+#include "deepdive_cost.hh"
 
 // GLOBAL PARAMETERS
 
 // List of lighthouses
 LighthouseMap lighthouses_;
 TrackerMap trackers_;
-MeasurementMap measurements_;
+MeasurementStore measurements_;
 CorrectionMap corrections_;
 
 // Global strings
@@ -62,6 +74,9 @@ int thresh_count_ = 4;
 double thresh_angle_ = 60.0;
 double thresh_duration_ = 1.0;
 
+// Threads used to estimate initial poses in parallel (0 = one per core)
+int threads_ = 0;
+
 // Solver parameters
 ceres::Solver::Options options_;
 
@@ -77,6 +92,9 @@ bool refine_params_ = false;
 // Are we running in "offline" mode
 bool offline_ = false;
 
+// Bag to read directly, instead of subscribing to a played-back one
+std::string bag_;
+
 // Should we publish rviz markers
 bool visualize_ = true;
 
@@ -92,6 +110,9 @@ double wTv_[6];
 // Smoothing factor
 double smoothing_ = 10.0;
 
+// Use analytic per-sensor light costs instead of autodiff group costs
+bool analytic_ = true;
+
 // Sensor visualization publisher
 ros::Publisher pub_sensors_;
 ros::Publisher pub_path_;
@@ -100,159 +121,157 @@ ros::Publisher pub_ekf_;
 // Timer for managing offline
 ros::Timer timer_;
 
-// CERES SOLVER
-
-// Helper function to apply a transform b = Ra + t
-template <typename T> inline
-void TransformInPlace(const T transform[6], T x[3]) {
-  T tmp[3];
-  ceres::AngleAxisRotatePoint(&transform[3], x, tmp);
-  x[0] = tmp[0] + transform[0];
-  x[1] = tmp[1] + transform[1];
-  x[2] = tmp[2] + transform[2];
+// Online sliding window mode
+bool online_ = false;                 // Refine continuously on live data
+int online_window_ = 50;              // Number of poses in the window
+double online_rate_ = 1.0;            // Rate at which to re-solve (Hz)
+double online_prior_ = 1.0;           // Weight of prior on calibration
+ros::Timer online_timer_;
+
+// Background solving, which writes the solution back with Commit
+bool Solve(Segment & seg);
+void Commit(Segment const& seg);
+SegmentSolver solver_(measurements_, corrections_, lighthouses_, trackers_,
+  wTv_, Solve, Commit);
+
+// Principal distance of a synthetic image plane 1m wide with a 120deg FOV
+static const double FOCAL = 1.0 / (2.0 * std::tan(2.0944 / 2.0));
+
+// Use PNP to estimate the body pose from the sensors seen by one lighthouse
+bool EstimatePose(Lighthouse const& lighthouse, Tracker const& tracker,
+  double const wTv[6], std::vector<cv::Point3f> const& obj, std::vector<cv::Point2f> const& img,
+  double wTb[6]) {
+  cv::Mat cam = cv::Mat::eye(3, 3, cv::DataType<double>::type);
+  cv::Mat dist;
+  cam.at<double>(0, 0) = FOCAL;
+  cam.at<double>(1, 1) = FOCAL;
+  cv::Mat R(3, 1, cv::DataType<double>::type);
+  cv::Mat T(3, 1, cv::DataType<double>::type);
+  cv::Mat C(3, 3, cv::DataType<double>::type);
+  if (!cv::solvePnPRansac(obj, img, cam, dist, R, T,  false,
+    100, 8.0, 0.99, cv::noArray(), cv::SOLVEPNP_UPNP)) return false;
+  cv::Rodrigues(R, C);
+  Eigen::Matrix3d rot;
+  for (size_t r = 0; r < 3; r++)
+    for (size_t c = 0; c < 3; c++)
+      rot(r, c) = C.at<double>(r, c);
+  // Get the transform from the trackng to lighthouse frame
+  Eigen::Affine3d lTt;
+  lTt.translation()[0] = T.at<double>(0, 0);
+  lTt.translation()[1] = T.at<double>(1, 0);
+  lTt.translation()[2] = T.at<double>(2, 0);
+  lTt.linear() = rot;
+  // This is a great initial estimate of the true location
+  Eigen::Affine3d obs;
+  obs = CeresToEigen(wTv)                   // vive -> world
+      * CeresToEigen(lighthouse.vTl)        // lighthouse -> vive
+      * lTt                                 // tracking -> lighthouse
+      * CeresToEigen(tracker.tTh)           // head -> tracking
+      * CeresToEigen(tracker.bTh, true);    // body -> head
+  // Set the initial estimate to this pose
+  Eigen::AngleAxisd aa(obs.linear());
+  wTb[0] = obs.translation()[0];
+  wTb[1] = obs.translation()[1];
+  wTb[2] = obs.translation()[2];
+  wTb[3] = aa.angle() * aa.axis()[0];
+  wTb[4] = aa.angle() * aa.axis()[1];
+  wTb[5] = aa.angle() * aa.axis()[2];
+  return true;
 }
 
-// Helper function to invert a transform a = R'(b - t)
-template <typename T> inline
-void InverseTransformInPlace(const T transform[6], T x[3]) {
-  T aa[3], tmp[3];
-  tmp[0] = x[0] - transform[0];
-  tmp[1] = x[1] - transform[1];
-  tmp[2] = x[2] - transform[2];
-  aa[0] = -transform[3];
-  aa[1] = -transform[4];
-  aa[2] = -transform[5];
-  ceres::AngleAxisRotatePoint(aa, tmp, x);
+// Collect the sensors seen in a bin as light and as PNP correspondences
+void Correspondences(Lighthouse const& lighthouse, Tracker const& tracker,
+  LightBin const& bin, std::vector<cv::Point3f> & obj,
+  std::vector<cv::Point2f> & img, Group & group) {
+  for (uint8_t s = 0; s < NUM_SENSORS; s++) {
+    // Check that we have azimuth/elevation for both lighthouses
+    if (!bin.Seen(s))
+      continue;
+    double angles[2] = { bin.angles[s][0], bin.angles[s][1] };
+    // Add the pre-corrected angles to the light group
+    group[std::pair<uint16_t, uint8_t>(s, 0)] = angles[0];
+    group[std::pair<uint16_t, uint8_t>(s, 1)] = angles[1];
+    // Correct the angles using the lighthouse parameters
+    Correct(lighthouse, angles, correct_);
+    // Push on the correct world sensor position
+    obj.push_back(cv::Point3f(
+      tracker.sensors[s * 6 + 0],
+      tracker.sensors[s * 6 + 1],
+      tracker.sensors[s * 6 + 2]));
+    // Push on the coordinate in the slave image plane
+    img.push_back(cv::Point2f(FOCAL * tan(angles[0]), FOCAL * tan(angles[1])));
+  }
 }
 
-// Group of light measurements -- essential for accuracy
-typedef std::map<std::pair<uint16_t, uint8_t>, double> Group;
-
-// Residual error between predicted angles to a lighthouse
-struct GroupCost {
-  explicit GroupCost(Group const& group) : group_(group) {}
-  // Called by ceres-solver to calculate error
-  template <typename T>
-  bool operator()(const T* const wTv,         // Vive -> World
-                  const T* const vTl,         // Lighthouse -> vive
-                  const T* const wTb_pos_xy,  // Body -> world (pos xy)
-                  const T* const wTb_pos_z,   // Body -> world (pos z)
-                  const T* const wTb_rot_xy,  // Body -> world (rot xy)
-                  const T* const wTb_rot_z,   // Body -> world (rot z)
-                  const T* const bTh,         // Head -> body
-                  const T* const tTh,         // Head -> tracking (light)
-                  const T* const sensors,     // Lighthouse calibration
-                  const T* const params,      // Tracker extrinsics
-                  T* residual) const {
-    // The position of the sensor
-    T x[3], angle[2], wTb[6];
-    // Reconstruct a transform from the components
-    wTb[0] = wTb_pos_xy[0];
-    wTb[1] = wTb_pos_xy[1];
-    wTb[2] = wTb_pos_z[0];
-    wTb[3] = wTb_rot_xy[0];
-    wTb[4] = wTb_rot_xy[1];
-    wTb[5] = wTb_rot_z[0];
-    // Used to index the residual
-    size_t cnt = 0;
-    // Iterate over all measurements
-    Group::const_iterator gt;
-    for (gt = group_.begin(); gt != group_.end(); gt++) {
-      // Get the sensor and axis for this group
-      uint16_t const& s = gt->first.first;
-      uint8_t const& a = gt->first.second;
-      // Get the sensor position in the tracking frame
-      x[0] = sensors[6*s+0];
-      x[1] = sensors[6*s+1];
-      x[2] = sensors[6*s+2];
-      // Project the sensor position into the lighthouse frame
-      InverseTransformInPlace(tTh, x);    // light -> head
-      TransformInPlace(bTh, x);           // head -> body
-      TransformInPlace(wTb, x);           // body -> world
-      InverseTransformInPlace(wTv, x);    // world -> vive
-      InverseTransformInPlace(vTl, x);    // vive -> lighthouse
-      // Predict the angles - Note that the 
-      Predict(params, x, angle, correct_);
-      // The residual angle error for the specific axis
-      residual[cnt++] = angle[a] - T(gt->second);
-    }
-    return true;
+// Convert a body pose to a stamped ROS pose
+geometry_msgs::PoseStamped ToPose(ros::Time const& t, double const wTb[6]) {
+  geometry_msgs::PoseStamped ps;
+  Eigen::Vector3d v(wTb[3], wTb[4], wTb[5]);
+  Eigen::AngleAxisd aa = Eigen::AngleAxisd::Identity();
+  if (v.norm() > 0) {
+    aa.angle() = v.norm();
+    aa.axis() = v.normalized();
   }
- // Internal variables
- private:
-  Group group_;
-};
+  Eigen::Quaterniond q(aa);
+  ps.header.stamp = t;
+  ps.header.frame_id = frame_world_;
+  ps.pose.position.x = wTb[0];
+  ps.pose.position.y = wTb[1];
+  ps.pose.position.z = wTb[2];
+  ps.pose.orientation.w = q.w();
+  ps.pose.orientation.x = q.x();
+  ps.pose.orientation.y = q.y();
+  ps.pose.orientation.z = q.z();
+  return ps;
+}
 
-// Residual error between sequential poses
-struct MotionCost {
-  explicit MotionCost() {}
-  // Called by ceres-solver to calculate error
-  template <typename T>
-  bool operator()(const T* const prev_pos_xy,  // PREV Body -> world (pos xy)
-                  const T* const prev_pos_z,   // PREV Body -> world (pos z)
-                  const T* const prev_rot_xy,  // PREV Body -> world (rot xy)
-                  const T* const prev_rot_z,   // PREV Body -> world (rot z)
-                  const T* const next_pos_xy,  // NEXT Body -> world (pos xy)
-                  const T* const next_pos_z,   // NEXT Body -> world (pos z)
-                  const T* const next_rot_xy,  // NEXT Body -> world (rot xy)
-                  const T* const next_rot_z,   // NEXT Body -> world (rot z)
-                  T* residual) const {
-    residual[0] =  prev_pos_xy[0] - next_pos_xy[0];
-    residual[1] =  prev_pos_xy[1] - next_pos_xy[1];
-    residual[2] =  prev_pos_z[0] - next_pos_z[0];
-    residual[3] =  prev_rot_xy[0] - next_rot_xy[0];
-    residual[4] =  prev_rot_xy[1] - next_rot_xy[1];
-    residual[5] =  prev_rot_z[0] - next_rot_z[0];
-    for (size_t i = 0; i < 6; i++)
-      residual[i] *= T(smoothing_);
-    return true;
+// Reports every solver iteration, and gives up if we are asked to stop
+class ProgressCallback : public ceres::IterationCallback {
+ public:
+  ceres::CallbackReturnType operator()(
+    ceres::IterationSummary const& summary) override {
+    solver_.Progress("solving", summary.iteration, summary.cost);
+    if (solver_.Stopping() || ros::isShuttingDown())
+      return ceres::SOLVER_ABORT;
+    return ceres::SOLVER_CONTINUE;
   }
 };
 
-// Solve the problem
-bool Solve() {
+// Solve the problem posed by a recorded segment
+bool Solve(Segment & seg) {
   // Create the ceres problem
   ceres::Problem problem;
 
   // BASIC SANITY CHECKS
 
   // Check measurements
-  if (measurements_.empty()) {
+  if (seg.measurements.Empty()) {
     ROS_WARN("No measurements received, so cannot solve the problem.");
     return false;
   } else {
-    double t = (measurements_.rbegin()->first - measurements_.begin()->first).toSec();
-    ROS_INFO_STREAM("Processing " << measurements_.size()
+    double t = (seg.measurements.Last() - seg.measurements.First()).toSec();
+    ROS_INFO_STREAM("Processing " << seg.measurements.Size()
       << " measurements running for " << t << " seconds from "
-      << measurements_.begin()->first << " to "
-      << measurements_.rbegin()->first);
+      << seg.measurements.First() << " to "
+      << seg.measurements.Last());
   }
 
   // Check corrections
-  if (corrections_.empty()) {
+  if (seg.corrections.empty()) {
     ROS_INFO("No corrections in dataset. Assuming first body pose at origin.");
   } else {
-    double t = (corrections_.rbegin()->first - corrections_.begin()->first).toSec();
-    ROS_INFO_STREAM("Processing " << corrections_.size()
+    double t = (seg.corrections.rbegin()->first - seg.corrections.begin()->first).toSec();
+    ROS_INFO_STREAM("Processing " << seg.corrections.size()
       << " corrections running for " << t << " seconds from "
-      << corrections_.begin()->first << " to "
-      << corrections_.rbegin()->first);
+      << seg.corrections.begin()->first << " to "
+      << seg.corrections.rbegin()->first);
   }
 
   // BUNDLE DATA AND CORRECTIONS
 
-  typedef std::map<ros::Time,             // Time
-            std::map<uint8_t,             // Sensor
-              std::map<uint8_t,           // Axis
-                std::vector<double>       // Sample
-              >
-            >
-          > Bundle;
-  std::map<std::string,                   // Tracker
-    std::map<std::string,                 // Lighthouse
-      Bundle
-    >
-  > bundle;
+  solver_.Progress("bundling");
+
+  LightBins bundle;                       // Light
 
   std::map<ros::Time, double[6]> corr;
 
@@ -260,19 +279,10 @@ bool Solve() {
   // us to take the average of the measurements to improve accuracy
   {
     ROS_INFO("Bundling measurements into larger discrete time units.");
-    MeasurementMap::iterator mt;
-    for (mt = measurements_.begin(); mt != measurements_.end(); mt++) {
-      std::string const& tserial = mt->second.light.header.frame_id;
-      std::string const& lserial = mt->second.light.lighthouse;
-      size_t const& a = mt->second.light.axis;
-      ros::Time t = ros::Time(round(mt->first.toSec() / res_) * res_);
-      std::vector<deepdive_ros::Pulse>::iterator pt;
-      for (pt = mt->second.light.pulses.begin(); pt != mt->second.light.pulses.end(); pt++)
-        bundle[tserial][lserial][t][pt->sensor][a].push_back(pt->angle);
-    }
+    seg.measurements.Bundle(res_, bundle);
     ROS_INFO("Bundling corrections into larger discrete time units.");
     CorrectionMap::iterator ct;
-    for (ct = corrections_.begin(); ct != corrections_.end(); ct++) {
+    for (ct = seg.corrections.begin(); ct != seg.corrections.end(); ct++) {
       ros::Time t = ros::Time(round(ct->first.toSec() / res_) * res_);
       Eigen::Quaterniond q(
         ct->second.transform.rotation.w,
@@ -298,51 +308,44 @@ bool Solve() {
   // ondences (photosensors). We want to calibrate this stereo pair.
   {
     ROS_INFO("Using P3P to estimate tracker pose in light frame.");
+    solver_.Progress("estimating");
     // Create a new ceres problem to solve
     ceres::Problem problem;
     // Various lighjthouse parameters
-    double fov = 2.0944;                          // 120deg FOV
-    double w = 1.0;                               // 1m synthetic image plane
-    double z = w / (2.0 * std::tan(fov / 2.0));   // Principle distance
     uint32_t count = 0;                           // Track num transforms
     // This recursively calculates the mean, std dev for a variable
     Statistic height;
     // Iterate over lighthouses
     LighthouseMap::iterator lt;
-    for (lt = lighthouses_.begin(); lt != lighthouses_.end(); lt++) {
+    for (lt = seg.lighthouses.begin(); lt != seg.lighthouses.end(); lt++) {
       // Iterate over trackers
       TrackerMap::iterator tt;
-      for (tt = trackers_.begin(); tt != trackers_.end(); tt++) {
+      for (tt = seg.trackers.begin(); tt != seg.trackers.end(); tt++) {
         ROS_INFO_STREAM("- Slave " << lt->first << " and tracker " << tt->first);
         // Iterate over time epochs
-        Bundle::iterator bt;
-        for (bt = bundle[tt->first][lt->first].begin();
-          bt != bundle[tt->first][lt->first].end(); bt++) {
+        LightBins::const_iterator bt, bb, be;
+        seg.measurements.Find(bundle, tt->first, lt->first, bb, be);
+        // PNP on each epoch is independent of the others, so estimate all of
+        // the initial poses in parallel before building the problem
+        std::vector<std::array<double, 6>> est(be - bb);
+        std::vector<char> ok(be - bb, 0);
+        if (refine_trajectory_) {
+          ParallelFor(be - bb, [&](size_t i) {
+            std::vector<cv::Point3f> obj;
+            std::vector<cv::Point2f> img;
+            Group group;
+            Correspondences(lt->second, tt->second, *(bb + i), obj, img, group);
+            if (obj.size() > 3)
+              ok[i] = EstimatePose(lt->second, tt->second, seg.wTv, obj, img,
+                est[i].data());
+          }, threads_);
+        }
+        for (bt = bb; bt != be; bt++) {
           // One for each time instance
           std::vector<cv::Point3f> obj;
           std::vector<cv::Point2f> img;
           Group group;
-          // Try and find correspondences for every possible sensor
-          for (uint8_t s = 0; s < NUM_SENSORS; s++) {
-            // Mean angles for the <lighthouse, axis>
-            double angles[2];
-            // Check that we have azimuth/elevation for both lighthouses
-            if (!Mean(bundle[tt->first][lt->first][bt->first][s][0], angles[0]) ||
-                !Mean(bundle[tt->first][lt->first][bt->first][s][1], angles[1]))
-              continue;
-            // Add the pre-corrected angles to the light group
-            group[std::pair<uint16_t, uint8_t>(s, 0)] = angles[0];
-            group[std::pair<uint16_t, uint8_t>(s, 1)] = angles[1];
-            // Correct the angles using the lighthouse parameters
-            Correct(lt->second.params, angles, correct_);
-            // Push on the correct world sensor position
-            obj.push_back(cv::Point3f(
-              trackers_[tt->first].sensors[s * 6 + 0],
-              trackers_[tt->first].sensors[s * 6 + 1],
-              trackers_[tt->first].sensors[s * 6 + 2]));
-            // Push on the coordinate in the slave image plane
-            img.push_back(cv::Point2f(z * tan(angles[0]), z * tan(angles[1])));
-          }
+          Correspondences(lt->second, tt->second, *bt, obj, img, group);
           // In the case that we have 4 or more measurements, then we can try
           // and estimate the trackers location in the lighthouse frame.
           if (obj.size() > 3) {
@@ -350,92 +353,50 @@ bool Solve() {
             // as estimates of the sensor trajectory. This is mainly to help
             // solve for extrinsics and lighthouse prameters.
             if (!refine_trajectory_) {
-              std::map<ros::Time, double[6]>::iterator ct = corr.find(bt->first);
+              std::map<ros::Time, double[6]>::iterator ct = corr.find(bt->time);
               if (ct == corr.end())
                 continue;
               for (size_t i = 0; i < 6; i++)
-                wTb[bt->first][i] = ct->second[i];
+                wTb[bt->time][i] = ct->second[i];
             // If we are solving for trajectory, get a nice initial estimate
             // using PNP. Otherwise, the majority of the solvers effort goes
             // into moving each pose in the trajectory.
+            } else if (ok[bt - bb]) {
+              for (size_t i = 0; i < 6; i++)
+                wTb[bt->time][i] = est[bt - bb][i];
             } else {
-              cv::Mat cam = cv::Mat::eye(3, 3, cv::DataType<double>::type);
-              cv::Mat dist;
-              cam.at<double>(0, 0) = z;
-              cam.at<double>(1, 1) = z;
-              cv::Mat R(3, 1, cv::DataType<double>::type);
-              cv::Mat T(3, 1, cv::DataType<double>::type);
-              cv::Mat C(3, 3, cv::DataType<double>::type);
-              if (!cv::solvePnPRansac(obj, img, cam, dist, R, T,  false,
-                100, 8.0, 0.99, cv::noArray(), cv::SOLVEPNP_UPNP)) continue;
-              cv::Rodrigues(R, C);
-              Eigen::Matrix3d rot;
-              for (size_t r = 0; r < 3; r++)
-                for (size_t c = 0; c < 3; c++)
-                  rot(r, c) = C.at<double>(r, c);
-              // Get the transform from the trackng to lighthouse frame
-              Eigen::Affine3d lTt;
-              lTt.translation()[0] = T.at<double>(0, 0);
-              lTt.translation()[1] = T.at<double>(1, 0);
-              lTt.translation()[2] = T.at<double>(2, 0);
-              lTt.linear() = rot;
-              // This is a great initial estimate of the true location
-              Eigen::Affine3d obs;
-              obs = CeresToEigen(wTv_)                  // vive -> world
-                  * CeresToEigen(lt->second.vTl)        // lighthouse -> vive
-                  * lTt                                 // tracking -> lighthouse
-                  * CeresToEigen(tt->second.tTh)        // head -> tracking
-                  * CeresToEigen(tt->second.bTh, true); // body -> head
-              // Set the initial estimate to this pose
-              Eigen::AngleAxisd aa(obs.linear());
-              wTb[bt->first][0] = obs.translation()[0];
-              wTb[bt->first][1] = obs.translation()[1];
-              wTb[bt->first][2] = obs.translation()[2];
-              wTb[bt->first][3] = aa.angle() * aa.axis()[0];
-              wTb[bt->first][4] = aa.angle() * aa.axis()[1];
-              wTb[bt->first][5] = aa.angle() * aa.axis()[2];
+              wTb.erase(bt->time);
+              continue;
             }
             // Recursive calculation of mean
-            height.Feed(wTb[bt->first][2]);
-            // Add the cost function
-            ceres::CostFunction* cost = new ceres::AutoDiffCostFunction<GroupCost,
-              ceres::DYNAMIC, 6, 6, 2, 1, 2, 1, 6, 6, NUM_SENSORS * 6,
-                NUM_PARAMS * 2>(new GroupCost(group), group.size());
-            // Add the residual block
-            problem.AddResidualBlock(cost, new ceres::HuberLoss(1.0),
-              reinterpret_cast<double*>(wTv_),
-              reinterpret_cast<double*>(lt->second.vTl),
-              reinterpret_cast<double*>(&wTb[bt->first][0]),
-              reinterpret_cast<double*>(&wTb[bt->first][2]),
-              reinterpret_cast<double*>(&wTb[bt->first][3]),
-              reinterpret_cast<double*>(&wTb[bt->first][5]),
-              reinterpret_cast<double*>(tt->second.bTh),
-              reinterpret_cast<double*>(tt->second.tTh),
-              reinterpret_cast<double*>(tt->second.sensors),
-              reinterpret_cast<double*>(lt->second.params));
+            height.Feed(wTb[bt->time][2]);
+            // Add the light residual blocks
+            AddLightCost(problem, group, analytic_, correct_, seg.wTv,
+              lt->second.vTl, wTb[bt->time], tt->second.bTh, tt->second.tTh,
+              tt->second.sensors, lt->second.params);
             // If we do not want the trajectory refined then mark all parts of
             // the trajectory as constant blocks
             if (!refine_trajectory_) {
-              problem.SetParameterBlockConstant(&wTb[bt->first][0]);
-              problem.SetParameterBlockConstant(&wTb[bt->first][2]);
-              problem.SetParameterBlockConstant(&wTb[bt->first][3]);
-              problem.SetParameterBlockConstant(&wTb[bt->first][5]);
+              problem.SetParameterBlockConstant(&wTb[bt->time][0]);
+              problem.SetParameterBlockConstant(&wTb[bt->time][2]);
+              problem.SetParameterBlockConstant(&wTb[bt->time][3]);
+              problem.SetParameterBlockConstant(&wTb[bt->time][5]);
             } 
             // If we are forcing 3D, then set the pitch and roll
             if (force2d_) {
-              wTb[bt->first][3] = 0.0;    // Pitch
-              wTb[bt->first][4] = 0.0;    // Roll
-              problem.SetParameterBlockConstant(&wTb[bt->first][2]);
-              problem.SetParameterBlockConstant(&wTb[bt->first][3]);
+              wTb[bt->time][3] = 0.0;    // Pitch
+              wTb[bt->time][4] = 0.0;    // Roll
+              problem.SetParameterBlockConstant(&wTb[bt->time][2]);
+              problem.SetParameterBlockConstant(&wTb[bt->time][3]);
             }
             // If we have a previous node, then link with a motion cost
             if (smoothing_ > 0) {
-              std::map<ros::Time, double[6]>::iterator c = wTb.find(bt->first);
+              std::map<ros::Time, double[6]>::iterator c = wTb.find(bt->time);
               std::map<ros::Time, double[6]>::iterator p = std::prev(c);
               if (c != wTb.end() && p != c) {
                 // Create a cost function to represent motion
                 ceres::CostFunction* cost = new ceres::AutoDiffCostFunction
-                      <MotionCost, 6, 2, 1, 2, 1, 2, 1, 2, 1>(new MotionCost());
+                      <MotionCost, 6, 2, 1, 2, 1, 2, 1, 2, 1>(new MotionCost(smoothing_));
                 // Add a residual block for error
                 problem.AddResidualBlock(cost, new ceres::HuberLoss(1.0),
                   reinterpret_cast<double*>(&p->second[0]),  // pos: xy
@@ -456,17 +417,21 @@ bool Solve() {
           problem.SetParameterBlockConstant(tt->second.bTh);
         if (!refine_head_)
           problem.SetParameterBlockConstant(tt->second.tTh);
-        if (!refine_sensors_)
-          problem.SetParameterBlockConstant(tt->second.sensors);
+        if (!refine_sensors_) {
+          std::vector<std::pair<double*, int>> blocks =
+            SensorBlocks(problem, tt->second.sensors);
+          for (size_t i = 0; i < blocks.size(); i++)
+            problem.SetParameterBlockConstant(blocks[i].first);
+        }
       }
        // Fix lighthouse parameters
-      if (!refine_lighthouses_ || lt == lighthouses_.begin())
+      if (!refine_lighthouses_ || lt == seg.lighthouses.begin())
         problem.SetParameterBlockConstant(lt->second.vTl);
       if (!refine_params_)
         problem.SetParameterBlockConstant(lt->second.params);
     }
     if (!refine_registration_)
-      problem.SetParameterBlockConstant(wTv_);
+      problem.SetParameterBlockConstant(seg.wTv);
 
     // If we have a fixed the height use the mean height estimate
     if (force2d_) {
@@ -478,7 +443,7 @@ bool Solve() {
     // Lighthouse after solving
     {
       LighthouseMap::iterator lt;
-      for (lt = lighthouses_.begin(); lt != lighthouses_.end(); lt++) {
+      for (lt = seg.lighthouses.begin(); lt != seg.lighthouses.end(); lt++) {
         ROS_INFO_STREAM("Lighthouse BEFORE solving: " << lt->first);
         ROS_INFO_STREAM("- px: " << lt->second.vTl[0]);
         ROS_INFO_STREAM("- py: " << lt->second.vTl[1]);
@@ -492,7 +457,7 @@ bool Solve() {
     // Extrinsocs before solving
     {
       TrackerMap::iterator tt;
-      for (tt = trackers_.begin(); tt != trackers_.end(); tt++) {
+      for (tt = seg.trackers.begin(); tt != seg.trackers.end(); tt++) {
         ROS_INFO_STREAM("Extrinsics BEFORE solving: " << tt->first);
         ROS_INFO_STREAM("- px: " << tt->second.bTh[0]);
         ROS_INFO_STREAM("- py: " << tt->second.bTh[1]);
@@ -506,7 +471,7 @@ bool Solve() {
     // Parameters before solving
     {
       LighthouseMap::iterator lt;
-      for (lt = lighthouses_.begin(); lt != lighthouses_.end(); lt++) {
+      for (lt = seg.lighthouses.begin(); lt != seg.lighthouses.end(); lt++) {
         ROS_INFO_STREAM("Parameters BEFORE solving: " << lt->first);
         for (uint8_t a = 0; a < 2; a++) {
           ROS_INFO_STREAM("AXIS " << a);
@@ -521,8 +486,11 @@ bool Solve() {
 
     // Now solve the problem
     ROS_INFO_STREAM("Solving optimization problem with " << count << " obs");
+    ceres::Solver::Options options = options_;
+    ProgressCallback callback;
+    options.callbacks.push_back(&callback);
     ceres::Solver::Summary summary;
-    ceres::Solve(options_, &problem, &summary);
+    ceres::Solve(options, &problem, &summary);
     if (summary.IsSolutionUsable()) {
       ROS_INFO("Usable solution found.");
       if (visualize_) {
@@ -531,26 +499,8 @@ bool Solve() {
         msg.header.stamp = ros::Time::now();
         msg.header.frame_id = frame_world_;
         std::map<ros::Time, double[6]>::iterator it;
-        for (it = wTb.begin(); it != wTb.end(); it++) {
-          geometry_msgs::PoseStamped ps;
-          Eigen::Vector3d v(it->second[3], it->second[4], it->second[5]);
-          Eigen::AngleAxisd aa;
-          if (v.norm() > 0) {
-            aa.angle() = v.norm();
-            aa.axis() = v.normalized();
-          }
-          Eigen::Quaterniond q(aa);
-          ps.header.stamp = it->first;
-          ps.header.frame_id = frame_world_;
-          ps.pose.position.x = it->second[0];
-          ps.pose.position.y = it->second[1];
-          ps.pose.position.z = it->second[2];
-          ps.pose.orientation.w = q.w();
-          ps.pose.orientation.x = q.x();
-          ps.pose.orientation.y = q.y();
-          ps.pose.orientation.z = q.z();
-          msg.poses.push_back(ps);
-        }
+        for (it = wTb.begin(); it != wTb.end(); it++)
+          msg.poses.push_back(ToPose(it->first, it->second));
         pub_path_.publish(msg);
       }
       ROS_INFO("- Writing performance to file");
@@ -578,31 +528,14 @@ bool Solve() {
                   << ct->second[4] << ","
                   << ct->second[5] << std::endl;
           // Add the pose
-          geometry_msgs::PoseStamped ps;
-          Eigen::Vector3d v(ct->second[3], ct->second[4], ct->second[5]);
-          Eigen::AngleAxisd aa;
-          if (v.norm() > 0) {
-            aa.angle() = v.norm();
-            aa.axis() = v.normalized();
-          }
-          Eigen::Quaterniond q(aa);
-          ps.header.stamp = ct->first;
-          ps.header.frame_id = frame_world_;
-          ps.pose.position.x = ct->second[0];
-          ps.pose.position.y = ct->second[1];
-          ps.pose.position.z = ct->second[2];
-          ps.pose.orientation.w = q.w();
-          ps.pose.orientation.x = q.x();
-          ps.pose.orientation.y = q.y();
-          ps.pose.orientation.z = q.z();
-          msg.poses.push_back(ps);
+          msg.poses.push_back(ToPose(ct->first, ct->second));
         }
         outfile.close();
         pub_ekf_.publish(msg);
       }
       // Update transforms so we can see the solution iun rviz
       SendTransforms(frame_world_, frame_vive_, frame_body_,
-        wTv_, lighthouses_, trackers_);
+        seg.wTv, seg.lighthouses, seg.trackers);
     } else {
       ROS_WARN("Solution is not usable.");
       return false;
@@ -612,7 +545,7 @@ bool Solve() {
   // Lighthouse after solving
   {
     LighthouseMap::iterator lt;
-    for (lt = lighthouses_.begin(); lt != lighthouses_.end(); lt++) {
+    for (lt = seg.lighthouses.begin(); lt != seg.lighthouses.end(); lt++) {
       ROS_INFO_STREAM("Lighthouse AFTER solving: " << lt->first);
       ROS_INFO_STREAM("- px: " << lt->second.vTl[0]);
       ROS_INFO_STREAM("- py: " << lt->second.vTl[1]);
@@ -626,7 +559,7 @@ bool Solve() {
   // Extrinsics after solving
   {
     TrackerMap::iterator tt;
-    for (tt = trackers_.begin(); tt != trackers_.end(); tt++) {
+    for (tt = seg.trackers.begin(); tt != seg.trackers.end(); tt++) {
       ROS_INFO_STREAM("Extrinsics AFTER solving: " << tt->first);
       ROS_INFO_STREAM("- px: " << tt->second.bTh[0]);
       ROS_INFO_STREAM("- py: " << tt->second.bTh[1]);
@@ -640,7 +573,7 @@ bool Solve() {
   // Parameters before solving
   {
     LighthouseMap::iterator lt;
-    for (lt = lighthouses_.begin(); lt != lighthouses_.end(); lt++) {
+    for (lt = seg.lighthouses.begin(); lt != seg.lighthouses.end(); lt++) {
       ROS_INFO_STREAM("Parameters AFTER solving: " << lt->first);
       for (uint8_t a = 0; a < 2; a++) {
         ROS_INFO_STREAM("AXIS " << a);
@@ -657,21 +590,316 @@ bool Solve() {
   return true;
 }
 
+// ONLINE SLIDING WINDOW
+
+// In online mode the problem is kept between solves. Light is binned into
+// epochs of width "resolution", and each closed epoch adds one pose and its
+// residual blocks. Once the window is full the oldest pose is marginalized by
+// dropping its light and holding it constant, so it anchors the next pose
+// through the motion cost. The calibration blocks being refined carry a prior
+// centred on their last solution, which stands in for the information from
+// light that has left the window.
+
+// A pose in the sliding window
+struct Epoch {
+  double wTb[6];                                  // Body -> world
+  std::vector<ceres::ResidualBlockId> residuals;  // Light residuals
+  bool anchor;                                    // Marginalized pose
+};
+typedef std::map<ros::Time, Epoch> EpochMap;
+
+// Light samples for one epoch, by tracker, lighthouse, sensor and axis
+typedef std::map<std::string,
+  std::map<std::string,
+    std::map<uint8_t,
+      std::map<uint8_t, std::vector<double>>
+    >
+  >
+> EpochData;
+
+// Linear penalty on moving a parameter block away from an anchor
+class PriorCost : public ceres::CostFunction {
+ public:
+  PriorCost(double const* anchor, int size, double weight)
+    : anchor_(anchor), weight_(weight) {
+    set_num_residuals(size);
+    mutable_parameter_block_sizes()->push_back(size);
+  }
+  // Called by ceres-solver to calculate error
+  bool Evaluate(double const* const* parameters, double* residuals,
+    double** jacobians) const {
+    int n = num_residuals();
+    for (int i = 0; i < n; i++)
+      residuals[i] = weight_ * (parameters[0][i] - anchor_[i]);
+    if (jacobians && jacobians[0]) {
+      for (int i = 0; i < n * n; i++)
+        jacobians[0][i] = 0.0;
+      for (int i = 0; i < n; i++)
+        jacobians[0][i * n + i] = weight_;
+    }
+    return true;
+  }
+ // Internal variables
+ private:
+  double const* anchor_;
+  double weight_;
+};
+
+std::unique_ptr<ceres::Problem> online_problem_;      // Persistent problem
+EpochMap online_epochs_;                              // Poses in the window
+EpochData online_data_;                               // Epoch being binned
+ros::Time online_bin_;                                // Time of that epoch
+std::map<double*, std::vector<double>> online_priors_;  // Prior anchors
+
+// Hold a calibration block constant, or give it a prior if it's refined
+void OnlineBlock(double* block, int size, bool refine) {
+  if (!refine) {
+    online_problem_->SetParameterBlockConstant(block);
+    return;
+  }
+  if (online_priors_.count(block))
+    return;
+  std::vector<double> & anchor = online_priors_[block];
+  anchor.assign(block, block + size);
+  online_problem_->AddResidualBlock(
+    new PriorCost(anchor.data(), size, online_prior_), nullptr, block);
+}
+
+// Drop the oldest pose once the window is full
+void OnlineMarginalize() {
+  while (online_epochs_.size() > static_cast<size_t>(online_window_)) {
+    EpochMap::iterator et = online_epochs_.begin();
+    // The previous anchor is no longer needed
+    if (et->second.anchor) {
+      online_problem_->RemoveParameterBlock(&et->second.wTb[0]);
+      online_problem_->RemoveParameterBlock(&et->second.wTb[2]);
+      online_problem_->RemoveParameterBlock(&et->second.wTb[3]);
+      online_problem_->RemoveParameterBlock(&et->second.wTb[5]);
+      online_epochs_.erase(et);
+      continue;
+    }
+    // The oldest pose forgets its light and becomes the new anchor
+    std::vector<ceres::ResidualBlockId>::iterator rt;
+    for (rt = et->second.residuals.begin();
+      rt != et->second.residuals.end(); rt++)
+      online_problem_->RemoveResidualBlock(*rt);
+    et->second.residuals.clear();
+    online_problem_->SetParameterBlockConstant(&et->second.wTb[0]);
+    online_problem_->SetParameterBlockConstant(&et->second.wTb[2]);
+    online_problem_->SetParameterBlockConstant(&et->second.wTb[3]);
+    online_problem_->SetParameterBlockConstant(&et->second.wTb[5]);
+    et->second.anchor = true;
+    // The anchor is only counted if it's still linked by a motion cost
+    if (smoothing_ <= 0)
+      continue;
+    break;
+  }
+}
+
+// Add the epoch that has just finished binning to the window
+void OnlineEpoch() {
+  if (!online_problem_) {
+    ceres::Problem::Options options;
+    options.enable_fast_removal = true;
+    online_problem_.reset(new ceres::Problem(options));
+  }
+  Epoch & epoch = online_epochs_[online_bin_];
+  epoch.anchor = false;
+  EpochMap::iterator et = online_epochs_.find(online_bin_);
+  EpochMap::iterator pt = (et == online_epochs_.begin() ? et : std::prev(et));
+  bool initialized = false;
+  EpochData::iterator tt;
+  for (tt = online_data_.begin(); tt != online_data_.end(); tt++) {
+    Tracker & tracker = trackers_[tt->first];
+    std::map<std::string, std::map<uint8_t,
+      std::map<uint8_t, std::vector<double>>>>::iterator lt;
+    for (lt = tt->second.begin(); lt != tt->second.end(); lt++) {
+      Lighthouse & lighthouse = lighthouses_[lt->first];
+      std::vector<cv::Point3f> obj;
+      std::vector<cv::Point2f> img;
+      Group group;
+      for (uint8_t s = 0; s < NUM_SENSORS; s++) {
+        double angles[2];
+        if (!Mean(lt->second[s][0], angles[0]) ||
+            !Mean(lt->second[s][1], angles[1]))
+          continue;
+        group[std::pair<uint16_t, uint8_t>(s, 0)] = angles[0];
+        group[std::pair<uint16_t, uint8_t>(s, 1)] = angles[1];
+        Correct(lighthouse, angles, correct_);
+        obj.push_back(cv::Point3f(
+          tracker.sensors[s * 6 + 0],
+          tracker.sensors[s * 6 + 1],
+          tracker.sensors[s * 6 + 2]));
+        img.push_back(cv::Point2f(FOCAL * tan(angles[0]),
+          FOCAL * tan(angles[1])));
+      }
+      if (obj.size() < 4)
+        continue;
+      // Warm start from the previous pose, or bootstrap with PNP
+      if (!initialized) {
+        if (pt != et) {
+          for (size_t i = 0; i < 6; i++)
+            epoch.wTb[i] = pt->second.wTb[i];
+        } else if (!EstimatePose(lighthouse, tracker, wTv_, obj, img,
+          epoch.wTb)) {
+          continue;
+        }
+        if (force2d_) {
+          epoch.wTb[3] = 0.0;    // Pitch
+          epoch.wTb[4] = 0.0;    // Roll
+        }
+        initialized = true;
+      }
+      AddLightCost(*online_problem_, group, analytic_, correct_, wTv_,
+        lighthouse.vTl, epoch.wTb, tracker.bTh, tracker.tTh, tracker.sensors,
+        lighthouse.params, &epoch.residuals);
+      // Fix or add priors to the calibration, as in the batch solution
+      OnlineBlock(wTv_, 6, refine_registration_);
+      OnlineBlock(lighthouse.vTl, 6, refine_lighthouses_
+        && lt->first != lighthouses_.begin()->first);
+      OnlineBlock(lighthouse.params, NUM_PARAMS * 2, refine_params_);
+      OnlineBlock(tracker.bTh, 6, refine_extrinsics_);
+      OnlineBlock(tracker.tTh, 6, refine_head_);
+      std::vector<std::pair<double*, int>> blocks =
+        SensorBlocks(*online_problem_, tracker.sensors);
+      for (size_t i = 0; i < blocks.size(); i++)
+        OnlineBlock(blocks[i].first, blocks[i].second, refine_sensors_);
+    }
+  }
+  online_data_.clear();
+  // Nothing in this epoch was good enough to estimate a pose
+  if (!initialized) {
+    online_epochs_.erase(et);
+    return;
+  }
+  // Constrain the trajectory like the batch solution does
+  if (!refine_trajectory_) {
+    online_problem_->SetParameterBlockConstant(&epoch.wTb[0]);
+    online_problem_->SetParameterBlockConstant(&epoch.wTb[2]);
+    online_problem_->SetParameterBlockConstant(&epoch.wTb[3]);
+    online_problem_->SetParameterBlockConstant(&epoch.wTb[5]);
+  }
+  if (force2d_) {
+    online_problem_->SetParameterBlockConstant(&epoch.wTb[2]);
+    online_problem_->SetParameterBlockConstant(&epoch.wTb[3]);
+  }
+  // Link to the previous pose with a motion cost
+  if (smoothing_ > 0 && pt != et) {
+    ceres::CostFunction* cost = new ceres::AutoDiffCostFunction
+          <MotionCost, 6, 2, 1, 2, 1, 2, 1, 2, 1>(new MotionCost(smoothing_));
+    online_problem_->AddResidualBlock(cost, new ceres::HuberLoss(1.0),
+      reinterpret_cast<double*>(&pt->second.wTb[0]),  // pos: xy
+      reinterpret_cast<double*>(&pt->second.wTb[2]),  // pos: z
+      reinterpret_cast<double*>(&pt->second.wTb[3]),  // rot: xy
+      reinterpret_cast<double*>(&pt->second.wTb[5]),  // rot: z
+      reinterpret_cast<double*>(&epoch.wTb[0]),       // pos: xy
+      reinterpret_cast<double*>(&epoch.wTb[2]),       // pos: z
+      reinterpret_cast<double*>(&epoch.wTb[3]),       // rot: xy
+      reinterpret_cast<double*>(&epoch.wTb[5]));      // rot: z
+  }
+  // Keep the window bounded
+  OnlineMarginalize();
+}
+
+// Bin light into the current epoch, closing it when a later one starts
+void OnlineLight(deepdive_ros::Light const& light) {
+  ros::Time t = ros::Time(round(light.header.stamp.toSec() / res_) * res_);
+  if (t != online_bin_ && !online_data_.empty()) {
+    if (t < online_bin_) {
+      ROS_INFO_STREAM_THROTTLE(1, "Light arrived too late for its epoch");
+      return;
+    }
+    OnlineEpoch();
+  }
+  online_bin_ = t;
+  std::vector<deepdive_ros::Pulse>::const_iterator pt;
+  for (pt = light.pulses.begin(); pt != light.pulses.end(); pt++)
+    online_data_[light.header.frame_id][light.lighthouse]
+      [pt->sensor][light.axis].push_back(pt->angle);
+}
+
+// Re-solve the window, starting from the last solution
+void OnlineTimerCallback(ros::TimerEvent const& event) {
+  if (!online_problem_ || online_epochs_.size() < 2)
+    return;
+  ceres::Solver::Options options = options_;
+  options.max_solver_time_in_seconds =
+    std::min(options_.max_solver_time_in_seconds, 1.0 / online_rate_);
+  ceres::Solver::Summary summary;
+  ceres::Solve(options, online_problem_.get(), &summary);
+  if (!summary.IsSolutionUsable()) {
+    ROS_WARN("Window solution is not usable.");
+    return;
+  }
+  ROS_INFO_STREAM("Window solved over " << online_epochs_.size()
+    << " poses in " << summary.total_time_in_seconds << " seconds");
+  // Re-centre the priors on the new calibration
+  std::map<double*, std::vector<double>>::iterator it;
+  for (it = online_priors_.begin(); it != online_priors_.end(); it++)
+    it->second.assign(it->first, it->first + it->second.size());
+  // Keep the correction tables in step with refined lighthouse parameters
+  if (refine_params_ && correct_) {
+    LighthouseMap::iterator lt;
+    for (lt = lighthouses_.begin(); lt != lighthouses_.end(); lt++)
+      lt->second.correction.Build(lt->second.params);
+  }
+  // Show the window trajectory
+  if (visualize_) {
+    nav_msgs::Path msg;
+    msg.header.stamp = ros::Time::now();
+    msg.header.frame_id = frame_world_;
+    EpochMap::iterator et;
+    for (et = online_epochs_.begin(); et != online_epochs_.end(); et++)
+      msg.poses.push_back(ToPose(et->first, et->second.wTb));
+    pub_path_.publish(msg);
+  }
+  // Update transforms so we can see the solution iun rviz
+  SendTransforms(frame_world_, frame_vive_, frame_body_,
+    wTv_, lighthouses_, trackers_);
+}
+
+// BACKGROUND SOLVING
+
+// Write the solution of a segment back to the calibration, which the solver
+// has locked, keeping whether each lighthouse and tracker is ready as the
+// callbacks last saw it
+void Commit(Segment const& seg) {
+  LighthouseMap::const_iterator lt;
+  for (lt = seg.lighthouses.begin(); lt != seg.lighthouses.end(); lt++) {
+    LighthouseMap::iterator it = lighthouses_.find(lt->first);
+    if (it == lighthouses_.end())
+      continue;
+    bool ready = it->second.ready;
+    it->second = lt->second;
+    it->second.ready = ready;
+  }
+  TrackerMap::const_iterator tt;
+  for (tt = seg.trackers.begin(); tt != seg.trackers.end(); tt++) {
+    TrackerMap::iterator it = trackers_.find(tt->first);
+    if (it == trackers_.end())
+      continue;
+    bool ready = it->second.ready;
+    it->second = tt->second;
+    it->second.ready = ready;
+  }
+  for (size_t i = 0; i < 6; i++)
+    wTv_[i] = seg.wTv[i];
+}
+
 // MESSAGE CALLBACKS
 
-void LightCallback(deepdive_ros::Light::ConstPtr const& msg) {
-  // Reset the timer use din offline mode to determine the end of experiment
-  timer_.stop();
-  timer_.start();
+// Add light that was received at a given time
+void AddLight(ros::Time const& t, deepdive_ros::Light const& msg) {
+  std::lock_guard<std::mutex> lock(solver_.Mutex());
   // Check that we are recording and that the tracker/lighthouse is ready
   if (!recording_ ||
-    trackers_.find(msg->header.frame_id) == trackers_.end() ||
-    lighthouses_.find(msg->lighthouse) == lighthouses_.end() ||
-    !trackers_[msg->header.frame_id].ready ||
-    !lighthouses_[msg->lighthouse].ready) return;
+    trackers_.find(msg.header.frame_id) == trackers_.end() ||
+    lighthouses_.find(msg.lighthouse) == lighthouses_.end() ||
+    !trackers_[msg.header.frame_id].ready ||
+    !lighthouses_[msg.lighthouse].ready) return;
   // Copy over the data
   size_t deleted = 0;
-  deepdive_ros::Light data = *msg;
+  deepdive_ros::Light data = msg;
   std::vector<deepdive_ros::Pulse>::iterator it = data.pulses.end();
   while (it-- > data.pulses.begin()) {
     if (it->angle > thresh_angle_ / 57.2958 &&    // Check angle
@@ -683,43 +911,71 @@ void LightCallback(deepdive_ros::Light::ConstPtr const& msg) {
   if (data.pulses.size() < thresh_count_)
     return; 
   // Add the data
-  measurements_[ros::Time::now()].light = data;
+  if (online_)
+    OnlineLight(data);
+  else
+    measurements_.Add(t, data);
 }
 
-void CorrectionCallback(tf2_msgs::TFMessage::ConstPtr const& msg) {
+void LightCallback(deepdive_ros::Light::ConstPtr const& msg) {
+  // Reset the timer use din offline mode to determine the end of experiment
+  if (!online_) {
+    timer_.stop();
+    timer_.start();
+  }
+  AddLight(ros::Time::now(), *msg);
+}
+
+// Called when a batch of packed light arrives
+void PackedCallback(deepdive_ros::Packed::ConstPtr const& msg) {
+  // Reset the timer used in offline mode to determine the end of experiment
+  if (!online_) {
+    timer_.stop();
+    timer_.start();
+  }
+  BagHandlers handlers;
+  handlers.light = AddLight;
+  if (!Unpack(*msg, handlers))
+    ROS_WARN("Ignoring an inconsistent packed message");
+}
+
+// Add corrections that were received at a given time
+void AddCorrections(ros::Time const& t, tf2_msgs::TFMessage const& msg) {
   // Check that we are recording and that the tracker/lighthouse is ready
   if (!recording_)
     return;
+  std::lock_guard<std::mutex> lock(solver_.Mutex());
   std::vector<geometry_msgs::TransformStamped>::const_iterator it;
-  for (it = msg->transforms.begin(); it != msg->transforms.end(); it++) {
+  for (it = msg.transforms.begin(); it != msg.transforms.end(); it++) {
     if (it->header.frame_id == frame_world_ &&
         it->child_frame_id == frame_body_) {
-      corrections_[ros::Time::now()] = *it;
+      corrections_[t] = *it;
     }
   }
 }
 
+void CorrectionCallback(tf2_msgs::TFMessage::ConstPtr const& msg) {
+  AddCorrections(ros::Time::now(), *msg);
+}
+
+// The first trigger starts recording. Every later one ends the segment and
+// solves it in the background, while the next segment is recorded into the
+// buffers that the last solve left empty. Progress goes to "/progress".
 bool TriggerCallback(std_srvs::Trigger::Request  &req,
                      std_srvs::Trigger::Response &res)
 {
+  if (online_) {
+    res.success = false;
+    res.message = "The window is solved continuously in online mode.";
+    return true;
+  }
   if (!recording_) {
+    recording_ = true;
     res.success = true;
     res.message = "Recording started.";
+    return true;
   }
-  if (recording_) {
-    // Solve the problem
-    res.success = Solve();
-    if (res.success)
-      res.message = "Recording stopped. Solution found.";
-    else
-      res.message = "Recording stopped. Solution not found.";
-    // Clear all the data and corrections
-    measurements_.clear();
-    corrections_.clear();
-  }
-  // Toggle recording state
-  recording_ = !recording_;
-  // Success
+  res.success = solver_.Trigger(res.message);
   return true;
 }
 
@@ -728,6 +984,44 @@ void TimerCallback(ros::TimerEvent const& event) {
   std_srvs::Trigger::Request req;
   std_srvs::Trigger::Response res;
   TriggerCallback(req, res);
+  // Try again once the last segment has been solved
+  if (!res.success && solver_.Busy()) {
+    timer_.stop();
+    timer_.start();
+  }
+}
+
+// Stream a bag straight into the bins, and then solve
+void ReplayBag() {
+  ros::Time next;
+  BagHandlers handlers;
+  handlers.trackers = [](deepdive_ros::Trackers::ConstPtr const& msg) {
+    solver_.TrackersCallback(msg);
+  };
+  handlers.lighthouses = [](deepdive_ros::Lighthouses::ConstPtr const& msg) {
+    solver_.LighthousesCallback(msg);
+  };
+  handlers.light = [&next](ros::Time const& t,
+    deepdive_ros::Light const& msg) {
+    AddLight(t, msg);
+    // Solve the window at the configured rate of bag time
+    if (online_ && t >= next) {
+      OnlineTimerCallback(ros::TimerEvent());
+      next = t + ros::Duration(1.0 / online_rate_);
+    }
+    // The bag is read in time order, so closed bins can be reduced early
+    if (measurements_.Samples() > COMPACT_SAMPLES)
+      measurements_.Compact(res_);
+  };
+  // Only the last correction in each bin is used, so only keep that one
+  handlers.tf = [](ros::Time const& t, tf2_msgs::TFMessage const& msg) {
+    AddCorrections(ros::Time(round(t.toSec() / res_) * res_), msg);
+  };
+  if (!ReadBag(bag_, handlers))
+    return;
+  if (online_)
+    return;
+  TimerCallback(ros::TimerEvent());
 }
 
 // Called when a new lighthouse appears
@@ -790,10 +1084,14 @@ void NewTrackerCallback(TrackerMap::iterator tracker) {
 
 // MAIN ENTRY POINT
 
-int main(int argc, char **argv) {
-  // Initialize ROS and create node handle
-  ros::init(argc, argv, "deepdive_registration");
-  ros::NodeHandle nh("~");
+// Subscriptions, services and timers, which live as long as the node
+std::vector<ros::Subscriber> subs_;
+ros::ServiceServer service_;
+ros::Timer replay_timer_;
+
+// Read the parameters and connect to the data. The solver is not thread-safe,
+// so the handle must call back from a single thread.
+bool Setup(ros::NodeHandle & nh) {
 
   // If we are in offline mode when we will replay the data back at 10x the
   // speed, using it all to find a calibration solution for both the body
@@ -805,6 +1103,29 @@ int main(int argc, char **argv) {
     recording_ = true;
   }
 
+  // A bag can also be read directly, which is as fast as the disk allows
+  if (!nh.getParam("bag", bag_))
+    bag_ = "";
+  if (!bag_.empty()) {
+    ROS_INFO_STREAM("Reading light and corrections from " << bag_);
+    recording_ = true;
+  }
+
+  // In online mode a sliding window is refined continuously as light arrives,
+  // instead of solving over everything once recording stops.
+  if (!nh.getParam("online/enabled", online_))
+    online_ = false;
+  if (!nh.getParam("online/window", online_window_))
+    online_window_ = 50;
+  if (!nh.getParam("online/rate", online_rate_))
+    online_rate_ = 1.0;
+  if (!nh.getParam("online/prior", online_prior_))
+    online_prior_ = 1.0;
+  if (online_) {
+    ROS_INFO("We are in online mode. Refining over a sliding window.");
+    recording_ = true;
+  }
+
   // Get the calibration file
   if (!nh.getParam("calfile", calfile_))
     ROS_FATAL("Failed to get the calfile file.");
@@ -835,6 +1156,10 @@ int main(int argc, char **argv) {
   if (!nh.getParam("thresholds/duration", thresh_duration_))
     ROS_FATAL("Failed to get thresholds/duration parameter.");
 
+  // Number of threads used to estimate initial poses in parallel
+  if (!nh.getParam("threads", threads_))
+    threads_ = 0;
+
   // Whether to apply light corrections
   if (!nh.getParam("correct", correct_))
     ROS_FATAL("Failed to get correct parameter.");
@@ -873,6 +1198,8 @@ int main(int argc, char **argv) {
     ROS_FATAL("Failed to get the solver/threads parameter.");
   if (!nh.getParam("solver/debug", options_.minimizer_progress_to_stdout))
     ROS_FATAL("Failed to get the solver/debug parameter.");
+  if (!nh.getParam("solver/analytic", analytic_))
+    analytic_ = true;
 
   // Visualization option
   if (!nh.getParam("visualize", visualize_))
@@ -953,20 +1280,14 @@ int main(int argc, char **argv) {
     wTv_, lighthouses_, trackers_);
 
   // Subscribe to tracker and lighthouse updates
-  ros::Subscriber sub_tracker  = 
-    nh.subscribe<deepdive_ros::Trackers>("/trackers", 1000, std::bind(
-      TrackerCallback, std::placeholders::_1, std::ref(trackers_),
-        NewTrackerCallback));
-  ros::Subscriber sub_lighthouse = 
-    nh.subscribe<deepdive_ros::Lighthouses>("/lighthouses", 1000, std::bind(
-      LighthouseCallback, std::placeholders::_1, std::ref(lighthouses_),
-        NewLighthouseCallback));
-  ros::Subscriber sub_light =
-    nh.subscribe("/light", 1000, LightCallback);
-  ros::Subscriber sub_corrections =
-    nh.subscribe("/tf", 1000, CorrectionCallback);
-  ros::ServiceServer service =
-    nh.advertiseService("/trigger", TriggerCallback);
+  subs_.push_back(nh.subscribe("/trackers", 1000,
+    &SegmentSolver::TrackersCallback, &solver_));
+  subs_.push_back(nh.subscribe("/lighthouses", 1000,
+    &SegmentSolver::LighthousesCallback, &solver_));
+  subs_.push_back(nh.subscribe("/light", 1000, LightCallback));
+  subs_.push_back(nh.subscribe("/packed", 100, PackedCallback));
+  subs_.push_back(nh.subscribe("/tf", 1000, CorrectionCallback));
+  service_ = nh.advertiseService("/trigger", TriggerCallback);
 
   // Publish sensor location and body trajectory 
   pub_sensors_ =
@@ -975,13 +1296,65 @@ int main(int argc, char **argv) {
     nh.advertise<nav_msgs::Path>("/path", 10, true);
   pub_ekf_ =
     nh.advertise<nav_msgs::Path>("/truth", 10, true);
+  solver_.Advertise(nh);
 
   // Setup a timer to automatically trigger solution on end of experiment
   timer_ = nh.createTimer(ros::Duration(1.0), TimerCallback, true, false);
 
+  // Setup a timer to periodically re-solve the sliding window
+  if (online_)
+    online_timer_ = nh.createTimer(ros::Duration(1.0 / online_rate_),
+      OnlineTimerCallback);
+
+  // Read the bag once spinning, if one was given
+  if (!bag_.empty())
+    replay_timer_ = nh.createTimer(ros::Duration(0.1),
+      [](ros::TimerEvent const& event) { ReplayBag(); }, true);
+
+  // Success!
+  return true;
+}
+
+#ifdef DEEPDIVE_NODELET
+
+namespace deepdive_ros {
+
+// The refinement as a nodelet, which receives light from a bridge in the same
+// manager as shared pointers, without serialization
+class RefineNodelet : public nodelet::Nodelet {
+ public:
+  ~RefineNodelet() {
+    solver_.Stop();
+  }
+ private:
+  void onInit() override {
+    Setup(getPrivateNodeHandle());
+  }
+};
+
+}  // namespace deepdive_ros
+
+PLUGINLIB_EXPORT_CLASS(deepdive_ros::RefineNodelet, nodelet::Nodelet)
+
+#else
+
+int main(int argc, char **argv) {
+  // Initialize ROS and create node handle
+  ros::init(argc, argv, "deepdive_registration");
+  ros::NodeHandle nh("~");
+
+  // Read the parameters and connect to the data
+  if (!Setup(nh))
+    return 1;
+
   // Block until safe shutdown
   ros::spin();
 
+  // Stop any solve that is still running
+  solver_.Stop();
+
   // Success!
   return 0;
-}
\ No newline at end of file
+}
+
+#endif
\ No newline at end of file
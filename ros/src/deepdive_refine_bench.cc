@@ -0,0 +1,308 @@
+/*
+  This benchmark bundles the light in a bag into epochs like the refinement
+  does, and builds the same problem from autodiff group costs and from the
+  analytic costs. It checks that the jacobians agree, with and without the
+  lighthouse corrections, and fails if they don't. It then compares the time
+  taken to evaluate and solve each problem.
+
+  Usage: deepdive_refine_bench <bag> [resolution] [evaluations] [calibrate]
+*/
+
+// C includes
+#include <cstdio>
+#include <cstdlib>
+
+// C++ includes
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+// Deepdive internal
+#include "deepdive.hh"
+#include "deepdive_cost.hh"
+
+// Smoothing factor for the motion costs
+static constexpr double SMOOTHING = 1.0;
+
+// Largest difference allowed between the autodiff and analytic costs
+static constexpr double TOLERANCE = 1e-6;
+
+// One group of light seen by a tracker in an epoch
+struct Observation {
+  ros::Time stamp;
+  std::string tracker;
+  std::string lighthouse;
+  Group group;
+};
+
+// Everything that is estimated by the problem
+struct Parameters {
+  double wTv[6];
+  LighthouseMap lighthouses;
+  TrackerMap trackers;
+  std::map<std::string, std::map<ros::Time, std::vector<double>>> wTb;
+};
+
+// Read a bag and bundle its light into groups
+static bool Load(std::string const& file, double res, Parameters & p,
+  std::vector<Observation> & observations) {
+  // Every lighthouse and tracker in the bag is added to the problem
+  MeasurementStore store;
+  BagHandlers handlers;
+  handlers.lighthouses = [&p](deepdive_ros::Lighthouses::ConstPtr const& msg) {
+    for (size_t i = 0; i < msg->lighthouses.size(); i++)
+      p.lighthouses[msg->lighthouses[i].serial];
+    LighthouseCallback(msg, p.lighthouses, [](LighthouseMap::iterator) {});
+  };
+  handlers.trackers = [&p](deepdive_ros::Trackers::ConstPtr const& msg) {
+    for (size_t i = 0; i < msg->trackers.size(); i++)
+      p.trackers[msg->trackers[i].serial];
+    TrackerCallback(msg, p.trackers, [](TrackerMap::iterator) {});
+  };
+  handlers.light = [&store](ros::Time const& t,
+    deepdive_ros::Light const& light) {
+    store.Add(t, light);
+  };
+  if (!ReadBag(file, handlers))
+    return false;
+  // Reduce the samples to mean angles, keeping groups with enough sensors
+  LightBins bins;
+  store.Bundle(res, bins);
+  TrackerMap::iterator tt;
+  for (tt = p.trackers.begin(); tt != p.trackers.end(); tt++) {
+    LighthouseMap::iterator lt;
+    for (lt = p.lighthouses.begin(); lt != p.lighthouses.end(); lt++) {
+      LightBins::const_iterator bt, be;
+      store.Find(bins, tt->first, lt->first, bt, be);
+      for (; bt != be; bt++) {
+        Observation obs;
+        obs.stamp = bt->time;
+        obs.tracker = tt->first;
+        obs.lighthouse = lt->first;
+        for (uint8_t s = 0; s < NUM_SENSORS; s++) {
+          if (!bt->Seen(s))
+            continue;
+          obs.group[std::pair<uint16_t, uint8_t>(s, 0)] = bt->angles[s][0];
+          obs.group[std::pair<uint16_t, uint8_t>(s, 1)] = bt->angles[s][1];
+        }
+        if (obs.group.size() < 8)
+          continue;
+        observations.push_back(obs);
+      }
+    }
+  }
+  // Start with every body one meter in front of the vive frame
+  for (size_t i = 0; i < 6; i++)
+    p.wTv[i] = 0.0;
+  for (size_t i = 0; i < observations.size(); i++) {
+    Observation const& obs = observations[i];
+    p.wTb[obs.tracker][obs.stamp] = {0.0, 0.0, 1.0, 0.0, 0.0, 0.0};
+  }
+  return !observations.empty();
+}
+
+// Hold a block constant if it's part of the problem
+static void Fix(ceres::Problem & problem, double* block) {
+  if (problem.HasParameterBlock(block))
+    problem.SetParameterBlockConstant(block);
+}
+
+// Build the same problem as the refinement, using either cost
+static void Build(ceres::Problem & problem, Parameters & p, bool analytic,
+  bool calibrate, std::vector<Observation> const& observations) {
+  for (size_t i = 0; i < observations.size(); i++) {
+    Observation const& obs = observations[i];
+    Lighthouse & lighthouse = p.lighthouses[obs.lighthouse];
+    Tracker & tracker = p.trackers[obs.tracker];
+    AddLightCost(problem, obs.group, analytic, false, p.wTv, lighthouse.vTl,
+      p.wTb[obs.tracker][obs.stamp].data(), tracker.bTh, tracker.tTh,
+      tracker.sensors, lighthouse.params);
+  }
+  // Link sequential poses of each tracker
+  std::map<std::string, std::map<ros::Time, std::vector<double>>>::iterator tt;
+  for (tt = p.wTb.begin(); tt != p.wTb.end(); tt++) {
+    std::map<ros::Time, std::vector<double>>::iterator c, n;
+    for (c = tt->second.begin(); c != tt->second.end(); c++) {
+      n = std::next(c);
+      if (n == tt->second.end())
+        break;
+      ceres::CostFunction* cost = new ceres::AutoDiffCostFunction
+            <MotionCost, 6, 2, 1, 2, 1, 2, 1, 2, 1>(new MotionCost(SMOOTHING));
+      problem.AddResidualBlock(cost, new ceres::HuberLoss(1.0),
+        &c->second[0], &c->second[2], &c->second[3], &c->second[5],
+        &n->second[0], &n->second[2], &n->second[3], &n->second[5]);
+    }
+  }
+  // The registration and first lighthouse are always held
+  Fix(problem, p.wTv);
+  LighthouseMap::iterator lt;
+  for (lt = p.lighthouses.begin(); lt != p.lighthouses.end(); lt++) {
+    if (!calibrate || lt == p.lighthouses.begin())
+      Fix(problem, lt->second.vTl);
+    if (!calibrate)
+      Fix(problem, lt->second.params);
+  }
+  if (calibrate)
+    return;
+  TrackerMap::iterator it;
+  for (it = p.trackers.begin(); it != p.trackers.end(); it++) {
+    Fix(problem, it->second.bTh);
+    Fix(problem, it->second.tTh);
+    std::vector<std::pair<double*, int>> blocks =
+      SensorBlocks(problem, it->second.sensors);
+    for (size_t i = 0; i < blocks.size(); i++)
+      problem.SetParameterBlockConstant(blocks[i].first);
+  }
+}
+
+// Largest difference between the autodiff and analytic jacobians of a group
+static double Compare(Parameters & p, Observation const& obs, bool correct) {
+  Lighthouse & lighthouse = p.lighthouses[obs.lighthouse];
+  Tracker & tracker = p.trackers[obs.tracker];
+  double* wTb = p.wTb[obs.tracker][obs.stamp].data();
+  static const int sizes[10] = {
+    6, 6, 2, 1, 2, 1, 6, 6, NUM_SENSORS * 6, NUM_PARAMS * 2
+  };
+  double const* blocks[10] = { p.wTv, lighthouse.vTl, &wTb[0], &wTb[2],
+    &wTb[3], &wTb[5], tracker.bTh, tracker.tTh, tracker.sensors,
+    lighthouse.params };
+  // Evaluate the whole group with automatic differentiation
+  size_t n = obs.group.size();
+  ceres::AutoDiffCostFunction<GroupCost, ceres::DYNAMIC, 6, 6, 2, 1, 2, 1,
+    6, 6, NUM_SENSORS * 6, NUM_PARAMS * 2> group(
+      new GroupCost(obs.group, correct), n);
+  std::vector<double> residuals(n);
+  std::vector<std::vector<double>> jac(10);
+  double* jacobians[10];
+  for (size_t b = 0; b < 10; b++) {
+    jac[b].resize(n * sizes[b]);
+    jacobians[b] = jac[b].data();
+  }
+  group.Evaluate(blocks, residuals.data(), jacobians);
+  // Evaluate it again with the analytic cost, which has a block per sensor
+  SensorGroupCost sensor(obs.group, correct);
+  std::vector<uint16_t> const& seen = sensor.Sensors();
+  size_t k = seen.size();
+  std::vector<double const*> sblocks(blocks, blocks + 8);
+  for (size_t j = 0; j < k; j++)
+    sblocks.push_back(&tracker.sensors[6 * seen[j]]);
+  sblocks.push_back(lighthouse.params);
+  std::vector<double> sresiduals(n);
+  std::vector<std::vector<double>> sjac(9 + k);
+  std::vector<double*> sjacobians(9 + k);
+  for (size_t b = 0; b < 9 + k; b++) {
+    sjac[b].resize(n * (b < 8 ? sizes[b] : (b < 8 + k ? 3 : sizes[9])));
+    sjacobians[b] = sjac[b].data();
+  }
+  sensor.Evaluate(sblocks.data(), sresiduals.data(), sjacobians.data());
+  // Compare each row, where a sensor block is part of the sensor array
+  double worst = 0.0;
+  for (size_t r = 0; r < n; r++) {
+    worst = std::max(worst, std::fabs(sresiduals[r] - residuals[r]));
+    for (size_t b = 0; b < 8; b++)
+      for (int c = 0; c < sizes[b]; c++)
+        worst = std::max(worst, std::fabs(sjac[b][r * sizes[b] + c]
+          - jac[b][r * sizes[b] + c]));
+    for (int c = 0; c < sizes[9]; c++)
+      worst = std::max(worst, std::fabs(sjac[8 + k][r * sizes[9] + c]
+        - jac[9][r * sizes[9] + c]));
+    for (size_t j = 0; j < k; j++)
+      for (int c = 0; c < 3; c++)
+        worst = std::max(worst, std::fabs(sjac[8 + j][r * 3 + c]
+          - jac[8][r * sizes[8] + 6 * seen[j] + c]));
+  }
+  return worst;
+}
+
+// Give every lighthouse small non-zero parameters, so that the corrections
+// contribute to the comparison whatever the bag holds
+static void Perturb(Parameters & p) {
+  LighthouseMap::iterator lt;
+  for (lt = p.lighthouses.begin(); lt != p.lighthouses.end(); lt++) {
+    for (size_t m = 0; m < NUM_MOTORS; m++) {
+      double sign = (m == 0 ? 1.0 : -1.0);
+      double* params = &lt->second.params[m * NUM_PARAMS];
+      params[PARAM_PHASE] = sign * 0.005;
+      params[PARAM_TILT] = sign * 0.002;
+      params[PARAM_GIB_PHASE] = sign * 0.3;
+      params[PARAM_GIB_MAG] = 0.004;
+      params[PARAM_CURVE] = sign * 0.001;
+    }
+  }
+}
+
+// Time the evaluation and solution of one problem, returning ms/eval
+static double Run(char const* name, Parameters const& initial, bool analytic,
+  bool calibrate, int evaluations,
+  std::vector<Observation> const& observations) {
+  Parameters p = initial;
+  ceres::Problem problem;
+  Build(problem, p, analytic, calibrate, observations);
+  // Residuals and jacobians, as evaluated by every solver iteration
+  double cost;
+  ceres::CRSMatrix jacobian;
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  for (int i = 0; i < evaluations; i++)
+    problem.Evaluate(ceres::Problem::EvaluateOptions(),
+      &cost, nullptr, nullptr, &jacobian);
+  std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+  double eval_ms = std::chrono::duration<double, std::milli>(t1 - t0).count()
+    / evaluations;
+  // Full solution
+  ceres::Solver::Options options;
+  options.linear_solver_type = ceres::SPARSE_NORMAL_CHOLESKY;
+  options.max_num_iterations = 20;
+  ceres::Solver::Summary summary;
+  ceres::Solve(options, &problem, &summary);
+  printf("%-8s %6d residual blocks %10.3f ms/eval %10.3f ms/iteration "
+    "%10.3e final cost\n", name, problem.NumResidualBlocks(), eval_ms,
+    1e3 * summary.total_time_in_seconds / summary.iterations.size(),
+    summary.final_cost);
+  return eval_ms;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    printf("Usage: %s <bag> [resolution] [evaluations] [calibrate]\n", argv[0]);
+    return 1;
+  }
+  double res = (argc > 2 ? atof(argv[2]) : 0.1);
+  int evaluations = (argc > 3 ? atoi(argv[3]) : 100);
+  bool calibrate = (argc > 4 ? atoi(argv[4]) != 0 : false);
+  if (res <= 0 || evaluations <= 0) {
+    printf("Resolution and evaluations must be positive\n");
+    return 1;
+  }
+  Parameters initial;
+  std::vector<Observation> observations;
+  if (!Load(argv[1], res, initial, observations)) {
+    printf("No usable light in %s\n", argv[1]);
+    return 1;
+  }
+  printf("%zu groups from %zu lighthouses and %zu trackers\n",
+    observations.size(), initial.lighthouses.size(), initial.trackers.size());
+  // The two costs must agree before their timing means anything, both with
+  // and without the lighthouse corrections
+  Parameters perturbed = initial;
+  Perturb(perturbed);
+  double worst = 0.0, worst_correct = 0.0;
+  for (size_t i = 0; i < observations.size(); i++) {
+    worst = std::max(worst, Compare(initial, observations[i], false));
+    worst_correct = std::max(worst_correct,
+      Compare(perturbed, observations[i], true));
+  }
+  printf("max jacobian difference %.3e (corrected %.3e)\n",
+    worst, worst_correct);
+  if (worst > TOLERANCE || worst_correct > TOLERANCE) {
+    printf("Analytic and autodiff costs disagree\n");
+    return 1;
+  }
+  double ms_auto =
+    Run("autodiff", initial, false, calibrate, evaluations, observations);
+  double ms_analytic =
+    Run("analytic", initial, true, calibrate, evaluations, observations);
+  printf("speedup  %10.2fx\n", ms_auto / ms_analytic);
+  return 0;
+}
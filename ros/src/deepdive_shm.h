@@ -0,0 +1,146 @@
+/*
+  Shared-memory output of the tracker. When its "shm" parameter is set, the
+  tracker writes the newest state of every body into a POSIX shared memory
+  segment of that name, which any local process can map and read at whatever
+  rate it likes, with no dependency on ROS. For example:
+
+    struct DeepdiveShm const* shm = deepdive_shm_open("/deepdive", 0);
+    struct DeepdiveShmState state;
+    if (shm && deepdive_shm_read(&shm->bodies[0], &state))
+      printf("%f %f %f\n", state.position[0], state.position[1],
+        state.position[2]);
+
+  Each body holds a small ring of slots. The writer fills the slot after the
+  newest one, bracketed by a sequence number that is odd while it is being
+  written, and then advances the head of the body. A reader copies the newest
+  slot, and only has to try again if the writer lapped the whole ring while
+  it was copying. Readers never block the writer, or each other.
+*/
+
+#ifndef DEEPDIVE_SHM_H
+#define DEEPDIVE_SHM_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DEEPDIVE_SHM_MAGIC          0x44445348    // "DDSH"
+#define DEEPDIVE_SHM_VERSION        1
+#define DEEPDIVE_SHM_MAX_BODIES     16
+#define DEEPDIVE_SHM_SLOTS          4             // Must be a power of two
+#define DEEPDIVE_SHM_FRAME_LENGTH   64
+#define DEEPDIVE_SHM_CACHE_LINE     64
+
+// State of a body at one instant, in the world frame
+struct DeepdiveShmState {
+  int64_t stamp;                    // Device time on the host clock (ns)
+  double position[3];               // Position (m)
+  double attitude[4];               // Attitude quaternion (w, x, y, z)
+  double velocity[3];               // Linear velocity (m/s)
+  double omega[3];                  // Angular velocity (rad/s)
+  double pose_covariance[36];       // Row-major, as in geometry_msgs
+  double twist_covariance[36];      // Row-major, as in geometry_msgs
+};
+
+// One slot of the ring of a body
+struct DeepdiveShmSlot {
+  uint32_t sequence;                // Odd while being written
+  struct DeepdiveShmState state;
+} __attribute__((aligned(DEEPDIVE_SHM_CACHE_LINE)));
+
+// Newest states of one body
+struct DeepdiveShmBody {
+  char frame[DEEPDIVE_SHM_FRAME_LENGTH];  // Child frame of the body
+  uint64_t head;                          // Number of states written
+  struct DeepdiveShmSlot slots[DEEPDIVE_SHM_SLOTS];
+} __attribute__((aligned(DEEPDIVE_SHM_CACHE_LINE)));
+
+// The whole segment
+struct DeepdiveShm {
+  uint32_t magic;                   // DEEPDIVE_SHM_MAGIC once initialized
+  uint32_t version;                 // DEEPDIVE_SHM_VERSION
+  uint32_t num_bodies;              // Number of bodies in use
+  struct DeepdiveShmBody bodies[DEEPDIVE_SHM_MAX_BODIES];
+};
+
+// Map a segment, creating and clearing it if it is writable. Returns NULL if
+// it could not be mapped, or if it was not written by this version.
+static inline struct DeepdiveShm * deepdive_shm_open(const char * name,
+  int writable) {
+  int fd = shm_open(name, writable ? (O_CREAT | O_RDWR) : O_RDONLY, 0644);
+  if (fd < 0)
+    return NULL;
+  if (writable && ftruncate(fd, sizeof(struct DeepdiveShm))) {
+    close(fd);
+    return NULL;
+  }
+  void * addr = mmap(NULL, sizeof(struct DeepdiveShm),
+    writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED)
+    return NULL;
+  struct DeepdiveShm * shm = (struct DeepdiveShm *) addr;
+  if (writable) {
+    memset(shm, 0, sizeof(struct DeepdiveShm));
+    shm->version = DEEPDIVE_SHM_VERSION;
+    __atomic_store_n(&shm->magic, DEEPDIVE_SHM_MAGIC, __ATOMIC_RELEASE);
+  } else if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE)
+      != DEEPDIVE_SHM_MAGIC || shm->version != DEEPDIVE_SHM_VERSION) {
+    munmap(addr, sizeof(struct DeepdiveShm));
+    return NULL;
+  }
+  return shm;
+}
+
+// Unmap a segment
+static inline void deepdive_shm_close(struct DeepdiveShm const* shm) {
+  if (shm)
+    munmap((void *) shm, sizeof(struct DeepdiveShm));
+}
+
+// Write a new state of a body (single writer only)
+static inline void deepdive_shm_write(struct DeepdiveShmBody * body,
+  struct DeepdiveShmState const* state) {
+  uint64_t head = __atomic_load_n(&body->head, __ATOMIC_RELAXED);
+  struct DeepdiveShmSlot * slot = &body->slots[head & (DEEPDIVE_SHM_SLOTS - 1)];
+  uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->sequence, sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(&slot->state, state, sizeof(struct DeepdiveShmState));
+  __atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+  __atomic_store_n(&body->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Read the newest state of a body. Returns the number of states written so
+// far, which readers can compare to notice a new state, or 0 if there are none.
+static inline uint64_t deepdive_shm_read(struct DeepdiveShmBody const* body,
+  struct DeepdiveShmState * state) {
+  for (;;) {
+    uint64_t head = __atomic_load_n(&body->head, __ATOMIC_ACQUIRE);
+    if (head == 0)
+      return 0;
+    struct DeepdiveShmSlot const* slot =
+      &body->slots[(head - 1) & (DEEPDIVE_SHM_SLOTS - 1)];
+    uint32_t before = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    if (before & 1)
+      continue;
+    memcpy(state, &slot->state, sizeof(struct DeepdiveShmState));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint32_t after = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+    if (before == after)
+      return head;
+  }
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
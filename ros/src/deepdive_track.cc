@@ -8,6 +8,12 @@
 #include <tf2_ros/transform_broadcaster.h>
 #include <tf2_ros/static_transform_broadcaster.h>
 
+// Nodelet includes
+#ifdef DEEPDIVE_NODELET
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#endif
+
 // General messages
 #include <geometry_msgs/PoseWithCovarianceStamped.h>
 #include <geometry_msgs/TwistWithCovarianceStamped.h>
@@ -15,93 +21,26 @@
 #include <sensor_msgs/Imu.h>
 #include <deepdive_ros/Trackers.h>
 #include <deepdive_ros/Light.h>
+#include <deepdive_ros/Packed.h>
 #include <deepdive_ros/Lighthouses.h>
+#include <deepdive_ros/Predict.h>
+#include <deepdive_ros/Timing.h>
 
-// Eigen includes
-#include <Eigen/Core>
-#include <Eigen/Geometry>
-
-// UKF includes
-#include <UKF/Types.h>
-#include <UKF/Integrator.h>
-#include <UKF/StateVector.h>
-#include <UKF/MeasurementVector.h>
-#include <UKF/Core.h>
+// Boost includes
+#include <boost/make_shared.hpp>
 
 // C++ includes
 #include <vector>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <functional>
 
 // Deepdive internal
 #include "deepdive.hh"
-
-// FILTER KEYS
-
-// State indexes
-enum Keys : uint8_t {
-  // STATE
-  Position,             // Position (world frame, m)
-  Attitude,             // Attitude quaternion (rotates vec from body to world)
-  Velocity,             // Velocity (body frame, m/s)
-  Omega,                // Angular velocity (body frame, rads/s)
-  Acceleration,         // Acceleration (body frame, m/s^2)
-  Alpha,                // Angular acceleration (body frame, rads/s^2)
-  // ERRORS
-  GyroscopeBias,        // Gyroscope bias offset (body frame, rad/s)
-  GyroscopeScale,       // Gyroscope scale factor (body frame, multiplier)
-  AccelerometerBias,    // Accelerometer bias offset (body frame, m/s^2)
-  AccelerometerScale,   // Accelerometer scale factor (body frame, mutliplier)
-  // MEASUREMENTS
-  Accelerometer,        // Acceleration (body frame, m/s^2)
-  Gyroscope,            // Gyroscope (body frame, rads/s)
-  Angle
-};
-
-// OBSERVATION
-
-// Observation vector
-using Observation = UKF::DynamicMeasurementVector<
-  UKF::Field<Accelerometer, UKF::Vector<3>>,
-  UKF::Field<Gyroscope, UKF::Vector<3>>,
-  UKF::Field<Angle, real_t>
->;
-
-// TRACKING FILTER
-
-// State vector
-using State = UKF::StateVector<
-  UKF::Field<Position, UKF::Vector<3>>,
-  UKF::Field<Attitude, UKF::Quaternion>,
-  UKF::Field<Velocity, UKF::Vector<3>>,
-  UKF::Field<Omega, UKF::Vector<3>>,
-  UKF::Field<Acceleration, UKF::Vector<3>>,
-  UKF::Field<Alpha, UKF::Vector<3>>
->;
-
-// For tracking
-using TrackingFilter = UKF::Core<
-  State, Observation, UKF::IntegratorRK4
->;
-
-// ERROR FILTER
-
-// Parameters
-using Error = UKF::StateVector<
-  UKF::Field<AccelerometerBias, UKF::Vector<3>>,
-  UKF::Field<AccelerometerScale, UKF::Vector<3>>,
-  UKF::Field<GyroscopeBias, UKF::Vector<3>>,
-  UKF::Field<GyroscopeScale, UKF::Vector<3>>
->;
-
-// For parameter estimation
-using ErrorFilter = UKF::Core<
-  Error, Observation, UKF::IntegratorEuler
->;
-
-// For IMU parameter estimation
-
-typedef std::map<std::string, Eigen::Affine3d> TransformMap;
-typedef std::map<std::string, ErrorFilter> ErrorMap;
+#include "deepdive_filter.hh"
+#include "deepdive_shm.h"
 
 // Default IMU errors
 Eigen::Vector3d imu_cov_ab_;         // Initial covariance: Accel bias
@@ -122,200 +61,148 @@ std::string frame_body_ = "body";       // EKF / external solution
 std::string frame_truth_ = "truth";     // Vive solution
 
 
+// A measurement waiting in the reorder buffer (only one is set), with the
+// model ids it was resolved to when it arrived
+struct Pending {
+  deepdive_ros::Light::ConstPtr light;
+  sensor_msgs::Imu::ConstPtr imu;
+  uint16_t tracker;
+  uint16_t lighthouse;
+  uint64_t received = 0;             // When it arrived, if timing (ns)
+};
+
+// A tracker as seen by a body, indexed by its id in the tracking model
+struct Mount {
+  bool mounted = false;              // Whether the tracker is on this body
+  ErrorFilter* error = nullptr;      // Its error filter, once initialized
+  Preintegration imu;                // IMU preintegrated since the last step
+};
+
+// A rigid body carrying one or more trackers, with its own filters. Updates
+// to a body are serialized by its mutex, which acts as a strand, while the
+// spinner threads are free to update different bodies in parallel.
+struct Body {
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  std::string frame;                 // Child frame, eg "truth"
+  std::set<std::string> trackers;    // Serials of the trackers on this body
+  ErrorMap errors;                   // Error filter for each tracker
+  std::vector<Mount> mounts;         // Indexed by model tracker id
+  double integrated = 0;             // IMU time preintegrated since last step
+  TrackingFilter filter;             // Tracking filter
+  ros::Time last;                    // Time of the last filter update
+  ros::Time newest;                  // Newest measurement time received
+  std::multimap<ros::Time, Pending> queue;  // Measurements awaiting fusion
+  ros::Publisher pub_pose;           // Pose publisher
+  ros::Publisher pub_twist;          // Twist publisher
+  DeepdiveShmBody* shm = nullptr;    // Shared memory output, if any
+  std::vector<deepdive_ros::Timing> timing;  // Light fused since publishing
+  std::mutex mutex;                  // Serializes updates to this body
+};
+typedef std::map<std::string, std::shared_ptr<Body>> BodyMap;
+
 LighthouseMap lighthouses_;          // List of lighthouses
 TrackerMap trackers_;                // List of trackers
-ErrorMap errors_;                    // List of error filters
-TrackingFilter filter_;              // Tracking filter
+BodyMap bodies_;                     // List of rigid bodies
+std::vector<int> tracker_lookup_;    // Driver id -> model id (-1 = unknown)
+std::vector<int> lighthouse_lookup_; // Driver id -> model id (-1 = unknown)
+std::shared_timed_mutex config_;     // Guards lighthouse and tracker data
+int threads_ = 0;                    // Spinner threads (0 = one per core)
 std::string frame_parent_;           // Parent frame, eg "world"
 std::string frame_child_;            // Child frame, eg "truth"
 double rate_ = 10.0;                 // Desired tracking rate in Hz
+bool publish_update_ = false;        // Publish after every filter step
+bool timing_ = false;                // Time light through the filter
+ros::Publisher pub_timing_;          // Timing publisher
+double buffer_ = 0.02;               // Reorder buffer length in seconds
 int thresh_count_ = 4;               // Min num measurements required per bundle
 double thresh_angle_ = 60.0;         // Angle threshold in degrees
 double thresh_duration_ = 1.0;       // Duration threshold in micorseconds
 bool use_gyroscope_ = true;          // Input measurements from gyroscope
 bool use_accelerometer_ = true;      // Input measurements from accelerometer
 bool use_light_ = true;              // Input measurements from light
+bool preintegrate_ = true;           // Preintegrate IMU between filter steps
+double preintegrate_rate_ = 50.0;    // Preintegrated fusion rate (0 = light)
 double registration_[6];             // World -> vive
-
-// ROS publishers
-ros::Publisher pub_pose_;
-ros::Publisher pub_twist_;
+std::string shm_;                    // Shared memory output ("" disables it)
+DeepdiveShm* segment_ = nullptr;     // Mapped shared memory output
 
 // Default measurement errors
-bool correct_ = false;               // Whether to correct light parameters
-Eigen::Vector3d gravity_;            // Gravity
 Eigen::Vector3d obs_cov_acc_;        // Measurement covariance: Accelerometer
 Eigen::Vector3d obs_cov_gyr_;        // Measurement covariance: Gyroscope
 double obs_cov_ang_;                 // Measurement covariance: Angle
 
-// Intermediary data
-Eigen::Affine3d wTv_;                // ALL: world -> vive
-TransformMap vTl_;                   // ALL: vive -> lighthouse
-TransformMap bTh_;                   // ALL: head -> body
-TransformMap tTh_;                   // ALL: head -> tracking
-TransformMap tTi_;                   // ALL: imu -> tracking
-
-// Context data
-struct Context {
-  std::string lighthouse;            // Active lighthouse
-  std::string tracker;               // Active tracker
-  Eigen::Vector3d sensor;            // Active sensor
-  uint8_t axis;                      // Active axis
-};
-
+// Compiled tracking model
+TrackingModel model_;               // Guarded by the configuration lock
+bool batch_ = true;                 // Fuse each sweep as one observation
 
 // Are we initialized and ready to track
 bool initialized_ = false;
 
-// TRACKING FILTER
-
-namespace UKF {
-
-  // MEASURMENT
-
-  template <>
-  Observation::CovarianceVector Observation::measurement_covariance(
-    (Observation::CovarianceVector() << 
-      1.0e-4, 1.0e-4, 1.0e-4,   // Accel
-      1.0e-6, 1.0e-6, 1.0e-6,   // Gyro
-      1.0e-8).finished());
-
-  // TRACKING FILTER
-
-  // Standard 6DoF kinematics with constant Acceleration assumption
-  template <> template <> State
-  State::derivative<>() const {
-    UKF::Quaternion omega_q;
-    omega_q.vec() = get_field<Omega>() * 0.5;
-    omega_q.w() = 0;
-    State output;
-    output.set_field<Position>(get_field<Velocity>());
-    output.set_field<Velocity>(get_field<Attitude>() * get_field<Acceleration>());
-    output.set_field<Acceleration>(UKF::Vector<3>(0, 0, 0));
-    output.set_field<Attitude>(omega_q * get_field<Attitude>());
-    output.set_field<Omega>(get_field<Alpha>());
-    output.set_field<Alpha>(UKF::Vector<3>(0, 0, 0));
-    return output;
-  }
-
-  // See http://www.mdpi.com/1424-8220/11/7/6771/htm
-  template <> template <> UKF::Vector<3>
-  Observation::expected_measurement<State, Accelerometer, Error, Context>(
-    State const& state, Error const& error, Context const& context) {
-    Eigen::Affine3d iTb = tTi_[context.tracker].inverse()    // light -> imu
-                        * tTh_[context.tracker]              // head -> light
-                        * bTh_[context.tracker].inverse();   // body -> head
-    Eigen::Vector3d r = iTb.translation();
-    Eigen::Vector3d w = state.get_field<Omega>();
-    return error.get_field<AccelerometerScale>().cwiseInverse().cwiseProduct(
-        iTb.linear() * state.get_field<Acceleration>()
-      + iTb.linear() * w.cross(w.cross(r))
-      + iTb.linear() * (state.get_field<Attitude>().conjugate() * gravity_)
-      - error.get_field<AccelerometerBias>());
-  }
-
-  // See http://www.mdpi.com/1424-8220/11/7/6771/htm
-  template <> template <> UKF::Vector<3>
-  Observation::expected_measurement<State, Gyroscope, Error, Context>(
-    State const& state, Error const& error, Context const& context) {
-    Eigen::Affine3d iTb = tTi_[context.tracker].inverse()    // light -> imu
-                        * tTh_[context.tracker]              // head -> light
-                        * bTh_[context.tracker].inverse();   // body -> head
-    return error.get_field<GyroscopeScale>().cwiseInverse().cwiseProduct(
-        iTb.linear() * state.get_field<Omega>()
-      - error.get_field<GyroscopeBias>());
-  }
-
-  // Lighthouse angle prediction
-  template <> template <> real_t
-  Observation::expected_measurement<State, Angle, Error, Context>(
-    State const& state, Error const& error, Context const& context) {
-    Eigen::Affine3d wTb;
-    wTb.translation() = state.get_field<Position>();
-    wTb.linear() = state.get_field<Attitude>().toRotationMatrix();
-    UKF::Vector<3> x = wTv_.inverse()                      // world -> vive
-                     * vTl_[context.lighthouse].inverse()  // vive -> lh
-                     * wTb                                 // body -> world
-                     * bTh_[context.tracker]               // head -> body
-                     * tTh_[context.tracker].inverse()     // tracker -> head
-                     * context.sensor;
-    double xyz[3], ang[2];
-    xyz[0] = x[0];
-    xyz[1] = x[1];
-    xyz[2] = x[2];
-    Predict(lighthouses_[context.lighthouse].params, xyz, ang, correct_);
-    return ang[context.axis];
-  }
-
-  // ERROR FILTER
-
-  template <> template <> Error
-  Error::derivative<>() const {
-    return Error::Zero();
-  }
-
-  template <> template <> UKF::Vector<3>
-  Observation::expected_measurement<Error, Accelerometer, State, Context>(
-    Error const& errors, State const& state, Context const& context) {
-    return expected_measurement<State, Accelerometer, Error, Context>(
-      state, errors, context);
-  }
-
-  template <> template <> UKF::Vector<3>
-  Observation::expected_measurement<Error, Gyroscope, State, Context>(
-    Error const& errors, State const& state, Context const& context) {
-    return expected_measurement<State, Gyroscope, Error, Context>(
-      state, errors, context);
-  }
-
-  template <> template <> real_t
-  Observation::expected_measurement<Error, Angle, State, Context>(
-    Error const& errors, State const& state, Context const& context) {
-    return expected_measurement<State, Angle, Error, Context>(
-      state, errors, context);
+// UTILITY FUNCTIONS
+
+// Time between the last update of a body and a measurement taken at some
+// device time. Measurements sharing a stamp are fused as zero-length steps,
+// and after a long gap the body restarts from the measurement. The body is
+// only moved forward once the measurement is fused, so the interval of one
+// that is rejected is carried into the next step (call with the body locked).
+bool Delta(ros::Time & last, ros::Time const& stamp, double & dt) {
+  if (last.isZero())
+    last = stamp;
+  dt = (stamp - last).toSec();
+  if (dt >= 1.0) {
+    last = stamp;
+    return false;
   }
+  return (dt >= 0);
 }
 
-// UTILITY FUNCTIONS
+// Model id of a driver id, or -1 if it is not known (call with the
+// configuration shared)
+int Lookup(std::vector<int> const& lookup, uint16_t id) {
+  return (id < lookup.size() ? lookup[id] : -1);
+}
 
-bool Delta(double & dt) {
-  static ros::Time last = ros::Time::now(), now;
-  now = ros::Time::now();
-  dt = (now - last).toSec();
-  if (dt > 0)
-    last = now;
-  return (dt > 0 && dt < 1.0);
+// Rebuild the mounts of every body after the model is compiled, so that the
+// callbacks only ever index by model id (call with the configuration locked)
+void Remap() {
+  BodyMap::iterator bt;
+  for (bt = bodies_.begin(); bt != bodies_.end(); bt++) {
+    Body & body = *bt->second;
+    body.mounts.resize(model_.trackers.size());
+    std::map<std::string, uint16_t>::const_iterator it;
+    for (it = model_.tracker_ids.begin();
+      it != model_.tracker_ids.end(); it++) {
+      Mount & mount = body.mounts[it->second];
+      mount.mounted = body.trackers.count(it->first);
+      ErrorMap::iterator error = body.errors.find(it->first);
+      mount.error = (error == body.errors.end() ? nullptr : &error->second);
+    }
+  }
 }
 
 // CALLBACKS
 
-// This will be called at approximately 120Hz
-// - Single lighthouse in 'A' mode : 120Hz (60Hz per axis)
-// - Dual lighthouses in b/A or b/c modes : 120Hz (30Hz per axis)
-void LightCallback(deepdive_ros::Light::ConstPtr const& msg) {
-  static double dt;
-  if (!use_light_ || !initialized_ || !Delta(dt))
-    return;
-
+// Fuse a bundle of light stamped dt after the last update of the body, and
+// move the body up to the stamp. Returns whether the filters were stepped.
+bool FuseLight(deepdive_ros::Light::ConstPtr const& msg, Body & body,
+  uint16_t tracker, uint16_t lighthouse, ros::Time const& stamp, double dt) {
   // Check that we are recording and that the tracker/lighthouse is ready
-  TrackerMap::iterator tracker = trackers_.find(msg->header.frame_id);
-  if (tracker == trackers_.end() || !tracker->second.ready) {
-    ROS_INFO_STREAM_THROTTLE(1, "Tracker not found or ready");
-    return;
+  if (!model_.trackers[tracker].ready) {
+    ROS_INFO_STREAM_THROTTLE(1, "Tracker not ready");
+    return false;
   }
 
   // Check that we are recording and that the tracker/lighthouse is ready
-  LighthouseMap::iterator lighthouse = lighthouses_.find(msg->lighthouse);
-  if (lighthouse == lighthouses_.end() || !lighthouse->second.ready) {
-    ROS_INFO_STREAM_THROTTLE(1, "Lighthouse not found or ready");
-    return;
+  if (!model_.lighthouses[lighthouse].ready) {
+    ROS_INFO_STREAM_THROTTLE(1, "Lighthouse not ready");
+    return false;
   }
 
   // Make sure we have a filter setup for this
-  ErrorMap::iterator error = errors_.find(msg->header.frame_id);
-  if (error == errors_.end()) {
+  ErrorFilter * error = body.mounts[tracker].error;
+  if (!error) {
     ROS_INFO_STREAM_THROTTLE(1, "Tracker error filter not initialized");
-    return;
+    return false;
   }
 
   // Clean up the measurments
@@ -338,61 +225,63 @@ void LightCallback(deepdive_ros::Light::ConstPtr const& msg) {
   }
   if (thresh_count_ > 0 && data.size() < thresh_count_) {
     ROS_INFO_STREAM_THROTTLE(1, "Not enough data so skipping bundle.");
-    return;
+    return false;
   }
 
   // Set the context correctly
   Context context;
-  context.tracker = msg->header.frame_id;
-  context.lighthouse = msg->lighthouse;
+  context.model = &model_;
+  context.tracker = tracker;
+  context.lighthouse = lighthouse;
   context.axis = msg->axis;
 
-  // Correct the error filter
-  error->second.a_priori_step(dt);
-  for (size_t i = 0; i < data.size(); i++) {
-    // Set the context correctly
-    context.sensor[0] = tracker->second.sensors[6 * data[i].sensor + 0];
-    context.sensor[1] = tracker->second.sensors[6 * data[i].sensor + 1];
-    context.sensor[2] = tracker->second.sensors[6 * data[i].sensor + 2];
-    // Create the observation
-    Observation obs;
-    obs.set_field<Angle>(data[i].angle);
-    error->second.innovation_step(obs, filter_.state, context);
-  }
-  error->second.a_posteriori_step();
-
-  // Correct the tracking filter
-  filter_.a_priori_step(dt);
-  for (size_t i = 0; i < data.size(); i++) {
-    // Set the context correctly
-    context.sensor[0] = tracker->second.sensors[6 * data[i].sensor + 0];
-    context.sensor[1] = tracker->second.sensors[6 * data[i].sensor + 1];
-    context.sensor[2] = tracker->second.sensors[6 * data[i].sensor + 2];
-    // Create the observation
-    Observation obs;
-    obs.set_field<Angle>(data[i].angle);
-    filter_.innovation_step(obs, error->second.state, context);
-  }
-  filter_.a_posteriori_step();
+  // Correct the error and tracking filters
+  LightUpdate(*error, body.filter, context, data, dt, batch_);
+  body.last = stamp;
+  return true;
 }
-// This will be called at approximately 250Hz
-void ImuCallback(sensor_msgs::Imu::ConstPtr const& msg) {
-  static double dt;
-  if ((!use_accelerometer_ && !use_gyroscope_) || !initialized_ || !Delta(dt))
-    return;
 
+// Fuse all preintegrated IMU in one step of the filters, which brings them up
+// to the newest sample. Returns whether anything was fused (call with the
+// configuration shared and the body locked).
+bool FusePreintegrated(Body & body) {
+  bool fused = false;
+  double dt = body.integrated;
+  for (size_t i = 0; i < body.mounts.size(); i++) {
+    Mount & mount = body.mounts[i];
+    if (mount.imu.count == 0 || !mount.error)
+      continue;
+    Context context;
+    context.model = &model_;
+    context.tracker = i;
+    // Each error filter steps over its own samples, but only the first
+    // tracker to be stepped moves the shared tracking filter forward in time
+    if (!PreintegratedUpdate(*mount.error, body.filter, context, mount.imu,
+      dt, use_accelerometer_, use_gyroscope_))
+      continue;
+    dt = 0;
+    fused = true;
+  }
+  body.integrated = 0;
+  return fused;
+}
+
+// Fuse an IMU measurement stamped dt after the last update of the body, or
+// preintegrate it to be fused later, and move the body up to the stamp.
+// Returns whether the filters were stepped.
+bool FuseImu(sensor_msgs::Imu::ConstPtr const& msg, Body & body,
+  uint16_t tracker, ros::Time const& stamp, double dt) {
   // Check that we are recording and that the tracker/lighthouse is ready
-  TrackerMap::iterator tracker = trackers_.find(msg->header.frame_id);
-  if (tracker == trackers_.end() || !tracker->second.ready) {
-    ROS_INFO_STREAM_THROTTLE(1, "Tracker not found or ready");
-    return;
+  if (!model_.trackers[tracker].ready) {
+    ROS_INFO_STREAM_THROTTLE(1, "Tracker not ready");
+    return false;
   }
 
   // Make sure we have a filter setup for this
-  ErrorMap::iterator error = errors_.find(msg->header.frame_id);
-  if (error == errors_.end()) {
+  Mount & mount = body.mounts[tracker];
+  if (!mount.error) {
     ROS_INFO_STREAM_THROTTLE(1, "Tracker error filter not initialized");
-    return;
+    return false;
   }
 
   // Get the measurements
@@ -405,9 +294,21 @@ void ImuCallback(sensor_msgs::Imu::ConstPtr const& msg) {
     msg->angular_velocity.y,
     msg->angular_velocity.z);
 
+  // Accumulate the sample, and only step the filters once enough time has
+  // been integrated (light always fuses what has been integrated first)
+  if (preintegrate_) {
+    Preintegrate(mount.imu, *mount.error, acc, gyr, dt);
+    body.integrated += dt;
+    body.last = stamp;
+    if (preintegrate_rate_ <= 0 || body.integrated < 1.0 / preintegrate_rate_)
+      return false;
+    return FusePreintegrated(body);
+  }
+
   // Set the context correctly
   Context context;
-  context.tracker = msg->header.frame_id;
+  context.model = &model_;
+  context.tracker = tracker;
 
   // Create a measurement
   Observation obs;
@@ -416,86 +317,324 @@ void ImuCallback(sensor_msgs::Imu::ConstPtr const& msg) {
   if (use_gyroscope_)
     obs.set_field<Gyroscope>(gyr);
 
-  // Step the parameter filter
-  error->second.a_priori_step(dt);
-  error->second.innovation_step(obs, filter_.state, context);
-  error->second.a_posteriori_step(); 
+  // Step the parameter and tracking filters
+  ImuUpdate(*mount.error, body.filter, context, obs, dt);
+  body.last = stamp;
+  return true;
+}
+
+// Time before which buffered measurements are ready to be fused
+ros::Time Horizon(ros::Time const& t) {
+  if (t.toSec() < buffer_)
+    return ros::Time(0);
+  return t - ros::Duration(buffer_);
+}
+
+// Time of the filter of a body, which lags the newest measurement by any IMU
+// that is still being preintegrated (call with the body locked)
+ros::Time FilterTime(Body const& body) {
+  return body.last - ros::Duration(body.integrated);
+}
 
-  // Propagate the filter
-  filter_.a_priori_step(dt);
-  filter_.innovation_step(obs, error->second.state, context);
-  filter_.a_posteriori_step();
+// Write the newest state of a body to shared memory, so that local processes
+// can read it without waiting for the timer (call with the body locked)
+void Share(Body & body) {
+  if (!body.shm)
+    return;
+  DeepdiveShmState state;
+  state.stamp = FilterTime(body).toNSec();
+  for (size_t i = 0; i < 3; i++) {
+    state.position[i] = body.filter.state.get_field<Position>()[i];
+    state.velocity[i] = body.filter.state.get_field<Velocity>()[i];
+    state.omega[i] = body.filter.state.get_field<Omega>()[i];
+  }
+  state.attitude[0] = body.filter.state.get_field<Attitude>().w();
+  state.attitude[1] = body.filter.state.get_field<Attitude>().x();
+  state.attitude[2] = body.filter.state.get_field<Attitude>().y();
+  state.attitude[3] = body.filter.state.get_field<Attitude>().z();
+  for (size_t i = 0; i < 6; i++) {
+    for (size_t j = 0; j < 6; j++) {
+      state.pose_covariance[i*6 + j] = body.filter.covariance(i, j);
+      state.twist_covariance[i*6 + j] = body.filter.covariance(6+i, 6+j);
+    }
+  }
+  deepdive_shm_write(body.shm, &state);
+}
+
+// Fill the pose and twist of a filter at some time
+void Fill(TrackingFilter const& filter, ros::Time const& stamp,
+  geometry_msgs::PoseWithCovarianceStamped & pwcs,
+  geometry_msgs::TwistWithCovarianceStamped & twcs) {
+  pwcs.header.stamp = stamp;
+  pwcs.header.frame_id = frame_world_;
+  pwcs.pose.pose.position.x = filter.state.get_field<Position>()[0];
+  pwcs.pose.pose.position.y = filter.state.get_field<Position>()[1];
+  pwcs.pose.pose.position.z = filter.state.get_field<Position>()[2];
+  pwcs.pose.pose.orientation.w = filter.state.get_field<Attitude>().w();
+  pwcs.pose.pose.orientation.x = filter.state.get_field<Attitude>().x();
+  pwcs.pose.pose.orientation.y = filter.state.get_field<Attitude>().y();
+  pwcs.pose.pose.orientation.z = filter.state.get_field<Attitude>().z();
+  for (size_t i = 0; i < 6; i++)
+    for (size_t j = 0; j < 6; j++)
+      pwcs.pose.covariance[i*6 + j] = filter.covariance(i, j);
+  twcs.header.stamp = stamp;
+  twcs.header.frame_id = frame_world_;
+  twcs.twist.twist.linear.x = filter.state.get_field<Velocity>()[0];
+  twcs.twist.twist.linear.y = filter.state.get_field<Velocity>()[1];
+  twcs.twist.twist.linear.z = filter.state.get_field<Velocity>()[2];
+  twcs.twist.twist.angular.x = filter.state.get_field<Omega>()[0];
+  twcs.twist.twist.angular.y = filter.state.get_field<Omega>()[1];
+  twcs.twist.twist.angular.z = filter.state.get_field<Omega>()[2];
+  for (size_t i = 0; i < 6; i++)
+    for (size_t j = 0; j < 6; j++)
+      twcs.twist.covariance[i*6 + j] = filter.covariance(6+i, 6+j);
+}
+
+// Broadcast the state of a body (call with the body locked)
+void Publish(Body & body) {
+  // The filter relates WORLD and IMU frames at the time it was last stepped
+  geometry_msgs::PoseWithCovarianceStamped pwcs;
+  geometry_msgs::TwistWithCovarianceStamped twcs;
+  Fill(body.filter, FilterTime(body), pwcs, twcs);
+
+  // Broadcast the tracker pose on TF2
+  geometry_msgs::TransformStamped tfs;
+  tfs.header = pwcs.header;
+  tfs.child_frame_id = body.frame;
+  tfs.transform.translation.x = pwcs.pose.pose.position.x;
+  tfs.transform.translation.y = pwcs.pose.pose.position.y;
+  tfs.transform.translation.z = pwcs.pose.pose.position.z;
+  tfs.transform.rotation = pwcs.pose.pose.orientation;
+  SendDynamicTransform(tfs);
+
+  // Broadcast the pose and twist with covariance
+  body.pub_pose.publish(pwcs);
+  body.pub_twist.publish(twcs);
+
+  // Report how long the light fused into this pose took to get here
+  uint64_t now = Monotonic();
+  for (size_t i = 0; i < body.timing.size(); i++) {
+    body.timing[i].published = now;
+    pub_timing_.publish(body.timing[i]);
+  }
+  body.timing.clear();
+}
+
+// Called whenever the filter of a body has been stepped (call with the body
+// locked)
+void Updated(Body & body) {
+  Share(body);
+  if (publish_update_)
+    Publish(body);
+}
+
+// Fuse buffered measurements up to some time, in device-time order (call
+// with the configuration shared and the body locked)
+void Flush(Body & body, ros::Time const& horizon) {
+  bool fused = false;
+  while (!body.queue.empty() && body.queue.begin()->first <= horizon) {
+    double dt;
+    ros::Time const& stamp = body.queue.begin()->first;
+    if (Delta(body.last, stamp, dt)) {
+      Pending const& pending = body.queue.begin()->second;
+      if (pending.light) {
+        if (FusePreintegrated(body))
+          fused = true;
+        bool stepped = FuseLight(pending.light, body, pending.tracker,
+          pending.lighthouse, stamp, dt);
+        if (stepped)
+          fused = true;
+        if (stepped && pending.received) {
+          deepdive_ros::Timing timing;
+          timing.tracker_id = pending.light->tracker_id;
+          timing.timecode = pending.light->timecode;
+          timing.received = pending.received;
+          timing.fused = Monotonic();
+          body.timing.push_back(timing);
+        }
+      } else if (pending.imu && FuseImu(pending.imu, body, pending.tracker,
+        stamp, dt)) {
+        fused = true;
+      }
+    }
+    body.queue.erase(body.queue.begin());
+  }
+  if (fused)
+    Updated(body);
+}
+
+// Add a measurement to the reorder buffer of a body, and fuse everything
+// older than the buffer length (call with the body locked)
+void Buffer(Body & body, ros::Time const& stamp, Pending const& pending) {
+  if (!body.last.isZero() && stamp <= body.last) {
+    ROS_INFO_STREAM_THROTTLE(1, "Measurement arrived too late to be fused");
+    return;
+  }
+  body.queue.emplace(stamp, pending);
+  if (stamp > body.newest)
+    body.newest = stamp;
+  Flush(body, Horizon(body.newest));
+}
+
+// Light and IMU measurements are stamped with device time by the bridge, and
+// are buffered so that they can be fused in order, no matter how late their
+// callbacks are run.
+
+// Buffer light seen by a tracker mounted on the body (call with the
+// configuration shared)
+void BufferLight(deepdive_ros::Light::ConstPtr const& msg, Body & body,
+  uint16_t tracker) {
+  int lighthouse = Lookup(lighthouse_lookup_, msg->lighthouse_id);
+  if (lighthouse < 0) {
+    ROS_INFO_STREAM_THROTTLE(1, "Lighthouse not found");
+    return;
+  }
+  std::lock_guard<std::mutex> lock(body.mutex);
+  if (!use_light_ || !initialized_)
+    return;
+  Pending pending;
+  pending.light = msg;
+  pending.tracker = tracker;
+  pending.lighthouse = lighthouse;
+  if (timing_)
+    pending.received = Monotonic();
+  Buffer(body, msg->header.stamp, pending);
+}
+
+// This will be called at approximately 120Hz
+// - Single lighthouse in 'A' mode : 120Hz (60Hz per axis)
+// - Dual lighthouses in b/A or b/c modes : 120Hz (30Hz per axis)
+void LightCallback(deepdive_ros::Light::ConstPtr const& msg, Body & body) {
+  std::shared_lock<std::shared_timed_mutex> config(config_);
+  // Every body sees all light, so ignore trackers mounted on other bodies
+  int tracker = Lookup(tracker_lookup_, msg->tracker_id);
+  if (tracker < 0 || !body.mounts[tracker].mounted)
+    return;
+  BufferLight(msg, body, tracker);
+}
+
+// Buffer an IMU sample from a tracker mounted on the body (call with the
+// configuration shared)
+void BufferImu(sensor_msgs::Imu::ConstPtr const& msg, Body & body,
+  uint16_t tracker) {
+  std::lock_guard<std::mutex> lock(body.mutex);
+  if ((!use_accelerometer_ && !use_gyroscope_) || !initialized_)
+    return;
+  Pending pending;
+  pending.imu = msg;
+  pending.tracker = tracker;
+  Buffer(body, msg->header.stamp, pending);
+}
+
+// This will be called at approximately 250Hz
+void ImuCallback(sensor_msgs::Imu::ConstPtr const& msg, Body & body) {
+  std::shared_lock<std::shared_timed_mutex> config(config_);
+  // Every body sees all IMU data, so ignore trackers mounted on other bodies.
+  // The IMU message has no room for an id, so this is the one serial lookup.
+  std::map<std::string, uint16_t>::const_iterator tracker =
+    model_.tracker_ids.find(msg->header.frame_id);
+  if (tracker == model_.tracker_ids.end()
+    || !body.mounts[tracker->second].mounted)
+    return;
+  BufferImu(msg, body, tracker->second);
+}
+
+// Unpack a batch of raw light and IMU, keeping what is seen by this body.
+// Every body gets every batch, so the trackers are resolved to this body
+// before anything is unpacked, and only its own samples are copied.
+void PackedCallback(deepdive_ros::Packed::ConstPtr const& msg, Body & body) {
+  std::shared_lock<std::shared_timed_mutex> config(config_);
+  std::vector<bool> keep(msg->tracker_ids.size(), false);
+  std::map<std::string, uint16_t> trackers;       // IMU is keyed by serial
+  for (size_t i = 0; i < keep.size() && i < msg->trackers.size(); i++) {
+    int tracker = Lookup(tracker_lookup_, msg->tracker_ids[i]);
+    if (tracker >= 0 && body.mounts[tracker].mounted) {
+      keep[i] = true;
+      trackers[msg->trackers[i]] = tracker;
+    }
+  }
+  if (trackers.empty())
+    return;
+  BagHandlers handlers;
+  handlers.light = [&](ros::Time const& t, deepdive_ros::Light const& light) {
+    BufferLight(boost::make_shared<deepdive_ros::Light>(light), body,
+      Lookup(tracker_lookup_, light.tracker_id));
+  };
+  handlers.imu = [&](ros::Time const& t, sensor_msgs::Imu const& imu) {
+    BufferImu(boost::make_shared<sensor_msgs::Imu>(imu), body,
+      trackers[imu.header.frame_id]);
+  };
+  if (!Unpack(*msg, handlers, &keep))
+    ROS_WARN("Ignoring an inconsistent packed message");
 }
 
 // This will be called back at the desired tracking rate
-void TimerCallback(ros::TimerEvent const& info) {
-  static double dt;
-  if (!initialized_ || !Delta(dt))
+void TimerCallback(ros::TimerEvent const& info, Body & body) {
+  std::shared_lock<std::shared_timed_mutex> config(config_);
+  std::lock_guard<std::mutex> lock(body.mutex);
+  if (!initialized_)
+    return;
+
+  // Fuse anything that has been buffered for long enough, so that the pose
+  // keeps up even if one of the measurement streams stops
+  Flush(body, Horizon(ros::Time::now()));
+  if (body.last.isZero())
     return;
 
-  // Propagate the filter forward
-  filter_.a_priori_step(dt);
+  // Bring the filter up to the newest IMU sample before publishing
+  if (FusePreintegrated(body))
+    Updated(body);
 
   // Debug
   /*
   ErrorMap::iterator it;
-  for (it = errors_.begin(); it != errors_.end(); it++) {
+  for (it = body.errors.begin(); it != body.errors.end(); it++) {
     ROS_INFO_STREAM(it->first << ":");
     ROS_INFO_STREAM(it->second.state);
   }
-  ROS_INFO_STREAM(filter_.state);
   ROS_INFO_STREAM("Filter:");
-  ROS_INFO_STREAM(filter_.state);
+  ROS_INFO_STREAM(body.filter.state);
   */
 
-  // The filter relates WORLD and IMU frames
-  ros::Time now = ros::Time::now();
-
-  // Broadcast the tracker pose on TF2
-  static tf2_ros::TransformBroadcaster br;
-  geometry_msgs::TransformStamped tfs;
-  tfs.header.stamp = now;
-  tfs.header.frame_id = frame_world_;
-  tfs.child_frame_id = frame_truth_;
-  tfs.transform.translation.x = filter_.state.get_field<Position>()[0];
-  tfs.transform.translation.y = filter_.state.get_field<Position>()[1];
-  tfs.transform.translation.z = filter_.state.get_field<Position>()[2];
-  tfs.transform.rotation.w = filter_.state.get_field<Attitude>().w();
-  tfs.transform.rotation.x = filter_.state.get_field<Attitude>().x();
-  tfs.transform.rotation.y = filter_.state.get_field<Attitude>().y();
-  tfs.transform.rotation.z = filter_.state.get_field<Attitude>().z();
-  SendDynamicTransform(tfs);
-
-  // Broadcast the pose with covariance
-  geometry_msgs::PoseWithCovarianceStamped pwcs;
-  pwcs.header.stamp = now;
-  pwcs.header.frame_id = frame_world_;
-  pwcs.pose.pose.position.x = filter_.state.get_field<Position>()[0];
-  pwcs.pose.pose.position.y = filter_.state.get_field<Position>()[1];
-  pwcs.pose.pose.position.z = filter_.state.get_field<Position>()[2];
-  pwcs.pose.pose.orientation.w = filter_.state.get_field<Attitude>().w();
-  pwcs.pose.pose.orientation.x = filter_.state.get_field<Attitude>().x();
-  pwcs.pose.pose.orientation.y = filter_.state.get_field<Attitude>().y();
-  pwcs.pose.pose.orientation.z = filter_.state.get_field<Attitude>().z();
-  for (size_t i = 0; i < 6; i++)
-    for (size_t j = 0; j < 6; j++)
-      pwcs.pose.covariance[i*6 + j] = filter_.covariance(i, j);
-  pub_pose_.publish(pwcs);
+  // Bodies that publish on update have already done so
+  if (!publish_update_)
+    Publish(body);
+}
 
-  // Broadcast the twist with covariance
-  geometry_msgs::TwistWithCovarianceStamped twcs;
-  twcs.header.stamp = now;
-  twcs.header.frame_id = frame_world_;
-  twcs.twist.twist.linear.x = filter_.state.get_field<Velocity>()[0];
-  twcs.twist.twist.linear.y = filter_.state.get_field<Velocity>()[1];
-  twcs.twist.twist.linear.z = filter_.state.get_field<Velocity>()[2];
-  twcs.twist.twist.angular.x = filter_.state.get_field<Omega>()[0];
-  twcs.twist.twist.angular.y = filter_.state.get_field<Omega>()[1];
-  twcs.twist.twist.angular.z = filter_.state.get_field<Omega>()[2];
-  for (size_t i = 0; i < 6; i++)
-    for (size_t j = 0; j < 6; j++)
-      twcs.twist.covariance[i*6 + j] = filter_.covariance(6+i, 6+j);
-  pub_twist_.publish(twcs);
+// Extrapolate a copy of the filter of a body to some time, without changing
+// the filter itself, so that callers can compensate for their own latency
+bool PredictCallback(deepdive_ros::Predict::Request & req,
+                     deepdive_ros::Predict::Response & res) {
+  std::shared_lock<std::shared_timed_mutex> config(config_);
+  BodyMap::iterator bt;
+  for (bt = bodies_.begin(); bt != bodies_.end(); bt++)
+    if (bt->second->frame == req.frame)
+      break;
+  if (bt == bodies_.end()) {
+    res.success = false;
+    res.message = "No body has frame " + req.frame;
+    return true;
+  }
+  std::lock_guard<std::mutex> lock(bt->second->mutex);
+  Body const& body = *bt->second;
+  if (!initialized_ || body.last.isZero()) {
+    res.success = false;
+    res.message = "Body is not being tracked yet";
+    return true;
+  }
+  ros::Time stamp = (req.stamp.isZero() ? ros::Time::now() : req.stamp);
+  double dt = (stamp - FilterTime(body)).toSec();
+  if (dt < 0 || dt > 1.0) {
+    res.success = false;
+    res.message = "Can only predict up to a second after the last update";
+    return true;
+  }
+  TrackingFilter filter = body.filter;
+  if (dt > 0)
+    filter.a_priori_step(dt);
+  Fill(filter, stamp, res.pose, res.twist);
+  res.success = true;
+  return true;
 }
 
 void CheckIfReadyToTrack() {
@@ -511,25 +650,9 @@ void CheckIfReadyToTrack() {
   }
 }
 
-// Convert an angle axis to an eigen transform
-Eigen::Affine3d AngleAxisToTransform(double data[6]) {
-  Eigen::Affine3d tf = Eigen::Affine3d::Identity();
-  tf.translation() = Eigen::Vector3d(data[0], data[1], data[2]);
-  Eigen::Vector3d v(data[3], data[4], data[5]);
-  if (v.norm() > 0) {
-    Eigen::AngleAxisd aa = Eigen::AngleAxisd::Identity();
-    aa.angle() = v.norm();
-    aa.axis() = v.normalized();
-    tf.linear() = aa.toRotationMatrix();
-  }
-  return tf;
-}
-
 // Called when a new lighthouse appears
 void NewLighthouseCallback(LighthouseMap::iterator lighthouse) {
   ROS_INFO_STREAM("Found lighthouse " << lighthouse->first);
-  // Initialize
-  vTl_[lighthouse->first] = AngleAxisToTransform(lighthouse->second.vTl);
   // Check if we have got all info from lighthouses and trackers
   CheckIfReadyToTrack();
 }
@@ -537,8 +660,18 @@ void NewLighthouseCallback(LighthouseMap::iterator lighthouse) {
 // Called when a new tracker appears
 void NewTrackerCallback(TrackerMap::iterator tracker) {
   ROS_INFO_STREAM("Found tracker " << tracker->first);
+  // Find the body on which this tracker is mounted
+  BodyMap::iterator body;
+  for (body = bodies_.begin(); body != bodies_.end(); body++)
+    if (body->second->trackers.count(tracker->first))
+      break;
+  if (body == bodies_.end()) {
+    ROS_WARN_STREAM("Tracker " << tracker->first << " is not on any body");
+    CheckIfReadyToTrack();
+    return;
+  }
   // Initialize the error filter
-  ErrorFilter & error = errors_[tracker->first];
+  ErrorFilter & error = body->second->errors[tracker->first];
   error.state.set_field<AccelerometerBias>(UKF::Vector<3>(
     tracker->second.errors[ERROR_ACC_BIAS][0],
     tracker->second.errors[ERROR_ACC_BIAS][1],
@@ -561,14 +694,48 @@ void NewTrackerCallback(TrackerMap::iterator tracker) {
   error.process_noise_covariance = Error::CovarianceMatrix::Zero();
   error.process_noise_covariance.diagonal() <<
     imu_proc_ab_, imu_proc_as_, imu_proc_gb_, imu_proc_gs_;
-  // Global cache
-  bTh_[tracker->first] = AngleAxisToTransform(tracker->second.bTh);
-  tTh_[tracker->first] = AngleAxisToTransform(tracker->second.tTh);
-  tTi_[tracker->first] = AngleAxisToTransform(tracker->second.tTi);
   // Check if we have got all info from lighthouses and trackers
   CheckIfReadyToTrack();
 }
 
+// Lighthouse and tracker updates are applied exclusively of filter updates
+
+void TrackersCallback(deepdive_ros::Trackers::ConstPtr const& msg) {
+  std::unique_lock<std::shared_timed_mutex> config(config_);
+  TrackerCallback(msg, trackers_, NewTrackerCallback);
+  CompileModel(model_, registration_, lighthouses_, trackers_);
+  Remap();
+  // The message lists every tracker plugged in, so rebuild the lookup
+  tracker_lookup_.clear();
+  std::vector<deepdive_ros::Tracker>::const_iterator it;
+  for (it = msg->trackers.begin(); it != msg->trackers.end(); it++) {
+    std::map<std::string, uint16_t>::const_iterator id =
+      model_.tracker_ids.find(it->serial);
+    if (it->id >= tracker_lookup_.size())
+      tracker_lookup_.resize(it->id + 1, -1);
+    tracker_lookup_[it->id] =
+      (id == model_.tracker_ids.end() ? -1 : id->second);
+  }
+}
+
+void LighthousesCallback(deepdive_ros::Lighthouses::ConstPtr const& msg) {
+  std::unique_lock<std::shared_timed_mutex> config(config_);
+  LighthouseCallback(msg, lighthouses_, NewLighthouseCallback);
+  CompileModel(model_, registration_, lighthouses_, trackers_);
+  Remap();
+  // The message lists every lighthouse seen, so rebuild the lookup
+  lighthouse_lookup_.clear();
+  std::vector<deepdive_ros::Lighthouse>::const_iterator it;
+  for (it = msg->lighthouses.begin(); it != msg->lighthouses.end(); it++) {
+    std::map<std::string, uint16_t>::const_iterator id =
+      model_.lighthouse_ids.find(it->serial);
+    if (it->id >= lighthouse_lookup_.size())
+      lighthouse_lookup_.resize(it->id + 1, -1);
+    lighthouse_lookup_[it->id] =
+      (id == model_.lighthouse_ids.end() ? -1 : id->second);
+  }
+}
+
 // MAIN ENTRY POINT OF APPLICATION
 
 bool GetPairParam(ros::NodeHandle &nh,
@@ -604,10 +771,14 @@ bool GetQuaternionParam(ros::NodeHandle &nh,
   return true;
 }
 
-int main(int argc, char **argv) {
-  // Initialize ROS and create node handle
-  ros::init(argc, argv, "deepdive_tracker");
-  ros::NodeHandle nh("~");
+// Subscriptions, services and timers, which live as long as the node
+std::vector<ros::Subscriber> subs_;
+std::vector<ros::Timer> timers_;
+ros::ServiceServer service_;
+
+// Read the parameters and connect to the data. Updates to different bodies may
+// be called back concurrently from the handle's threads.
+bool Setup(ros::NodeHandle & nh) {
 
   // Get the parent information
   if (!nh.getParam("calfile", calfile_))
@@ -658,11 +829,13 @@ int main(int argc, char **argv) {
   std::vector<std::string> trackers;
   if (!nh.getParam("trackers", trackers))
     ROS_FATAL("Failed to get the tracker list.");
+  std::map<std::string, std::string> serials;
   std::vector<std::string>::iterator jt;
   for (jt = trackers.begin(); jt != trackers.end(); jt++) {
     std::string serial;
     if (!nh.getParam(*jt + "/serial", serial))
       ROS_FATAL("Failed to get the tracker serial.");
+    serials[*jt] = serial;
     std::vector<double> extrinsics;
     if (!nh.getParam(*jt + "/extrinsics", extrinsics))
       ROS_FATAL("Failed to get the tracker extrinsics.");
@@ -685,12 +858,86 @@ int main(int argc, char **argv) {
     trackers_[serial].ready = false;
   }
 
-  // Get the topics for data topics
-  std::string topic_pose, topic_twist;
-  if (!nh.getParam("topics/pose", topic_pose))
-    ROS_FATAL("Failed to get topics/pose parameter.");
-  if (!nh.getParam("topics/twist", topic_twist))
-    ROS_FATAL("Failed to get topics/twist parameter.");
+  // Get the rigid bodies, each of which is tracked with its own filter. If
+  // none are listed then all trackers are assumed to be on a single body.
+  std::vector<std::string> bodies;
+  if (nh.getParam("bodies", bodies)) {
+    std::vector<std::string>::iterator kt;
+    for (kt = bodies.begin(); kt != bodies.end(); kt++) {
+      std::shared_ptr<Body> body =
+        std::allocate_shared<Body>(Eigen::aligned_allocator<Body>());
+      if (!nh.getParam(*kt + "/frame", body->frame))
+        ROS_FATAL("Failed to get the body frame.");
+      std::vector<std::string> names;
+      if (!nh.getParam(*kt + "/trackers", names))
+        ROS_FATAL("Failed to get the body tracker list.");
+      for (jt = names.begin(); jt != names.end(); jt++) {
+        if (!serials.count(*jt)) {
+          ROS_FATAL_STREAM("Body " << *kt << " has unknown tracker " << *jt);
+          continue;
+        }
+        body->trackers.insert(serials[*jt]);
+      }
+      std::string topic_pose, topic_twist;
+      if (!nh.getParam(*kt + "/topics/pose", topic_pose))
+        ROS_FATAL("Failed to get the body topics/pose parameter.");
+      if (!nh.getParam(*kt + "/topics/twist", topic_twist))
+        ROS_FATAL("Failed to get the body topics/twist parameter.");
+      body->pub_pose = nh.advertise<geometry_msgs::PoseWithCovarianceStamped>
+        (topic_pose, 0);
+      body->pub_twist = nh.advertise<geometry_msgs::TwistWithCovarianceStamped>
+        (topic_twist, 0);
+      bodies_[*kt] = body;
+    }
+  } else {
+    std::shared_ptr<Body> body =
+      std::allocate_shared<Body>(Eigen::aligned_allocator<Body>());
+    body->frame = frame_truth_;
+    std::map<std::string, std::string>::iterator kt;
+    for (kt = serials.begin(); kt != serials.end(); kt++)
+      body->trackers.insert(kt->second);
+    std::string topic_pose, topic_twist;
+    if (!nh.getParam("topics/pose", topic_pose))
+      ROS_FATAL("Failed to get topics/pose parameter.");
+    if (!nh.getParam("topics/twist", topic_twist))
+      ROS_FATAL("Failed to get topics/twist parameter.");
+    body->pub_pose = nh.advertise<geometry_msgs::PoseWithCovarianceStamped>
+      (topic_pose, 0);
+    body->pub_twist = nh.advertise<geometry_msgs::TwistWithCovarianceStamped>
+      (topic_twist, 0);
+    bodies_["default"] = body;
+  }
+
+  // How long to hold measurements so that they can be fused in order
+  if (!nh.getParam("buffer", buffer_))
+    buffer_ = 0.02;
+
+  // Number of threads used to update bodies in parallel
+  if (!nh.getParam("threads", threads_))
+    threads_ = 0;
+
+  // Name of a shared memory segment to write body states to
+  if (!nh.getParam("shm", shm_))
+    shm_ = "";
+  if (!shm_.empty()) {
+    segment_ = deepdive_shm_open(shm_.c_str(), 1);
+    if (!segment_)
+      ROS_ERROR_STREAM("Could not open shared memory " << shm_);
+  }
+  if (segment_) {
+    BodyMap::iterator bt;
+    for (bt = bodies_.begin(); bt != bodies_.end(); bt++) {
+      if (segment_->num_bodies == DEEPDIVE_SHM_MAX_BODIES) {
+        ROS_WARN_STREAM("No shared memory left for body " << bt->first);
+        continue;
+      }
+      DeepdiveShmBody & shm = segment_->bodies[segment_->num_bodies++];
+      snprintf(shm.frame, DEEPDIVE_SHM_FRAME_LENGTH, "%s",
+        bt->second->frame.c_str());
+      bt->second->shm = &shm;
+      ROS_INFO_STREAM("Sharing " << bt->second->frame << " in " << shm_);
+    }
+  }
 
   // Get the thresholds
   if (!nh.getParam("thresholds/angle", thresh_angle_))
@@ -701,13 +948,33 @@ int main(int argc, char **argv) {
     ROS_FATAL("Failed to get thresholds/count parameter.");
 
   // Whether to apply light corrections
-  if (!nh.getParam("correct", correct_))
+  if (!nh.getParam("correct", model_.correct))
     ROS_FATAL("Failed to get correct parameter.");
 
+  // Whether to fuse each sweep as one stacked observation
+  if (!nh.getParam("batch", batch_))
+    batch_ = true;
+
+  // Whether to preintegrate IMU samples, and how often to fuse them
+  if (!nh.getParam("preintegration/enabled", preintegrate_))
+    preintegrate_ = true;
+  if (!nh.getParam("preintegration/rate", preintegrate_rate_))
+    preintegrate_rate_ = 50.0;
+
   // Get the tracker update rate.
   if (!nh.getParam("rate", rate_))
     ROS_FATAL("Failed to get rate parameter.");
 
+  // Whether to publish after every filter step, rather than at the rate
+  if (!nh.getParam("publish_on_update", publish_update_))
+    publish_update_ = false;
+
+  // Whether to report when light is received, fused and published
+  if (!nh.getParam("timing", timing_))
+    timing_ = false;
+  if (timing_)
+    pub_timing_ = nh.advertise<deepdive_ros::Timing>("/timing", 1000);
+
   // Get the tracker update rate.
   if (!nh.getParam("use/gyroscope", use_gyroscope_))
     ROS_FATAL("Failed to get use/gyroscope  parameter.");
@@ -717,7 +984,7 @@ int main(int argc, char **argv) {
     ROS_FATAL("Failed to get use/light parameter.");
 
   // Get gravity
-  if (!GetVectorParam(nh, "gravity", gravity_))
+  if (!GetVectorParam(nh, "gravity", model_.gravity))
     ROS_FATAL("Failed to get gravity parameter.");
 
   // Tracking filter: Initial estimates
@@ -780,23 +1047,27 @@ int main(int argc, char **argv) {
   if (!GetVectorParam(nh, "process_noise_cov/alpha", noise_alpha))
     ROS_FATAL("Failed to get acceleration parameter.");
 
-  // Setup the filter
-  filter_.state.set_field<Position>(est_position);
-  filter_.state.set_field<Attitude>(est_attitude);
-  filter_.state.set_field<Velocity>(est_velocity);
-  filter_.state.set_field<Omega>(est_omega);
-  filter_.state.set_field<Acceleration>(est_acceleration);
-  filter_.state.set_field<Alpha>(est_alpha);
-  filter_.covariance = State::CovarianceMatrix::Zero();
-  filter_.covariance.diagonal() << 
-    cov_position, cov_attitude,
-    cov_velocity, cov_omega,
-    cov_accel, cov_alpha;
-  filter_.process_noise_covariance = State::CovarianceMatrix::Zero();
-  filter_.process_noise_covariance.diagonal() <<
-    noise_position, noise_attitude,
-    noise_velocity, noise_omega,
-    noise_accel, noise_alpha;
+  // Setup the filter for every body
+  BodyMap::iterator bt;
+  for (bt = bodies_.begin(); bt != bodies_.end(); bt++) {
+    TrackingFilter & filter = bt->second->filter;
+    filter.state.set_field<Position>(est_position);
+    filter.state.set_field<Attitude>(est_attitude);
+    filter.state.set_field<Velocity>(est_velocity);
+    filter.state.set_field<Omega>(est_omega);
+    filter.state.set_field<Acceleration>(est_acceleration);
+    filter.state.set_field<Alpha>(est_alpha);
+    filter.covariance = State::CovarianceMatrix::Zero();
+    filter.covariance.diagonal() << 
+      cov_position, cov_attitude,
+      cov_velocity, cov_omega,
+      cov_accel, cov_alpha;
+    filter.process_noise_covariance = State::CovarianceMatrix::Zero();
+    filter.process_noise_covariance.diagonal() <<
+      noise_position, noise_attitude,
+      noise_velocity, noise_omega,
+      noise_accel, noise_alpha;
+  }
 
   // IMU error : initial estimate
   if (!GetVectorParam(nh, "measurement_cov/accelerometer", obs_cov_acc_))
@@ -838,33 +1109,73 @@ int main(int argc, char **argv) {
   SendTransforms(frame_world_, frame_vive_, frame_body_,
     registration_, lighthouses_, trackers_);
 
-  // Convert the registration info to a world transform
-  wTv_ = AngleAxisToTransform(registration_);
-
-  // Markers showing sensor positions
-  pub_pose_ = nh.advertise<geometry_msgs::PoseWithCovarianceStamped>
-    (topic_pose, 0);
-  pub_twist_ = nh.advertise<geometry_msgs::TwistWithCovarianceStamped>
-    (topic_twist, 0);
-
-  // Subscribe to the motion and light callbacks
-  std::vector<ros::Subscriber> subs;
-  subs.push_back(nh.subscribe<deepdive_ros::Trackers>("/trackers", 1000,
-    std::bind(TrackerCallback, std::placeholders::_1,
-      std::ref(trackers_), NewTrackerCallback)));
-  subs.push_back(nh.subscribe<deepdive_ros::Lighthouses>("/lighthouses", 1000,
-    std::bind(LighthouseCallback, std::placeholders::_1,
-      std::ref(lighthouses_), NewLighthouseCallback)));
-  subs.push_back(nh.subscribe("/light", 1000, LightCallback));
-  subs.push_back(nh.subscribe("/imu", 1000, ImuCallback));
-
-  // Start a timer to callback
-  ros::Timer timer = nh.createTimer(
-    ros::Duration(ros::Rate(rate_)), TimerCallback, false, true);
+  // Give every lighthouse and tracker a dense id, and build the model
+  CompileModel(model_, registration_, lighthouses_, trackers_);
+  Remap();
+
+  // Subscribe to the tracker and lighthouse info
+  subs_.push_back(nh.subscribe("/trackers", 1000, TrackersCallback));
+  subs_.push_back(nh.subscribe("/lighthouses", 1000, LighthousesCallback));
+
+  // Each body has its own subscriptions and timer. ROS never runs the same
+  // subscription concurrently, so each body sees its data in order, while
+  // different bodies are free to run on different spinner threads.
+  for (bt = bodies_.begin(); bt != bodies_.end(); bt++) {
+    Body & body = *bt->second;
+    subs_.push_back(nh.subscribe<deepdive_ros::Light>("/light", 1000,
+      std::bind(LightCallback, std::placeholders::_1, std::ref(body))));
+    subs_.push_back(nh.subscribe<sensor_msgs::Imu>("/imu", 1000,
+      std::bind(ImuCallback, std::placeholders::_1, std::ref(body))));
+    subs_.push_back(nh.subscribe<deepdive_ros::Packed>("/packed", 100,
+      std::bind(PackedCallback, std::placeholders::_1, std::ref(body))));
+    timers_.push_back(nh.createTimer(ros::Duration(ros::Rate(rate_)),
+      std::bind(TimerCallback, std::placeholders::_1, std::ref(body)),
+        false, true));
+  }
+
+  // Predict the state of any body at some time on request
+  service_ = nh.advertiseService("/predict", PredictCallback);
+
+  // Success!
+  return true;
+}
+
+#ifdef DEEPDIVE_NODELET
+
+namespace deepdive_ros {
+
+// The tracker as a nodelet, which receives light and IMU messages from a
+// bridge in the same manager as shared pointers, without serialization. The
+// manager's worker threads take the place of the spinner threads.
+class TrackNodelet : public nodelet::Nodelet {
+ private:
+  void onInit() override {
+    Setup(getMTPrivateNodeHandle());
+  }
+};
+
+}  // namespace deepdive_ros
+
+PLUGINLIB_EXPORT_CLASS(deepdive_ros::TrackNodelet, nodelet::Nodelet)
+
+#else
+
+int main(int argc, char **argv) {
+  // Initialize ROS and create node handle
+  ros::init(argc, argv, "deepdive_tracker");
+  ros::NodeHandle nh("~");
+
+  // Read the parameters and connect to the data
+  if (!Setup(nh))
+    return 1;
 
   // Block until safe shutdown
-  ros::spin();
+  ros::AsyncSpinner spinner(threads_);
+  spinner.start();
+  ros::waitForShutdown();
 
   // Success!
   return 0;
 }
+
+#endif
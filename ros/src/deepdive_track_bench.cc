@@ -0,0 +1,303 @@
+/*
+  This benchmark replays synthetic sweeps of a tracker moving in front of a
+  lighthouse through the tracking filter, and compares the time taken to fuse
+  each bundle pulse-by-pulse against fusing it as one stacked observation. It
+  then adds the IMU samples taken between sweeps, and compares fusing every
+  sample against preintegrating them and fusing them in one step. The bias
+  jacobians of the preintegration are checked against finite differences, and
+  the benchmark fails if they disagree.
+
+  Usage: deepdive_track_bench [bundles] [pulses per bundle] [imu per bundle]
+*/
+
+// C includes
+#include <cstdio>
+#include <cstdlib>
+
+// C++ includes
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+// Deepdive internal
+#include "deepdive.hh"
+#include "deepdive_filter.hh"
+
+// Sweep rate for dual lighthouses in b/c modes
+static constexpr double RATE = 120.0;
+
+// Largest relative error allowed between analytic and numerical jacobians
+static constexpr double JACOBIAN_TOLERANCE = 1e-4;
+
+// Build a model with one lighthouse two meters from a tracker at the origin
+static void SetupModel(TrackingModel & model) {
+  double registration[6] = {0, 0, 0, 0, 0, 0};
+  LighthouseMap lighthouses;
+  Lighthouse & lh = lighthouses["lighthouse"];
+  for (size_t i = 0; i < 6; i++)
+    lh.vTl[i] = 0;
+  lh.vTl[2] = -2.0;
+  for (size_t i = 0; i < NUM_MOTORS*NUM_PARAMS; i++)
+    lh.params[i] = 0;
+  lh.ready = true;
+  TrackerMap trackers;
+  Tracker & tr = trackers["tracker"];
+  for (size_t i = 0; i < 6; i++)
+    tr.bTh[i] = tr.tTh[i] = tr.tTi[i] = 0;
+  for (size_t i = 0; i < NUM_SENSORS; i++) {
+    double a = 2.0 * M_PI * i / NUM_SENSORS;
+    tr.sensors[6*i+0] = 0.05 * cos(a);
+    tr.sensors[6*i+1] = 0.05 * sin(a);
+    tr.sensors[6*i+2] = 0.01 * (i % 4);
+    tr.sensors[6*i+3] = 0;
+    tr.sensors[6*i+4] = 0;
+    tr.sensors[6*i+5] = -1;
+  }
+  tr.ready = true;
+  model.gravity = Eigen::Vector3d(0, 0, 9.80665);
+  model.correct = false;
+  CompileModel(model, registration, lighthouses, trackers);
+}
+
+// The body moves on a slow circle while spinning about its z axis
+static void Truth(double t, Eigen::Vector3d & p, Eigen::Quaterniond & q) {
+  p = Eigen::Vector3d(0.2 * cos(t), 0.2 * sin(t), 0.1 * sin(0.5 * t));
+  q = Eigen::Quaterniond(Eigen::AngleAxisd(0.5 * t, Eigen::Vector3d::UnitZ()));
+}
+
+// Time of the i'th of n IMU samples taken after bundle b
+static double ImuTime(size_t b, size_t i, size_t n) {
+  return (b + (i + 1.0) / (n + 1.0)) / RATE;
+}
+
+// Generate the noise-free IMU samples of the moving body, whose imu frame is
+// its body frame
+static void GenerateImu(TrackingModel const& model, size_t bundles,
+  size_t samples, std::vector<std::vector<Eigen::Vector3d>> & acc,
+  std::vector<std::vector<Eigen::Vector3d>> & gyr) {
+  acc.resize(bundles);
+  gyr.resize(bundles);
+  for (size_t b = 0; b < bundles; b++) {
+    for (size_t i = 0; i < samples; i++) {
+      double t = ImuTime(b, i, samples);
+      Eigen::Vector3d p;
+      Eigen::Quaterniond q;
+      Truth(t, p, q);
+      Eigen::Vector3d a(-0.2 * cos(t), -0.2 * sin(t), -0.025 * sin(0.5 * t));
+      acc[b].push_back(q.conjugate() * (a + model.gravity));
+      gyr[b].push_back(Eigen::Vector3d(0, 0, 0.5));
+    }
+  }
+}
+
+// Generate the noise-free sweeps seen by the lighthouse
+static void Generate(TrackingModel const& model, size_t bundles,
+  size_t pulses, std::vector<std::vector<deepdive_ros::Pulse>> & data) {
+  LighthouseModel const& lm = model.lighthouses[0];
+  TrackerModel const& tm = model.trackers[0];
+  data.resize(bundles);
+  for (size_t b = 0; b < bundles; b++) {
+    Eigen::Vector3d p;
+    Eigen::Quaterniond q;
+    Truth(b / RATE, p, q);
+    for (size_t i = 0; i < pulses; i++) {
+      uint16_t s = (b * 7 + i) % NUM_SENSORS;
+      Eigen::Vector3d x = lm.lTw * (q * tm.bPs[s] + p);
+      double ang[2];
+      Predict(lm.params, x.data(), ang, false);
+      deepdive_ros::Pulse pulse;
+      pulse.sensor = s;
+      pulse.angle = ang[b % 2];
+      pulse.duration = 10e-6;
+      data[b].push_back(pulse);
+    }
+  }
+}
+
+// Filters with the body starting a little off the truth
+static void SetupFilters(TrackingFilter & filter, ErrorFilter & error) {
+  filter.state.set_field<Position>(UKF::Vector<3>(0.2, 0, 0));
+  filter.state.set_field<Attitude>(UKF::Quaternion(1, 0, 0, 0));
+  filter.state.set_field<Velocity>(UKF::Vector<3>(0, 0, 0));
+  filter.state.set_field<Omega>(UKF::Vector<3>(0, 0, 0));
+  filter.state.set_field<Acceleration>(UKF::Vector<3>(0, 0, 0));
+  filter.state.set_field<Alpha>(UKF::Vector<3>(0, 0, 0));
+  filter.covariance = State::CovarianceMatrix::Identity() * 1.0e-2;
+  filter.process_noise_covariance =
+    State::CovarianceMatrix::Identity() * 1.0e-6;
+  error.state.set_field<AccelerometerBias>(UKF::Vector<3>(0, 0, 0));
+  error.state.set_field<AccelerometerScale>(UKF::Vector<3>(1, 1, 1));
+  error.state.set_field<GyroscopeBias>(UKF::Vector<3>(0, 0, 0));
+  error.state.set_field<GyroscopeScale>(UKF::Vector<3>(1, 1, 1));
+  error.covariance = Error::CovarianceMatrix::Identity() * 1.0e-20;
+  error.process_noise_covariance = Error::CovarianceMatrix::Zero();
+}
+
+// Fuse all bundles and return the time per bundle in microseconds
+static double Run(TrackingModel const& model,
+  std::vector<std::vector<deepdive_ros::Pulse>> const& data, bool batch,
+  double & error_mm) {
+  TrackingFilter filter;
+  ErrorFilter error;
+  SetupFilters(filter, error);
+  Context context;
+  context.model = &model;
+  context.lighthouse = 0;
+  context.tracker = 0;
+  context.sensor = 0;
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  for (size_t b = 0; b < data.size(); b++) {
+    context.axis = b % 2;
+    LightUpdate(error, filter, context, data[b], 1.0 / RATE, batch);
+  }
+  std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+  Eigen::Vector3d p;
+  Eigen::Quaterniond q;
+  Truth((data.size() - 1) / RATE, p, q);
+  error_mm = 1e3 * (filter.state.get_field<Position>() - p).norm();
+  return std::chrono::duration<double, std::micro>(t1 - t0).count()
+    / data.size();
+}
+
+// Fuse all bundles and the IMU samples between them, either one at a time or
+// preintegrated, and return the time per bundle in microseconds
+static double RunImu(TrackingModel const& model,
+  std::vector<std::vector<deepdive_ros::Pulse>> const& data,
+  std::vector<std::vector<Eigen::Vector3d>> const& acc,
+  std::vector<std::vector<Eigen::Vector3d>> const& gyr,
+  bool preintegrate, double & error_mm) {
+  TrackingFilter filter;
+  ErrorFilter error;
+  SetupFilters(filter, error);
+  Context context;
+  context.model = &model;
+  context.lighthouse = 0;
+  context.tracker = 0;
+  context.sensor = 0;
+  Preintegration imu;
+  double last = 0, integrated = 0;
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  for (size_t b = 0; b < data.size(); b++) {
+    // Light always fuses what has been integrated first
+    if (preintegrate)
+      PreintegratedUpdate(error, filter, context, imu, integrated, true, true);
+    integrated = 0;
+    context.axis = b % 2;
+    double dt = (b == 0 ? 1.0 / RATE : b / RATE - last);
+    LightUpdate(error, filter, context, data[b], dt, true);
+    last = b / RATE;
+    for (size_t i = 0; i < acc[b].size(); i++) {
+      double t = ImuTime(b, i, acc[b].size());
+      if (preintegrate) {
+        Preintegrate(imu, error, acc[b][i], gyr[b][i], t - last);
+        integrated += t - last;
+      } else {
+        Observation obs;
+        obs.set_field<Accelerometer>(acc[b][i]);
+        obs.set_field<Gyroscope>(gyr[b][i]);
+        ImuUpdate(error, filter, context, obs, t - last);
+      }
+      last = t;
+    }
+  }
+  if (preintegrate)
+    PreintegratedUpdate(error, filter, context, imu, integrated, true, true);
+  std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+  Eigen::Vector3d p;
+  Eigen::Quaterniond q;
+  Truth(last, p, q);
+  error_mm = 1e3 * (filter.state.get_field<Position>() - p).norm();
+  return std::chrono::duration<double, std::micro>(t1 - t0).count()
+    / data.size();
+}
+
+// Preintegrate a second of samples spinning about all axes, with the error
+// estimate offset by h along one bias axis (k < 3 accel, otherwise gyro)
+static Preintegration Integrate(size_t k, double h) {
+  Eigen::Vector3d ab(0.01, -0.02, 0.03), gb(0.002, -0.001, 0.003);
+  if (k < 3)
+    ab[k] += h;
+  else
+    gb[k - 3] += h;
+  ErrorFilter error;
+  error.state.set_field<AccelerometerBias>(ab);
+  error.state.set_field<AccelerometerScale>(UKF::Vector<3>(1, 1, 1));
+  error.state.set_field<GyroscopeBias>(gb);
+  error.state.set_field<GyroscopeScale>(UKF::Vector<3>(1, 1, 1));
+  Preintegration imu;
+  for (size_t i = 0; i < 200; i++) {
+    double t = i * 0.005;
+    Eigen::Vector3d acc(0.3 * sin(t), -0.2, 9.8 + 0.1 * cos(t));
+    Eigen::Vector3d gyr(0.4 * sin(2.0 * t), 0.3 * cos(t), 0.5);
+    Preintegrate(imu, error, acc, gyr, 0.005);
+  }
+  ReducePreintegration(imu);
+  return imu;
+}
+
+// Compare the bias jacobians of the mean rates against central differences,
+// and return the worst error relative to the size of the jacobian
+static double CheckJacobians() {
+  static constexpr double h = 1e-5;
+  Preintegration imu = Integrate(0, 0);
+  double worst = 0;
+  for (size_t k = 0; k < 6; k++) {
+    Preintegration p = Integrate(k, h);
+    Preintegration m = Integrate(k, -h);
+    Eigen::Vector3d jomega = (k < 3 ? Eigen::Vector3d::Zero()
+      : Eigen::Vector3d(imu.domega_dgb.col(k - 3)));
+    Eigen::Vector3d jforce = (k < 3 ? imu.dforce_dab.col(k)
+      : imu.dforce_dgb.col(k - 3));
+    Eigen::Vector3d domega = (p.omega - m.omega) / (2.0 * h);
+    Eigen::Vector3d dforce = (p.force - m.force) / (2.0 * h);
+    worst = std::max(worst,
+      (domega - jomega).norm() / std::max(1.0, jomega.norm()));
+    worst = std::max(worst,
+      (dforce - jforce).norm() / std::max(1.0, jforce.norm()));
+  }
+  return worst;
+}
+
+int main(int argc, char **argv) {
+  size_t bundles = (argc > 1 ? atoi(argv[1]) : 10000);
+  size_t pulses = (argc > 2 ? atoi(argv[2]) : 12);
+  size_t samples = (argc > 3 ? atoi(argv[3]) : 8);
+  if (bundles == 0 || pulses == 0 || pulses > NUM_SENSORS) {
+    printf("Usage: %s [bundles] [pulses per bundle <= %zu] [imu per bundle]\n",
+      argv[0], NUM_SENSORS);
+    return 1;
+  }
+  TrackingModel model;
+  SetupModel(model);
+  std::vector<std::vector<deepdive_ros::Pulse>> data;
+  Generate(model, bundles, pulses, data);
+  printf("%zu bundles of %zu pulses\n", bundles, pulses);
+  double err_pulse, err_batch;
+  double us_pulse = Run(model, data, false, err_pulse);
+  double us_batch = Run(model, data, true, err_batch);
+  printf("%-8s %10.2f us/bundle %10.3f mm final error\n",
+    "pulse", us_pulse, err_pulse);
+  printf("%-8s %10.2f us/bundle %10.3f mm final error\n",
+    "batch", us_batch, err_batch);
+  printf("speedup  %10.2fx\n", us_pulse / us_batch);
+  double jacobian = CheckJacobians();
+  printf("%-8s %10.2e max relative error\n", "jacobian", jacobian);
+  if (jacobian > JACOBIAN_TOLERANCE) {
+    printf("Preintegration jacobians disagree with finite differences\n");
+    return 1;
+  }
+  if (samples == 0)
+    return 0;
+  std::vector<std::vector<Eigen::Vector3d>> acc, gyr;
+  GenerateImu(model, bundles, samples, acc, gyr);
+  printf("%zu imu samples per bundle\n", samples);
+  double err_raw, err_pre;
+  double us_raw = RunImu(model, data, acc, gyr, false, err_raw);
+  double us_pre = RunImu(model, data, acc, gyr, true, err_pre);
+  printf("%-8s %10.2f us/bundle %10.3f mm final error\n",
+    "imu", us_raw, err_raw);
+  printf("%-8s %10.2f us/bundle %10.3f mm final error\n",
+    "preint", us_pre, err_pre);
+  printf("speedup  %10.2fx\n", us_raw / us_pre);
+  return 0;
+}
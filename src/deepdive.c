@@ -33,11 +33,37 @@
 
 #include <deepdive.h>
 
+#include <math.h>
+
 // Interface implementations
 #include "deepdive_usb.h"
+#include "deepdive_ring.h"
+#include "deepdive_data_light.h"
+#include "deepdive_capture.h"
+#include "deepdive_stats.h"
+
+// How long the USB thread blocks in libusb before checking for a stop request
+#define THREAD_TIMEOUT_US     100000
 
 // Initialize the driver
 struct Driver * deepdive_init() {
+  return deepdive_init_options(NULL);
+}
+
+// Fill the options with their default values
+void deepdive_default_options(struct Options * opts) {
+  if (opts == NULL) return;
+  memset(opts, 0, sizeof(struct Options));
+  opts->num_transfers = DEFAULT_TRANSFERS;
+  opts->hotplug = 1;
+  opts->speed = 1.0f;
+  const char * home = getenv("HOME");
+  if (home)
+    snprintf(opts->cache_dir, MAX_PATH_LENGTH, "%s/.cache/deepdive", home);
+}
+
+// Create a driver with the given options (NULL = defaults) without any devices
+struct Driver * deepdive_alloc(const struct Options * opts) {
   // Create a new driver context
   struct Driver *drv = malloc(sizeof(struct Driver));
   if (drv == NULL)
@@ -53,13 +79,62 @@ struct Driver * deepdive_init() {
   drv->general.pulse_max_for_sweep    = 1800UL;
   drv->general.pulse_synctime_offset  = 20000UL;
   drv->general.pulse_synctime_slack   = 5000UL;
+  // Options
+  if (opts)
+    drv->options = *opts;
+  else
+    deepdive_default_options(&drv->options);
+  if (drv->options.num_transfers < 1)
+    drv->options.num_transfers = 1;
+  if (drv->options.num_transfers > MAX_TRANSFERS)
+    drv->options.num_transfers = MAX_TRANSFERS;
+  if (drv->options.imu_rate > 0)
+    drv->imu_period = drv->general.timebase_hz / drv->options.imu_rate;
+  // Trackers may be decoded on different threads, but share lighthouses
+  pthread_mutex_init(&drv->lock, NULL);
+  pthread_mutex_init(&drv->cache_lock, NULL);
+  // The tracker list is recursive so that its holders may look trackers up
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&drv->trackers_lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  return drv;
+}
+
+// Initialize the driver with the given options (NULL = defaults)
+struct Driver * deepdive_init_options(const struct Options * opts) {
+  struct Driver *drv = deepdive_alloc(opts);
+  if (drv == NULL)
+    return NULL;
+  // Replay a capture in place of the devices
+  if (drv->options.replay[0]) {
+    // Caches would make replays depend on what state the host is in
+    drv->options.cache_dir[0] = '\0';
+    drv->options.capture[0] = '\0';
+    if (deepdive_replay_init(drv) == 0) {
+      printf("No devices found in capture\n");
+      goto fail;
+    }
+    return drv;
+  }
+  // Capture raw packets, if requested
+  if (drv->options.capture[0] && deepdive_capture_open(drv))
+    goto fail;
   // Initialize tracker
   if (deepdive_usb_init(drv) == 0) {
+    // With hotplug we can happily wait for devices to be plugged in
+    if (drv->has_hotplug) {
+      printf("No devices found, waiting for them to be plugged in\n");
+      return drv;
+    }
     printf("No devices found\n");
-    free(drv);
-    return NULL;
+    goto fail;
   }
   return drv;
+fail:
+  deepdive_close(drv);
+  return NULL;
 }
 
 // CALLBACKS
@@ -88,12 +163,38 @@ void deepdive_install_tracker_fn(struct Driver * drv, tracker_func fbp) {
   if (fbp) drv->tracker_fn = fbp;
 }
 
+// Register a callback function for when a tracker is unplugged
+void deepdive_install_removal_fn(struct Driver * drv, tracker_func fbp) {
+  if (drv == NULL) return;
+  if (fbp) drv->removal_fn = fbp;
+}
+
 // Register an button callback function
 void deepdive_install_lighthouse_fn(struct Driver * drv, lighthouse_func fbp) {
   if (drv == NULL) return;
   if (fbp) drv->lighthouse_fn = fbp;
 }
 
+// Register a sweep bundle callback, called per sweep or once per poll (batched)
+void deepdive_install_bundle_fn(struct Driver * drv, bundle_func fbp,
+  uint8_t batched) {
+  if (drv == NULL) return;
+  if (fbp) drv->bundle_fn = fbp;
+  drv->batched = batched;
+}
+
+// Convert all pulse angles in a bundle from ticks to radians
+void deepdive_bundle_radians(struct Driver * drv,
+  const struct SweepBundle * bundle, float * radians) {
+  if (drv == NULL || bundle == NULL || radians == NULL) return;
+  // Half a rotation takes two sweep centers, so the scale is pi / (2 * center)
+  const float center = (float) drv->general.timecenter_ticks;
+  const float scale = (float) M_PI / (2.0f * center);
+  const uint32_t * __restrict__ ticks = bundle->angles;
+  for (uint16_t i = 0; i < bundle->num_pulses; i++)
+    radians[i] = ((float) ticks[i] - center) * scale;
+}
+
 // GETTERS
 
 // Get the general configuration data
@@ -105,44 +206,389 @@ struct General * deepdive_general(struct Driver * drv) {
 // Get the calibration data for the lighthouse with the given serial number
 struct Lighthouse * deepdive_lighthouse(struct Driver * drv, const char* id) {
   if (!drv) return NULL;
-  for (size_t i = 0; i < MAX_NUM_LIGHTHOUSES; i++) {
+  struct Lighthouse * lh = NULL;
+  pthread_mutex_lock(&drv->lock);
+  for (size_t i = 0; i < MAX_NUM_LIGHTHOUSES && !lh; i++) {
     if (strcmp(drv->lighthouses[i].serial, id) == 0)
-      return &drv->lighthouses[i];
+      lh = &drv->lighthouses[i];
   }
-  return NULL;
+  pthread_mutex_unlock(&drv->lock);
+  return lh;
 }
 
 // Get the calibration data for a tracker with the given serial number
 struct Tracker * deepdive_tracker(struct Driver * drv, const char* id) {
   if (!drv) return NULL;
-  for (size_t i = 0; i < drv->num_trackers; i++) {
-    if (strcmp(drv->trackers[i]->serial, id) == 0)
-      return drv->trackers[i];
+  struct Tracker * tracker = NULL;
+  pthread_mutex_lock(&drv->trackers_lock);
+  for (size_t i = 0; i < drv->num_trackers && !tracker; i++) {
+    if (drv->trackers[i]->attached && strcmp(drv->trackers[i]->serial, id) == 0)
+      tracker = drv->trackers[i];
+  }
+  pthread_mutex_unlock(&drv->trackers_lock);
+  return tracker;
+}
+
+// Get the lighthouse with the given id
+struct Lighthouse * deepdive_lighthouse_by_id(struct Driver * drv, uint8_t id) {
+  if (!drv || id >= MAX_NUM_LIGHTHOUSES) return NULL;
+  struct Lighthouse * lighthouse = NULL;
+  pthread_mutex_lock(&drv->lock);
+  if (drv->lighthouses[id].timestamp)
+    lighthouse = &drv->lighthouses[id];
+  pthread_mutex_unlock(&drv->lock);
+  return lighthouse;
+}
+
+// Get the tracker with the given id
+struct Tracker * deepdive_tracker_by_id(struct Driver * drv, uint16_t id) {
+  if (!drv) return NULL;
+  struct Tracker * tracker = NULL;
+  pthread_mutex_lock(&drv->trackers_lock);
+  if (id < drv->num_trackers)
+    tracker = drv->trackers[id];
+  pthread_mutex_unlock(&drv->trackers_lock);
+  return tracker;
+}
+
+// Copy the tracker list, so that callbacks run without holding its lock and
+// are free to call back into the driver. Trackers are only freed when the
+// driver is closed, and the list only ever grows, so the copy stays valid.
+static uint16_t snapshot(struct Driver * drv) {
+  pthread_mutex_lock(&drv->trackers_lock);
+  uint16_t n = drv->num_trackers;
+  if (n > drv->max_snapshot) {
+    struct Tracker ** trackers =
+      realloc(drv->snapshot, drv->max_trackers * sizeof(struct Tracker*));
+    if (trackers) {
+      drv->snapshot = trackers;
+      drv->max_snapshot = drv->max_trackers;
+    } else {
+      n = drv->max_snapshot;
+    }
+  }
+  if (n)
+    memcpy(drv->snapshot, drv->trackers, n * sizeof(struct Tracker*));
+  pthread_mutex_unlock(&drv->trackers_lock);
+  return n;
+}
+
+// Push new tracker configuration and unplug events to the callee, once each
+static void push_trackers(struct Driver * drv) {
+  // Lighthouses loaded from the cache are pushed ahead of any light data
+  if (!drv->lighthouses_pushed) {
+    for (size_t i = 0; i < MAX_NUM_LIGHTHOUSES; i++)
+      if (drv->lighthouse_fn && drv->lighthouses[i].provisional)
+        drv->lighthouse_fn(&drv->lighthouses[i]);
+    drv->lighthouses_pushed = 1;
+  }
+  uint16_t n = snapshot(drv);
+  for (size_t i = 0; i < n; i++) {
+    struct Tracker * tracker = drv->snapshot[i];
+    if (tracker->pushed == 0) {
+      if (drv->tracker_fn)
+        drv->tracker_fn(tracker);
+      tracker->pushed = 1;
+    }
+    if (tracker->pushed == 1 && !tracker->attached) {
+      if (drv->removal_fn)
+        drv->removal_fn(tracker);
+      tracker->pushed = 2;
+    }
+  }
+}
+
+// Dispatch a single queued event to the relevant callback
+static void dispatch(struct Tracker * tracker, struct Event * ev) {
+  struct Driver * drv = tracker->driver;
+  tracker->completed = ev->stamp;
+  if (ev->captured)
+    __atomic_store_n(&drv->captured, ev->captured, __ATOMIC_RELAXED);
+  switch (ev->type) {
+  case EVENT_LIGHT: {
+    // Append the pulses to the bundle, which then dispatches the callbacks
+    struct SweepBundle * b = &tracker->bundle;
+    uint16_t n = ev->light.num_sensors;
+    if (b->num_sweeps == MAX_BUNDLE_SWEEPS)
+      deepdive_data_light_flush(tracker);
+    memcpy(b->sensors + b->num_pulses, ev->light.sensors, n * sizeof(uint16_t));
+    memcpy(b->sweeptimes + b->num_pulses, ev->light.sweeptimes,
+      n * sizeof(uint32_t));
+    memcpy(b->angles + b->num_pulses, ev->light.angles, n * sizeof(uint32_t));
+    memcpy(b->lengths + b->num_pulses, ev->light.lengths, n * sizeof(uint16_t));
+    deepdive_data_light_sweep(tracker, ev->light.lighthouse, ev->light.axis,
+      ev->light.synctime, n);
+    break;
+  }
+  case EVENT_IMU:
+    if (drv->imu_fn)
+      drv->imu_fn(tracker, ev->imu.timecode, ev->imu.acc, ev->imu.gyr,
+        (ev->imu.has_mag ? ev->imu.mag : NULL));
+    break;
+  case EVENT_BUTTON:
+    if (drv->but_fn)
+      drv->but_fn(tracker, ev->button.mask, ev->button.trigger,
+        ev->button.horizontal, ev->button.vertical);
+    break;
+  case EVENT_LIGHTHOUSE:
+    if (drv->lighthouse_fn)
+      drv->lighthouse_fn(ev->lighthouse.lighthouse);
+    break;
+  }
+}
+
+// Deliver any sweep bundles that were batched during the last poll
+static void flush_bundles(struct Driver * drv) {
+  uint16_t n = snapshot(drv);
+  for (size_t i = 0; i < n; i++)
+    deepdive_data_light_flush(drv->snapshot[i]);
+}
+
+// Body of the USB thread
+static void * usb_thread(void * arg) {
+  struct Driver * drv = arg;
+  struct timeval tv = {0, THREAD_TIMEOUT_US};
+  while (__atomic_load_n(&drv->running, __ATOMIC_ACQUIRE)) {
+    if (drv->replay) {
+      if (deepdive_replay_poll(drv)) {
+        __atomic_store_n(&drv->finished, 1, __ATOMIC_RELEASE);
+        break;
+      }
+      deepdive_replay_wait(drv);
+    } else {
+      libusb_handle_events_timeout_completed(drv->usb, &tv, NULL);
+    }
   }
   return NULL;
 }
 
+// Called by libusb when it starts or stops using a descriptor
+static void pollfd_added(int fd, short events, void * user_data) {
+  struct Driver * drv = user_data;
+  if (drv->pollfd_fn)
+    drv->pollfd_fn(fd, events);
+}
+
+static void pollfd_removed(int fd, void * user_data) {
+  struct Driver * drv = user_data;
+  if (drv->pollfd_fn)
+    drv->pollfd_fn(fd, 0);
+}
+
+// Register a callback for when a descriptor is added, or removed (events = 0)
+void deepdive_install_pollfd_fn(struct Driver * drv, pollfd_func fbp) {
+  if (drv == NULL) return;
+  if (fbp) drv->pollfd_fn = fbp;
+  if (drv->usb)
+    libusb_set_pollfd_notifiers(drv->usb, pollfd_added, pollfd_removed, drv);
+}
+
+// Copy up to max descriptors to wait on, returning how many there are
+int deepdive_get_pollfds(struct Driver * drv, struct pollfd * fds, size_t max) {
+  if (drv == NULL) return -1;
+  // A replay is only ever driven by its timeout
+  if (drv->replay || drv->usb == NULL) return 0;
+  const struct libusb_pollfd ** list = libusb_get_pollfds(drv->usb);
+  if (list == NULL) return -1;
+  size_t n = 0;
+  for (; list[n]; n++) {
+    if (fds == NULL || n >= max)
+      continue;
+    fds[n].fd = list[n]->fd;
+    fds[n].events = list[n]->events;
+    fds[n].revents = 0;
+  }
+  libusb_free_pollfds(list);
+  return (int) n;
+}
+
+// Get the longest time to wait before handling events
+int deepdive_next_timeout(struct Driver * drv, struct timeval * tv) {
+  if (drv == NULL || tv == NULL) return -1;
+  if (drv->threaded) return -1;
+  if (drv->replay)
+    return deepdive_replay_timeout(drv, tv);
+  return libusb_get_next_timeout(drv->usb, tv);
+}
+
+// Get the capture time of the packet handed to the callbacks
+int deepdive_replay_time(struct Driver * drv, uint64_t * ns) {
+  if (drv == NULL || ns == NULL) return -1;
+  if (!drv->replay) return -1;
+  *ns = __atomic_load_n(&drv->captured, __ATOMIC_RELAXED);
+  return (*ns ? 0 : -1);
+}
+
+// Handle whatever is ready without blocking
+int deepdive_handle_ready(struct Driver * drv) {
+  if (drv == NULL) return -1;
+  // In threaded mode the USB thread owns event handling
+  if (drv->threaded) return -1;
+  // Push general and tracker config
+  push_trackers(drv);
+  // Handle completed USB events, or the packets of a replay that are due
+  int ret;
+  if (drv->replay) {
+    ret = deepdive_replay_poll(drv);
+  } else {
+    struct timeval tv = {0, 0};
+    ret = libusb_handle_events_timeout_completed(drv->usb, &tv, NULL);
+  }
+  flush_bundles(drv);
+  return ret;
+}
+
 // Poll the driver for events
 int deepdive_poll(struct Driver * drv) {
   if (drv == NULL) return -1;
+  // In threaded mode the USB thread does the work, so we just drain
+  if (drv->threaded) {
+    int finished = __atomic_load_n(&drv->finished, __ATOMIC_ACQUIRE);
+    int n = deepdive_drain(drv, 0);
+    if (n == 0 && finished)
+      return 1;
+    if (n == 0)
+      usleep(1000);
+    return (n < 0 ? n : 0);
+  }
   // Push general and tracker config
-  if (drv->pushed == 0) {
-    for (size_t i = 0; i < drv->num_trackers; i++)
-      if (drv->tracker_fn)
-        drv->tracker_fn(drv->trackers[i]);
-    drv->pushed = 1;
+  push_trackers(drv);
+  // Handle any USB events, or the next chunk of a replay
+  int ret = (drv->replay ? deepdive_replay_poll(drv)
+                         : libusb_handle_events(drv->usb));
+  flush_bundles(drv);
+  // Replay polls never block, so wait here for the next packet to fall due
+  if (drv->replay && ret == 0)
+    deepdive_replay_wait(drv);
+  return ret;
+}
+
+// Start handling USB events on a dedicated thread, queueing them per tracker
+int deepdive_start(struct Driver * drv) {
+  if (drv == NULL) return -1;
+  if (drv->threaded) return 0;
+  // Each tracker gets its own queue, so there is only ever one producer
+  pthread_mutex_lock(&drv->trackers_lock);
+  for (size_t i = 0; i < drv->num_trackers; i++) {
+    drv->trackers[i]->ring = deepdive_ring_alloc();
+    if (drv->trackers[i]->ring == NULL) {
+      printf("Could not allocate event queue\n");
+      goto fail;
+    }
+  }
+  __atomic_store_n(&drv->threaded, 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&drv->running, 1, __ATOMIC_RELEASE);
+  if (pthread_create(&drv->thread, NULL, usb_thread, drv)) {
+    printf("Could not start USB thread\n");
+    drv->threaded = 0;
+    drv->running = 0;
+    goto fail;
+  }
+  pthread_mutex_unlock(&drv->trackers_lock);
+  return 0;
+fail:
+  for (size_t i = 0; i < drv->num_trackers; i++) {
+    deepdive_ring_free(drv->trackers[i]->ring);
+    drv->trackers[i]->ring = NULL;
+  }
+  pthread_mutex_unlock(&drv->trackers_lock);
+  return -1;
+}
+
+// Stop the USB thread and dispatch any events that are still queued
+int deepdive_stop(struct Driver * drv) {
+  if (drv == NULL) return -1;
+  if (!drv->threaded) return 0;
+  __atomic_store_n(&drv->running, 0, __ATOMIC_RELEASE);
+  pthread_join(drv->thread, NULL);
+  deepdive_drain(drv, 0);
+  pthread_mutex_lock(&drv->trackers_lock);
+  __atomic_store_n(&drv->threaded, 0, __ATOMIC_RELEASE);
+  for (size_t i = 0; i < drv->num_trackers; i++) {
+    deepdive_ring_free(drv->trackers[i]->ring);
+    drv->trackers[i]->ring = NULL;
+  }
+  pthread_mutex_unlock(&drv->trackers_lock);
+  return 0;
+}
+
+// Dispatch up to max (0 = all) queued events on the calling thread
+int deepdive_drain(struct Driver * drv, size_t max) {
+  if (drv == NULL) return -1;
+  if (!drv->threaded) return -1;
+  // Push general and tracker config
+  push_trackers(drv);
+  // Round-robin over the trackers so that one busy device can't starve others
+  size_t n = 0, active = 1;
+  uint16_t num = snapshot(drv);
+  while (active && (max == 0 || n < max)) {
+    active = 0;
+    for (size_t i = 0; i < num && (max == 0 || n < max); i++) {
+      struct Tracker * tracker = drv->snapshot[i];
+      struct Ring * ring = tracker->ring;
+      if (ring == NULL)
+        continue;
+      struct Event * ev = deepdive_ring_peek(ring);
+      if (ev == NULL)
+        continue;
+      dispatch(tracker, ev);
+      if (ev->stamp)
+        deepdive_stats_latency(tracker, ev->stamp);
+      deepdive_ring_release(ring);
+      active = 1;
+      n++;
+    }
+  }
+  flush_bundles(drv);
+  return (int) n;
+}
+
+// Get the event queue statistics for a tracker (threaded mode only)
+int deepdive_queue_stats(struct Tracker * tracker, struct QueueStats * stats) {
+  if (tracker == NULL || stats == NULL) return -1;
+  if (tracker->ring == NULL) return -1;
+  deepdive_ring_stats(tracker->ring, stats);
+  return 0;
+}
+
+// Get the decoder statistics for a tracker, or summed over all trackers
+int deepdive_stats(struct Driver * drv, struct Tracker * tracker,
+  struct Stats * stats) {
+  if (drv == NULL || stats == NULL) return -1;
+  memset(stats, 0, sizeof(struct Stats));
+  int found = 0;
+  pthread_mutex_lock(&drv->trackers_lock);
+  for (size_t i = 0; i < drv->num_trackers; i++) {
+    if (tracker && drv->trackers[i] != tracker)
+      continue;
+    deepdive_stats_add(stats, &drv->trackers[i]->stats);
+    found++;
   }
-  // Handle any USB events
-  return libusb_handle_events(drv->usb);
+  pthread_mutex_unlock(&drv->trackers_lock);
+  return (tracker && !found ? -1 : 0);
 }
 
 // Close the driver and clean up memory
 void deepdive_close(struct Driver * drv) {
   if (drv == NULL) return;
+  deepdive_stop(drv);
+  deepdive_usb_close(drv);
   for (size_t i = 0; i < drv->num_trackers; i++) {
-    libusb_close(drv->trackers[i]->udev);
+    if (drv->trackers[i]->udev)
+      libusb_close(drv->trackers[i]->udev);
+    if (drv->trackers[i]->dev)
+      libusb_unref_device(drv->trackers[i]->dev);
+    deepdive_ring_free(drv->trackers[i]->ring);
     free(drv->trackers[i]);
   }
-  libusb_exit(drv->usb);
+  free(drv->trackers);
+  free(drv->snapshot);
+  deepdive_capture_close(drv);
+  deepdive_replay_close(drv);
+  if (drv->usb)
+    libusb_exit(drv->usb);
+  pthread_mutex_destroy(&drv->trackers_lock);
+  pthread_mutex_destroy(&drv->lock);
+  pthread_mutex_destroy(&drv->cache_lock);
   free(drv);
 }
@@ -36,6 +36,9 @@
 
 #include <libusb-1.0/libusb.h>
 
+#include <poll.h>
+#include <pthread.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -46,9 +49,11 @@
 #define PREAMBLE_LENGTH       17
 
 #define MAX_NUM_LIGHTHOUSES   2
-#define MAX_NUM_TRACKERS      128
 #define MAX_NUM_SENSORS       32
 #define MAX_SERIAL_LENGTH     32
+#define MAX_PATH_LENGTH       256
+#define MAX_BUNDLE_SWEEPS     16
+#define MAX_BUNDLE_PULSES     (MAX_BUNDLE_SWEEPS * MAX_NUM_SENSORS)
 #define USB_INT_BUFF_LENGTH   64
 
 #define USB_VEND_HTC          0x28de
@@ -60,6 +65,11 @@
 #define USB_ENDPOINT_LIGHT    0x82
 #define USB_ENDPOINT_BUTTONS  0x83
 #define MAX_ENDPOINTS         3
+#define MAX_TRANSFERS         16
+#define DEFAULT_TRANSFERS     4
+#define MAX_USB_ERRORS        8
+#define NUM_FAULTS            7
+#define NUM_LATENCY_BINS      24
 
 #define DEFAULT_ACC_SCALE     (float)(9.80665/4096.0)
 #define DEFAULT_GYR_SCALE     (float)((1./32.768)*(3.14159/180.));
@@ -67,6 +77,9 @@
 // Forward declaration of driver context
 struct Driver;
 struct Tracker;
+struct Ring;
+struct Capture;
+struct Replay;
 
 // Extrinsics axes
 typedef enum {
@@ -86,12 +99,27 @@ typedef enum {
   BUTTON_PAD_TOUCH  = (1<<28)
 } ButtonType;
 
-// Interrupt buffer for an endpoint
+// A single in-flight interrupt transfer and its buffer
+struct Transfer {
+  struct Endpoint *endpoint;                // Parent endpoint
+  struct libusb_transfer *tx;               // Libusb transfer
+  uint8_t done;                             // Completed, awaiting processing
+  int length;                               // Bytes received (-1 = error)
+  uint8_t buffer[USB_INT_BUFF_LENGTH];      // Receive buffer
+};
+
+// Interrupt buffers for an endpoint
 struct Endpoint {
-  struct Tracker *tracker;
-  CallbackType type;
-  struct libusb_transfer *tx;
-  uint8_t buffer[USB_INT_BUFF_LENGTH];
+  struct Tracker *tracker;                  // Parent tracker
+  CallbackType type;                        // What the endpoint carries
+  uint8_t num_transfers;                    // Transfers kept in flight
+  uint8_t next;                             // Next transfer to process
+  unsigned char address;                    // Endpoint address
+  uint8_t errors;                           // Consecutive failed transfers
+  uint8_t parked;                           // Transfers awaiting a restart
+  uint8_t stalled;                          // Halted, awaiting a clear
+  uint8_t failed;                           // Given up after repeated errors
+  struct Transfer transfers[MAX_TRANSFERS]; // Transfers in submission order
 };
 
 // Calibration for a given tracker
@@ -151,10 +179,63 @@ typedef struct {
   struct Lighthouse *lighthouse;  // Lighthouse reference...
 } OOTX;
 
+// A batch of sweeps stored as a structure of arrays. Sweep i owns the pulses
+// in the range [offsets[i], offsets[i] + counts[i]) of the pulse arrays.
+struct SweepBundle {
+  uint16_t num_sweeps;                                  // Sweeps in bundle
+  uint16_t num_pulses;                                  // Pulses in bundle
+  struct Lighthouse *lighthouses[MAX_BUNDLE_SWEEPS];    // Sweep lighthouse
+  uint8_t axes[MAX_BUNDLE_SWEEPS];                      // Sweep axis
+  uint32_t synctimes[MAX_BUNDLE_SWEEPS];                // Sweep sync time
+  uint16_t offsets[MAX_BUNDLE_SWEEPS];                  // First pulse
+  uint16_t counts[MAX_BUNDLE_SWEEPS];                   // Number of pulses
+  uint16_t sensors[MAX_BUNDLE_PULSES]
+    __attribute__((aligned(64)));                       // Pulse sensor
+  uint32_t sweeptimes[MAX_BUNDLE_PULSES]
+    __attribute__((aligned(64)));                       // Pulse time
+  uint32_t angles[MAX_BUNDLE_PULSES]
+    __attribute__((aligned(64)));                       // Pulse angle (ticks)
+  uint16_t lengths[MAX_BUNDLE_PULSES]
+    __attribute__((aligned(64)));                       // Pulse length
+} __attribute__((aligned(64)));
+
+// Decoder statistics for a tracker. Every field is a counter that only ever
+// increases. Latency bin 0 counts samples under 1us, and bin i > 0 counts
+// samples in [2^(i-1), 2^i) us, measured from USB completion to the return
+// of the callbacks for that packet.
+struct Stats {
+  uint64_t packets;                         // Packets decoded
+  uint64_t usb_errors;                      // Failed interrupt transfers
+  uint64_t usb_stalls;                      // Endpoint halts cleared
+  uint64_t faults[NUM_FAULTS];              // Watchman light faults by code
+  uint64_t bad_sensor;                      // Pulses with an invalid sensor
+  uint64_t bad_length;                      // Pulses that were too long
+  uint64_t syncs;                           // Sync pulses
+  uint64_t sweeps;                          // Sweeps emitted
+  uint64_t no_ootx;                         // Sweeps dropped awaiting OOTX
+  uint64_t ootx;                            // OOTX packets decoded
+  uint64_t ootx_crc;                        // OOTX packets failing CRC
+  uint64_t imu;                             // IMU samples
+  uint64_t buttons;                         // Button reports
+  uint64_t samples;                         // Latency samples
+  uint64_t latency[NUM_LATENCY_BINS];       // Latency histogram
+};
+
+// IMU samples of a tracker being averaged into one decimated sample
+struct ImuWindow {
+  uint32_t next;                            // Timecode at which it closes
+  uint32_t first;                           // Timecode of its first sample
+  uint32_t last;                            // Timecode of its newest sample
+  uint32_t count;                           // Samples averaged so far
+  double acc[3];                            // Sum of accelerometer counts
+  double gyr[3];                            // Sum of gyroscope counts
+};
+
 // Information about a tracked device
 struct Tracker {
   uint16_t type;                            // Tracker type
   struct Driver * driver;                   // Parent driver
+  struct libusb_device * dev;               // Device (for hotplug events)
   struct libusb_device_handle * udev;       // Udev handle
   char serial[MAX_SERIAL_LENGTH];           // Serial number
   struct Endpoint endpoints[MAX_ENDPOINTS]; // USB endpoints
@@ -167,6 +248,17 @@ struct Tracker {
   uint8_t axis[3];                          // Gravitational axis
   uint8_t buttonmask;                       // Buttom mask
   uint32_t timecode;                        // Timecode of last update
+  struct Ring * ring;                       // Event queue (threaded mode)
+  struct SweepBundle bundle;                // Sweeps awaiting delivery
+  uint8_t attached;                         // Still plugged in?
+  uint8_t added;                            // Listed by the driver yet?
+  uint8_t pushed;                           // 0 = new, 1 = pushed, 2 = removed
+  uint16_t capture_id;                      // Identifier in a capture file
+  uint16_t id;                              // Index in the tracker list
+  struct Stats stats;                       // Decoder statistics
+  struct ImuWindow imu;                     // IMU decimation state
+  uint64_t completed;                       // Completion time of the packet
+                                            // being handled (ns, 0 = untimed)
 };
 
 // Motor information
@@ -197,8 +289,9 @@ struct Motor {
 // Lighthouse information
 struct Lighthouse {
   uint32_t timestamp;                   // Time of last update (0 = invalud)
-  uint8_t id;                           // ID of this lighthouse
+  uint8_t id;                           // Slot in the lighthouse table
   uint16_t fw_version;                  // Firmware version
+  uint32_t serial_number;               // Serial number as sent over OOTX
   char serial[MAX_SERIAL_LENGTH];       // Unique serial number
   struct Motor motors[MAX_NUM_MOTORS];  // Motor calibration data
   float accel[3];                       // acceleration vector
@@ -206,6 +299,7 @@ struct Lighthouse {
   uint8_t hw_version;                   // Hardware version
   uint8_t mode_current;                 // Current mode (default: 0=A, 1=B, 2=C)
   uint8_t sys_faults;                   // "fault detect flags" (should be 0)
+  uint8_t provisional;                  // Loaded from cache, awaiting OOTX
 };
 
 // General configuration
@@ -230,25 +324,84 @@ typedef void (*but_func)(struct Tracker * tracker,
   uint32_t mask, uint16_t trigger, int16_t horizontal, int16_t vertical);
 typedef void (*tracker_func)(struct Tracker * tracker);
 typedef void (*lighthouse_func)(struct Lighthouse * lighthouse);
+typedef void (*bundle_func)(struct Tracker * tracker,
+  struct SweepBundle * bundle);
+typedef void (*pollfd_func)(int fd, short events);
+
+// Driver options
+struct Options {
+  uint8_t num_transfers;         // Interrupt transfers in flight per endpoint
+  uint8_t hotplug;               // Pick up devices plugged in after init
+  char cache_dir[MAX_PATH_LENGTH]; // Calibration cache ("" = disabled)
+  char capture[MAX_PATH_LENGTH]; // Record raw packets here ("" = disabled)
+  char replay[MAX_PATH_LENGTH];  // Replay this capture instead of USB
+  float speed;                   // Replay rate (1 = real time, 0 = max)
+  uint8_t imu_calibrate;         // Apply the IMU calibration in the driver
+  float imu_rate;                // IMU output rate in Hz (0 = every sample)
+  uint8_t timing;                // Time every packet, rather than a sample
+};
 
 // Driver context
 struct Driver {
   struct libusb_context* usb;
-  uint16_t num_trackers;
-  struct Tracker *trackers[MAX_NUM_TRACKERS];
+  uint16_t num_trackers;         // Number of trackers seen so far
+  uint16_t max_trackers;         // Allocated length of the tracker list
+  struct Tracker **trackers;     // Tracker list (grows with hotplug)
+  pthread_mutex_t trackers_lock; // Guards the tracker list
+  uint16_t max_snapshot;         // Allocated length of the snapshot
+  struct Tracker **snapshot;     // Tracker list copied for dispatching
   lig_func lig_fn;               // Called when new light data arrives
   imu_func imu_fn;               // Called when new IMU data arrives
   but_func but_fn;               // Called when new button data arrives
   tracker_func tracker_fn;       // Called when tracker cal info is ready
+  tracker_func removal_fn;       // Called when a tracker is unplugged
   lighthouse_func lighthouse_fn; // Called when lighthouse cal info is ready
+  bundle_func bundle_fn;         // Called when sweep bundles are ready
+  pollfd_func pollfd_fn;         // Called when the pollable descriptors change
+  uint8_t batched;               // Deliver bundles once per poll?
+  uint32_t imu_period;           // IMU output period in ticks (0 = all)
   struct Lighthouse lighthouses[MAX_NUM_LIGHTHOUSES];
+  pthread_mutex_t lock;          // Guards the lighthouse table
+  uint64_t lighthouses_changed;  // Lighthouse table generation
+  pthread_mutex_t cache_lock;    // Serializes lighthouse cache saves
+  uint64_t lighthouses_saved;    // Generation last saved to the cache
+  uint8_t lighthouses_pushed;    // Have we pushed the cached lighthouses?
   struct General general;        // General configuration
-  uint8_t pushed;                // Have we pushed thie tracker/general config
+  struct Options options;        // Options used to initialize the driver
+  libusb_hotplug_callback_handle hotplug; // Hotplug registration
+  uint8_t has_hotplug;           // Is hotplug registered?
+  int workers;                   // Background workers still running
+  struct Capture * capture;      // Raw packet capture
+  struct Replay * replay;        // Raw packet replay
+  uint64_t captured;             // Capture time of the replayed callbacks
+  int finished;                  // Has the replay reached the end?
+  uint8_t threaded;              // Are events being queued by a USB thread?
+  int running;                   // Should the USB thread keep running?
+  pthread_t thread;              // USB event thread
+};
+
+// Event queue statistics for a single tracker
+struct QueueStats {
+  uint64_t pushed;               // Events queued by the USB thread
+  uint64_t drained;              // Events dispatched by deepdive_drain
+  uint64_t dropped;              // Events dropped because the queue was full
+  uint32_t high_water;           // Largest observed queue depth
+  uint32_t depth;                // Current queue depth
 };
 
 // Initialize the driver
 struct Driver * deepdive_init();
 
+// Fill the options with their default values
+void deepdive_default_options(struct Options * opts);
+
+// Initialize the driver with the given options (NULL = defaults)
+struct Driver * deepdive_init_options(const struct Options * opts);
+
+// Create a driver with the given options (NULL = defaults) without opening
+// any devices, so that trackers can be added to it by hand
+struct Driver * deepdive_alloc(const struct Options * opts);
+
 // Register a light callback function
 void deepdive_install_light_fn(struct Driver * drv, lig_func fbp);
 
@@ -261,9 +414,20 @@ void deepdive_install_button_fn(struct Driver * drv, but_func fbp);
 // Register a tracker callback function
 void deepdive_install_tracker_fn(struct Driver * drv, tracker_func fbp);
 
+// Register a callback function for when a tracker is unplugged
+void deepdive_install_removal_fn(struct Driver * drv, tracker_func fbp);
+
 // Register a lighthouse callback function
 void deepdive_install_lighthouse_fn(struct Driver * drv, lighthouse_func fbp);
 
+// Register a sweep bundle callback, called per sweep or once per poll (batched)
+void deepdive_install_bundle_fn(struct Driver * drv, bundle_func fbp,
+  uint8_t batched);
+
+// Convert all pulse angles in a bundle from ticks to radians
+void deepdive_bundle_radians(struct Driver * drv,
+  const struct SweepBundle * bundle, float * radians);
+
 // Get the general configuration data
 struct General * deepdive_general(struct Driver * drv);
 
@@ -273,9 +437,66 @@ struct Lighthouse * deepdive_lighthouse(struct Driver * drv, const char* id);
 // Get the calibration data for a tracker with the given serial number
 struct Tracker * deepdive_tracker(struct Driver * tracker, const char* id);
 
+// Trackers and lighthouses are also given small integer ids when they are
+// first seen, which are passed to every callback as tracker->id and
+// lighthouse->id, so that callers can index arrays rather than compare
+// serials. A tracker keeps its id until it is unplugged, and ids are never
+// reused. A lighthouse id is its slot, which only passes to another
+// lighthouse if a cached one that was never heard from is replaced.
+
+// Get the lighthouse with the given id, or NULL if its slot was never filled
+struct Lighthouse * deepdive_lighthouse_by_id(struct Driver * drv, uint8_t id);
+
+// Get the tracker with the given id
+struct Tracker * deepdive_tracker_by_id(struct Driver * drv, uint16_t id);
+
 // Poll the driver for events
 int deepdive_poll(struct Driver * drv);
 
+// Rather than calling deepdive_poll, which blocks, the driver can be run from
+// an external event loop. Wait for any of its descriptors to become ready, or
+// for its next timeout to expire, and then call deepdive_handle_ready, which
+// never blocks. All callbacks are run from within deepdive_handle_ready.
+
+// Copy up to max descriptors to wait on, returning how many there are
+int deepdive_get_pollfds(struct Driver * drv, struct pollfd * fds, size_t max);
+
+// Register a callback for when a descriptor is added, or removed (events = 0)
+void deepdive_install_pollfd_fn(struct Driver * drv, pollfd_func fbp);
+
+// Get the longest time to wait before handling events. Returns 1 if tv was
+// set, and 0 if there is no timeout, so it is enough to wait on descriptors.
+int deepdive_next_timeout(struct Driver * drv, struct timeval * tv);
+
+// Handle whatever is ready without blocking (returns 1 at the end of replay)
+int deepdive_handle_ready(struct Driver * drv);
+
+// Start handling USB events on a dedicated thread, queueing them per tracker
+int deepdive_start(struct Driver * drv);
+
+// Stop the USB thread and dispatch any events that are still queued
+int deepdive_stop(struct Driver * drv);
+
+// Dispatch up to max (0 = all) queued events on the calling thread
+int deepdive_drain(struct Driver * drv, size_t max);
+
+// Get the event queue statistics for a tracker (threaded mode only)
+int deepdive_queue_stats(struct Tracker * tracker, struct QueueStats * stats);
+
+// Get the decoder statistics for a tracker, or summed over all trackers
+int deepdive_stats(struct Driver * drv, struct Tracker * tracker,
+  struct Stats * stats);
+
+// The callbacks for a timed packet can read tracker->completed, which is the
+// host monotonic time at which its transfer completed, or at which it was fed
+// to the decoders in a replay. With the timing option every packet is timed.
+
+// Get the wall clock time (ns) at which the packet whose callbacks are running,
+// or last ran, was captured. So a replay can be stamped as it was recorded, at
+// any speed, even when events are queued. Returns 0 if it was set, or -1 if
+// not replaying or before the first packet was handled.
+int deepdive_replay_time(struct Driver * drv, uint64_t * ns);
+
 // Close the driver and clean up memory
 void deepdive_close(struct Driver * drv);
 
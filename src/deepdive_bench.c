@@ -0,0 +1,532 @@
+/* 
+  Unofficial driver for Vive Trackers and up to two lighthouses, with an
+    emphasis on pulling tracker and lighthouse calibration data from devices.
+  
+  Adapted from: https://github.com/cnlohr/libsurvive
+  Which was based off: https://github.com/collabora/OSVR-Vive-Libre
+    Originally Copyright 2016 Philipp Zabel
+    Originally Copyright 2016 Lubosz Sarnecki <lubosz.sarnecki@collabora.co.uk>
+    Originally Copyright (C) 2013 Fredrik Hultin
+    Originally Copyright (C) 2013 Jakob Bornecrantz
+  Using documentation from: https://github.com/nairol/LighthouseRedox
+  
+  Copyright (c) 2017 Andrew Symington
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include <argtable2.h>
+#include <errno.h>
+#include <time.h>
+#include <zlib.h>
+
+#include <deepdive.h>
+#include "deepdive_usb.h"
+#include "deepdive_capture.h"
+
+/* Microbenchmarks for the packet decoders. Synthetic streams are generated
+   up front for a tracker and a watchman that see two lighthouses in B/C mode,
+   with each lighthouse broadcasting its OOTX frame one bit per sync pulse.
+   Packets are then fed straight to deepdive_usb_decode with no USB or I/O in
+   the loop. A capture file can be loaded into memory and timed the same way. */
+
+#define TICKS_PER_CYCLE   400000    // One sync cycle at 120Hz and 48MHz
+#define TICKS_TO_SLAVE    19200     // Master to slave sync separation
+#define TICKS_TO_SWEEP    150000    // Sync to first swept sensor
+#define TICKS_PER_SENSOR  10000     // Separation between swept sensors
+#define SWEPT_SENSORS     8         // Sensors hit on every sweep
+#define SWEEP_LENGTH      200       // Length of a sweep pulse
+#define WATCHMAN_PULSES   6         // Maximum pulses per watchman packet
+#define MAX_TRACKERS      64        // Maximum trackers in a capture
+
+// Allocation counter, which only counts while a benchmark is timed
+static volatile int counting_ = 0;
+static size_t allocs_ = 0;
+
+#ifdef __GLIBC__
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+// Interpose the allocator to count calls made by the library
+void *malloc(size_t size) {
+  if (counting_) allocs_++;
+  return __libc_malloc(size);
+}
+void *calloc(size_t nmemb, size_t size) {
+  if (counting_) allocs_++;
+  return __libc_calloc(nmemb, size);
+}
+void *realloc(void *ptr, size_t size) {
+  if (counting_) allocs_++;
+  return __libc_realloc(ptr, size);
+}
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+  if (counting_) allocs_++;
+  *ptr = __libc_memalign(alignment, size);
+  return (*ptr ? 0 : ENOMEM);
+}
+
+#endif
+
+// A single light pulse
+struct Pulse {
+  uint32_t time;
+  uint16_t sensor;
+  uint16_t length;
+};
+
+// A raw packet destined for a given tracker and endpoint
+struct Packet {
+  uint16_t id;
+  uint8_t type;
+  uint8_t length;
+  uint8_t data[64];
+};
+
+// A stream of packets, along with the trackers they belong to
+struct Stream {
+  size_t num;
+  size_t max;
+  struct Packet *packets;
+  uint16_t num_trackers;
+  uint16_t types[MAX_TRACKERS];
+  char serials[MAX_TRACKERS][MAX_SERIAL_LENGTH];
+  struct Calibration cals[MAX_TRACKERS];
+};
+
+// What the decoders produced
+static size_t sweeps_ = 0;
+static size_t pulses_ = 0;
+static size_t imus_ = 0;
+static size_t lighthouses_ = 0;
+
+static void bench_light(struct Tracker * tracker, struct Lighthouse * lighthouse,
+  uint8_t axis, uint32_t synctime, uint16_t num_sensors, uint16_t *sensors,
+    uint32_t *sweeptimes, uint32_t *angles, uint16_t *lengths) {
+  sweeps_++;
+  pulses_ += num_sensors;
+}
+
+static void bench_imu(struct Tracker * tracker, uint32_t timecode,
+  int16_t acc[3], int16_t gyr[3], int16_t mag[3]) {
+  imus_++;
+}
+
+static void bench_lighthouse(struct Lighthouse * lighthouse) {
+  lighthouses_++;
+}
+
+// Append a packet to the stream and return it
+static struct Packet * stream_add(struct Stream * s, uint16_t id,
+  uint8_t type, uint8_t length) {
+  if (s->num == s->max) {
+    s->max = (s->max ? 2 * s->max : 4096);
+    s->packets = realloc(s->packets, s->max * sizeof(struct Packet));
+    if (!s->packets) {
+      printf("Out of memory\n");
+      exit(1);
+    }
+  }
+  struct Packet * p = &s->packets[s->num++];
+  memset(p, 0, sizeof(struct Packet));
+  p->id = id;
+  p->type = type;
+  p->length = length;
+  return p;
+}
+
+// Release a stream
+static void stream_free(struct Stream * s) {
+  free(s->packets);
+  memset(s, 0, sizeof(struct Stream));
+}
+
+// Append a number of bits, most significant first
+static size_t put_bits(uint8_t *bits, size_t n, uint32_t val, int len) {
+  for (int i = len - 1; i >= 0; i--)
+    bits[n++] = (val >> i) & 1;
+  return n;
+}
+
+// Build the OOTX bitstream for a lighthouse, returning the number of bits
+static size_t ootx_bits(uint8_t lh, uint8_t *bits) {
+  uint8_t data[34];
+  memset(data, 0, sizeof(data));
+  uint16_t length = 33;
+  *(uint16_t*)(data + 0x00) = 0x0106;                   // fw_version
+  *(uint32_t*)(data + 0x02) = 0x5a5a0000 + lh;          // serial
+  *(uint16_t*)(data + 0x06) = 0x2e66;                   // phase 0
+  *(uint16_t*)(data + 0x08) = 0xae66;                   // phase 1
+  *(uint16_t*)(data + 0x0a) = 0x1c00;                   // tilt 0
+  *(uint16_t*)(data + 0x0c) = 0x9c00;                   // tilt 1
+  data[0x0f] = 9;                                       // hw_version
+  *(uint16_t*)(data + 0x10) = 0x0001;                   // curve 0 (denormal)
+  *(uint16_t*)(data + 0x12) = 0x8001;                   // curve 1 (denormal)
+  data[0x14] = 0; data[0x15] = 127; data[0x16] = 0;     // accel
+  *(uint16_t*)(data + 0x17) = 0x3c00;                   // gibphase 0
+  *(uint16_t*)(data + 0x19) = 0xbc00;                   // gibphase 1
+  *(uint16_t*)(data + 0x1b) = 0x2000;                   // gibmag 0
+  *(uint16_t*)(data + 0x1d) = 0xa000;                   // gibmag 1
+  data[0x1f] = 1 + lh;                                  // mode_current
+  uint32_t crc = crc32(crc32(0L, Z_NULL, 0), data, length);
+  // Preamble of 17 zeros and a one, then length, payload and CRC as 16 bit
+  // little-endian words, each followed by a sync bit
+  size_t n = put_bits(bits, 0, 1, 18);
+  n = put_bits(bits, n, ((length & 0xff) << 8) | (length >> 8), 16);
+  n = put_bits(bits, n, 1, 1);
+  for (uint16_t i = 0; i < length + (length % 2); i += 2) {
+    n = put_bits(bits, n, (data[i] << 8) | data[i + 1], 16);
+    n = put_bits(bits, n, 1, 1);
+  }
+  for (int i = 0; i < 4; i += 2) {
+    n = put_bits(bits, n, (((crc >> (8 * i)) & 0xff) << 8)
+      | ((crc >> (8 * (i + 1))) & 0xff), 16);
+    n = put_bits(bits, n, 1, 1);
+  }
+  return n;
+}
+
+// Generate a time-ordered pulse train for the given number of sync cycles,
+// sweeping each lighthouse axis in turn. Without sweeps only the sync pulses
+// are generated, which makes for an OOTX-only stream.
+static size_t generate_pulses(size_t cycles, int sweeps, struct Pulse **out) {
+  uint8_t bits[MAX_NUM_LIGHTHOUSES][512];
+  size_t num_bits[MAX_NUM_LIGHTHOUSES];
+  for (uint8_t lh = 0; lh < MAX_NUM_LIGHTHOUSES; lh++)
+    num_bits[lh] = ootx_bits(lh, bits[lh]);
+  size_t n = 0;
+  struct Pulse *p = malloc(cycles * (2 + SWEPT_SENSORS) * sizeof(struct Pulse));
+  if (!p) {
+    printf("Out of memory\n");
+    exit(1);
+  }
+  uint32_t t = 1000;
+  for (size_t c = 0; c < cycles; c++, t += TICKS_PER_CYCLE) {
+    uint8_t active = (c / 2) % MAX_NUM_LIGHTHOUSES;
+    uint8_t axis = c % 2;
+    for (uint8_t lh = 0; lh < MAX_NUM_LIGHTHOUSES; lh++) {
+      uint8_t acode = axis | (bits[lh][c % num_bits[lh]] << 1)
+        | ((sweeps && lh == active ? 0 : 1) << 2);
+      p[n].time = t + lh * TICKS_TO_SLAVE;
+      p[n].sensor = lh;
+      p[n].length = 2750 + 500 * acode + 250;
+      n++;
+    }
+    if (!sweeps)
+      continue;
+    for (uint16_t s = 0; s < SWEPT_SENSORS; s++) {
+      p[n].time = t + TICKS_TO_SWEEP + s * TICKS_PER_SENSOR + 37 * axis;
+      p[n].sensor = s;
+      p[n].length = SWEEP_LENGTH;
+      n++;
+    }
+  }
+  *out = p;
+  return n;
+}
+
+// Pack pulses into tracker light packets of seven pulses each
+static void packetize_tracker(struct Stream *s, const struct Pulse *p, size_t n) {
+  for (size_t i = 0; i < n; i += 7) {
+    struct Packet *pkt = stream_add(s, 0, TRACKER_LIGHT, 64);
+    for (size_t j = 0; j < 7; j++) {
+      uint8_t *rec = pkt->data + j * 8 + 1;
+      if (i + j >= n) {
+        *(uint16_t*)(rec + 0) = 0xffff;
+        continue;
+      }
+      *(uint16_t*)(rec + 0) = p[i + j].sensor;
+      *(uint16_t*)(rec + 2) = p[i + j].length;
+      *(uint32_t*)(rec + 4) = p[i + j].time;
+    }
+  }
+}
+
+// Append a varint in the order the watchman decoder reads it backwards
+static size_t put_arcane(uint8_t *buf, size_t n, uint32_t val) {
+  buf[n++] = (val & 0x7f) | 0x80;
+  for (val >>= 7; val; val >>= 7)
+    buf[n++] = val & 0x7f;
+  return n;
+}
+
+// Pack pulses into watchman light packets. Each packet holds one LED byte
+// per pulse, followed by the edge times as deltas back from the most recent
+// edge in the packet, whose low 24 bits come last.
+static void packetize_watchman(struct Stream *s, const struct Pulse *p, size_t n) {
+  for (size_t i = 0; i < n; i += WATCHMAN_PULSES) {
+    size_t num = (n - i < WATCHMAN_PULSES ? n - i : WATCHMAN_PULSES);
+    // Edges from the most recent backwards: end, start, end, start...
+    uint32_t times[2 * WATCHMAN_PULSES];
+    for (size_t j = 0; j < num; j++) {
+      const struct Pulse *q = &p[i + num - 1 - j];
+      times[2 * j] = q->time + q->length;
+      times[2 * j + 1] = q->time;
+    }
+    struct Packet *pkt = stream_add(s, 0, WATCHMAN, 0);
+    uint8_t *region = pkt->data + 4;
+    size_t len = 0;
+    for (size_t j = 0; j < num; j++)
+      region[len++] = p[i + num - 1 - j].sensor << 3;
+    for (size_t k = 2 * num - 1; k > 0; k--)
+      len = put_arcane(region, len, times[k - 1] - times[k]);
+    region[len++] = times[0] & 0xff;
+    region[len++] = (times[0] >> 8) & 0xff;
+    region[len++] = (times[0] >> 16) & 0xff;
+    pkt->data[0] = 35;
+    pkt->data[1] = times[0] >> 24;
+    pkt->data[2] = len + 1;
+    pkt->data[3] = 0;
+    pkt->length = 4 + len;
+  }
+}
+
+// Generate IMU packets at 1kHz for the given number of sync cycles
+static void generate_imu(struct Stream *s, size_t cycles, int watchman) {
+  size_t num = cycles * TICKS_PER_CYCLE / 48000;
+  for (size_t i = 0; i < num; i++) {
+    uint32_t t = 1000 + i * 48000;
+    int16_t v[6] = {(int16_t)(i % 64), -12, 4096, 3, (int16_t)-(i % 32), 1};
+    struct Packet *pkt;
+    if (watchman) {
+      pkt = stream_add(s, 0, WATCHMAN, 18);
+      pkt->data[0] = 35;
+      pkt->data[1] = t >> 24;
+      pkt->data[2] = 15;
+      pkt->data[3] = (t >> 16) & 0xff;
+      pkt->data[4] = 0xe8;
+      pkt->data[5] = (t >> 8) & 0xff;
+      memcpy(pkt->data + 6, v, sizeof(v));
+    } else {
+      pkt = stream_add(s, 0, TRACKER_IMU, 52);
+      pkt->data[0] = 32;
+      memcpy(pkt->data + 1, v, sizeof(v));
+      *(uint32_t*)(pkt->data + 13) = t;
+    }
+  }
+}
+
+// Load a capture file into memory
+static int load_capture(struct Stream *s, const char *path) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    printf("Could not open capture %s\n", path);
+    return -1;
+  }
+  struct CaptureHeader hdr;
+  if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != CAPTURE_MAGIC
+    || hdr.version != CAPTURE_VERSION
+      || hdr.cal_size != sizeof(struct Calibration)) {
+    printf("Capture %s is not compatible with this build\n", path);
+    fclose(fp);
+    return -2;
+  }
+  uint16_t ids[MAX_TRACKERS];
+  int kind;
+  while ((kind = fgetc(fp)) != EOF) {
+    ungetc(kind, fp);
+    if (kind == CAPTURE_TRACKER) {
+      struct CaptureTracker rec;
+      if (fread(&rec, sizeof(rec), 1, fp) != 1)
+        break;
+      if (s->num_trackers == MAX_TRACKERS) {
+        printf("Too many trackers in capture\n");
+        break;
+      }
+      ids[s->num_trackers] = rec.id;
+      s->types[s->num_trackers] = rec.type;
+      memcpy(s->serials[s->num_trackers], rec.serial, MAX_SERIAL_LENGTH);
+      s->serials[s->num_trackers][MAX_SERIAL_LENGTH - 1] = '\0';
+      s->cals[s->num_trackers] = rec.cal;
+      s->num_trackers++;
+    } else if (kind == CAPTURE_PACKET) {
+      struct CapturePacket rec;
+      uint8_t data[256];
+      if (fread(&rec, sizeof(rec), 1, fp) != 1
+        || fread(data, 1, rec.length, fp) != rec.length)
+        break;
+      uint16_t idx;
+      for (idx = 0; idx < s->num_trackers; idx++)
+        if (ids[idx] == rec.id) break;
+      if (idx == s->num_trackers || rec.length > 64)
+        continue;
+      struct Packet *pkt = stream_add(s, idx, rec.type, rec.length);
+      memcpy(pkt->data, data, rec.length);
+    } else {
+      printf("Corrupt record in capture %s\n", path);
+      break;
+    }
+  }
+  fclose(fp);
+  return 0;
+}
+
+// Create a driver that is not attached to any USB devices
+static struct Driver * create_driver(struct Stream *s) {
+  struct Options opts;
+  deepdive_default_options(&opts);
+  opts.cache_dir[0] = '\0';
+  struct Driver * drv = deepdive_alloc(&opts);
+  if (!drv)
+    return NULL;
+  drv->lig_fn = bench_light;
+  drv->imu_fn = bench_imu;
+  drv->lighthouse_fn = bench_lighthouse;
+  for (uint16_t i = 0; i < (s->num_trackers ? s->num_trackers : 1); i++) {
+    struct Tracker * tracker = NULL;
+    if (posix_memalign((void**)&tracker, 64, sizeof(struct Tracker))) {
+      deepdive_close(drv);
+      return NULL;
+    }
+    memset(tracker, 0, sizeof(struct Tracker));
+    tracker->driver = drv;
+    if (s->num_trackers) {
+      tracker->type = s->types[i];
+      strcpy(tracker->serial, s->serials[i]);
+      tracker->cal = s->cals[i];
+    }
+    if (deepdive_usb_add(drv, tracker)) {
+      free(tracker);
+      deepdive_close(drv);
+      return NULL;
+    }
+  }
+  return drv;
+}
+
+// Get the current monotonic time in nanoseconds
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Decode the stream several times with fresh state, reporting the best run
+static void run(const char *name, struct Stream *s, int repeat) {
+  uint64_t best = UINT64_MAX;
+  size_t allocs = 0;
+  for (int r = 0; r < repeat; r++) {
+    struct Driver * drv = create_driver(s);
+    if (!drv) {
+      printf("Could not create driver\n");
+      return;
+    }
+    sweeps_ = pulses_ = imus_ = lighthouses_ = 0;
+    allocs_ = 0;
+    counting_ = 1;
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < s->num; i++) {
+      struct Packet *p = &s->packets[i];
+      deepdive_usb_decode(drv->trackers[p->id], p->type, p->data, p->length);
+    }
+    uint64_t elapsed = now_ns() - start;
+    counting_ = 0;
+    if (elapsed < best) {
+      best = elapsed;
+      allocs = allocs_;
+    }
+    deepdive_close(drv);
+  }
+  double ns = (s->num ? (double) best / s->num : 0.0);
+  printf("%-16s %10zu %10.1f %12.0f %8.3f %8zu %8zu %8zu %4zu\n", name, s->num,
+    ns, (ns > 0 ? 1e9 / ns : 0.0), (s->num ? (double) allocs / s->num : 0.0),
+      sweeps_, pulses_, imus_, lighthouses_);
+}
+
+// Main entry point for application
+int main(int argc, char **argv) {
+  // Get commandline arguments
+  struct arg_int  *cycles  = arg_int0("c", "cycles", "<n>", "sync cycles to synthesize (default 50000)");
+  struct arg_int  *repeat  = arg_int0("n", "repeat", "<n>", "runs per benchmark, best is kept (default 5)");
+  struct arg_str  *replay  = arg_str0("r", "read", "<file>", "also decode a recorded capture");
+  struct arg_lit  *help    = arg_lit0(NULL, "help", "print this help and exit");
+  struct arg_end  *end     = arg_end(20);
+  void* argtable[] = {cycles, repeat, replay, help, end};
+  const char* progname = "deepdive_bench";
+  int nerrors, exitcode = 0;
+  if (arg_nullcheck(argtable) != 0) {
+    printf("%s: insufficient memory\n", progname);
+    exitcode = 1;
+    goto exit;
+  }
+  nerrors = arg_parse(argc, argv, argtable);
+  if (help->count > 0) {
+    printf("Usage: %s", progname);
+    arg_print_syntax(stdout, argtable, "\n");
+    printf("This program benchmarks the packet decoders.\n");
+    arg_print_glossary(stdout, argtable,"  %-25s %s\n");
+    exitcode = 0;
+    goto exit;
+  }
+  if (nerrors > 0) {
+    arg_print_errors(stdout,end,progname);
+    printf("Try '%s --help' for more information.\n", progname);
+    exitcode = 2;
+    goto exit;
+  }
+  size_t num_cycles = (cycles->count > 0 && cycles->ival[0] > 0
+    ? cycles->ival[0] : 50000);
+  int num_repeat = (repeat->count > 0 && repeat->ival[0] > 0
+    ? repeat->ival[0] : 5);
+
+  // Header
+  printf("%-16s %10s %10s %12s %8s %8s %8s %8s %4s\n", "benchmark", "packets",
+    "ns/packet", "packets/sec", "allocs", "sweeps", "pulses", "imu", "ootx");
+
+  // Synthetic tracker and watchman streams
+  struct Stream s;
+  struct Pulse *pulses;
+  size_t n;
+  memset(&s, 0, sizeof(s));
+  n = generate_pulses(num_cycles, 1, &pulses);
+  packetize_tracker(&s, pulses, n);
+  run("tracker_light", &s, num_repeat);
+  stream_free(&s);
+  packetize_watchman(&s, pulses, n);
+  run("watchman_light", &s, num_repeat);
+  stream_free(&s);
+  free(pulses);
+  n = generate_pulses(num_cycles, 0, &pulses);
+  packetize_tracker(&s, pulses, n);
+  run("ootx", &s, num_repeat);
+  stream_free(&s);
+  free(pulses);
+  generate_imu(&s, num_cycles, 0);
+  run("tracker_imu", &s, num_repeat);
+  stream_free(&s);
+  generate_imu(&s, num_cycles, 1);
+  run("watchman_imu", &s, num_repeat);
+  stream_free(&s);
+
+  // Recorded stream
+  if (replay->count > 0) {
+    if (load_capture(&s, replay->sval[0]) == 0)
+      run("capture", &s, num_repeat);
+    else
+      exitcode = 3;
+    stream_free(&s);
+  }
+
+exit:
+  arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+  return exitcode;
+}
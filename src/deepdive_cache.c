@@ -0,0 +1,255 @@
+/* 
+  Unofficial driver for Vive Trackers and up to two lighthouses, with an
+    emphasis on pulling tracker and lighthouse calibration data from devices.
+  
+  Adapted from: https://github.com/cnlohr/libsurvive
+  Which was based off: https://github.com/collabora/OSVR-Vive-Libre
+    Originally Copyright 2016 Philipp Zabel
+    Originally Copyright 2016 Lubosz Sarnecki <lubosz.sarnecki@collabora.co.uk>
+    Originally Copyright (C) 2013 Fredrik Hultin
+    Originally Copyright (C) 2013 Jakob Bornecrantz
+  Using documentation from: https://github.com/nairol/LighthouseRedox
+  
+  Copyright (c) 2017 Andrew Symington
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "deepdive_cache.h"
+
+#include <sys/stat.h>
+#include <stddef.h>
+#include <zlib.h>
+#include <errno.h>
+
+// Bump the version whenever the meaning of the calibration changes. Layout
+// changes are picked up automatically through the size field.
+#define CACHE_MAGIC           0x43444444  // "DDDC"
+#define CACHE_VERSION         1
+
+// On-disk image of a tracker calibration
+struct CacheEntry {
+  uint32_t magic;                   // Always CACHE_MAGIC
+  uint32_t version;                 // Format version
+  uint32_t size;                    // Size of the calibration structure
+  uint16_t type;                    // USB product ID
+  uint16_t firmware;                // USB device release number
+  char serial[MAX_SERIAL_LENGTH];   // Serial number from the configuration
+  struct Calibration cal;           // Calibration data
+  uint32_t crc;                     // CRC32 of all fields above
+};
+
+// On-disk image of the lighthouse table
+struct CacheLighthouses {
+  uint32_t magic;                   // Always CACHE_MAGIC
+  uint32_t version;                 // Format version
+  uint32_t size;                    // Size of the lighthouse structure
+  struct Lighthouse lighthouses[MAX_NUM_LIGHTHOUSES];
+  uint32_t crc;                     // CRC32 of all fields above
+};
+
+// Get the path to the cache entry for a given USB serial
+static int cache_path(struct Tracker * tracker, const char * usb_serial,
+  char * path, size_t len) {
+  const char * dir = tracker->driver->options.cache_dir;
+  if (dir[0] == '\0')
+    return -1;
+  if (snprintf(path, len, "%s/%s.cal", dir, usb_serial) >= (int) len)
+    return -1;
+  return 0;
+}
+
+// Create every directory along a path, ignoring those that already exist
+static int make_dirs(const char * dir) {
+  char tmp[MAX_PATH_LENGTH];
+  if (snprintf(tmp, sizeof(tmp), "%s", dir) >= (int) sizeof(tmp))
+    return -1;
+  for (char * p = tmp + 1; *p; p++) {
+    if (*p != '/')
+      continue;
+    *p = '\0';
+    if (mkdir(tmp, 0755) && errno != EEXIST)
+      return -1;
+    *p = '/';
+  }
+  if (mkdir(tmp, 0755) && errno != EEXIST)
+    return -1;
+  return 0;
+}
+
+// Load the calibration for a tracker from the cache
+int deepdive_cache_load(struct Tracker * tracker,
+  const char * usb_serial, uint16_t firmware) {
+  char path[MAX_PATH_LENGTH];
+  if (cache_path(tracker, usb_serial, path, sizeof(path)))
+    return -1;
+  FILE * f = fopen(path, "rb");
+  if (!f)
+    return -2;
+  struct CacheEntry entry;
+  size_t n = fread(&entry, sizeof(entry), 1, f);
+  fclose(f);
+  if (n != 1)
+    return -3;
+  // Check that the entry is intact and still describes this device
+  if (entry.magic != CACHE_MAGIC
+   || entry.version != CACHE_VERSION
+   || entry.size != sizeof(struct Calibration)
+   || entry.type != tracker->type
+   || entry.firmware != firmware
+   || entry.crc != crc32(0L, (const Bytef *) &entry,
+        offsetof(struct CacheEntry, crc))) {
+    printf("Cached calibration for %s is stale\n", usb_serial);
+    return -4;
+  }
+  entry.serial[MAX_SERIAL_LENGTH - 1] = '\0';
+  strcpy(tracker->serial, entry.serial);
+  memcpy(&tracker->cal, &entry.cal, sizeof(struct Calibration));
+  printf("Read cached calibration data for tracker %s\n", tracker->serial);
+  return 0;
+}
+
+// Store the calibration for a tracker in the cache
+int deepdive_cache_save(struct Tracker * tracker,
+  const char * usb_serial, uint16_t firmware) {
+  char path[MAX_PATH_LENGTH], tmp[MAX_PATH_LENGTH + 4];
+  if (cache_path(tracker, usb_serial, path, sizeof(path)))
+    return -1;
+  if (make_dirs(tracker->driver->options.cache_dir))
+    return -2;
+  struct CacheEntry entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.magic = CACHE_MAGIC;
+  entry.version = CACHE_VERSION;
+  entry.size = sizeof(struct Calibration);
+  entry.type = tracker->type;
+  entry.firmware = firmware;
+  snprintf(entry.serial, sizeof(entry.serial), "%s", tracker->serial);
+  memcpy(&entry.cal, &tracker->cal, sizeof(struct Calibration));
+  entry.crc = crc32(0L, (const Bytef *) &entry,
+    offsetof(struct CacheEntry, crc));
+  // Write to a temporary file and rename, so readers never see half an entry
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  FILE * f = fopen(tmp, "wb");
+  if (!f)
+    return -3;
+  size_t n = fwrite(&entry, sizeof(entry), 1, f);
+  if (fclose(f) || n != 1 || rename(tmp, path)) {
+    remove(tmp);
+    return -4;
+  }
+  return 0;
+}
+
+// Get the path to the lighthouse cache
+static int cache_path_lighthouses(struct Driver * drv, char * path, size_t len) {
+  const char * dir = drv->options.cache_dir;
+  if (dir[0] == '\0')
+    return -1;
+  if (snprintf(path, len, "%s/lighthouses.cal", dir) >= (int) len)
+    return -1;
+  return 0;
+}
+
+// Load the last known lighthouses into the driver as provisional records
+int deepdive_cache_load_lighthouses(struct Driver * drv) {
+  char path[MAX_PATH_LENGTH];
+  if (cache_path_lighthouses(drv, path, sizeof(path)))
+    return -1;
+  FILE * f = fopen(path, "rb");
+  if (!f)
+    return -2;
+  struct CacheLighthouses entry;
+  size_t n = fread(&entry, sizeof(entry), 1, f);
+  fclose(f);
+  if (n != 1)
+    return -3;
+  if (entry.magic != CACHE_MAGIC
+   || entry.version != CACHE_VERSION
+   || entry.size != sizeof(struct Lighthouse)
+   || entry.crc != crc32(0L, (const Bytef *) &entry,
+        offsetof(struct CacheLighthouses, crc))) {
+    printf("Cached lighthouse calibration is stale\n");
+    return -4;
+  }
+  // Slave lighthouses (mode C) sync second, everything else syncs first
+  pthread_mutex_lock(&drv->lock);
+  for (size_t i = 0; i < MAX_NUM_LIGHTHOUSES; i++) {
+    struct Lighthouse * lh = &entry.lighthouses[i];
+    if (!lh->timestamp)
+      continue;
+    lh->serial[MAX_SERIAL_LENGTH - 1] = '\0';
+    size_t slot = (lh->mode_current == 2 ? 1 : 0);
+    if (slot >= MAX_NUM_LIGHTHOUSES || drv->lighthouses[slot].timestamp)
+      continue;
+    memcpy(&drv->lighthouses[slot], lh, sizeof(struct Lighthouse));
+    drv->lighthouses[slot].id = slot;
+    drv->lighthouses[slot].provisional = 1;
+    printf("Read cached calibration data for lighthouse %s\n", lh->serial);
+  }
+  pthread_mutex_unlock(&drv->lock);
+  return 0;
+}
+
+// Write a lighthouse table to the cache file (call with the cache lock held)
+static int write_lighthouses(struct Driver * drv,
+  struct CacheLighthouses const * entry) {
+  char path[MAX_PATH_LENGTH], tmp[MAX_PATH_LENGTH + 4];
+  if (cache_path_lighthouses(drv, path, sizeof(path)))
+    return -1;
+  if (make_dirs(drv->options.cache_dir))
+    return -2;
+  // Write to a temporary file and rename, so readers never see half an entry
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  FILE * f = fopen(tmp, "wb");
+  if (!f)
+    return -3;
+  size_t n = fwrite(entry, sizeof(*entry), 1, f);
+  if (fclose(f) || n != 1 || rename(tmp, path)) {
+    remove(tmp);
+    return -4;
+  }
+  return 0;
+}
+
+// Store a copy of the lighthouse table (call without the driver lock held)
+int deepdive_cache_save_lighthouses(struct Driver * drv,
+  const struct Lighthouse * lighthouses, uint64_t generation) {
+  struct CacheLighthouses entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.magic = CACHE_MAGIC;
+  entry.version = CACHE_VERSION;
+  entry.size = sizeof(struct Lighthouse);
+  memcpy(entry.lighthouses, lighthouses, sizeof(entry.lighthouses));
+  for (size_t i = 0; i < MAX_NUM_LIGHTHOUSES; i++)
+    entry.lighthouses[i].provisional = 0;
+  entry.crc = crc32(0L, (const Bytef *) &entry,
+    offsetof(struct CacheLighthouses, crc));
+  // Saves are serialized, and a copy older than the one already written is
+  // dropped, so that a slow writer never replaces a newer table
+  int ret = 0;
+  pthread_mutex_lock(&drv->cache_lock);
+  if (generation > drv->lighthouses_saved) {
+    ret = write_lighthouses(drv, &entry);
+    if (ret == 0)
+      drv->lighthouses_saved = generation;
+  }
+  pthread_mutex_unlock(&drv->cache_lock);
+  return ret;
+}
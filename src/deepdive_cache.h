@@ -0,0 +1,59 @@
+/* 
+  Unofficial driver for Vive Trackers and up to two lighthouses, with an
+    emphasis on pulling tracker and lighthouse calibration data from devices.
+  
+  Adapted from: https://github.com/cnlohr/libsurvive
+  Which was based off: https://github.com/collabora/OSVR-Vive-Libre
+    Originally Copyright 2016 Philipp Zabel
+    Originally Copyright 2016 Lubosz Sarnecki <lubosz.sarnecki@collabora.co.uk>
+    Originally Copyright (C) 2013 Fredrik Hultin
+    Originally Copyright (C) 2013 Jakob Bornecrantz
+  Using documentation from: https://github.com/nairol/LighthouseRedox
+  
+  Copyright (c) 2017 Andrew Symington
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#ifndef LIBDEEPDIVE_DEEPDIVE_CACHE_H
+#define LIBDEEPDIVE_DEEPDIVE_CACHE_H
+
+#include <deepdive.h>
+
+// Load the calibration for a tracker from the cache. The entry is keyed by
+// USB serial, and is only valid for the same firmware and format version.
+// Watchman dongles are never cached, as their calibration follows the
+// device paired with them.
+int deepdive_cache_load(struct Tracker * tracker,
+  const char * usb_serial, uint16_t firmware);
+
+// Store the calibration for a tracker in the cache
+int deepdive_cache_save(struct Tracker * tracker,
+  const char * usb_serial, uint16_t firmware);
+
+// Load the last known lighthouses into the driver as provisional records,
+// each placed in the slot its mode suggests (A/B = first, C = second)
+int deepdive_cache_load_lighthouses(struct Driver * drv);
+
+// Store a copy of the lighthouse table, taken at the given generation, unless
+// a newer one has been stored (call without the driver lock held)
+int deepdive_cache_save_lighthouses(struct Driver * drv,
+  const struct Lighthouse * lighthouses, uint64_t generation);
+
+#endif
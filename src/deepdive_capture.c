@@ -0,0 +1,355 @@
+/* 
+  Unofficial driver for Vive Trackers and up to two lighthouses, with an
+    emphasis on pulling tracker and lighthouse calibration data from devices.
+  
+  Adapted from: https://github.com/cnlohr/libsurvive
+  Which was based off: https://github.com/collabora/OSVR-Vive-Libre
+    Originally Copyright 2016 Philipp Zabel
+    Originally Copyright 2016 Lubosz Sarnecki <lubosz.sarnecki@collabora.co.uk>
+    Originally Copyright (C) 2013 Fredrik Hultin
+    Originally Copyright (C) 2013 Jakob Bornecrantz
+  Using documentation from: https://github.com/nairol/LighthouseRedox
+  
+  Copyright (c) 2017 Andrew Symington
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "deepdive_capture.h"
+
+// Interface implementations
+#include "deepdive_usb.h"
+#include "deepdive_ring.h"
+
+#include <time.h>
+
+// Size of the stdio buffer used when capturing
+#define CAPTURE_BUFFER_LENGTH (1 << 20)
+
+// Packets decoded per poll when replaying as fast as possible
+#define REPLAY_CHUNK          1024
+
+// Longest we sleep in a single wait when replaying in real time
+#define REPLAY_MAX_SLEEP_NS   100000000ULL
+
+// How long to wait for a full queue to drain
+#define REPLAY_BACKOFF_NS     100000ULL
+
+// Leave room for the events a single packet can produce
+#define REPLAY_RING_SLACK     16
+
+// Capture state
+struct Capture {
+  FILE * f;                             // Output file
+  uint16_t num_trackers;                // Trackers recorded so far
+};
+
+// Replay state
+struct Replay {
+  FILE * f;                             // Input file
+  struct Tracker ** trackers;           // Trackers indexed by capture id
+  uint16_t max_trackers;                // Length of the tracker index
+  uint8_t have;                         // Is there a packet waiting?
+  uint8_t backlogged;                   // Is its tracker's queue too full?
+  struct CapturePacket pkt;             // The waiting packet
+  uint8_t data[USB_INT_BUFF_LENGTH];    // The waiting packet data
+  uint64_t first_ns;                    // Capture time of first packet
+  uint64_t start_ns;                    // Host time of first packet
+  uint64_t wall_ns;                     // Wall clock time at capture start
+  uint64_t mono_ns;                     // Monotonic time at capture start
+};
+
+// Host monotonic time in nanoseconds
+static uint64_t now_ns(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// CAPTURE
+
+// Start capturing to the file named in the driver options
+int deepdive_capture_open(struct Driver * drv) {
+  struct Capture * c = malloc(sizeof(struct Capture));
+  if (!c)
+    return -1;
+  memset(c, 0, sizeof(struct Capture));
+  c->f = fopen(drv->options.capture, "wb");
+  if (!c->f) {
+    printf("Could not open capture file %s\n", drv->options.capture);
+    free(c);
+    return -2;
+  }
+  setvbuf(c->f, NULL, _IOFBF, CAPTURE_BUFFER_LENGTH);
+  struct CaptureHeader hdr;
+  hdr.magic = CAPTURE_MAGIC;
+  hdr.version = CAPTURE_VERSION;
+  hdr.cal_size = sizeof(struct Calibration);
+  // The two clocks are read together, so packets map onto the wall clock
+  hdr.start_ns = now_ns(CLOCK_REALTIME);
+  hdr.mono_ns = now_ns(CLOCK_MONOTONIC);
+  if (fwrite(&hdr, sizeof(hdr), 1, c->f) != 1) {
+    fclose(c->f);
+    free(c);
+    return -3;
+  }
+  drv->capture = c;
+  return 0;
+}
+
+// Record a tracker, which must be done before any of its packets
+int deepdive_capture_tracker(struct Tracker * tracker) {
+  struct Capture * c = tracker->driver->capture;
+  if (!c)
+    return 0;
+  struct CaptureTracker rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.kind = CAPTURE_TRACKER;
+  rec.id = __atomic_fetch_add(&c->num_trackers, 1, __ATOMIC_RELAXED);
+  rec.type = tracker->type;
+  snprintf(rec.serial, sizeof(rec.serial), "%s", tracker->serial);
+  memcpy(&rec.cal, &tracker->cal, sizeof(struct Calibration));
+  tracker->capture_id = rec.id;
+  // A single write per record keeps records whole across threads
+  if (fwrite(&rec, sizeof(rec), 1, c->f) != 1)
+    return -1;
+  return 0;
+}
+
+// Record a raw packet received on the given endpoint type
+void deepdive_capture_packet(struct Tracker * tracker, CallbackType type,
+  const uint8_t * buf, int len) {
+  struct Capture * c = tracker->driver->capture;
+  if (!c || len < 0)
+    return;
+  if (len > USB_INT_BUFF_LENGTH)
+    len = USB_INT_BUFF_LENGTH;
+  uint8_t rec[sizeof(struct CapturePacket) + USB_INT_BUFF_LENGTH];
+  struct CapturePacket * pkt = (struct CapturePacket *) rec;
+  pkt->kind = CAPTURE_PACKET;
+  pkt->id = tracker->capture_id;
+  pkt->type = type;
+  pkt->length = len;
+  pkt->ns = now_ns(CLOCK_MONOTONIC);
+  memcpy(rec + sizeof(struct CapturePacket), buf, len);
+  fwrite(rec, sizeof(struct CapturePacket) + len, 1, c->f);
+}
+
+// Flush and close the capture
+void deepdive_capture_close(struct Driver * drv) {
+  struct Capture * c = drv->capture;
+  if (!c)
+    return;
+  fclose(c->f);
+  free(c);
+  drv->capture = NULL;
+}
+
+// REPLAY
+
+// Stand in for a recorded device
+static int replay_tracker(struct Driver * drv, struct Replay * r) {
+  struct CaptureTracker rec;
+  rec.kind = CAPTURE_TRACKER;
+  if (fread((uint8_t*)&rec + 1, sizeof(rec) - 1, 1, r->f) != 1)
+    return -1;
+  // Grow the index if needed
+  if (rec.id >= r->max_trackers) {
+    uint16_t max = rec.id + 8;
+    struct Tracker ** trackers =
+      realloc(r->trackers, max * sizeof(struct Tracker*));
+    if (!trackers)
+      return -2;
+    memset(trackers + r->max_trackers, 0,
+      (max - r->max_trackers) * sizeof(struct Tracker*));
+    r->trackers = trackers;
+    r->max_trackers = max;
+  }
+  // Allocate the tracker memory, aligned for the sweep bundle
+  struct Tracker * tracker = NULL;
+  if (posix_memalign((void**)&tracker, 64, sizeof(struct Tracker)))
+    return -3;
+  memset(tracker, 0, sizeof(struct Tracker));
+  tracker->driver = drv;
+  tracker->type = rec.type;
+  rec.serial[MAX_SERIAL_LENGTH - 1] = '\0';
+  strcpy(tracker->serial, rec.serial);
+  memcpy(&tracker->cal, &rec.cal, sizeof(struct Calibration));
+  tracker->attached = 1;
+  if (deepdive_usb_add(drv, tracker)) {
+    deepdive_ring_free(tracker->ring);
+    free(tracker);
+    return -4;
+  }
+  r->trackers[rec.id] = tracker;
+  printf("Replaying tracker %s\n", tracker->serial);
+  return 0;
+}
+
+// Read records until the next packet (returns 1 at the end of file)
+static int replay_next(struct Driver * drv, struct Replay * r) {
+  uint8_t kind;
+  while (!r->have) {
+    if (fread(&kind, 1, 1, r->f) != 1)
+      return 1;
+    switch (kind) {
+    case CAPTURE_TRACKER:
+      if (replay_tracker(drv, r))
+        return -1;
+      break;
+    case CAPTURE_PACKET:
+      r->pkt.kind = kind;
+      if (fread((uint8_t*)&r->pkt + 1, sizeof(r->pkt) - 1, 1, r->f) != 1)
+        return 1;
+      if (r->pkt.length > USB_INT_BUFF_LENGTH)
+        return -1;
+      if (fread(r->data, 1, r->pkt.length, r->f) != r->pkt.length)
+        return 1;
+      r->have = 1;
+      break;
+    default:
+      printf("Corrupt capture record (kind %u)\n", kind);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Open the capture named in the driver options and create its first trackers
+int deepdive_replay_init(struct Driver * drv) {
+  struct Replay * r = malloc(sizeof(struct Replay));
+  if (!r)
+    return 0;
+  memset(r, 0, sizeof(struct Replay));
+  r->f = fopen(drv->options.replay, "rb");
+  if (!r->f) {
+    printf("Could not open capture file %s\n", drv->options.replay);
+    free(r);
+    return 0;
+  }
+  struct CaptureHeader hdr;
+  if (fread(&hdr, sizeof(hdr), 1, r->f) != 1
+    || hdr.magic != CAPTURE_MAGIC
+    || hdr.version != CAPTURE_VERSION
+    || hdr.cal_size != sizeof(struct Calibration)) {
+    printf("Capture file %s is not compatible\n", drv->options.replay);
+    fclose(r->f);
+    free(r);
+    return 0;
+  }
+  r->wall_ns = hdr.start_ns;
+  r->mono_ns = hdr.mono_ns;
+  drv->replay = r;
+  // Trackers recorded at startup appear before the first packet
+  replay_next(drv, r);
+  return drv->num_trackers;
+}
+
+// Host time at which the waiting packet is due, when throttled
+static uint64_t replay_due(struct Driver * drv, struct Replay * r) {
+  return r->start_ns
+    + (uint64_t)((double)(r->pkt.ns - r->first_ns) / drv->options.speed);
+}
+
+// Feed the next due packets to the decoders (returns 1 at the end of file)
+int deepdive_replay_poll(struct Driver * drv) {
+  struct Replay * r = drv->replay;
+  if (!r)
+    return -1;
+  for (size_t n = 0; n < REPLAY_CHUNK; n++) {
+    int ret = replay_next(drv, r);
+    if (ret)
+      return (ret > 0 ? 1 : ret);
+    // The first packet anchors the capture timeline
+    if (!r->first_ns)
+      r->first_ns = r->pkt.ns;
+    // Throttle to the requested rate, if there is one
+    if (drv->options.speed > 0) {
+      uint64_t now = now_ns(CLOCK_MONOTONIC);
+      if (!r->start_ns)
+        r->start_ns = now;
+      if (replay_due(drv, r) > now)
+        return 0;
+    }
+    struct Tracker * tracker = (r->pkt.id < r->max_trackers
+      ? r->trackers[r->pkt.id] : NULL);
+    // Replaying faster than the consumer drains should not drop events, so
+    // the packet stays waiting until its queue has room
+    r->backlogged = (tracker && tracker->ring
+      && deepdive_ring_depth(tracker->ring) > RING_LENGTH - REPLAY_RING_SLACK);
+    if (r->backlogged)
+      return 0;
+    r->have = 0;
+    if (!tracker)
+      continue;
+    // Queued events carry the capture time to the callbacks, which may run
+    // later on another thread
+    uint64_t captured = r->wall_ns + (r->pkt.ns - r->mono_ns);
+    if (tracker->ring)
+      tracker->ring->captured = captured;
+    else
+      __atomic_store_n(&drv->captured, captured, __ATOMIC_RELAXED);
+    deepdive_usb_decode(tracker, r->pkt.type, r->data, r->pkt.length);
+  }
+  return 0;
+}
+
+// Get the time until the next packet is due. Until the first packet has been
+// read it is due straight away.
+int deepdive_replay_timeout(struct Driver * drv, struct timeval * tv) {
+  struct Replay * r = drv->replay;
+  if (!r)
+    return -1;
+  uint64_t ns = 0;
+  if (r->have && r->backlogged) {
+    ns = REPLAY_BACKOFF_NS;
+  } else if (r->have && r->start_ns && drv->options.speed > 0) {
+    uint64_t now = now_ns(CLOCK_MONOTONIC);
+    uint64_t due = replay_due(drv, r);
+    if (due > now)
+      ns = due - now;
+  }
+  tv->tv_sec = ns / 1000000000ULL;
+  tv->tv_usec = (ns % 1000000000ULL) / 1000;
+  return 1;
+}
+
+// Sleep until the next packet is due or its queue has room, but not so long
+// that a request to stop goes unnoticed
+void deepdive_replay_wait(struct Driver * drv) {
+  struct timeval tv;
+  if (deepdive_replay_timeout(drv, &tv) < 0)
+    return;
+  uint64_t ns = (uint64_t) tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL;
+  if (ns > REPLAY_MAX_SLEEP_NS)
+    ns = REPLAY_MAX_SLEEP_NS;
+  if (ns)
+    usleep(ns / 1000);
+}
+
+// Close the replay
+void deepdive_replay_close(struct Driver * drv) {
+  struct Replay * r = drv->replay;
+  if (!r)
+    return;
+  fclose(r->f);
+  free(r->trackers);
+  free(r);
+  drv->replay = NULL;
+}
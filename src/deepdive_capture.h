@@ -0,0 +1,109 @@
+/* 
+  Unofficial driver for Vive Trackers and up to two lighthouses, with an
+    emphasis on pulling tracker and lighthouse calibration data from devices.
+  
+  Adapted from: https://github.com/cnlohr/libsurvive
+  Which was based off: https://github.com/collabora/OSVR-Vive-Libre
+    Originally Copyright 2016 Philipp Zabel
+    Originally Copyright 2016 Lubosz Sarnecki <lubosz.sarnecki@collabora.co.uk>
+    Originally Copyright (C) 2013 Fredrik Hultin
+    Originally Copyright (C) 2013 Jakob Bornecrantz
+  Using documentation from: https://github.com/nairol/LighthouseRedox
+  
+  Copyright (c) 2017 Andrew Symington
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#ifndef LIBDEEPDIVE_DEEPDIVE_CAPTURE_H
+#define LIBDEEPDIVE_DEEPDIVE_CAPTURE_H
+
+#include <deepdive.h>
+
+/* A capture is an append-only stream of records that follows a short file
+   header. Tracker records carry everything needed to stand in for a device
+   (type, serial and calibration) and are written before the device streams.
+   Packet records carry one raw interrupt transfer and the host time at which
+   it completed. All fields are little-endian and packed.                  */
+
+#define CAPTURE_MAGIC         0x43524444  // "DDRC"
+#define CAPTURE_VERSION       2
+
+// Record types
+typedef enum {
+  CAPTURE_TRACKER   = 1,
+  CAPTURE_PACKET    = 2
+} CaptureKind;
+
+// File header
+struct CaptureHeader {
+  uint32_t magic;                       // Always CAPTURE_MAGIC
+  uint32_t version;                     // Format version
+  uint32_t cal_size;                    // Size of struct Calibration
+  uint64_t start_ns;                    // Wall clock time at start
+  uint64_t mono_ns;                     // Host monotonic time at start
+} __attribute__((packed));
+
+// Tracker record
+struct CaptureTracker {
+  uint8_t kind;                         // Always CAPTURE_TRACKER
+  uint16_t id;                          // Identifier used by packets
+  uint16_t type;                        // USB product ID
+  char serial[MAX_SERIAL_LENGTH];       // Serial number from configuration
+  struct Calibration cal;               // Calibration data
+} __attribute__((packed));
+
+// Packet record, followed by length bytes of data
+struct CapturePacket {
+  uint8_t kind;                         // Always CAPTURE_PACKET
+  uint16_t id;                          // Tracker identifier
+  uint8_t type;                         // Endpoint type (CallbackType)
+  uint8_t length;                       // Bytes of data that follow
+  uint64_t ns;                          // Host monotonic time
+} __attribute__((packed));
+
+// Start capturing to the file named in the driver options
+int deepdive_capture_open(struct Driver * drv);
+
+// Record a tracker, which must be done before any of its packets
+int deepdive_capture_tracker(struct Tracker * tracker);
+
+// Record a raw packet received on the given endpoint type
+void deepdive_capture_packet(struct Tracker * tracker, CallbackType type,
+  const uint8_t * buf, int len);
+
+// Flush and close the capture
+void deepdive_capture_close(struct Driver * drv);
+
+// Open the capture named in the driver options and create its first trackers
+int deepdive_replay_init(struct Driver * drv);
+
+// Feed the next due packets to the decoders (returns 1 at the end of file)
+int deepdive_replay_poll(struct Driver * drv);
+
+// Get the time until the next packet is due
+int deepdive_replay_timeout(struct Driver * drv, struct timeval * tv);
+
+// Block until the next packet is due
+void deepdive_replay_wait(struct Driver * drv);
+
+// Close the replay
+void deepdive_replay_close(struct Driver * drv);
+
+#endif
@@ -32,11 +32,27 @@
 */
 
 #include "deepdive_data_button.h"
+#include "deepdive_ring.h"
+#include "deepdive_stats.h"
 
 // Called when a new button event occurs
 void deepdive_data_button(struct Tracker * tracker,
   uint32_t mask, uint16_t trigger, int16_t horizontal, int16_t vertical) {
   tracker->buttonmask = mask;
-  if (tracker->driver->but_fn && (mask || trigger))
-    tracker->driver->but_fn(tracker, mask, trigger, horizontal, vertical);
+  STATS_INC(tracker->stats.buttons);
+  if (!tracker->driver->but_fn || !(mask || trigger))
+    return;
+  // In threaded mode queue a copy for the consumer to drain
+  if (tracker->ring) {
+    struct Event * ev = deepdive_ring_claim(tracker->ring);
+    if (ev == NULL) return;
+    ev->type = EVENT_BUTTON;
+    ev->button.mask = mask;
+    ev->button.trigger = trigger;
+    ev->button.horizontal = horizontal;
+    ev->button.vertical = vertical;
+    deepdive_ring_publish(tracker->ring);
+    return;
+  }
+  tracker->driver->but_fn(tracker, mask, trigger, horizontal, vertical);
 }
\ No newline at end of file
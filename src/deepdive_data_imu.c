@@ -32,10 +32,105 @@
 */
 
 #include "deepdive_data_imu.h"
+#include "deepdive_ring.h"
+#include "deepdive_stats.h"
+
+#include <math.h>
+
+// Physical units of one accelerometer and gyroscope count
+#define IMU_ACC_UNIT          (9.80665 / 4096.0)          // m/s^2
+#define IMU_GYR_UNIT          (M_PI / 180.0 / 32.768)     // rad/s
+
+// Round to the nearest count, saturating at the range of the sensor
+static int16_t imu_count(double x) {
+  x = round(x);
+  if (x > INT16_MAX) return INT16_MAX;
+  if (x < INT16_MIN) return INT16_MIN;
+  return (int16_t) x;
+}
+
+// Correct raw counts as true = scale * measured + bias, which is the model the
+// tracking filter estimates the errors with, and keep the result in counts. A
+// scale that was missing from the calibration is taken to be one.
+static void imu_calibrate(struct Calibration const* cal,
+  int16_t acc[3], int16_t gyr[3]) {
+  for (size_t i = 0; i < 3; i++) {
+    double as = (cal->acc_scale[i] != 0 ? cal->acc_scale[i] : 1.0);
+    double gs = (cal->gyr_scale[i] != 0 ? cal->gyr_scale[i] : 1.0);
+    acc[i] = imu_count(as * acc[i] + cal->acc_bias[i] / IMU_ACC_UNIT);
+    gyr[i] = imu_count(gs * gyr[i] + cal->gyr_bias[i] / IMU_GYR_UNIT);
+  }
+}
+
+// Average the samples in each output period, which is a linear-phase filter
+// with nulls at every multiple of the output rate, and so removes what would
+// alias onto the mean. The mean is stamped at the middle of its samples,
+// where it has no lag. Returns whether a decimated sample is ready.
+static int imu_decimate(struct Tracker * tracker, uint32_t period,
+  uint32_t * timecode, int16_t acc[3], int16_t gyr[3]) {
+  struct ImuWindow * w = &tracker->imu;
+  // A new window must close within a period, or we are starting out or have
+  // seen a gap in the samples
+  int32_t ahead = (int32_t)(w->next - *timecode);
+  if (w->count == 0 && (ahead <= 0 || ahead > (int32_t) period))
+    w->next = *timecode + period;
+  uint32_t spacing = (w->count ? *timecode - w->last : 0);
+  if (w->count == 0)
+    w->first = *timecode;
+  w->last = *timecode;
+  w->count++;
+  for (size_t i = 0; i < 3; i++) {
+    w->acc[i] += acc[i];
+    w->gyr[i] += gyr[i];
+  }
+  // Close the window if the next sample is expected to fall past its end
+  if ((int32_t)(*timecode + spacing - w->next) < 0)
+    return 0;
+  *timecode = w->first + (w->last - w->first) / 2;
+  for (size_t i = 0; i < 3; i++) {
+    acc[i] = imu_count(w->acc[i] / w->count);
+    gyr[i] = imu_count(w->gyr[i] / w->count);
+    w->acc[i] = 0;
+    w->gyr[i] = 0;
+  }
+  w->count = 0;
+  w->next += period;
+  return 1;
+}
 
 void deepdive_data_imu(struct Tracker * tracker,
   uint32_t timecode, int16_t acc[3], int16_t gyr[3], int16_t mag[3]) {
+  STATS_INC(tracker->stats.imu);
+  struct Driver * drv = tracker->driver;
+  if (!drv->imu_fn)
+    return;
+  // Optionally calibrate and decimate, working on copies of the samples
+  int16_t a[3], g[3];
+  if (drv->options.imu_calibrate || drv->imu_period) {
+    memcpy(a, acc, sizeof(a));
+    memcpy(g, gyr, sizeof(g));
+    acc = a;
+    gyr = g;
+    if (drv->options.imu_calibrate)
+      imu_calibrate(&tracker->cal, acc, gyr);
+    if (drv->imu_period
+      && !imu_decimate(tracker, drv->imu_period, &timecode, acc, gyr))
+      return;
+  }
+  // In threaded mode queue a copy for the consumer to drain
+  if (tracker->ring) {
+    struct Event * ev = deepdive_ring_claim(tracker->ring);
+    if (ev == NULL) return;
+    ev->type = EVENT_IMU;
+    ev->imu.timecode = timecode;
+    memcpy(ev->imu.acc, acc, sizeof(ev->imu.acc));
+    memcpy(ev->imu.gyr, gyr, sizeof(ev->imu.gyr));
+    ev->imu.has_mag = (mag != NULL);
+    if (mag)
+      memcpy(ev->imu.mag, mag, sizeof(ev->imu.mag));
+    deepdive_ring_publish(tracker->ring);
+    return;
+  }
   // Simple passthrough
-  if (tracker->driver->imu_fn)
-    tracker->driver->imu_fn(tracker, timecode, acc, gyr, mag);
-}
\ No newline at end of file
+  drv->imu_fn(tracker, timecode, acc, gyr, mag);
+}
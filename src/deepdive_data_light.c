@@ -32,6 +32,9 @@
 */
 
 #include "deepdive_data_light.h"
+#include "deepdive_ring.h"
+#include "deepdive_cache.h"
+#include "deepdive_stats.h"
 
 #include <zlib.h>
 
@@ -75,12 +78,34 @@ static float convert_float(uint8_t* data) {
   return fnum.f;
 }
 
+// Has the calibration of a lighthouse changed, ignoring when it was heard?
+static int lighthouse_changed(const struct Lighthouse *a,
+  const struct Lighthouse *b) {
+  if (a->id != b->id || a->fw_version != b->fw_version
+    || a->serial_number != b->serial_number || strcmp(a->serial, b->serial))
+    return 1;
+  for (size_t i = 0; i < MAX_NUM_MOTORS; i++) {
+    const struct Motor *m = &a->motors[i], *n = &b->motors[i];
+    if (m->phase != n->phase || m->tilt != n->tilt || m->gibphase != n->gibphase
+      || m->gibmag != n->gibmag || m->curve != n->curve)
+      return 1;
+  }
+  for (size_t i = 0; i < 3; i++)
+    if (a->accel[i] != b->accel[i])
+      return 1;
+  return a->sys_unlock_count != b->sys_unlock_count
+    || a->hw_version != b->hw_version || a->mode_current != b->mode_current
+    || a->sys_faults != b->sys_faults;
+}
+
 // Convert the packet
 static void decode_packet(struct Tracker *tracker, uint8_t id,
   uint8_t *data, uint32_t tc) {
   // Pop the serial number off the packet, so we can perform a lookup
-  static char serial[MAX_SERIAL_LENGTH];
-  sprintf(serial, "%u", *(uint32_t*)(data + 0x02));
+  uint32_t serial = *(uint32_t*)(data + 0x02);
+
+  // The lighthouse table is shared by all trackers of this driver
+  pthread_mutex_lock(&tracker->driver->lock);
 
   // We need to search to see if we already know about this LH
   uint8_t idx, available = MAX_NUM_LIGHTHOUSES;
@@ -90,16 +115,29 @@ static void decode_packet(struct Tracker *tracker, uint8_t id,
     if (!tracker->driver->lighthouses[idx].timestamp &&
       available == MAX_NUM_LIGHTHOUSES) available = idx;
     // If we find the tracker
-    if (!strcmp(tracker->driver->lighthouses[idx].serial, serial))
+    if (tracker->driver->lighthouses[idx].timestamp &&
+      tracker->driver->lighthouses[idx].serial_number == serial)
       break;
   }
 
+  // A new lighthouse may take the place of a cached one that we have not
+  // heard from yet, preferring the slot it was provisionally assigned to
+  if (idx >= MAX_NUM_LIGHTHOUSES && available == MAX_NUM_LIGHTHOUSES) {
+    if (id < MAX_NUM_LIGHTHOUSES && tracker->driver->lighthouses[id].provisional)
+      available = id;
+    for (uint8_t i = 0; i < MAX_NUM_LIGHTHOUSES
+      && available == MAX_NUM_LIGHTHOUSES; i++)
+      if (tracker->driver->lighthouses[i].provisional)
+        available = i;
+  }
+
   // We should never really be in the position where we get OOTX packets
   // from more than two lighthouses. But, if we do, you should see this...
   if (idx >= MAX_NUM_LIGHTHOUSES) {
     if (available == MAX_NUM_LIGHTHOUSES) {
       printf("We appear to have seen more than MAX_NUM_LIGHTHOUSES\n");
       printf("We are therefore going to disregard this OOTX data :(\n");
+      pthread_mutex_unlock(&tracker->driver->lock);
       return;
     }
     idx = available;
@@ -107,7 +145,12 @@ static void decode_packet(struct Tracker *tracker, uint8_t id,
 
   // Populate this data
   struct Lighthouse *lh = &tracker->driver->lighthouses[idx]; 
-  strcpy(lh->serial, serial);
+  struct Lighthouse old = *lh;
+  if (lh->serial_number != serial || !lh->serial[0]) {
+    lh->serial_number = serial;
+    snprintf(lh->serial, MAX_SERIAL_LENGTH, "%u", serial);
+  }
+  lh->id = idx;
   lh->fw_version = *(uint16_t*)(data + 0x00);
   lh->motors[0].phase = convert_float(data + 0x06);
   lh->motors[1].phase = convert_float(data + 0x08);
@@ -127,6 +170,7 @@ static void decode_packet(struct Tracker *tracker, uint8_t id,
   lh->mode_current = *(int8_t*)(data + 0x1f);
   lh->sys_faults = *(int8_t*)(data + 0x20);
   lh->timestamp = tc;
+  lh->provisional = 0;
   // printf("[%10u] Tracker # %s rx config for LH %s (id: %u)\n",
   //  tc, tracker->serial, lh->serial, id);
 
@@ -134,9 +178,30 @@ static void decode_packet(struct Tracker *tracker, uint8_t id,
   // same lighthouses as id 0 and id 1. So we need a lookup!
   tracker->ootx[id].lighthouse = lh;
 
-  // Push the new lighthouse data to the callee
-  if (tracker->driver->lighthouse_fn)
+  // Only touch the cache when the calibration actually changed, and write
+  // a copy of the table so the lock is not held over file system calls
+  struct Lighthouse table[MAX_NUM_LIGHTHOUSES];
+  uint64_t generation = 0;
+  if (lighthouse_changed(&old, lh)) {
+    memcpy(table, tracker->driver->lighthouses, sizeof(table));
+    generation = ++tracker->driver->lighthouses_changed;
+  }
+  pthread_mutex_unlock(&tracker->driver->lock);
+  if (generation)
+    deepdive_cache_save_lighthouses(tracker->driver, table, generation);
+
+  // Push the new lighthouse data to the callee, or queue it in threaded mode
+  if (tracker->driver->lighthouse_fn) {
+    if (tracker->ring) {
+      struct Event * ev = deepdive_ring_claim(tracker->ring);
+      if (ev == NULL) return;
+      ev->type = EVENT_LIGHTHOUSE;
+      ev->lighthouse.lighthouse = lh;
+      deepdive_ring_publish(tracker->ring);
+      return;
+    }
     tracker->driver->lighthouse_fn(lh);
+  }
 }
 
 // Swap endianness of 16 bit unsigned integer
@@ -232,8 +297,12 @@ static void ootx_feed(struct Tracker *tracker,
         // printf("[CRC] -> [PRE]\n");
         // printf("[CRC] RX = %08x\n", swapl(ctx->crc));
         // printf("[CRC] CA = %08x\n", crc);
-        if (crc == swapl(ctx->crc))
+        if (crc == swapl(ctx->crc)) {
+          STATS_INC(tracker->stats.ootx);
           decode_packet(tracker, lh, ctx->data, tc);
+        } else {
+          STATS_INC(tracker->stats.ootx_crc);
+        }
         // Return to state
         ctx->state = PREAMBLE;
         ctx->pos = ctx->syn = 0;
@@ -279,31 +348,53 @@ void handle_measurements(struct Tracker * tracker) {
     if (lcd->sweep.sweep_len[q] != 0)
       allZero = 0;
 
-  // Temporary data structures to hold results
-  static uint16_t num_sensors;
-  static uint16_t sensors[MAX_NUM_SENSORS];
-  static uint32_t sweeptimes[MAX_NUM_SENSORS];
-  static uint32_t angles[MAX_NUM_SENSORS];
-  static uint16_t lengths[MAX_NUM_SENSORS];
-  static uint32_t st;
-  static uint8_t lh;
-  static uint8_t ax;
-
   // Get the sync pulse rising edge time, lighthouse and axis
-  st = lcd->per_sweep.activeSweepStartTime;
-  lh = lcd->per_sweep.activeLighthouse;
-  ax = lcd->per_sweep.activeAcode & 1;
+  uint32_t st = lcd->per_sweep.activeSweepStartTime;
+  uint8_t lh = lcd->per_sweep.activeLighthouse;
+  uint8_t ax = lcd->per_sweep.activeAcode & 1;
 
   // Get the rotation based on the axis and negate Y to 
   uint8_t motor = (ax == 0 ? MOTOR_AXIS0 : MOTOR_AXIS1);
 
+  // Only bother when we have data, have received an OOTX from the current
+  // lighthouse and somebody is listening for light data
+  struct Driver * drv = tracker->driver;
+  if (!allZero && lh < MAX_NUM_LIGHTHOUSES && !tracker->ootx[lh].lighthouse)
+    STATS_INC(tracker->stats.no_ootx);
+  if (allZero || lh >= MAX_NUM_LIGHTHOUSES || !tracker->ootx[lh].lighthouse
+    || !(drv->lig_fn || drv->bundle_fn)) {
+    memset(&lcd->sweep, 0, sizeof(lightcaps_sweep_data));
+    return;
+  }
+
+  // Decode straight into the queued event in threaded mode, or onto the end
+  // of the tracker's sweep bundle otherwise, so that nothing is copied
+  struct Event * ev = NULL;
+  uint16_t *sensors, *lengths;
+  uint32_t *sweeptimes, *angles;
+  if (tracker->ring) {
+    ev = deepdive_ring_claim(tracker->ring);
+    if (ev == NULL) {
+      memset(&lcd->sweep, 0, sizeof(lightcaps_sweep_data));
+      return;
+    }
+    sensors = ev->light.sensors;
+    sweeptimes = ev->light.sweeptimes;
+    angles = ev->light.angles;
+    lengths = ev->light.lengths;
+  } else {
+    struct SweepBundle * b = &tracker->bundle;
+    if (b->num_sweeps == MAX_BUNDLE_SWEEPS)
+      deepdive_data_light_flush(tracker);
+    sensors = b->sensors + b->num_pulses;
+    sweeptimes = b->sweeptimes + b->num_pulses;
+    angles = b->angles + b->num_pulses;
+    lengths = b->lengths + b->num_pulses;
+  }
+
   // Copy over the final data
-  num_sensors = 0;
+  uint16_t num_sensors = 0;
   for (int i = 0; i < MAX_NUM_SENSORS; i++) {
-    static int counts[MAX_NUM_SENSORS][2] = {0};
-    if (lcd->per_sweep.activeLighthouse > -1 && !allZero)
-      if (lcd->sweep.sweep_len[i] == 0)
-        counts[i][lcd->per_sweep.activeAcode & 1] = 0;
     if (lcd->sweep.sweep_len[i] != 0) {
       sensors[num_sensors] = i;
       sweeptimes[num_sensors] = lcd->sweep.sweep_time[i];
@@ -314,18 +405,61 @@ void handle_measurements(struct Tracker * tracker) {
     }
   }
 
-  // Push off the measurement bundle ONLY when we have received
-  // an OOTX from the current lighthouse and if we have data
-  if (num_sensors > 0 && tracker->ootx[lh].lighthouse) {
-    if (tracker->driver->lig_fn)
-      tracker->driver->lig_fn(tracker, tracker->ootx[lh].lighthouse,
-        motor, st, num_sensors, sensors, sweeptimes, angles, lengths);
+  // Push off the measurement bundle ONLY if we have data
+  if (num_sensors > 0) {
+    STATS_INC(tracker->stats.sweeps);
+    if (ev) {
+      ev->type = EVENT_LIGHT;
+      ev->light.lighthouse = tracker->ootx[lh].lighthouse;
+      ev->light.axis = motor;
+      ev->light.synctime = st;
+      ev->light.num_sensors = num_sensors;
+      deepdive_ring_publish(tracker->ring);
+    } else {
+      deepdive_data_light_sweep(tracker,
+        tracker->ootx[lh].lighthouse, motor, st, num_sensors);
+    }
   }
 
   // Clear memory
   memset(&lcd->sweep, 0, sizeof(lightcaps_sweep_data));
 }
 
+// Complete a sweep whose pulses were written to the end of the bundle
+void deepdive_data_light_sweep(struct Tracker * tracker,
+  struct Lighthouse * lighthouse, uint8_t axis, uint32_t synctime,
+    uint16_t num_sensors) {
+  struct Driver * drv = tracker->driver;
+  struct SweepBundle * b = &tracker->bundle;
+  uint16_t offset = b->num_pulses;
+  b->lighthouses[b->num_sweeps] = lighthouse;
+  b->axes[b->num_sweeps] = axis;
+  b->synctimes[b->num_sweeps] = synctime;
+  b->offsets[b->num_sweeps] = offset;
+  b->counts[b->num_sweeps] = num_sensors;
+  b->num_sweeps++;
+  b->num_pulses += num_sensors;
+  // The per-sweep callback is just a view into the bundle
+  if (drv->lig_fn)
+    drv->lig_fn(tracker, lighthouse, axis, synctime, num_sensors,
+      b->sensors + offset, b->sweeptimes + offset, b->angles + offset,
+        b->lengths + offset);
+  // Unless we are batching, deliver the bundle right away
+  if (!drv->bundle_fn || !drv->batched || b->num_sweeps == MAX_BUNDLE_SWEEPS)
+    deepdive_data_light_flush(tracker);
+}
+
+// Deliver and clear any bundled sweeps
+void deepdive_data_light_flush(struct Tracker * tracker) {
+  struct SweepBundle * b = &tracker->bundle;
+  if (b->num_sweeps == 0)
+    return;
+  if (tracker->driver->bundle_fn)
+    tracker->driver->bundle_fn(tracker, b);
+  b->num_sweeps = 0;
+  b->num_pulses = 0;
+}
+
 // Handle sync
 void handle_sync(struct Tracker * tracker,
   uint32_t timecode, uint16_t sensor, uint16_t length) {
@@ -333,6 +467,7 @@ void handle_sync(struct Tracker * tracker,
   lightcap_data* lcd = &tracker->lcd;
   // Get the acode from the sendor treading
   int acode = handle_acode(lcd, length);
+  STATS_INC(tracker->stats.syncs);
   // Process any cached measurements
   handle_measurements(tracker);
   // Calculate the time since last sweet
@@ -400,8 +535,14 @@ void handle_sweep(struct Tracker * tracker,
 
 void deepdive_data_light(struct Tracker * tracker,
   uint32_t timecode, uint16_t sensor, uint16_t length) {
-  if (sensor > MAX_NUM_SENSORS) return;
-  if (length > 6750) return;
+  if (sensor > MAX_NUM_SENSORS) {
+    STATS_INC(tracker->stats.bad_sensor);
+    return;
+  }
+  if (length > 6750) {
+    STATS_INC(tracker->stats.bad_length);
+    return;
+  }
   if (length > 2750)
     handle_sync(tracker, timecode, sensor, length);
   else
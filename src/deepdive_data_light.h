@@ -40,4 +40,12 @@
 void deepdive_data_light(struct Tracker * tracker,
   uint32_t timecode, uint16_t sensor, uint16_t length);
 
+// Complete a sweep whose pulses were written to the end of the bundle
+void deepdive_data_light_sweep(struct Tracker * tracker,
+  struct Lighthouse * lighthouse, uint8_t axis, uint32_t synctime,
+    uint16_t num_sensors);
+
+// Deliver and clear any bundled sweeps
+void deepdive_data_light_flush(struct Tracker * tracker);
+
 #endif
\ No newline at end of file
@@ -35,6 +35,7 @@
 #include "deepdive_data_imu.h"
 #include "deepdive_data_light.h"
 #include "deepdive_data_button.h"
+#include "deepdive_stats.h"
 
 // Pop a value off the array (shifts the pointer to the next element)
 #define POP1  (*(buf++))
@@ -261,6 +262,7 @@ static void watchman_decode(struct Tracker * tracker, uint8_t *buf) {
 
     return;
 end:
+    STATS_INC(tracker->stats.faults[fault]);
     printf("Light decoding fault: %d", fault);
   }
 }
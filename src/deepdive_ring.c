@@ -0,0 +1,102 @@
+/* 
+  Unofficial driver for Vive Trackers and up to two lighthouses, with an
+    emphasis on pulling tracker and lighthouse calibration data from devices.
+  
+  Adapted from: https://github.com/cnlohr/libsurvive
+  Which was based off: https://github.com/collabora/OSVR-Vive-Libre
+    Originally Copyright 2016 Philipp Zabel
+    Originally Copyright 2016 Lubosz Sarnecki <lubosz.sarnecki@collabora.co.uk>
+    Originally Copyright (C) 2013 Fredrik Hultin
+    Originally Copyright (C) 2013 Jakob Bornecrantz
+  Using documentation from: https://github.com/nairol/LighthouseRedox
+  
+  Copyright (c) 2017 Andrew Symington
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "deepdive_ring.h"
+
+// Allocate a new ring
+struct Ring * deepdive_ring_alloc() {
+  struct Ring * ring = NULL;
+  if (posix_memalign((void**)&ring, CACHE_LINE_LENGTH, sizeof(struct Ring)))
+    return NULL;
+  memset(ring, 0, sizeof(struct Ring));
+  return ring;
+}
+
+// Free a ring
+void deepdive_ring_free(struct Ring * ring) {
+  free(ring);
+}
+
+// Get the next free slot, or NULL if the ring is full (producer only)
+struct Event * deepdive_ring_claim(struct Ring * ring) {
+  uint32_t head = ring->head;
+  uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  if (head - tail >= RING_LENGTH) {
+    __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  return &ring->events[head & (RING_LENGTH - 1)];
+}
+
+// Make the last claimed slot visible to the consumer (producer only)
+void deepdive_ring_publish(struct Ring * ring) {
+  uint32_t head = ring->head + 1;
+  uint32_t depth = head - __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+  if (depth > ring->high_water)
+    __atomic_store_n(&ring->high_water, depth, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&ring->pushed, 1, __ATOMIC_RELAXED);
+  ring->events[ring->head & (RING_LENGTH - 1)].stamp = ring->stamp;
+  ring->events[ring->head & (RING_LENGTH - 1)].captured = ring->captured;
+  __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+}
+
+// Get the oldest unread event, or NULL if the ring is empty (consumer only)
+struct Event * deepdive_ring_peek(struct Ring * ring) {
+  uint32_t tail = ring->tail;
+  if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail)
+    return NULL;
+  return &ring->events[tail & (RING_LENGTH - 1)];
+}
+
+// Release the event returned by the last peek (consumer only)
+void deepdive_ring_release(struct Ring * ring) {
+  __atomic_fetch_add(&ring->drained, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+// Get the number of queued events (any thread)
+uint32_t deepdive_ring_depth(struct Ring * ring) {
+  return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)
+    - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+// Get a snapshot of the ring statistics (any thread)
+void deepdive_ring_stats(struct Ring * ring, struct QueueStats * stats) {
+  uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  stats->pushed = __atomic_load_n(&ring->pushed, __ATOMIC_RELAXED);
+  stats->drained = __atomic_load_n(&ring->drained, __ATOMIC_RELAXED);
+  stats->dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+  stats->high_water = __atomic_load_n(&ring->high_water, __ATOMIC_RELAXED);
+  stats->depth = head - tail;
+}
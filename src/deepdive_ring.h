@@ -0,0 +1,124 @@
+/* 
+  Unofficial driver for Vive Trackers and up to two lighthouses, with an
+    emphasis on pulling tracker and lighthouse calibration data from devices.
+  
+  Adapted from: https://github.com/cnlohr/libsurvive
+  Which was based off: https://github.com/collabora/OSVR-Vive-Libre
+    Originally Copyright 2016 Philipp Zabel
+    Originally Copyright 2016 Lubosz Sarnecki <lubosz.sarnecki@collabora.co.uk>
+    Originally Copyright (C) 2013 Fredrik Hultin
+    Originally Copyright (C) 2013 Jakob Bornecrantz
+  Using documentation from: https://github.com/nairol/LighthouseRedox
+  
+  Copyright (c) 2017 Andrew Symington
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#ifndef LIBDEEPDIVE_DEEPDIVE_RING_H
+#define LIBDEEPDIVE_DEEPDIVE_RING_H
+
+#include <deepdive.h>
+
+// Number of events that can be queued per tracker (must be a power of two)
+#define RING_LENGTH           256
+#define CACHE_LINE_LENGTH     64
+
+// Event types that can be queued
+typedef enum {
+  EVENT_LIGHT       = 0,
+  EVENT_IMU         = 1,
+  EVENT_BUTTON      = 2,
+  EVENT_LIGHTHOUSE  = 3
+} EventType;
+
+// A single decoded event
+struct Event {
+  uint8_t type;
+  uint64_t stamp;                 // Start time if being timed (or 0)
+  uint64_t captured;              // Capture time if replayed (or 0)
+  union {
+    struct {
+      struct Lighthouse *lighthouse;
+      uint8_t axis;
+      uint32_t synctime;
+      uint16_t num_sensors;
+      uint16_t sensors[MAX_NUM_SENSORS];
+      uint32_t sweeptimes[MAX_NUM_SENSORS];
+      uint32_t angles[MAX_NUM_SENSORS];
+      uint16_t lengths[MAX_NUM_SENSORS];
+    } light;
+    struct {
+      uint32_t timecode;
+      int16_t acc[3];
+      int16_t gyr[3];
+      int16_t mag[3];
+      uint8_t has_mag;
+    } imu;
+    struct {
+      uint32_t mask;
+      uint16_t trigger;
+      int16_t horizontal;
+      int16_t vertical;
+    } button;
+    struct {
+      struct Lighthouse *lighthouse;
+    } lighthouse;
+  };
+};
+
+// Lock-free single-producer (USB thread), single-consumer (drain) queue. The
+// head and tail live on separate cache lines so the two threads don't fight.
+struct Ring {
+  uint32_t head __attribute__((aligned(CACHE_LINE_LENGTH)));
+  uint64_t pushed;
+  uint64_t dropped;
+  uint32_t high_water;
+  uint64_t stamp;                 // Stamped onto events as they are published
+  uint64_t captured;              // Likewise, for the capture time
+  uint32_t tail __attribute__((aligned(CACHE_LINE_LENGTH)));
+  uint64_t drained;
+  struct Event events[RING_LENGTH] __attribute__((aligned(CACHE_LINE_LENGTH)));
+};
+
+// Allocate a new ring
+struct Ring * deepdive_ring_alloc();
+
+// Free a ring
+void deepdive_ring_free(struct Ring * ring);
+
+// Get the next free slot, or NULL if the ring is full (producer only)
+struct Event * deepdive_ring_claim(struct Ring * ring);
+
+// Make the last claimed slot visible to the consumer (producer only)
+void deepdive_ring_publish(struct Ring * ring);
+
+// Get the oldest unread event, or NULL if the ring is empty (consumer only)
+struct Event * deepdive_ring_peek(struct Ring * ring);
+
+// Release the event returned by the last peek (consumer only)
+void deepdive_ring_release(struct Ring * ring);
+
+// Get the number of queued events (any thread)
+uint32_t deepdive_ring_depth(struct Ring * ring);
+
+// Get a snapshot of the ring statistics (any thread)
+void deepdive_ring_stats(struct Ring * ring, struct QueueStats * stats);
+
+#endif
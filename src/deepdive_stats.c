@@ -0,0 +1,71 @@
+/* 
+  Unofficial driver for Vive Trackers and up to two lighthouses, with an
+    emphasis on pulling tracker and lighthouse calibration data from devices.
+  
+  Adapted from: https://github.com/cnlohr/libsurvive
+  Which was based off: https://github.com/collabora/OSVR-Vive-Libre
+    Originally Copyright 2016 Philipp Zabel
+    Originally Copyright 2016 Lubosz Sarnecki <lubosz.sarnecki@collabora.co.uk>
+    Originally Copyright (C) 2013 Fredrik Hultin
+    Originally Copyright (C) 2013 Jakob Bornecrantz
+  Using documentation from: https://github.com/nairol/LighthouseRedox
+  
+  Copyright (c) 2017 Andrew Symington
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "deepdive_stats.h"
+
+#include <time.h>
+
+// Get the current monotonic time in nanoseconds
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Count a packet, returning its start time if it should be timed (or 0)
+uint64_t deepdive_stats_packet(struct Tracker * tracker) {
+  uint64_t n = __atomic_load_n(&tracker->stats.packets, __ATOMIC_RELAXED);
+  __atomic_store_n(&tracker->stats.packets, n + 1, __ATOMIC_RELAXED);
+  if ((n & (STATS_SAMPLE_PERIOD - 1)) && !tracker->driver->options.timing)
+    return 0;
+  return now_ns();
+}
+
+// Record the latency of a timed packet (callback thread only)
+void deepdive_stats_latency(struct Tracker * tracker, uint64_t start) {
+  uint64_t us = (now_ns() - start) / 1000;
+  int bin = (us ? 64 - __builtin_clzll(us) : 0);
+  if (bin >= NUM_LATENCY_BINS)
+    bin = NUM_LATENCY_BINS - 1;
+  STATS_INC(tracker->stats.samples);
+  STATS_INC(tracker->stats.latency[bin]);
+}
+
+// Add a snapshot of the source statistics to the destination (any thread)
+void deepdive_stats_add(struct Stats * dst, struct Stats * src) {
+  // Every field is a 64 bit counter, so we can walk the structure as an array
+  uint64_t * d = (uint64_t*) dst;
+  uint64_t * s = (uint64_t*) src;
+  for (size_t i = 0; i < sizeof(struct Stats) / sizeof(uint64_t); i++)
+    d[i] += __atomic_load_n(&s[i], __ATOMIC_RELAXED);
+}
@@ -0,0 +1,62 @@
+/* 
+  Unofficial driver for Vive Trackers and up to two lighthouses, with an
+    emphasis on pulling tracker and lighthouse calibration data from devices.
+  
+  Adapted from: https://github.com/cnlohr/libsurvive
+  Which was based off: https://github.com/collabora/OSVR-Vive-Libre
+    Originally Copyright 2016 Philipp Zabel
+    Originally Copyright 2016 Lubosz Sarnecki <lubosz.sarnecki@collabora.co.uk>
+    Originally Copyright (C) 2013 Fredrik Hultin
+    Originally Copyright (C) 2013 Jakob Bornecrantz
+  Using documentation from: https://github.com/nairol/LighthouseRedox
+  
+  Copyright (c) 2017 Andrew Symington
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#ifndef LIBDEEPDIVE_DEEPDIVE_STATS_H
+#define LIBDEEPDIVE_DEEPDIVE_STATS_H
+
+#include <deepdive.h>
+
+// Only every n-th packet (a power of two) is timed, to keep the overhead low
+#define STATS_SAMPLE_PERIOD   16
+
+/* Most counters have a single writer: the thread decoding the tracker, or
+   for the latency histogram the thread dispatching its callbacks. So a
+   relaxed load and store is enough, and avoids a locked add on the hot path,
+   while readers on other threads still never see a torn value. The USB error
+   and stall counters are also written by the workers that clear stalled
+   endpoints, so they take the locked add instead, which is rare enough.   */
+#define STATS_INC(counter) __atomic_store_n(&(counter), \
+  __atomic_load_n(&(counter), __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED)
+#define STATS_INC_SHARED(counter) \
+  __atomic_fetch_add(&(counter), 1, __ATOMIC_RELAXED)
+
+// Count a packet, returning its start time if it should be timed (or 0)
+uint64_t deepdive_stats_packet(struct Tracker * tracker);
+
+// Record the latency of a timed packet (callback thread only)
+void deepdive_stats_latency(struct Tracker * tracker, uint64_t start);
+
+// Add a snapshot of the source statistics to the destination (any thread)
+void deepdive_stats_add(struct Stats * dst, struct Stats * src);
+
+#endif
@@ -32,13 +32,22 @@
 */
 
 #include <argtable2.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
 
 #include <deepdive.h>
 
+// Most descriptors we wait on in the poll loop
+#define MAX_POLLFDS 64
+
 // Enable X and Y axis
 int en0_ = 0;
 int en1_ = 0;
 
+// Have the descriptors to poll changed?
+int pollfds_changed_ = 1;
+
 // Callback to display light info
 void my_light_process(struct Tracker * tracker, struct Lighthouse * lighthouse,
   uint8_t axis, uint32_t synctime, uint16_t num_sensors, uint16_t *sensors,
@@ -59,6 +68,28 @@ void my_light_process(struct Tracker * tracker, struct Lighthouse * lighthouse,
   }
 }
 
+// Callback to display a batch of light info
+void my_bundle_process(struct Tracker * tracker, struct SweepBundle * bundle) {
+  static float radians[MAX_BUNDLE_PULSES];
+  deepdive_bundle_radians(tracker->driver, bundle, radians);
+  for (uint16_t s = 0; s < bundle->num_sweeps; s++) {
+    // Enable X and Y
+    if (bundle->axes[s] == 0 && en0_ == 0) continue;
+    if (bundle->axes[s] == 1 && en1_ == 0) continue;
+    // Print header info
+    printf("[%u] # %s LH %s %s\n", bundle->synctimes[s], tracker->serial,
+      bundle->lighthouses[s]->serial,
+        (bundle->axes[s] == MOTOR_AXIS0 ? "AXIS 0" : "AXIS 1"));
+    // Print sensor info
+    for (uint16_t i = bundle->offsets[s];
+      i < bundle->offsets[s] + bundle->counts[s]; i++) {
+      printf(" ->  SEN (%2u) ANG (%f deg) LEN (%f us)\n", bundle->sensors[i],
+        radians[i] * 180.0 / 3.14159265358979323846,
+          ((float)bundle->lengths[i]) / 48000000.0 * 1000000.0);
+    }
+  }
+}
+
 // Callback to display imu info
 void my_imu_process(struct Tracker * tracker, uint32_t timecode,
   int16_t acc[3], int16_t gyr[3], int16_t mag[3]) {
@@ -94,7 +125,8 @@ void my_button_process(struct Tracker * tracker,
 void my_tracker_process(struct Tracker * t) {
   if (!t) return;
   // Sensor
-  printf("Metadata received for tracker with serial %s\n", t->serial);
+  printf("Metadata received for tracker with serial %s (id %u)\n",
+    t->serial, t->id);
   printf("- Photosensor positions\n");
   for (uint32_t i = 0; i < t->cal.num_channels; i++) {
     printf("  (SENSOR %u)\n", i);
@@ -144,11 +176,18 @@ void my_tracker_process(struct Tracker * t) {
     t->cal.head_transform[6]);
 }
 
+// Called when a tracker is unplugged
+void my_removal_process(struct Tracker * t) {
+  if (!t) return;
+  printf("Tracker with serial %s was unplugged\n", t->serial);
+}
+
 // Called when OOTX data is decoded from this lighthouse
 void my_lighthouse_process(struct Lighthouse *l) {
   if (!l) return;
   // Sensor
-  printf("Metadata received for lighthouse with serial  %s\n", l->serial);
+  printf("Metadata received for lighthouse with serial  %s (id %u)\n",
+    l->serial, l->id);
   for (uint32_t i = 0; i < MAX_NUM_MOTORS; i++) {
     printf("- Motor %u calibration\n", i);
     printf("  (PHASE) %f\n", l->motors[i].phase);
@@ -161,6 +200,80 @@ void my_lighthouse_process(struct Lighthouse *l) {
     l->accel[0], l->accel[1], l->accel[2]);
 }
 
+// Upper bound on the latency in microseconds below the given fraction
+static uint64_t my_latency_percentile(struct Stats * s, double fraction) {
+  uint64_t total = 0;
+  for (int i = 0; i < NUM_LATENCY_BINS; i++) {
+    total += s->latency[i];
+    if (s->samples && total >= fraction * s->samples)
+      return (1ULL << i);
+  }
+  return 0;
+}
+
+// Print the decoder statistics for every tracker
+void my_stats_process(struct Driver * drv) {
+  struct Stats s;
+  pthread_mutex_lock(&drv->trackers_lock);
+  for (size_t i = 0; i < drv->num_trackers; i++) {
+    struct Tracker * t = drv->trackers[i];
+    if (deepdive_stats(drv, t, &s))
+      continue;
+    uint64_t faults = 0;
+    for (int f = 0; f < NUM_FAULTS; f++)
+      faults += s.faults[f];
+    printf("[STATS] # %s PKT %" PRIu64 " ERR %" PRIu64 " STL %" PRIu64
+      " FLT %" PRIu64 " SYN %" PRIu64 " SWP %" PRIu64 " WAIT %" PRIu64
+      " DROP %" PRIu64 "/%" PRIu64 " IMU %" PRIu64 " OOTX %" PRIu64 "/%" PRIu64
+      " LAT p50 <%" PRIu64 "us p99 <%" PRIu64 "us\n",
+        t->serial, s.packets, s.usb_errors, s.usb_stalls, faults, s.syncs,
+          s.sweeps, s.no_ootx, s.bad_sensor, s.bad_length, s.imu, s.ootx, s.ootx_crc,
+            my_latency_percentile(&s, 0.5), my_latency_percentile(&s, 0.99));
+  }
+  pthread_mutex_unlock(&drv->trackers_lock);
+}
+
+// Called when the driver adds or removes a descriptor, possibly from a worker
+void my_pollfd_process(int fd, short events) {
+  (void) fd;
+  (void) events;
+  __atomic_store_n(&pollfds_changed_, 1, __ATOMIC_RELEASE);
+}
+
+// Run the driver from a poll() loop, as an external event loop would, waking
+// at least once a second to print statistics
+int my_poll_loop(struct Driver * drv, int print_stats) {
+  struct pollfd fds[MAX_POLLFDS];
+  int nfds = 0;
+  time_t last = time(NULL);
+  for (;;) {
+    // Only ask for the descriptors again if they have changed
+    if (__atomic_exchange_n(&pollfds_changed_, 0, __ATOMIC_ACQ_REL)) {
+      nfds = deepdive_get_pollfds(drv, fds, MAX_POLLFDS);
+      if (nfds < 0)
+        return nfds;
+      if (nfds > MAX_POLLFDS)
+        nfds = MAX_POLLFDS;
+    }
+    int ms = 1000;
+    struct timeval tv;
+    if (deepdive_next_timeout(drv, &tv) == 1) {
+      int64_t due = (int64_t) tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+      if (due < ms)
+        ms = (int) due;
+    }
+    if (poll(fds, nfds, ms) < 0 && errno != EINTR)
+      return -1;
+    int ret = deepdive_handle_ready(drv);
+    if (ret)
+      return ret;
+    if (print_stats && time(NULL) != last) {
+      last = time(NULL);
+      my_stats_process(drv);
+    }
+  }
+}
+
 // Main entry point for application
 int main(int argc, char **argv) {
   // Get commandline arguments
@@ -170,9 +283,21 @@ int main(int argc, char **argv) {
   struct arg_lit  *button  = arg_lit0("b", "button", "print buttons");
   struct arg_lit  *lh      = arg_lit0("l", "lh", "print lighthouse info");
   struct arg_lit  *tracker = arg_lit0("t", "tracker", "print tracker info");
+  struct arg_lit  *thread  = arg_lit0("x", "threaded", "handle usb on a separate thread");
+  struct arg_lit  *poller  = arg_lit0("P", "poll", "handle usb from a poll() loop");
+  struct arg_lit  *batch   = arg_lit0("s", "bundle", "print light in batches per poll");
+  struct arg_lit  *noplug  = arg_lit0("p", "no-hotplug", "ignore devices plugged in later");
+  struct arg_str  *cache   = arg_str0("c", "cache", "<dir>", "calibration cache (\"\" to disable)");
+  struct arg_str  *capture = arg_str0("w", "write", "<file>", "capture raw usb packets to a file");
+  struct arg_str  *replay  = arg_str0("r", "read", "<file>", "replay a capture instead of usb");
+  struct arg_dbl  *speed   = arg_dbl0(NULL, "speed", "<x>", "replay speed (1 = real time, 0 = max)");
+  struct arg_int  *queue   = arg_int0("n", "transfers", "<n>", "usb transfers per endpoint");
+  struct arg_lit  *imucal  = arg_lit0(NULL, "imu-cal", "apply the imu calibration in the driver");
+  struct arg_dbl  *imurate = arg_dbl0(NULL, "imu-rate", "<hz>", "average imu down to this rate (0 = off)");
+  struct arg_lit  *stats   = arg_lit0("S", "stats", "print decoder statistics every second");
   struct arg_lit  *help    = arg_lit0(NULL, "help", "print this help and exit");
   struct arg_end  *end     = arg_end(20);
-  void* argtable[] = {imu, l0, l1, button, tracker, lh, help, end};
+  void* argtable[] = {imu, l0, l1, button, tracker, lh, thread, poller, queue, batch, noplug, cache, capture, replay, speed, imucal, imurate, stats, help, end};
   // Verify we allocated correcty
   const char* progname = "deepdive_tool";
   int nerrors, exitcode = 0;
@@ -201,7 +326,27 @@ int main(int argc, char **argv) {
     goto exit;
   }
   // Initialize the driver
-  struct Driver * drv = deepdive_init(0);
+  struct Options opts;
+  deepdive_default_options(&opts);
+  if (queue->count > 0) {
+    int n = queue->ival[0];
+    opts.num_transfers = n < 1 ? 1 : (n > MAX_TRANSFERS ? MAX_TRANSFERS : n);
+  }
+  if (noplug->count > 0)
+    opts.hotplug = 0;
+  if (cache->count > 0)
+    snprintf(opts.cache_dir, MAX_PATH_LENGTH, "%s", cache->sval[0]);
+  if (capture->count > 0)
+    snprintf(opts.capture, MAX_PATH_LENGTH, "%s", capture->sval[0]);
+  if (replay->count > 0)
+    snprintf(opts.replay, MAX_PATH_LENGTH, "%s", replay->sval[0]);
+  if (speed->count > 0)
+    opts.speed = speed->dval[0];
+  if (imucal->count > 0)
+    opts.imu_calibrate = 1;
+  if (imurate->count > 0)
+    opts.imu_rate = imurate->dval[0];
+  struct Driver * drv = deepdive_init_options(&opts);
   if (!drv) {
     printf("%s: could not initialize driver\n", progname);
     exitcode = 3;
@@ -213,17 +358,44 @@ int main(int argc, char **argv) {
   // Install callbacks
   if (imu->count > 0)
     deepdive_install_imu_fn(drv, my_imu_process);
-  if (l0->count + l1->count > 0)
-    deepdive_install_light_fn(drv, my_light_process);
+  if (l0->count + l1->count > 0) {
+    if (batch->count > 0)
+      deepdive_install_bundle_fn(drv, my_bundle_process, 1);
+    else
+      deepdive_install_light_fn(drv, my_light_process);
+  }
   if (button->count > 0)
     deepdive_install_button_fn(drv, my_button_process);
   if (lh->count > 0)
     deepdive_install_lighthouse_fn(drv, my_lighthouse_process);
-  if (tracker->count > 0)
+  if (tracker->count > 0) {
     deepdive_install_tracker_fn(drv, my_tracker_process);
-  // Keep going until ctrl+c
-  while(deepdive_poll(drv) == 0) {}
-    return 0;
+    deepdive_install_removal_fn(drv, my_removal_process);
+  }
+  // Optionally move USB handling off this thread
+  if (thread->count > 0 && deepdive_start(drv)) {
+    printf("%s: could not start usb thread\n", progname);
+    deepdive_close(drv);
+    exitcode = 4;
+    goto exit;
+  }
+  // Optionally multiplex the driver in our own event loop
+  if (poller->count > 0 && thread->count == 0) {
+    deepdive_install_pollfd_fn(drv, my_pollfd_process);
+    my_poll_loop(drv, stats->count > 0);
+    deepdive_close(drv);
+    exitcode = 0;
+    goto exit;
+  }
+  // Keep going until ctrl+c, or the end of a replay
+  time_t last = time(NULL);
+  while(deepdive_poll(drv) == 0) {
+    if (stats->count > 0 && time(NULL) != last) {
+      last = time(NULL);
+      my_stats_process(drv);
+    }
+  }
+  deepdive_close(drv);
   // Exit cleanly
   exitcode = 0;
 exit:
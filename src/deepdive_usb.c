@@ -33,6 +33,10 @@
 
 // Interface implementations
 #include "deepdive_usb.h"
+#include "deepdive_ring.h"
+#include "deepdive_cache.h"
+#include "deepdive_capture.h"
+#include "deepdive_stats.h"
 
 // Controller implementations
 #include "deepdive_dev_tracker.h"
@@ -47,29 +51,186 @@
 // Special codes
 static uint8_t magic_code_power_en_[5] = {0x04};
 
-// Interrupt handler
-static void interrupt_handler(struct libusb_transfer* t) {
-  struct Endpoint *ep = t->user_data;
-  if (t->status != LIBUSB_TRANSFER_COMPLETED ) {
-    printf("Transfer problem\n");
-    return;
-  }
-  switch (ep->type) {
+// How long to let a stalled endpoint settle before clearing its halt
+#define STALL_BACKOFF_US      10000
+
+// Decode a raw packet received on the given endpoint type
+void deepdive_usb_decode(struct Tracker * tracker, CallbackType type,
+  uint8_t * buf, int len) {
+  // Every few packets are timed until their callbacks return, which in
+  // threaded mode happens when the events they queue are dispatched
+  uint64_t start = deepdive_stats_packet(tracker);
+  if (tracker->ring)
+    tracker->ring->stamp = start;
+  else
+    tracker->completed = start;
+  switch (type) {
    case TRACKER_IMU:
-    deepdive_dev_tracker_imu(ep->tracker, ep->buffer, t->actual_length);
+    deepdive_dev_tracker_imu(tracker, buf, len);
     break;
    case TRACKER_LIGHT:
-    deepdive_dev_tracker_light(ep->tracker, ep->buffer, t->actual_length);
+    deepdive_dev_tracker_light(tracker, buf, len);
     break;
    case TRACKER_BUTTONS:
-    deepdive_dev_tracker_button(ep->tracker, ep->buffer, t->actual_length);
+    deepdive_dev_tracker_button(tracker, buf, len);
     break;
    case WATCHMAN:
-    deepdive_dev_watchman(ep->tracker, ep->buffer, t->actual_length);
+    deepdive_dev_watchman(tracker, buf, len);
     break;
+   default:
+    break;
+  }
+  if (start && !tracker->ring)
+    deepdive_stats_latency(tracker, start);
+}
+
+// Transfers are submitted before a tracker is listed by the driver, and what
+// they receive is only reported once it is, so that callbacks never run before
+// the tracker has been announced. Without a queue the callbacks run as soon as
+// a packet is decoded, so they also wait for the announcement itself.
+static int reportable(struct Tracker * tracker) {
+  if (!__atomic_load_n(&tracker->added, __ATOMIC_ACQUIRE))
+    return 0;
+  return (tracker->ring || tracker->pushed);
+}
+
+// Stop using an endpoint that keeps failing. Its tracker is reported as
+// unplugged, which is how the callee learns that its data has stopped.
+static void fail_endpoint(struct Endpoint * ep) {
+  if (ep->failed)
+    return;
+  ep->failed = 1;
+  struct Driver * drv = ep->tracker->driver;
+  pthread_mutex_lock(&drv->trackers_lock);
+  ep->tracker->attached = 0;
+  pthread_mutex_unlock(&drv->trackers_lock);
+}
+
+// Count a failed transfer, giving up on the endpoint if they keep coming
+static void endpoint_error(struct Endpoint * ep) {
+  STATS_INC_SHARED(ep->tracker->stats.usb_errors);
+  if (++ep->errors >= MAX_USB_ERRORS)
+    fail_endpoint(ep);
+}
+
+// Resubmit every parked transfer in the order they will be processed, which
+// is only done with nothing in flight. One that can't be submitted would hold
+// up the rest, so it is retried until the endpoint is given up on.
+static void resume_endpoint(struct Endpoint * ep) {
+  uint8_t first = ep->next;
+  ep->parked = 0;
+  for (uint8_t i = 0; i < ep->num_transfers; i++) {
+    struct Transfer * xfer = &ep->transfers[(first + i) % ep->num_transfers];
+    while (libusb_submit_transfer(xfer->tx)) {
+      endpoint_error(ep);
+      if (ep->failed)
+        return;
+    }
+  }
+}
+
+// Clears the halt on a stalled endpoint, which blocks, and then restarts it
+static void * clear_worker(void * arg) {
+  struct Endpoint * ep = arg;
+  struct Driver * drv = ep->tracker->driver;
+  while (!ep->failed) {
+    usleep(STALL_BACKOFF_US);
+    if (libusb_clear_halt(ep->tracker->udev, ep->address) == 0)
+      break;
+    endpoint_error(ep);
+  }
+  if (!ep->failed) {
+    STATS_INC_SHARED(ep->tracker->stats.usb_stalls);
+    ep->stalled = 0;
+    resume_endpoint(ep);
+  }
+  __atomic_fetch_sub(&drv->workers, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+// Restart an endpoint once none of its transfers are in flight
+static void restart_endpoint(struct Endpoint * ep) {
+  if (!ep->stalled) {
+    resume_endpoint(ep);
+    return;
+  }
+  // Blocking transfers are not allowed here, so clear the halt on a worker
+  struct Driver * drv = ep->tracker->driver;
+  __atomic_fetch_add(&drv->workers, 1, __ATOMIC_ACQUIRE);
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, clear_worker, ep)) {
+    __atomic_fetch_sub(&drv->workers, 1, __ATOMIC_RELEASE);
+    fail_endpoint(ep);
+    return;
+  }
+  pthread_detach(thread);
+}
+
+// Interrupt handler. Several transfers are in flight per endpoint, so we only
+// mark this one as done and then process completed transfers strictly in the
+// order they were submitted, resubmitting each as soon as it is consumed.
+// After a stall or a failed resubmission the rest are parked as they come in,
+// so that the endpoint can be restarted in order once nothing is in flight.
+static void interrupt_handler(struct libusb_transfer* t) {
+  struct Transfer *xfer = t->user_data;
+  struct Endpoint *ep = xfer->endpoint;
+  if (t->status != LIBUSB_TRANSFER_COMPLETED) {
+    xfer->length = -1;
+  } else {
+    xfer->length = t->actual_length;
+  }
+  xfer->done = 1;
+  while (ep->transfers[ep->next].done) {
+    xfer = &ep->transfers[ep->next];
+    xfer->done = 0;
+    ep->next = (ep->next + 1) % ep->num_transfers;
+    if (xfer->length >= 0 && reportable(ep->tracker)) {
+      deepdive_capture_packet(ep->tracker, ep->type, xfer->buffer, xfer->length);
+      deepdive_usb_decode(ep->tracker, ep->type, xfer->buffer, xfer->length);
+    }
+    // Cancelled transfers and unplugged devices should not be resubmitted
+    int status = xfer->tx->status;
+    if (status == LIBUSB_TRANSFER_CANCELLED
+     || status == LIBUSB_TRANSFER_NO_DEVICE)
+      continue;
+    if (status == LIBUSB_TRANSFER_COMPLETED) {
+      ep->errors = 0;
+    } else {
+      endpoint_error(ep);
+      if (status == LIBUSB_TRANSFER_STALL)
+        ep->stalled = 1;
+    }
+    if (!ep->failed && !ep->stalled && !ep->parked) {
+      if (libusb_submit_transfer(xfer->tx) == 0)
+        continue;
+      endpoint_error(ep);
+    }
+    if (++ep->parked == ep->num_transfers && !ep->failed)
+      restart_endpoint(ep);
   }
-  if (libusb_submit_transfer(t))
-    printf( "Error resubmitting transfer\n");
+}
+
+// Allocate and submit all interrupt transfers for an endpoint
+static int setup_endpoint(struct Tracker * tracker, uint8_t idx,
+  CallbackType type, unsigned char address) {
+  struct Endpoint *ep = &tracker->endpoints[idx];
+  ep->tracker = tracker;
+  ep->type = type;
+  ep->next = 0;
+  ep->address = address;
+  ep->num_transfers = tracker->driver->options.num_transfers;
+  for (uint8_t i = 0; i < ep->num_transfers; i++) {
+    struct Transfer *xfer = &ep->transfers[i];
+    xfer->endpoint = ep;
+    xfer->tx = libusb_alloc_transfer(0);
+    if (!xfer->tx)
+      return -1;
+    libusb_fill_interrupt_transfer(xfer->tx, tracker->udev, address,
+      xfer->buffer, USB_INT_BUFF_LENGTH, interrupt_handler, xfer, 0);
+    if (libusb_submit_transfer(xfer->tx))
+      return -2;
+  }
+  return 0;
 }
 
 static inline int update_feature_report(libusb_device_handle* dev,
@@ -215,30 +376,34 @@ static int json_parse(struct Tracker * tracker, const char* data) {
   printf("Read calibration data for tracker %s\n", tracker->serial);
 }
 
+// Send the magic code that the watchman expects before config is read
+static void send_extra_magic(struct Tracker * tracker) {
+  uint8_t cfgbuffwide[65];
+  memset(cfgbuffwide, 0, sizeof(cfgbuffwide));
+  cfgbuffwide[0] = 0x01;
+  hid_get_feature_report_timeout(
+    tracker->udev, 0, cfgbuffwide,sizeof(cfgbuffwide) );
+  usleep(1000);
+  uint8_t cfgbuff_send[64] = { 0xff, 0x83 };
+  for (int k = 0; k < 10; k++ ) {
+    update_feature_report(tracker->udev, 0, cfgbuff_send, 64 );
+    usleep(1000);
+  }
+  cfgbuffwide[0] = 0xff;
+  hid_get_feature_report_timeout(
+    tracker->udev, 0, cfgbuffwide, sizeof(cfgbuffwide));
+  usleep(1000);
+}
+
 // Read the tracker configuration (sensor extrinsics and imu bias/scale)
-static int get_config(struct Tracker * tracker, int send_extra_magic) {
+static int get_config(struct Tracker * tracker, int extra_magic) {
   int ret, count = 0, size = 0;
   uint8_t cfgbuff[64];
   uint8_t compressed_data[8192];
   uint8_t uncompressed_data[65536];
   // Send a magic code to iniitalize the config download process
-  if (send_extra_magic) {
-    uint8_t cfgbuffwide[65];
-    memset(cfgbuffwide, 0, sizeof(cfgbuff));
-    cfgbuffwide[0] = 0x01;
-    ret = hid_get_feature_report_timeout(
-      tracker->udev, 0, cfgbuffwide,sizeof(cfgbuffwide) );
-    usleep(1000);
-    uint8_t cfgbuff_send[64] = { 0xff, 0x83 };
-    for (int k = 0; k < 10; k++ ) {
-      update_feature_report(tracker->udev, 0, cfgbuff_send, 64 );
-      usleep(1000);
-    }
-    cfgbuffwide[0] = 0xff;
-    ret = hid_get_feature_report_timeout(
-      tracker->udev, 0, cfgbuffwide, sizeof(cfgbuffwide));
-    usleep(1000);
-  }
+  if (extra_magic)
+    send_extra_magic(tracker);
   // Send Report 16 to prepare the device for reading config info
   memset(cfgbuff, 0, sizeof(cfgbuff));
   cfgbuff[0] = 0x10;
@@ -281,174 +446,337 @@ static int get_config(struct Tracker * tracker, int send_extra_magic) {
     printf( "Error: data for config descriptor is bad. (%d)", len);
     return -5;
   }
-  /*
-  char fstname[128];
-  sprintf(fstname, "%s.json.gz", tracker->serial);
-  FILE *f = fopen( fstname, "wb" );
-  fwrite(uncompressed_data, len, 1, f);
-  fclose(f);
-  */
   // Parse the JSON data structure
   json_parse(tracker, uncompressed_data);
   return 0;
 }
 
-// Enumerate all USBs on the bus and return the number of devices found
-int deepdive_usb_init(struct Driver * drv) {
-  // Initialize libusb
-  int ret = libusb_init(&drv->usb);
-  if (ret)
-    return 0;
-
-  // Get a list of devices
-  libusb_device** devs;
-  ret = libusb_get_device_list(drv->usb, &devs);
-  if (ret < 0)
-    return 0;
-
-  // Iterate over the devices looking for vive products
+// Open, configure and start streaming from a device (blocking)
+static struct Tracker * open_tracker(struct Driver * drv,
+  struct libusb_device * dev) {
+  // Get the device descriptor
   struct libusb_device_descriptor desc;
-  struct libusb_device * dev;
-  for (int did = 0; dev = devs[did]; did++) {
-    // Get the device descriptor
-    ret = libusb_get_device_descriptor(dev, &desc);
-    if (ret < 0 || dev == 0 || desc.idVendor != USB_VEND_HTC)
-      continue;
+  int ret = libusb_get_device_descriptor(dev, &desc);
+  if (ret < 0 || desc.idVendor != USB_VEND_HTC)
+    return NULL;
 
-    // Get a config descriptor
-    struct libusb_config_descriptor *conf;
-    ret = libusb_get_config_descriptor(dev, 0, &conf);
-    if (ret)
-      continue;
-
-    // Allocate the tracker memory
-    struct Tracker *tracker = malloc(sizeof(struct Tracker));
-    if (!tracker)
-      continue;
-    // Make sure the memory is zeroed
-    memset(tracker, 0, sizeof(struct Tracker));
-    tracker->driver = drv;
-
-    // Null the lighthouse pointer
-    for (size_t i = 0; i < MAX_NUM_LIGHTHOUSES; i++)
-      tracker->ootx[i].lighthouse = NULL;
+  // Get a config descriptor
+  struct libusb_config_descriptor *conf;
+  ret = libusb_get_config_descriptor(dev, 0, &conf);
+  if (ret)
+    return NULL;
 
-    // Try and open the device
-    ret = libusb_open(dev, &tracker->udev);
-    if (ret || !tracker->udev)
+  // Allocate the tracker memory, aligned for the sweep bundle
+  struct Tracker *tracker = NULL;
+  if (posix_memalign((void**)&tracker, 64, sizeof(struct Tracker))) {
+    libusb_free_config_descriptor(conf);
+    return NULL;
+  }
+  // Make sure the memory is zeroed
+  memset(tracker, 0, sizeof(struct Tracker));
+  tracker->driver = drv;
+  tracker->dev = dev;
+
+  // Start with any cached lighthouses, so light flows before the first OOTX
+  pthread_mutex_lock(&drv->lock);
+  for (size_t i = 0; i < MAX_NUM_LIGHTHOUSES; i++)
+    tracker->ootx[i].lighthouse = (drv->lighthouses[i].provisional
+      ? &drv->lighthouses[i] : NULL);
+  pthread_mutex_unlock(&drv->lock);
+
+  // Devices that arrive while a USB thread is running need a queue up front
+  if (__atomic_load_n(&drv->threaded, __ATOMIC_ACQUIRE)) {
+    tracker->ring = deepdive_ring_alloc();
+    if (!tracker->ring)
       goto fail;
+  }
 
-    // Set to auto-detatch
-    libusb_set_auto_detach_kernel_driver(tracker->udev, 1);
-    for (int j = 0; j < conf->bNumInterfaces; j++)
-      if (libusb_claim_interface(tracker->udev, j))
-        goto fail;
+  // Try and open the device
+  ret = libusb_open(dev, &tracker->udev);
+  if (ret || !tracker->udev)
+    goto fail;
 
-    // Get the serial number from the opened device handle
-    ret = libusb_get_string_descriptor_ascii(tracker->udev,
-      desc.iSerialNumber, tracker->serial, MAX_SERIAL_LENGTH);
-    if (ret < 0)
+  // Set to auto-detatch
+  libusb_set_auto_detach_kernel_driver(tracker->udev, 1);
+  for (int j = 0; j < conf->bNumInterfaces; j++)
+    if (libusb_claim_interface(tracker->udev, j))
       goto fail;
 
-    // The tracker type is simply the USB product ID
-    tracker->type = desc.idProduct;
-
-    // What we do depends on the product
-    switch (tracker->type) {
-     ///////////////////////////////
-     // USB TRACKER OR CONTROLLER //
-     ///////////////////////////////
-     default:
-      continue;
-     case USB_PROD_CONTROLLER:
-     case USB_PROD_TRACKER:
-      // Endpoint for IMU
-      tracker->endpoints[0].tracker = tracker;
-      tracker->endpoints[0].type = TRACKER_IMU;
-      tracker->endpoints[0].tx = libusb_alloc_transfer(0);
-      if (!tracker->endpoints[0].tx)
-        goto fail;
-      libusb_fill_interrupt_transfer(tracker->endpoints[0].tx, tracker->udev,
-        USB_ENDPOINT_GENERAL, tracker->endpoints[0].buffer,
-        USB_INT_BUFF_LENGTH, interrupt_handler, &tracker->endpoints[0], 0);
-      ret = libusb_submit_transfer(tracker->endpoints[0].tx);
-      if(ret)
-        goto fail;
-      // Endpoint for light
-      tracker->endpoints[1].tracker = tracker;
-      tracker->endpoints[1].type = TRACKER_LIGHT;
-      tracker->endpoints[1].tx = libusb_alloc_transfer(0);
-      if (!tracker->endpoints[1].tx)
-        goto fail;
-      libusb_fill_interrupt_transfer(tracker->endpoints[1].tx, tracker->udev,
-        USB_ENDPOINT_LIGHT, tracker->endpoints[1].buffer,
-        USB_INT_BUFF_LENGTH, interrupt_handler, &tracker->endpoints[1], 0);
-      ret = libusb_submit_transfer(tracker->endpoints[1].tx);
-      if(ret)
-        goto fail;
-      // Endpoint for buttons
-      tracker->endpoints[2].tracker = tracker;
-      tracker->endpoints[2].type = TRACKER_BUTTONS;
-      tracker->endpoints[2].tx = libusb_alloc_transfer(0);
-      if (!tracker->endpoints[2].tx)
-        goto fail;
-      libusb_fill_interrupt_transfer(tracker->endpoints[2].tx, tracker->udev,
-        USB_ENDPOINT_BUTTONS, tracker->endpoints[2].buffer,
-        USB_INT_BUFF_LENGTH, interrupt_handler, &tracker->endpoints[2], 0);
-      ret = libusb_submit_transfer(tracker->endpoints[2].tx);
-      if(ret)
-        goto fail;
-      // Send a magic code to power on the tracker
-      if (update_feature_report(tracker->udev, 0, magic_code_power_en_,
-        sizeof(magic_code_power_en_)) != sizeof(magic_code_power_en_))
-          printf("Power on failed\n");
-      else
-        printf("Power on success\n");
-      // Get the configuration for this device
+  // Get the serial number from the opened device handle
+  ret = libusb_get_string_descriptor_ascii(tracker->udev,
+    desc.iSerialNumber, tracker->serial, MAX_SERIAL_LENGTH);
+  if (ret < 0)
+    goto fail;
+
+  // The tracker type is simply the USB product ID
+  tracker->type = desc.idProduct;
+
+  // The USB serial keys the calibration cache, as the config overwrites it.
+  // A watchman dongle reports the calibration of whichever device is paired
+  // with it, which its own serial says nothing about, so it is never cached.
+  char usb_serial[MAX_SERIAL_LENGTH];
+  strcpy(usb_serial, tracker->serial);
+  int cached = (tracker->type != USB_PROD_WATCHMAN
+    && deepdive_cache_load(tracker, usb_serial, desc.bcdDevice) == 0);
+
+  // What we do depends on the product
+  switch (tracker->type) {
+   ///////////////////////////////
+   // USB TRACKER OR CONTROLLER //
+   ///////////////////////////////
+   default:
+    goto fail;
+   case USB_PROD_CONTROLLER:
+   case USB_PROD_TRACKER:
+    // Send a magic code to power on the tracker
+    if (update_feature_report(tracker->udev, 0, magic_code_power_en_,
+      sizeof(magic_code_power_en_)) != sizeof(magic_code_power_en_))
+        printf("Power on failed\n");
+    else
+      printf("Power on success\n");
+    // Get the configuration for this device, unless it was cached
+    if (!cached) {
       ret = get_config(tracker, 0);
       if (ret < 0) {
         printf("Calibration cannot be pulled. Ignoring.\n");
         goto fail;
       }
-      printf("Found tracker %s\n", tracker->serial);
-      break;
-     ///////////////////////
-     // WIRELESS WATCHMAN //
-     ///////////////////////
-     case USB_PROD_WATCHMAN:
-      // Set up the interrupts
-      tracker->endpoints[0].tracker = tracker;
-      tracker->endpoints[0].type = WATCHMAN;
-      tracker->endpoints[0].tx = libusb_alloc_transfer(0);
-      if (!tracker->endpoints[0].tx)
-        goto fail;
-      libusb_fill_interrupt_transfer(tracker->endpoints[0].tx, tracker->udev,
-        USB_ENDPOINT_GENERAL, tracker->endpoints[0].buffer,
-        USB_INT_BUFF_LENGTH, interrupt_handler, &tracker->endpoints[0], 0);
-      ret = libusb_submit_transfer(tracker->endpoints[0].tx);
-      if (ret)
-        goto fail;
-      // Get the configuration for this device
-      ret = get_config(tracker, 1);
-      if (ret < 0) {
-        printf("Calibration cannot be pulled. Ignoring.\n");
-        goto fail;
-      }
-      printf("Found watchman %s\n", tracker->serial);
-      break;
+      if (deepdive_cache_save(tracker, usb_serial, desc.bcdDevice))
+        printf("Could not cache calibration for %s\n", tracker->serial);
+    }
+    // Endpoints for IMU, light and buttons are only started once we know
+    // the device is usable, so that a failure never leaves transfers behind
+    deepdive_capture_tracker(tracker);
+    if (setup_endpoint(tracker, 0, TRACKER_IMU, USB_ENDPOINT_GENERAL))
+      goto fail;
+    if (setup_endpoint(tracker, 1, TRACKER_LIGHT, USB_ENDPOINT_LIGHT))
+      goto fail;
+    if (setup_endpoint(tracker, 2, TRACKER_BUTTONS, USB_ENDPOINT_BUTTONS))
+      goto fail;
+    printf("Found tracker %s\n", tracker->serial);
+    break;
+   ///////////////////////
+   // WIRELESS WATCHMAN //
+   ///////////////////////
+   case USB_PROD_WATCHMAN:
+    // Get the configuration of the paired device
+    ret = get_config(tracker, 1);
+    if (ret < 0) {
+      printf("Calibration cannot be pulled. Ignoring.\n");
+      goto fail;
     }
-    // Add the tracker to the dynamic list of trackers
-    drv->trackers[drv->num_trackers++] = tracker;
-    continue;
+    // Set up the interrupts
+    deepdive_capture_tracker(tracker);
+    if (setup_endpoint(tracker, 0, WATCHMAN, USB_ENDPOINT_GENERAL))
+      goto fail;
+    printf("Found watchman %s\n", tracker->serial);
+    break;
+  }
+  libusb_free_config_descriptor(conf);
+  libusb_ref_device(dev);
+  tracker->attached = 1;
+  return tracker;
 
-    // Catch-all to prevent memory leaks
+  // Catch-all to prevent memory leaks
 fail:
-     free(tracker);
+  libusb_free_config_descriptor(conf);
+  if (tracker->udev)
+    libusb_close(tracker->udev);
+  deepdive_ring_free(tracker->ring);
+  free(tracker);
+  return NULL;
+}
+
+// Add a tracker to the dynamic list of trackers
+int deepdive_usb_add(struct Driver * drv, struct Tracker * tracker) {
+  pthread_mutex_lock(&drv->trackers_lock);
+  if (drv->num_trackers == drv->max_trackers) {
+    uint16_t max = (drv->max_trackers ? 2 * drv->max_trackers : 8);
+    struct Tracker ** trackers =
+      realloc(drv->trackers, max * sizeof(struct Tracker*));
+    if (!trackers) {
+      printf("Could not grow the tracker list\n");
+      pthread_mutex_unlock(&drv->trackers_lock);
+      return -1;
+    }
+    drv->trackers = trackers;
+    drv->max_trackers = max;
+  }
+  if (drv->threaded && !tracker->ring) {
+    tracker->ring = deepdive_ring_alloc();
+    if (!tracker->ring) {
+      printf("Could not allocate event queue\n");
+      pthread_mutex_unlock(&drv->trackers_lock);
+      return -2;
+    }
+  }
+  tracker->id = drv->num_trackers;
+  drv->trackers[drv->num_trackers++] = tracker;
+  __atomic_store_n(&tracker->added, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&drv->trackers_lock);
+  return 0;
+}
+
+// Release an opened tracker that could not be added. Closing the device
+// drops its transfers, and nothing else refers to the tracker yet.
+static void close_tracker(struct Tracker * tracker) {
+  printf("Dropping tracker %s\n", tracker->serial);
+  libusb_close(tracker->udev);
+  libusb_unref_device(tracker->dev);
+  deepdive_ring_free(tracker->ring);
+  free(tracker);
+}
+
+// Is a tracker already attached for this device?
+static int is_attached(struct Driver * drv, struct libusb_device * dev) {
+  int found = 0;
+  pthread_mutex_lock(&drv->trackers_lock);
+  for (size_t i = 0; i < drv->num_trackers && !found; i++)
+    found = (drv->trackers[i]->dev == dev && drv->trackers[i]->attached);
+  pthread_mutex_unlock(&drv->trackers_lock);
+  return found;
+}
+
+// A device to be opened in the background
+struct Job {
+  struct Driver * drv;
+  struct libusb_device * dev;
+  struct Tracker * tracker;
+};
+
+// Opens a single device, so config downloads can run concurrently
+static void * config_worker(void * arg) {
+  struct Job * job = arg;
+  if (!is_attached(job->drv, job->dev))
+    job->tracker = open_tracker(job->drv, job->dev);
+  return NULL;
+}
+
+// Opens a hot-plugged device and adds it to the running driver
+static void * hotplug_worker(void * arg) {
+  struct Job * job = arg;
+  struct Driver * drv = job->drv;
+  config_worker(job);
+  if (job->tracker && deepdive_usb_add(drv, job->tracker))
+    close_tracker(job->tracker);
+  libusb_unref_device(job->dev);
+  free(job);
+  __atomic_fetch_sub(&drv->workers, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+// Called by libusb when an HTC device arrives or leaves
+static int hotplug_handler(struct libusb_context * ctx,
+  struct libusb_device * dev, libusb_hotplug_event event, void * data) {
+  struct Driver * drv = data;
+  if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+    // Blocking transfers are not allowed here, so open on a worker
+    struct Job * job = malloc(sizeof(struct Job));
+    if (!job)
+      return 0;
+    job->drv = drv;
+    job->dev = libusb_ref_device(dev);
+    job->tracker = NULL;
+    __atomic_fetch_add(&drv->workers, 1, __ATOMIC_ACQUIRE);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, hotplug_worker, job)) {
+      __atomic_fetch_sub(&drv->workers, 1, __ATOMIC_RELEASE);
+      libusb_unref_device(dev);
+      free(job);
+      return 0;
+    }
+    pthread_detach(thread);
+  } else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
+    // Transfers on the device will fail and not be resubmitted. The tracker
+    // itself stays in memory until the driver is closed.
+    pthread_mutex_lock(&drv->trackers_lock);
+    for (size_t i = 0; i < drv->num_trackers; i++) {
+      if (drv->trackers[i]->dev == dev && drv->trackers[i]->attached) {
+        drv->trackers[i]->attached = 0;
+        printf("Lost tracker %s\n", drv->trackers[i]->serial);
+      }
+    }
+    pthread_mutex_unlock(&drv->trackers_lock);
+  }
+  return 0;
+}
+
+// Enumerate all USBs on the bus and return the number of devices found
+int deepdive_usb_init(struct Driver * drv) {
+  // Initialize libusb
+  int ret = libusb_init(&drv->usb);
+  if (ret)
+    return 0;
+
+  // Lighthouses from the last run get us tracking before OOTX completes
+  deepdive_cache_load_lighthouses(drv);
+
+  // Listen for devices coming and going before we enumerate, so that none
+  // slip through the gap. A device already in the tracker list is skipped
+  // when opening, but nothing stops one that arrives during enumeration from
+  // being opened by both.
+  if (drv->options.hotplug && libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+    ret = libusb_hotplug_register_callback(drv->usb,
+      LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+        LIBUSB_HOTPLUG_NO_FLAGS, USB_VEND_HTC, LIBUSB_HOTPLUG_MATCH_ANY,
+          LIBUSB_HOTPLUG_MATCH_ANY, hotplug_handler, drv, &drv->hotplug);
+    if (ret == LIBUSB_SUCCESS)
+      drv->has_hotplug = 1;
+    else
+      printf("Hotplug is not available\n");
+  }
+
+  // Get a list of devices
+  libusb_device** devs;
+  ssize_t num = libusb_get_device_list(drv->usb, &devs);
+  if (num < 0)
+    return 0;
+
+  // Open every vive product on its own thread, as downloading the config
+  // is slow and otherwise startup time grows with the number of devices
+  struct Job * jobs = calloc(num, sizeof(struct Job));
+  pthread_t * threads = calloc(num, sizeof(pthread_t));
+  uint8_t * started = calloc(num, sizeof(uint8_t));
+  if (!jobs || !threads || !started)
+    goto done;
+  for (ssize_t did = 0; did < num; did++) {
+    struct libusb_device_descriptor desc;
+    ret = libusb_get_device_descriptor(devs[did], &desc);
+    if (ret < 0 || desc.idVendor != USB_VEND_HTC)
+      continue;
+    jobs[did].drv = drv;
+    jobs[did].dev = devs[did];
+    if (pthread_create(&threads[did], NULL, config_worker, &jobs[did]) == 0)
+      started[did] = 1;
+    else
+      config_worker(&jobs[did]);
   }
 
+  // Add trackers in bus order, so that the ordering is repeatable
+  for (ssize_t did = 0; did < num; did++) {
+    if (started[did])
+      pthread_join(threads[did], NULL);
+    if (jobs[did].tracker && deepdive_usb_add(drv, jobs[did].tracker))
+      close_tracker(jobs[did].tracker);
+  }
+
+done:
+  free(jobs);
+  free(threads);
+  free(started);
+
   // Free the device list
   libusb_free_device_list(devs, 1);
 
   // Success
   return drv->num_trackers;
-}
\ No newline at end of file
+}
+
+// Stop listening for devices and wait for any that are still being opened
+void deepdive_usb_close(struct Driver * drv) {
+  if (drv->has_hotplug)
+    libusb_hotplug_deregister_callback(drv->usb, drv->hotplug);
+  drv->has_hotplug = 0;
+  while (__atomic_load_n(&drv->workers, __ATOMIC_ACQUIRE) > 0)
+    usleep(1000);
+}
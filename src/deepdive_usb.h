@@ -39,4 +39,16 @@
 // Initialize and return the number of devices
 int deepdive_usb_init(struct Driver * drv);
 
+// Add a tracker to the dynamic list of trackers. On failure the tracker is
+// left to the caller to free.
+int deepdive_usb_add(struct Driver * drv, struct Tracker * tracker);
+
+// Stop listening for devices and wait for any that are still being opened
+void deepdive_usb_close(struct Driver * drv);
+
+// Decode a raw packet received on the given endpoint type. All decoder state
+// lives in the tracker, so different trackers may be decoded concurrently.
+void deepdive_usb_decode(struct Tracker * tracker, CallbackType type,
+  uint8_t * buf, int len);
+
 #endif
\ No newline at end of file